@@ -37,6 +37,7 @@
 #else
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <unistd.h>
 #endif
 #if defined(LLAMA_USE_CURL)
@@ -538,6 +539,14 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.defrag_thold = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--output-top-k") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.n_output_top_k = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--samplers") {
         if (++i >= argc) {
             invalid_param = true;
@@ -1198,6 +1207,14 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         sparams.penalize_nl = true;
         return true;
     }
+    if (arg == "--token-healing") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        sparams.n_token_healing = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-l" || arg == "--logit-bias") {
         if (++i >= argc) {
             invalid_param = true;
@@ -1499,8 +1516,11 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        pooling type for embeddings, use model default if unspecified\n");
     printf("  -dt N, --defrag-thold N\n");
     printf("                        KV cache defragmentation threshold (default: %.1f, < 0 - disabled)\n", params.defrag_thold);
+    printf("  --output-top-k N      select the top N tokens of each output on the graph and copy only them instead of the logits,\n");
+    printf("                        sampling then only considers these tokens (default: %d, 0 = disabled)\n", params.n_output_top_k);
     printf("  --ignore-eos          ignore end of stream token and continue generating (implies --logit-bias 2-inf)\n");
     printf("  --penalize-nl         penalize newline tokens\n");
+    printf("  --token-healing N     roll back the last N tokens of the prompt and regenerate their text, so that it can end mid-word (default: %d, 0 = disabled)\n", sparams.n_token_healing);
     printf("  --temp N              temperature (default: %.1f)\n", (double)sparams.temp);
     printf("  --all-logits          return logits for all tokens in the batch (default: disabled)\n");
     printf("  --hellaswag           compute HellaSwag score over random tasks from datafile supplied with -f\n");
@@ -1887,6 +1907,7 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.yarn_orig_ctx     = params.yarn_orig_ctx;
     cparams.pooling_type      = params.pooling_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.n_top_k           = params.n_output_top_k;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -2343,22 +2364,87 @@ std::vector<llama_token> llama_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
-    return llama_tokenize(llama_get_model(ctx), text, add_special, parse_special);
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return llama_tokenize(llama_get_model(ctx), text, add_special, parse_special, n_threads);
 }
 
 std::vector<llama_token> llama_tokenize(
     const struct llama_model * model,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     // upper limit for the number of tokens
     int n_tokens = text.length() + 2 * add_special;
     std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(model, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+    n_tokens = llama_tokenize_parallel(model, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
     if (n_tokens < 0) {
         result.resize(-n_tokens);
-        int check = llama_tokenize(model, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+        int check = llama_tokenize_parallel(model, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
+        GGML_ASSERT(check == -n_tokens);
+    } else {
+        result.resize(n_tokens);
+    }
+    return result;
+}
+
+std::vector<std::vector<llama_token>> llama_tokenize_batch(
+    const struct llama_model * model,
+ const std::vector<std::string> & texts,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    std::vector<const char *> ptrs;
+    std::vector<int32_t>      lens;
+    std::vector<int32_t>      offsets(texts.size() + 1);
+
+    // upper limit for the number of tokens
+    int n_tokens = 0;
+    for (const auto & text : texts) {
+        ptrs.push_back(text.data());
+        lens.push_back(text.length());
+        n_tokens += text.length() + 2 * add_special;
+    }
+
+    std::vector<llama_token> tokens(n_tokens);
+    n_tokens = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), offsets.data(), add_special, parse_special, n_threads);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        int check = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), offsets.data(), add_special, parse_special, n_threads);
+        GGML_ASSERT(check == -n_tokens);
+    }
+
+    std::vector<std::vector<llama_token>> result(texts.size());
+    for (size_t i = 0; i < texts.size(); i++) {
+        result[i].assign(tokens.begin() + offsets[i], tokens.begin() + offsets[i + 1]);
+    }
+    return result;
+}
+
+std::vector<llama_token> llama_tokenizer_stream_feed(
+       struct llama_tokenizer_stream * stream,
+                 const std::string & text) {
+    // usually enough, the tokens of text held back from before can take more
+    std::vector<llama_token> result(text.length() + 16);
+    int n_tokens = llama_tokenizer_stream_feed(stream, text.data(), text.length(), result.data(), result.size());
+    if (n_tokens < 0) {
+        result.resize(-n_tokens);
+        int check = llama_tokenizer_stream_feed(stream, "", 0, result.data(), result.size());
+        GGML_ASSERT(check == -n_tokens);
+    } else {
+        result.resize(n_tokens);
+    }
+    return result;
+}
+
+std::vector<llama_token> llama_tokenizer_stream_finish(
+       struct llama_tokenizer_stream * stream) {
+    std::vector<llama_token> result(16);
+    int n_tokens = llama_tokenizer_stream_finish(stream, result.data(), result.size());
+    if (n_tokens < 0) {
+        result.resize(-n_tokens);
+        int check = llama_tokenizer_stream_finish(stream, result.data(), result.size());
         GGML_ASSERT(check == -n_tokens);
     } else {
         result.resize(n_tokens);
@@ -2496,6 +2582,41 @@ bool create_directory_with_parents(const std::string & path) {
 #endif // _WIN32
 }
 
+// returns the names of the regular files in the directory, empty if it cannot be read
+std::vector<std::string> list_directory_files(const std::string & path) {
+    std::vector<std::string> files;
+#ifdef _WIN32
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+    std::wstring wpattern = converter.from_bytes(path + "\\*");
+
+    WIN32_FIND_DATAW data;
+    HANDLE handle = FindFirstFileW(wpattern.c_str(), &data);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return files;
+    }
+    do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            files.push_back(converter.to_bytes(data.cFileName));
+        }
+    } while (FindNextFileW(handle, &data));
+    FindClose(handle);
+#else
+    DIR * dir = opendir(path.c_str());
+    if (dir == NULL) {
+        return files;
+    }
+    while (struct dirent * ent = readdir(dir)) {
+        struct stat info;
+        const std::string name = ent->d_name;
+        if (stat((path + "/" + name).c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+            files.push_back(name);
+        }
+    }
+    closedir(dir);
+#endif // _WIN32
+    return files;
+}
+
 void dump_vector_float_yaml(FILE * stream, const char * prop_name, const std::vector<float> & data) {
     if (data.empty()) {
         fprintf(stream, "%s:\n", prop_name);
@@ -2721,6 +2842,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
 
     fprintf(stream, "tfs: %f # default: 1.0\n", sparams.tfs_z);
     fprintf(stream, "threads: %d # default: %u\n", params.n_threads, std::thread::hardware_concurrency());
+    fprintf(stream, "token_healing: %d # default: 0\n", sparams.n_token_healing);
     fprintf(stream, "top_k: %d # default: 40\n", sparams.top_k);
     fprintf(stream, "top_p: %f # default: 0.95\n", sparams.top_p);
     fprintf(stream, "min_p: %f # default: 0.0\n", sparams.min_p);
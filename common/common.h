@@ -99,6 +99,7 @@ struct gpt_params {
     float   yarn_beta_slow        = 1.0f;  // YaRN high correction dim
     int32_t yarn_orig_ctx         = 0;     // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t n_output_top_k        = 0;     // if > 0, only the top-k tokens of each output are copied from the graph
 
     ggml_backend_sched_eval_callback cb_eval = nullptr;
     void * cb_eval_user_data                 = nullptr;
@@ -251,17 +252,36 @@ void llama_batch_add(
 
 // tokenizes a string into a vector of tokens
 // should work similar to Python's `tokenizer.encode`
+// long texts are tokenized on n_threads threads, with the same result (see llama_tokenize_parallel)
 std::vector<llama_token> llama_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
 
 std::vector<llama_token> llama_tokenize(
     const struct llama_model * model,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
+
+// the tokens of many texts, tokenized at once on n_threads threads (see llama_tokenize_batch)
+std::vector<std::vector<llama_token>> llama_tokenize_batch(
+    const struct llama_model * model,
+ const std::vector<std::string> & texts,
+                        bool   add_special,
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
+
+// the tokens of a text fed in chunks that became final, and the rest of them at the end (see llama_tokenizer_stream_feed)
+std::vector<llama_token> llama_tokenizer_stream_feed(
+       struct llama_tokenizer_stream * stream,
+                 const std::string & text);
+
+std::vector<llama_token> llama_tokenizer_stream_finish(
+       struct llama_tokenizer_stream * stream);
 
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
@@ -295,6 +315,7 @@ bool llama_should_add_bos_token(const llama_model * model);
 //
 
 bool create_directory_with_parents(const std::string & path);
+std::vector<std::string> list_directory_files(const std::string & path);
 void dump_vector_float_yaml(FILE * stream, const char * prop_name, const std::vector<float> & data);
 void dump_vector_int_yaml(FILE * stream, const char * prop_name, const std::vector<int> & data);
 void dump_string_yaml_multiline(FILE * stream, const char * prop_name, const char * data);
@@ -1,6 +1,64 @@
 #define LLAMA_API_INTERNAL
 #include <llama/sampling.h>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <random>
+#include <thread>
+
+static int32_t llama_sampling_penalty_window(const llama_sampling_context * ctx) {
+    const int32_t penalty_last_n = ctx->params.penalty_last_n < 0 ? ctx->params.n_prev : ctx->params.penalty_last_n;
+
+    return std::min((int32_t) ctx->prev.size(), penalty_last_n);
+}
+
+static void llama_sampling_penalty_add(llama_sampling_context * ctx, llama_token id) {
+    const auto it = ctx->penalty_index.find(id);
+    if (it != ctx->penalty_index.end()) {
+        ctx->penalty_counts[it->second]++;
+        return;
+    }
+
+    ctx->penalty_index[id] = ctx->penalty_tokens.size();
+    ctx->penalty_tokens.push_back(id);
+    ctx->penalty_counts.push_back(1);
+}
+
+static void llama_sampling_penalty_remove(llama_sampling_context * ctx, llama_token id) {
+    const auto it = ctx->penalty_index.find(id);
+    GGML_ASSERT(it != ctx->penalty_index.end());
+
+    const int32_t i = it->second;
+    if (--ctx->penalty_counts[i] > 0) {
+        return;
+    }
+
+    // move the last token into the freed slot
+    ctx->penalty_index.erase(it);
+
+    const llama_token last = ctx->penalty_tokens.back();
+    if (last != id) {
+        ctx->penalty_tokens[i] = last;
+        ctx->penalty_counts[i] = ctx->penalty_counts.back();
+        ctx->penalty_index[last] = i;
+    }
+    ctx->penalty_tokens.pop_back();
+    ctx->penalty_counts.pop_back();
+}
+
+// recount the penalty window from scratch, after prev has been replaced
+static void llama_sampling_penalty_reset(llama_sampling_context * ctx) {
+    ctx->penalty_tokens.clear();
+    ctx->penalty_counts.clear();
+    ctx->penalty_index.clear();
+
+    const int32_t n_window = llama_sampling_penalty_window(ctx);
+    for (size_t i = ctx->prev.size() - n_window; i < ctx->prev.size(); i++) {
+        llama_sampling_penalty_add(ctx, ctx->prev[i]);
+    }
+}
 
 struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params) {
     struct llama_sampling_context * result = new llama_sampling_context();
@@ -35,6 +93,8 @@ struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_
 
     result->prev.resize(params.n_prev);
 
+    llama_sampling_penalty_reset(result);
+
     llama_sampling_set_rng_seed(result, params.seed);
 
     return result;
@@ -64,6 +124,14 @@ void llama_sampling_reset(llama_sampling_context * ctx) {
 
     std::fill(ctx->prev.begin(), ctx->prev.end(), 0);
     ctx->cur.clear();
+
+    ctx->healing_prefix.clear();
+    ctx->healing_candidates.clear();
+
+    ctx->n_grammar_fast = 0;
+    ctx->n_grammar_full = 0;
+
+    llama_sampling_penalty_reset(ctx);
 }
 
 void llama_sampling_set_rng_seed(struct llama_sampling_context * ctx, uint32_t seed) {
@@ -84,12 +152,116 @@ void llama_sampling_cp(llama_sampling_context * src, llama_sampling_context * ds
     }
 
     dst->prev = src->prev;
+
+    llama_sampling_penalty_reset(dst);
 }
 
 llama_token llama_sampling_last(llama_sampling_context * ctx) {
     return ctx->prev.back();
 }
 
+std::string llama_token_healing_rollback(
+        const struct llama_context * ctx_main,
+        std::vector<llama_token> & tokens,
+        int n_rollback) {
+    const llama_model * model = llama_get_model(ctx_main);
+
+    std::string prefix;
+
+    for (int i = 0; i < n_rollback && tokens.size() > 1; ++i) {
+        const llama_token id = tokens.back();
+
+        const std::string piece = llama_token_to_piece(ctx_main, id, false);
+        if (piece.empty() || llama_token_is_eog(model, id)) {
+            // control tokens are never regenerated
+            break;
+        }
+
+        prefix = piece + prefix;
+        tokens.pop_back();
+    }
+
+    return prefix;
+}
+
+// the tokens that can continue the remaining healing prefix
+static void llama_sampling_healing_update(llama_sampling_context * ctx, const llama_model * model) {
+    auto & candidates = ctx->healing_candidates;
+
+    candidates.clear();
+    if (ctx->healing_prefix.empty()) {
+        return;
+    }
+
+    candidates.resize(64);
+    int32_t n = llama_token_prefix_candidates(model, ctx->healing_prefix.data(), ctx->healing_prefix.size(), candidates.data(), candidates.size());
+    if (n < 0) {
+        candidates.resize(-n);
+        n = llama_token_prefix_candidates(model, ctx->healing_prefix.data(), ctx->healing_prefix.size(), candidates.data(), candidates.size());
+    }
+    candidates.resize(n);
+
+    if (candidates.empty()) {
+        // nothing can regenerate the text, leave the sampling unconstrained
+        ctx->healing_prefix.clear();
+    }
+}
+
+void llama_sampling_set_healing_prefix(
+        struct llama_sampling_context * ctx_sampling,
+        const struct llama_model * model,
+        const std::string & prefix) {
+    ctx_sampling->healing_prefix = prefix;
+
+    llama_sampling_healing_update(ctx_sampling, model);
+}
+
+std::shared_ptr<const llama_token_set> llama_token_set_init(
+        int32_t n_vocab,
+        const std::unordered_map<llama_token, float> & bias,
+        bool exclusive) {
+    auto set = std::make_shared<llama_token_set>();
+
+    set->n_vocab   = n_vocab;
+    set->exclusive = exclusive;
+    set->mask.assign((n_vocab + 31) / 32, 0);
+    set->bias.assign(n_vocab, exclusive ? -INFINITY : 0.0f);
+
+    for (const auto & it : bias) {
+        const llama_token id = it.first;
+        if (id < 0 || id >= n_vocab) {
+            continue;
+        }
+        set->mask[id >> 5] |= 1u << (id & 31);
+        set->bias[id] = it.second;
+        set->tokens.push_back(id);
+    }
+
+    std::sort(set->tokens.begin(), set->tokens.end());
+
+    return set;
+}
+
+void llama_token_set_apply(const llama_token_set & set, llama_token_data_array * candidates) {
+    GGML_ASSERT(candidates->size == (size_t) set.n_vocab);
+
+    llama_token_data * data = candidates->data;
+
+    // a few biased tokens: only touch them
+    if (!set.exclusive && set.tokens.size()*16 < (size_t) set.n_vocab) {
+        for (const llama_token id : set.tokens) {
+            data[id].logit += set.bias[id];
+        }
+        return;
+    }
+
+    // otherwise a branchless pass over the whole vocab, that the compiler vectorizes
+    const float * bias = set.bias.data();
+    for (int32_t i = 0; i < set.n_vocab; ++i) {
+        data[i].logit += bias[i];
+    }
+}
+
 std::string llama_sampling_prev_str(llama_sampling_context * ctx_sampling, llama_context * ctx_main, int n) {
     const int size = ctx_sampling->prev.size();
 
@@ -184,14 +356,14 @@ static llama_token llama_sampling_sample_impl(
     const float   mirostat_tau    = params.mirostat_tau;
     const float   mirostat_eta    = params.mirostat_eta;
 
-    std::vector<float> original_logits;
-    auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, !is_resampling, &original_logits);
-    if (!is_resampling) {
-        GGML_ASSERT(!original_logits.empty());
-    }
+    // in lazy mode, the grammar is only applied to the candidates if it rejects the token sampled without it
+    const bool grammar_lazy = ctx_sampling->grammar != NULL && params.grammar_lazy && !is_resampling;
+
+    // the logits are left untouched by the first pass (except for the guidance, which is not applied twice),
+    // so resampling prepares the candidates again without restoring anything
+    auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, is_resampling ? nullptr : ctx_cfg, idx, !grammar_lazy, nullptr);
+
     llama_token id = 0;
-    // Get a pointer to the logits
-    float * logits = llama_get_logits_ith(ctx_main, idx);
 
     if (temp < 0.0) {
         // greedy sampling, with probs
@@ -231,9 +403,9 @@ static llama_token llama_sampling_sample_impl(
         }
     }
 
-    if (ctx_sampling->grammar != NULL && !is_resampling) {
+    if (grammar_lazy) {
         // Create an array with a single token data element for the sampled id
-        llama_token_data single_token_data = {id, logits[id], 0.0f};
+        llama_token_data single_token_data = {id, 0.0f, 0.0f};
         llama_token_data_array single_token_data_array = { &single_token_data, 1, false };
 
         // Apply grammar constraints to the single token
@@ -246,11 +418,12 @@ static llama_token llama_sampling_sample_impl(
         if (!is_valid) {
             LOG("Resampling because token %d: '%s' does not meet grammar rules\n", id, llama_token_to_piece(ctx_main, id).c_str());
 
-            // Restore logits from the copy
-            std::copy(original_logits.begin(), original_logits.end(), logits);
+            ctx_sampling->n_grammar_full++;
 
             return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, true);  // Pass true for is_resampling
         }
+
+        ctx_sampling->n_grammar_fast++;
     }
 
     return id;
@@ -277,45 +450,88 @@ static llama_token_data_array llama_sampling_prepare_impl(
     auto & prev = ctx_sampling->prev;
     auto & cur  = ctx_sampling->cur;
 
-    // Get a pointer to the logits
-    float * logits = llama_get_logits_ith(ctx_main, idx);
+    // a context created with n_top_k > 0 only returns the top-k tokens of each output: they are the candidates,
+    // which are then not indexed by token id
+    const bool top_k = llama_n_top_k(ctx_main) > 0;
 
-    if (apply_grammar && original_logits != NULL) {
-        // Only make a copy of the original logits if we are not applying grammar checks, not sure if I actually have to do this.
-        *original_logits = {logits, logits + llama_n_vocab(llama_get_model(ctx_main))};
-    }
+    if (top_k) {
+        GGML_ASSERT(ctx_cfg == nullptr && "classifier-free guidance needs the logits");
 
-    // apply params.logit_bias map
-    for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
-        logits[it->first] += it->second;
-    }
+        cur.resize(llama_n_top_k(ctx_main));
+        cur.resize(std::max(0, llama_get_top_k_ith(ctx_main, idx, cur.data())));
 
-    if (ctx_cfg) {
-        float * logits_guidance = llama_get_logits_ith(ctx_cfg, idx);
-        llama_sample_apply_guidance(ctx_main, logits, logits_guidance, params.cfg_scale);
-    }
+        for (auto & td : cur) {
+            const auto it = params.logit_bias.find(td.id);
+            if (it != params.logit_bias.end()) {
+                td.logit += it->second;
+            }
+            for (const auto & set : params.token_sets) {
+                td.logit += set->bias[td.id];
+            }
+        }
+    } else {
+        // Get a pointer to the logits
+        float * logits = llama_get_logits_ith(ctx_main, idx);
 
-    cur.clear();
+        if (apply_grammar && original_logits != NULL) {
+            // Only make a copy of the original logits if we are not applying grammar checks, not sure if I actually have to do this.
+            original_logits->assign(logits, logits + n_vocab);
+        }
 
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        if (ctx_cfg) {
+            float * logits_guidance = llama_get_logits_ith(ctx_cfg, idx);
+            llama_sample_apply_guidance(ctx_main, logits, logits_guidance, params.cfg_scale);
+        }
+
+        // the buffer keeps its capacity across calls, so this does not allocate after the first token
+        cur.resize(n_vocab);
+
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        }
+
+        // apply params.logit_bias map to the candidates, leaving the logits as they are
+        for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
+            cur[it->first].logit += it->second;
+        }
     }
 
     llama_token_data_array cur_p = { cur.data(), cur.size(), false };
 
+    if (!top_k) {
+        for (const auto & set : params.token_sets) {
+            llama_token_set_apply(*set, &cur_p);
+        }
+    }
+
     // apply penalties
     const auto& penalty_tokens = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : prev;
     const int penalty_tokens_used_size = std::min((int)penalty_tokens.size(), penalty_last_n);
     if (penalty_tokens_used_size) {
-        const float nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
+        const llama_token nl_id = llama_token_nl(llama_get_model(ctx_main));
+
+        float nl_logit = -INFINITY;
+        for (size_t i = top_k ? 0 : nl_id; i < cur.size(); i++) {
+            if (cur[i].id == nl_id) {
+                nl_logit = cur[i].logit;
+                break;
+            }
+        }
 
-        llama_sample_repetition_penalties(ctx_main, &cur_p,
-                penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
-                penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+        if (params.use_penalty_prompt_tokens) {
+            llama_sample_repetition_penalties(ctx_main, &cur_p,
+                    penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
+                    penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+        } else {
+            // the window of prev is counted incrementally by llama_sampling_accept
+            llama_sample_repetition_penalties_counts(ctx_main, &cur_p,
+                    ctx_sampling->penalty_tokens.data(), ctx_sampling->penalty_counts.data(),
+                    ctx_sampling->penalty_tokens.size(), penalty_repeat, penalty_freq, penalty_present);
+        }
 
         if (!penalize_nl) {
             for (size_t idx = 0; idx < cur_p.size; idx++) {
-                if (cur_p.data[idx].id == llama_token_nl(llama_get_model(ctx_main))) {
+                if (cur_p.data[idx].id == nl_id) {
                     cur_p.data[idx].logit = nl_logit;
                     break;
                 }
@@ -328,6 +544,32 @@ static llama_token_data_array llama_sampling_prepare_impl(
         llama_sample_grammar(ctx_main, &cur_p, ctx_sampling->grammar);
     }
 
+    // token healing: only the tokens that regenerate the rolled back text of the prompt (the candidates are still indexed by id)
+    if (!ctx_sampling->healing_prefix.empty()) {
+        const auto & healing = ctx_sampling->healing_candidates;
+
+        if (top_k) {
+            for (auto & td : cur) {
+                if (std::find(healing.begin(), healing.end(), td.id) == healing.end()) {
+                    td.logit = -INFINITY;
+                }
+            }
+
+            return cur_p;
+        }
+
+        std::vector<float> healing_logits(healing.size());
+        for (size_t i = 0; i < healing.size(); ++i) {
+            healing_logits[i] = cur[healing[i]].logit;
+        }
+        for (auto & td : cur) {
+            td.logit = -INFINITY;
+        }
+        for (size_t i = 0; i < healing.size(); ++i) {
+            cur[healing[i]].logit = healing_logits[i];
+        }
+    }
+
     return cur_p;
 }
 
@@ -340,6 +582,117 @@ llama_token llama_sampling_sample(
     return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, false);
 }
 
+// worker threads kept across calls of llama_sampling_sample_batch, so that a decode step does not pay for
+// creating and joining threads - the pool grows to the largest n_threads requested and runs one batch at a time
+struct llama_sampling_pool {
+    std::mutex mutex_run; // held while a batch is running
+
+    std::mutex mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+
+    std::vector<std::thread> workers;
+
+    std::function<void(int, int)> work;
+
+    int      n_threads = 0;
+    int      n_pending = 0;
+    uint64_t n_runs    = 0;
+    bool     stop      = false;
+
+    ~llama_sampling_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    // runs fn(ith, nth) for ith in [0, nth), the calling thread takes ith == 0
+    void run(int nth, const std::function<void(int, int)> & fn) {
+        std::lock_guard<std::mutex> lock_run(mutex_run);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while ((int) workers.size() < nth - 1) {
+                workers.emplace_back(&llama_sampling_pool::loop, this, (int) workers.size() + 1, n_runs);
+            }
+            work      = fn;
+            n_threads = nth;
+            n_pending = nth - 1;
+            n_runs++;
+        }
+        cv_work.notify_all();
+
+        fn(0, nth);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_pending == 0; });
+        work = nullptr;
+    }
+
+private:
+    void loop(int ith, uint64_t n_seen) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_work.wait(lock, [&] { return stop || n_runs != n_seen; });
+            if (stop) {
+                return;
+            }
+            n_seen = n_runs;
+            if (ith >= n_threads) {
+                continue;
+            }
+            const int nth = n_threads;
+            lock.unlock();
+
+            work(ith, nth);
+
+            lock.lock();
+            if (--n_pending == 0) {
+                cv_done.notify_one();
+            }
+        }
+    }
+};
+
+std::vector<llama_token> llama_sampling_sample_batch(
+        const std::vector<llama_sampling_context *> & ctx_samplings,
+        struct llama_context * ctx_main,
+        const std::vector<int32_t> & idxs,
+        int n_threads) {
+    GGML_ASSERT(ctx_samplings.size() == idxs.size());
+
+    const int n_seqs = ctx_samplings.size();
+
+    std::vector<llama_token> result(n_seqs);
+
+    // wait for the outputs here, the workers then only read from ctx_main
+    llama_synchronize(ctx_main);
+
+    auto worker = [&](int ith, int nth) {
+        for (int i = ith; i < n_seqs; i += nth) {
+            result[i] = llama_sampling_sample_impl(ctx_samplings[i], ctx_main, nullptr, idxs[i], false);
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, n_seqs));
+
+    if (n_threads == 1) {
+        worker(0, 1);
+        return result;
+    }
+
+    static llama_sampling_pool pool;
+
+    pool.run(n_threads, worker);
+
+    return result;
+}
+
 llama_token_data_array llama_sampling_prepare(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
@@ -355,9 +708,23 @@ void llama_sampling_accept(
         struct llama_context * ctx_main,
         llama_token id,
         bool apply_grammar) {
+    const int32_t n_window = llama_sampling_penalty_window(ctx_sampling);
+    if (n_window > 0) {
+        llama_sampling_penalty_remove(ctx_sampling, ctx_sampling->prev[ctx_sampling->prev.size() - n_window]);
+        llama_sampling_penalty_add(ctx_sampling, id);
+    }
+
     ctx_sampling->prev.erase(ctx_sampling->prev.begin());
     ctx_sampling->prev.push_back(id);
 
+    if (!ctx_sampling->healing_prefix.empty() && apply_grammar) {
+        const std::string piece = llama_token_to_piece(ctx_main, id, false);
+
+        ctx_sampling->healing_prefix.erase(0, std::min(piece.size(), ctx_sampling->healing_prefix.size()));
+
+        llama_sampling_healing_update(ctx_sampling, llama_get_model(ctx_main));
+    }
+
     if (ctx_sampling->grammar != NULL && apply_grammar) {
         llama_grammar_accept_token(ctx_main, ctx_sampling->grammar, id);
     }
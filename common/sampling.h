@@ -4,6 +4,7 @@
 
 #include <llama/grammar-parser.h>
 
+#include <memory>
 #include <random>
 #include <string>
 #include <unordered_map>
@@ -19,6 +20,23 @@ enum class llama_sampler_type : char {
     TEMPERATURE = 't'
 };
 
+// precompiled set of token biases, built once and shared by the sampling contexts that reference it (e.g. registered
+// with the server and referenced by id from many requests) instead of rebuilding a logit_bias map for each of them
+// - bias holds one entry per token of the vocab, so that the set is applied to the candidates with a single dense pass
+// - with exclusive, the set is an allow-list: the bias of the tokens that are not in the set is -INFINITY
+struct llama_token_set {
+    int32_t n_vocab   = 0;
+    bool    exclusive = false;
+
+    std::vector<uint32_t>    mask;   // bit i is set if token i is in the set
+    std::vector<llama_token> tokens; // tokens in the set, ascending
+    std::vector<float>       bias;   // n_vocab entries
+
+    bool contains(llama_token id) const {
+        return id >= 0 && id < n_vocab && (mask[id >> 5] >> (id & 31) & 1);
+    }
+};
+
 // sampling parameters
 typedef struct llama_sampling_params {
     int32_t     n_prev                = 64;                 // number of previous tokens to remember
@@ -40,6 +58,7 @@ typedef struct llama_sampling_params {
     float       mirostat_tau          = 5.00f;              // target entropy
     float       mirostat_eta          = 0.10f;              // learning rate
     bool        penalize_nl           = false;              // consider newlines as a repeatable token
+    int32_t     n_token_healing       = 0;                  // number of prompt tokens to roll back and regenerate (0 = disabled)
     uint32_t    seed                  = LLAMA_DEFAULT_SEED; // the seed used to initialize llama_sampling_context
 
     std::vector<llama_sampler_type> samplers_sequence = {
@@ -51,7 +70,8 @@ typedef struct llama_sampling_params {
         llama_sampler_type::TEMPERATURE
     };
 
-    std::string grammar;  // optional BNF-like grammar to constrain sampling
+    std::string grammar;      // optional BNF-like grammar to constrain sampling
+    bool        grammar_lazy = true; // sample without the grammar first, and only apply it to the candidates when the sampled token is rejected
 
     // Classifier-Free Guidance
     // https://arxiv.org/abs/2306.17806
@@ -60,6 +80,8 @@ typedef struct llama_sampling_params {
 
     std::unordered_map<llama_token, float> logit_bias; // logit bias for specific tokens
 
+    std::vector<std::shared_ptr<const llama_token_set>> token_sets; // precompiled logit bias / allowed token sets
+
     std::vector<llama_token> penalty_prompt_tokens;
     bool                     use_penalty_prompt_tokens = false;
 } llama_sampling_params;
@@ -82,6 +104,22 @@ struct llama_sampling_context {
     std::vector<llama_token>      prev;
     std::vector<llama_token_data> cur;
 
+    // occurrences of the distinct tokens in the penalty window (the last penalty_last_n tokens of prev), updated as
+    // tokens enter and leave the window so that sampling does not recount it for every token
+    std::vector<llama_token>                 penalty_tokens;
+    std::vector<int32_t>                     penalty_counts;
+    std::unordered_map<llama_token, int32_t> penalty_index; // position of each token in penalty_tokens
+
+    // token healing: text of the rolled back prompt tokens that remains to be regenerated, and the tokens that can
+    // continue it (see llama_sampling_set_healing_prefix)
+    std::string              healing_prefix;
+    std::vector<llama_token> healing_candidates;
+
+    // grammar statistics since the last reset: tokens sampled without applying the grammar to the candidates
+    // (lazy grammar fast path), and tokens resampled after the grammar rejected the first choice
+    int32_t n_grammar_fast = 0;
+    int32_t n_grammar_full = 0;
+
     std::mt19937 rng;
 };
 
@@ -106,6 +144,32 @@ void llama_sampling_cp(llama_sampling_context * src, llama_sampling_context * ds
 // Get the last sampled token
 llama_token llama_sampling_last(llama_sampling_context * ctx);
 
+// Token healing: removes up to n_rollback tokens from the end of the prompt and returns the text they covered.
+// The first token and control tokens are never removed.
+// Passing the text to llama_sampling_set_healing_prefix makes the next sampled tokens regenerate it, so that a prompt
+// ending mid-word (e.g. " wor") can continue with a token that extends it (e.g. " world")
+std::string llama_token_healing_rollback(
+        const struct llama_context * ctx_main,
+        std::vector<llama_token> & tokens,
+        int n_rollback);
+
+// Constrain the next sampled tokens to regenerate the given text - the prefix is consumed by the tokens accepted with
+// apply_grammar (the sampled ones, not the prompt), and cleared by llama_sampling_reset
+void llama_sampling_set_healing_prefix(
+        struct llama_sampling_context * ctx_sampling,
+        const struct llama_model * model,
+        const std::string & prefix);
+
+// Build a token set from a map of token biases - out of range tokens are ignored
+// with exclusive, only the tokens of the map can be sampled
+std::shared_ptr<const llama_token_set> llama_token_set_init(
+        int32_t n_vocab,
+        const std::unordered_map<llama_token, float> & bias,
+        bool exclusive);
+
+// Add the biases of the set to candidates that are indexed by token id (candidates->data[i].id == i)
+void llama_token_set_apply(const llama_token_set & set, llama_token_data_array * candidates);
+
 // Get a string representation of the last sampled tokens
 std::string llama_sampling_prev_str(llama_sampling_context * ctx_sampling, llama_context * ctx_main, int n);
 
@@ -128,6 +192,9 @@ std::string llama_sampling_order_print(const llama_sampling_params & params);
 //  - ctx_cfg:      context to use for classifier-free guidance
 //  - idx:          sample from llama_get_logits_ith(ctx, idx)
 //
+// if ctx_main was created with n_top_k > 0, only the tokens of llama_get_top_k_ith(ctx, idx) are candidates
+// (classifier-free guidance is not supported then)
+//
 // returns:
 //  - token:      sampled token
 //  - candidates: vector of candidate tokens
@@ -138,7 +205,19 @@ llama_token llama_sampling_sample(
         struct llama_context * ctx_cfg,
         int idx = -1);
 
+// samples one token for each of several sequences whose outputs are in the same batch, in parallel on up to
+// n_threads threads - the sampling contexts must be distinct, ctx_samplings[i] samples from output idxs[i]
+// classifier-free guidance is not supported, and the tokens still have to be accepted with llama_sampling_accept
+// the worker threads are kept in a process-wide pool between calls, a single sequence is sampled on the calling thread
+// no llama_decode may be issued on ctx_main until the call returns (see llama_synchronize)
+std::vector<llama_token> llama_sampling_sample_batch(
+        const std::vector<llama_sampling_context *> & ctx_samplings,
+        struct llama_context * ctx_main,
+        const std::vector<int32_t> & idxs,
+        int n_threads);
+
 // Prepares and adjusts the set of token candidates for sampling based on penalties, biases, and sampling parameters.
+// original_logits is left untouched when ctx_main only returns the top-k tokens
 llama_token_data_array llama_sampling_prepare(
         struct llama_sampling_context * ctx_sampling,
         struct llama_context * ctx_main,
@@ -270,6 +270,13 @@ int main(int argc, char ** argv) {
         LOG("embd_inp was considered empty and bos was added: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd_inp).c_str());
     }
 
+    // token healing: the text of the last prompt tokens is regenerated by the first sampled tokens
+    std::string healing_prefix;
+    if (sparams.n_token_healing > 0) {
+        healing_prefix = llama_token_healing_rollback(ctx, embd_inp, sparams.n_token_healing);
+        LOG("token healing: rolled back \"%s\": %s\n", healing_prefix.c_str(), LOG_TOKENS_TOSTR_PRETTY(ctx, embd_inp).c_str());
+    }
+
     // Tokenize negative prompt
     std::vector<llama_token> guidance_inp;
     int guidance_offset = 0;
@@ -520,6 +527,9 @@ int main(int argc, char ** argv) {
     }
 
     struct llama_sampling_context * ctx_sampling = llama_sampling_init(sparams);
+    if (!healing_prefix.empty()) {
+        llama_sampling_set_healing_prefix(ctx_sampling, model, healing_prefix);
+    }
 
     while ((n_remain != 0 && !is_antiprompt) || params.interactive) {
         // predict
@@ -22,11 +22,16 @@
 
 #include <atomic>
 #include <chrono>
+#include <cinttypes>
 #include <condition_variable>
 #include <cstddef>
+#include <deque>
+#include <fstream>
+#include <list>
 #include <set>
 #include <mutex>
 #include <thread>
+#include <unordered_set>
 #include <signal.h>
 #include <memory>
 
@@ -35,11 +40,6 @@ using json = nlohmann::ordered_json;
 bool server_verbose = false;
 bool server_log_json = true;
 
-enum stop_type {
-    STOP_TYPE_FULL,
-    STOP_TYPE_PARTIAL,
-};
-
 enum slot_state {
     SLOT_STATE_IDLE,
     SLOT_STATE_PROCESSING,
@@ -67,6 +67,38 @@ enum server_task_type {
     SERVER_TASK_TYPE_SLOT_ERASE,
 };
 
+// the completion tasks of a higher class are given a slot, and their prompts a place in the batch, first
+enum server_task_priority {
+    SERVER_TASK_PRIORITY_HIGH,
+    SERVER_TASK_PRIORITY_NORMAL,
+    SERVER_TASK_PRIORITY_LOW,
+    SERVER_TASK_PRIORITY_COUNT,
+};
+
+static const char * server_task_priority_names[SERVER_TASK_PRIORITY_COUNT] = { "high", "normal", "low" };
+
+// the upper bounds of the buckets of the queue wait time histograms, in seconds
+static const int n_queue_wait_buckets = 13;
+static const double queue_wait_buckets[n_queue_wait_buckets] = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+
+static bool server_task_priority_from_string(const std::string & name, server_task_priority & priority) {
+    for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; ++i) {
+        if (name == server_task_priority_names[i]) {
+            priority = (server_task_priority) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char * server_task_priority_error = "\"priority\" must be one of \"high\", \"normal\" or \"low\"";
+
+// whether the "priority" of a request is the name of a class, if it has one
+static bool server_task_priority_valid(const json & data) {
+    server_task_priority priority;
+    return !data.contains("priority") || (data.at("priority").is_string() && server_task_priority_from_string(data.at("priority"), priority));
+}
+
 struct server_task {
     int id        = -1; // to be filled by server_queue
     int id_multi  = -1;
@@ -77,6 +109,16 @@ struct server_task {
 
     bool infill    = false;
     bool embedding = false;
+
+    // completion tasks: scheduling
+    server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL;
+    std::string          key;          // the tokens of the task are accounted to this key, for fair scheduling
+    int64_t              t_queued = 0; // set by server_queue
+
+    // completion tasks: the beginning of the prompt tokens, to send the task to the slot that holds them (see
+    // get_slot_by_prefix) - kept once tokenized, so that a deferred task is not tokenized again each time it is retried
+    std::vector<llama_token> tokens_route;
+    bool                     has_tokens_route = false;
 };
 
 struct server_task_result {
@@ -106,6 +148,7 @@ struct slot_params {
     int32_t  n_predict = -1; // new tokens to predict
 
     std::vector<std::string> antiprompt;
+    std::vector<int>         token_sets; // ids of the registered token sets applied by the sampler
 
     json input_prefix;
     json input_suffix;
@@ -132,6 +175,15 @@ struct server_params {
     bool slots_endpoint   = true;
     bool metrics_endpoint = false;
     std::string slot_save_path;
+    std::string grammar_cache_path;
+
+    int32_t tokenize_cache_tokens = 256*1024;
+    int32_t slot_prefix_min       = 32;
+    int32_t token_sets_max        = 64;
+
+    std::string prompt_cache_dir;
+    int32_t     prompt_cache_size_mb = 4096;
+    int32_t     prompt_cache_min     = 256;
 };
 
 struct server_slot {
@@ -139,6 +191,9 @@ struct server_slot {
     int id_task = -1;
     int id_multi = -1;
 
+    server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL;
+    std::string          key;
+
     struct slot_params params;
 
     slot_state state = SLOT_STATE_IDLE;
@@ -163,8 +218,17 @@ struct server_slot {
     // when a task is submitted, we first tokenize the prompt and store it here
     std::vector<llama_token> prompt_tokens;
 
+    // a long prompt is tokenized while it is processed: it is fed to this stream a chunk at a time, until there are
+    // enough tokens for the next batch (see server_context::prompt_stream_feed)
+    llama_tokenizer_stream * prompt_stream = nullptr;
+    size_t                   n_prompt_fed  = 0; // bytes of the prompt fed to the stream
+
     std::string generated_text;
     std::vector<llama_token> cache_tokens;
+
+    // token healing: text of the rolled back prompt tokens, which is regenerated but not sent back
+    std::string healing_prefix;
+    size_t      n_healing_skip = 0;
     std::vector<completion_token_output> generated_token_probs;
 
     bool infill         = false;
@@ -180,6 +244,9 @@ struct server_slot {
     std::string oaicompat_model;
     std::string stopping_word;
 
+    // the stop strings, searched in the generated text as it grows
+    stop_string_matcher stop_matcher;
+
     // sampling
     llama_token sampled;
     struct llama_sampling_params sparams;
@@ -216,7 +283,9 @@ struct server_slot {
         infill             = false;
         ga_i               = 0;
         n_past_se          = 0;
+        n_healing_skip     = 0;
 
+        healing_prefix.clear();
         generated_token_probs.clear();
     }
 
@@ -272,34 +341,6 @@ struct server_slot {
         };
     }
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, const stop_type type) {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string & word : params.antiprompt) {
-            size_t pos;
-
-            if (type == STOP_TYPE_FULL) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-
-                pos = text.find(word, from_pos);
-            } else {
-                pos = find_partial_stop_string(word, text);
-            }
-
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (type == STOP_TYPE_FULL) {
-                    stopped_word   = true;
-                    stopping_word  = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
-            }
-        }
-
-        return stop_pos;
-    }
-
     void print_timings() const {
         char buffer[512];
 
@@ -361,6 +402,18 @@ struct server_metrics {
     uint64_t n_tokens_predicted  = 0;
     uint64_t t_tokens_generation = 0;
 
+    uint64_t n_grammar_fast_total = 0;
+    uint64_t n_grammar_full_total = 0;
+
+    uint64_t n_prompt_tokens_cached_total = 0;
+    uint64_t n_prompt_tokens_copied_total = 0;
+    uint64_t n_slot_prefix_routed_total   = 0;
+
+    // the time that the completion tasks of each priority class waited for a slot, as a histogram
+    uint64_t n_queue_wait_bucket[SERVER_TASK_PRIORITY_COUNT][n_queue_wait_buckets] = {};
+    uint64_t n_queue_wait_count [SERVER_TASK_PRIORITY_COUNT] = {};
+    double   t_queue_wait_sum   [SERVER_TASK_PRIORITY_COUNT] = {};
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -377,6 +430,36 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+        n_grammar_fast_total       += slot.ctx_sampling->n_grammar_fast;
+        n_grammar_full_total       += slot.ctx_sampling->n_grammar_full;
+    }
+
+    void on_task_launched(const server_task & task) {
+        const double t_wait = (ggml_time_us() - task.t_queued) / 1e6;
+        for (int i = 0; i < n_queue_wait_buckets; ++i) {
+            if (t_wait <= queue_wait_buckets[i]) {
+                n_queue_wait_bucket[task.priority][i]++;
+            }
+        }
+        n_queue_wait_count[task.priority]++;
+        t_queue_wait_sum  [task.priority] += t_wait;
+    }
+
+    // the histograms, in the format of the /metrics endpoint
+    json queue_wait_data() const {
+        json data = json::object();
+        for (int p = 0; p < SERVER_TASK_PRIORITY_COUNT; ++p) {
+            json buckets = json::array();
+            for (int i = 0; i < n_queue_wait_buckets; ++i) {
+                buckets.push_back({ queue_wait_buckets[i], n_queue_wait_bucket[p][i] });
+            }
+            data[server_task_priority_names[p]] = {
+                { "buckets", buckets },
+                { "count",   n_queue_wait_count[p] },
+                { "sum",     t_queue_wait_sum[p] },
+            };
+        }
+        return data;
     }
 
     void reset_bucket() {
@@ -387,6 +470,83 @@ struct server_metrics {
     }
 };
 
+// the tokens of recently tokenized texts: whole prompts, and the strings of prompts that mix text and tokens - so that
+// the system prompts, tool schemas and few-shot examples that clients send again and again are tokenized once
+// bounded by the number of tokens held, the least recently used texts are evicted first
+// used by the HTTP threads and the main loop, the texts are tokenized outside of the lock
+struct server_tokenize_cache {
+    struct entry {
+        std::string text;
+        bool add_special;
+        bool parse_special;
+        std::vector<llama_token> tokens;
+    };
+
+    size_t n_tokens_max = 0; // 0 disables the cache
+    size_t n_tokens     = 0;
+
+    uint64_t n_hits   = 0;
+    uint64_t n_misses = 0;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<size_t, std::list<entry>::iterator> index;
+
+    std::mutex mutex;
+
+    static size_t key(const std::string & text, bool add_special, bool parse_special) {
+        return std::hash<std::string>()(text) ^ (add_special ? 0x9e3779b97f4a7c15ull : 0) ^ (parse_special ? 0x7f4a7c159e3779b9ull : 0);
+    }
+
+    std::vector<llama_token> tokenize(const llama_context * ctx, const std::string & text, bool add_special, bool parse_special) {
+        if (n_tokens_max == 0) {
+            return ::llama_tokenize(ctx, text, add_special, parse_special);
+        }
+
+        const size_t k = key(text, add_special, parse_special);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto it = index.find(k);
+            if (it != index.end() && it->second->text == text && it->second->add_special == add_special && it->second->parse_special == parse_special) {
+                entries.splice(entries.begin(), entries, it->second);
+                n_hits++;
+                return it->second->tokens;
+            }
+            n_misses++;
+        }
+
+        std::vector<llama_token> tokens = ::llama_tokenize(ctx, text, add_special, parse_special);
+
+        // a single text never takes more than half of the cache
+        if (tokens.size() > n_tokens_max/2) {
+            return tokens;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // another thread may have added the same text meanwhile, or one with the same key
+        auto it = index.find(k);
+        if (it != index.end()) {
+            n_tokens -= it->second->tokens.size();
+            entries.erase(it->second);
+            index.erase(it);
+        }
+
+        while (n_tokens + tokens.size() > n_tokens_max) {
+            n_tokens -= entries.back().tokens.size();
+            index.erase(key(entries.back().text, entries.back().add_special, entries.back().parse_special));
+            entries.pop_back();
+        }
+
+        entries.push_front({ text, add_special, parse_special, tokens });
+        index[k] = entries.begin();
+        n_tokens += tokens.size();
+
+        return tokens;
+    }
+};
+
 struct server_queue {
     int id = 0;
     bool running;
@@ -397,6 +557,13 @@ struct server_queue {
 
     std::vector<server_task_multi> queue_multitasks;
 
+    // the tokens processed for each key, as a virtual time: the completion tasks of the key that has been served the
+    // fewest tokens go first within a priority class - a key that has been idle starts at the current virtual time, so
+    // that it does not get credit for the time it was not served
+    // only the keys with a completion task queued or processed by a slot are kept, see forget_idle_keys
+    std::unordered_map<std::string, uint64_t> fair_vtime;
+    uint64_t fair_vtime_now = 0;
+
     std::mutex mutex_tasks;
     std::condition_variable condition_tasks;
 
@@ -412,6 +579,9 @@ struct server_queue {
             task.id = id++;
             LOG_VERBOSE("new task id", {{"new_id", task.id}});
         }
+        if (task.t_queued == 0) {
+            task.t_queued = ggml_time_us();
+        }
         queue_tasks.push_back(std::move(task));
         condition_tasks.notify_one();
         return task.id;
@@ -423,6 +593,54 @@ struct server_queue {
         queue_tasks_deferred.push_back(std::move(task));
     }
 
+    // The virtual time of the key, see fair_vtime
+    uint64_t get_fair_vtime(const std::string & key) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        return fair_vtime_of(key);
+    }
+
+    // Account tokens processed for a task to its key
+    void add_fair_tokens(const std::string & key, uint64_t n_tokens) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        fair_vtime[key] = fair_vtime_of(key) + n_tokens;
+    }
+
+    // Call when a completion task of the key is given a slot: the virtual time moves on to the start of the task, the
+    // keys behind it are forgotten - not when the task is taken from the queue, as it is deferred if no slot is free
+    void start_fair_task(const std::string & key) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        const uint64_t vtime = fair_vtime_of(key);
+        if (vtime > fair_vtime_now) {
+            fair_vtime_now = vtime;
+            for (auto it = fair_vtime.begin(); it != fair_vtime.end();) {
+                it = it->second <= fair_vtime_now ? fair_vtime.erase(it) : std::next(it);
+            }
+        }
+    }
+
+    // Forget the virtual time of the keys that have no completion task queued and are not in the keys of the tasks that
+    // the slots process: a key that comes back starts at the current virtual time, and the keys that clients make up do
+    // not pile up
+    void forget_idle_keys(const std::vector<std::string> & keys_processing) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (fair_vtime.empty()) {
+            return;
+        }
+
+        std::unordered_set<std::string> keys_busy(keys_processing.begin(), keys_processing.end());
+        for (const std::vector<server_task> * queue : { &queue_tasks, &queue_tasks_deferred }) {
+            for (const server_task & task : *queue) {
+                if (task.type == SERVER_TASK_TYPE_COMPLETION) {
+                    keys_busy.insert(task.key);
+                }
+            }
+        }
+
+        for (auto it = fair_vtime.begin(); it != fair_vtime.end();) {
+            it = keys_busy.count(it->first) == 0 ? fair_vtime.erase(it) : std::next(it);
+        }
+    }
+
     // Get the next id for creating anew task
     int get_new_id() {
         std::unique_lock<std::mutex> lock(mutex_tasks);
@@ -463,6 +681,32 @@ struct server_queue {
         condition_tasks.notify_all();
     }
 
+private:
+    uint64_t fair_vtime_of(const std::string & key) const {
+        const auto it = fair_vtime.find(key);
+        return it == fair_vtime.end() ? fair_vtime_now : std::max(it->second, fair_vtime_now);
+    }
+
+    // the completion task of the highest priority class, and of the key with the lowest virtual time within the class
+    // the other tasks are not reordered: a task that cancels a completion is always behind it in the queue
+    std::vector<server_task>::iterator next_completion_task() {
+        auto best = queue_tasks.end();
+        uint64_t best_vtime = 0;
+        for (auto it = queue_tasks.begin(); it != queue_tasks.end(); ++it) {
+            if (it->type != SERVER_TASK_TYPE_COMPLETION) {
+                continue;
+            }
+            const uint64_t vtime = fair_vtime_of(it->key);
+            if (best == queue_tasks.end() || it->priority < best->priority || (it->priority == best->priority && vtime < best_vtime)) {
+                best       = it;
+                best_vtime = vtime;
+            }
+        }
+
+        return best;
+    }
+
+public:
     /**
      * Main loop consists of these steps:
      * - Wait until a new task arrives
@@ -482,8 +726,12 @@ struct server_queue {
                     lock.unlock();
                     break;
                 }
-                server_task task = queue_tasks.front();
-                queue_tasks.erase(queue_tasks.begin());
+                auto it = queue_tasks.begin();
+                if (it->type == SERVER_TASK_TYPE_COMPLETION) {
+                    it = next_completion_task();
+                }
+                server_task task = std::move(*it);
+                queue_tasks.erase(it);
                 lock.unlock();
                 LOG_VERBOSE("callback_new_task", {{"id_task", task.id}});
                 callback_new_task(task);
@@ -555,50 +803,49 @@ struct server_response {
     typedef std::function<void(int, int, server_task_result &)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
 
-    // for keeping track of all tasks waiting for the result
-    std::set<int> waiting_task_ids;
+    // the results of a task that is waited for, and the condition its HTTP thread waits on
+    // each result wakes the thread of its own task only, not all the threads that wait for a result
+    struct channel {
+        std::deque<server_task_result> results;
+        std::condition_variable        condition;
+    };
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    // the channels of all tasks waiting for the result
+    std::unordered_map<int, channel> channels;
 
     std::mutex mutex_results;
-    std::condition_variable condition_results;
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
         LOG_VERBOSE("waiting for task id", {{"id_task", id_task}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        channels[id_task];
     }
 
     // when the request is finished, we can remove task associated with it
+    // the results that were not received are dropped with it
     void remove_waiting_task_id(int id_task) {
         LOG_VERBOSE("remove waiting for task id", {{"id_task", id_task}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        channels.erase(id_task);
     }
 
     // This function blocks the thread until there is a response for this id_task
     server_task_result recv(int id_task) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+        std::unique_lock<std::mutex> lock(mutex_results);
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (queue_results[i].id == id_task) {
-                    assert(queue_results[i].id_multi == -1);
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
-        }
+        // only the thread of the task removes its channel, so the reference stays valid while it waits
+        channel & ch = channels[id_task];
+        ch.condition.wait(lock, [&]{
+            return !ch.results.empty();
+        });
 
-        // should never reach here
+        server_task_result res = std::move(ch.results.front());
+        ch.results.pop_front();
+        assert(res.id_multi == -1);
+        return res;
     }
 
     // Register the function to update multitask
@@ -611,21 +858,18 @@ struct server_response {
         LOG_VERBOSE("send new result", {{"id_task", result.id}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            // LOG_TEE("waiting task id %i \n", id_task);
-            // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-            if (result.id_multi == id_task) {
-                LOG_VERBOSE("callback_update_multitask", {{"id_task", id_task}});
-                callback_update_multitask(id_task, result.id, result);
-                continue;
-            }
 
-            if (result.id == id_task) {
-                LOG_VERBOSE("queue_results.push_back", {{"id_task", id_task}});
-                queue_results.push_back(result);
-                condition_results.notify_all();
-                return;
-            }
+        // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
+        if (result.id_multi != -1 && channels.count(result.id_multi) > 0) {
+            LOG_VERBOSE("callback_update_multitask", {{"id_task", result.id_multi}});
+            callback_update_multitask(result.id_multi, result.id, result);
+        }
+
+        auto it = channels.find(result.id);
+        if (it != channels.end()) {
+            LOG_VERBOSE("queue_results.push_back", {{"id_task", result.id}});
+            it->second.results.push_back(std::move(result));
+            it->second.condition.notify_one();
         }
     }
 };
@@ -661,7 +905,42 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_tokenize_cache tokenize_cache;
+
+    // the tokens cached by the idle slots, to send each request to the slot holding most of its prompt
+    server_prefix_tree prefix_tree;
+    int32_t            slot_prefix_min = 0; // fewer cached tokens are not worth evicting a more recently used slot for
+
+    // the prompts that the slots drop, on disk
+    server_prompt_cache prompt_cache;
+
+    // GBNF of the JSON schemas seen so far, keyed by the serialized schema
+    std::unordered_map<std::string, std::string> schema_grammars;
+
+    // token sets registered with POST /token-sets - built once, and shared by the sampling contexts of the requests
+    // that reference them by id (the HTTP threads register them while the main loop launches the slots)
+    // each set holds n_vocab biases, so at most token_sets_max are kept: registering one more removes the least
+    // recently registered or referenced set
+    struct token_set_entry {
+        std::shared_ptr<const llama_token_set> set;
+        uint64_t n_used; // value of n_token_set_uses when last registered or referenced
+    };
+
+    std::unordered_map<int, token_set_entry> token_sets;
+    int      id_token_set         = 0;
+    size_t   token_sets_max       = 64;
+    uint64_t n_token_set_uses     = 0;
+    uint64_t n_token_sets_evicted = 0;
+    std::mutex mutex_token_sets;
+
     ~server_context() {
+        for (auto & slot : slots) {
+            if (slot.prompt_stream != nullptr) {
+                llama_tokenizer_stream_free(slot.prompt_stream);
+                slot.prompt_stream = nullptr;
+            }
+        }
+
         if (ctx) {
             llama_free(ctx);
             ctx = nullptr;
@@ -759,7 +1038,7 @@ struct server_context {
         metrics.init();
     }
 
-    std::vector<llama_token> tokenize(const json & json_prompt, bool add_special) const {
+    std::vector<llama_token> tokenize(const json & json_prompt, bool add_special) {
         // TODO: currently, we tokenize using special tokens by default
         //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
         //       but it's better compared to completely ignoring ChatML and other chat templates
@@ -777,10 +1056,10 @@ struct server_context {
 
                     std::vector<llama_token> p;
                     if (first) {
-                        p = ::llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
+                        p = tokenize_cache.tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
                         first = false;
                     } else {
-                        p = ::llama_tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
+                        p = tokenize_cache.tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
                     }
 
                     prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
@@ -794,12 +1073,89 @@ struct server_context {
             }
         } else {
             auto s = json_prompt.template get<std::string>();
-            prompt_tokens = ::llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
+            prompt_tokens = tokenize_cache.tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
         }
 
         return prompt_tokens;
     }
 
+    // feeds the prompt of the slot to its tokenizer stream until at least n_tokens prompt tokens are known, or until the
+    // end of the prompt - the stream is freed then, and n_prompt_tokens is final
+    void prompt_stream_feed(server_slot & slot, size_t n_tokens) {
+        const std::string & text = slot.prompt.get_ref<const std::string &>();
+
+        // small enough to start processing a batch soon, large enough to keep the calls cheap
+        const size_t n_chunk = 16*1024;
+
+        while (slot.prompt_tokens.size() < n_tokens && slot.n_prompt_fed < text.size()) {
+            const size_t n = std::min(n_chunk, text.size() - slot.n_prompt_fed);
+
+            const auto tokens = llama_tokenizer_stream_feed(slot.prompt_stream, text.substr(slot.n_prompt_fed, n));
+            slot.prompt_tokens.insert(slot.prompt_tokens.end(), tokens.begin(), tokens.end());
+            slot.n_prompt_fed += n;
+        }
+
+        if (slot.n_prompt_fed == text.size()) {
+            const auto tokens = llama_tokenizer_stream_finish(slot.prompt_stream);
+            slot.prompt_tokens.insert(slot.prompt_tokens.end(), tokens.begin(), tokens.end());
+
+            llama_tokenizer_stream_free(slot.prompt_stream);
+            slot.prompt_stream = nullptr;
+
+            LOG_VERBOSE("prompt stream finished", {
+                {"id_slot",         slot.id},
+                {"id_task",         slot.id_task},
+                {"n_prompt_tokens", slot.prompt_tokens.size()},
+            });
+        }
+
+        slot.n_prompt_tokens = slot.prompt_tokens.size();
+    }
+
+    // sets n_keep, and truncates the prompt if it does not fit in the context of the slot (unless self-extend is used)
+    void fit_prompt_in_context(server_slot & slot) {
+        auto & prompt_tokens = slot.prompt_tokens;
+
+        if (slot.params.n_keep < 0) {
+            slot.params.n_keep = slot.n_prompt_tokens;
+        }
+        slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
+
+        // if input prompt is too big, truncate it (if group attention self-extend is disabled)
+        if (slot.ga_n == 1 && slot.n_prompt_tokens >= slot.n_ctx) {
+            const int n_left = slot.n_ctx - slot.params.n_keep;
+
+            const int n_block_size = n_left / 2;
+            const int erased_blocks = (slot.n_prompt_tokens - slot.params.n_keep - n_block_size) / n_block_size;
+
+            std::vector<llama_token> new_tokens(
+                    prompt_tokens.begin(),
+                    prompt_tokens.begin() + slot.params.n_keep);
+
+            new_tokens.insert(
+                    new_tokens.end(),
+                    prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size,
+                    prompt_tokens.end());
+
+            prompt_tokens = std::move(new_tokens);
+
+            slot.truncated = true;
+            slot.n_prompt_tokens = prompt_tokens.size();
+
+            LOG_VERBOSE("input truncated", {
+                {"id_slot",         slot.id},
+                {"id_task",         slot.id_task},
+                {"n_ctx",           slot.n_ctx},
+                {"n_keep",          slot.params.n_keep},
+                {"n_left",          n_left},
+                {"n_prompt_tokens", slot.n_prompt_tokens},
+                {"prompt_tokens",   tokens_to_str(ctx, prompt_tokens.cbegin(), prompt_tokens.cend())},
+            });
+
+            GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
+        }
+    }
+
     server_slot * get_slot(int id) {
         int64_t t_last = ggml_time_us();
 
@@ -820,6 +1176,186 @@ struct server_context {
         return last_used;
     }
 
+    // the available slot that holds the longest prefix of the prompt of a completion task, if it is long enough
+    // among the slots holding the same prefix, the least recently used one
+    // a slot that has just finished is returned too, the task waits for it to be released
+    server_slot * get_slot_by_prefix(server_task & task) {
+        if (slot_prefix_min <= 0 || task.infill || task.embedding || !json_value(task.data, "cache_prompt", false)) {
+            return nullptr;
+        }
+
+        const auto & prompt = task.data.find("prompt");
+        if (prompt == task.data.end() || !(prompt->is_string() || prompt->is_array())) {
+            return nullptr;
+        }
+
+        if (!task.has_tokens_route) {
+            // only the beginning of long prompts is needed to route them
+            const size_t n_prompt_route_max = 64*1024;
+
+            if (prompt->is_string() && prompt->get_ref<const std::string &>().size() > n_prompt_route_max) {
+                const std::string & text = prompt->get_ref<const std::string &>();
+                const size_t n_text = n_prompt_route_max - utf8_incomplete_suffix(text.data(), n_prompt_route_max);
+                task.tokens_route = tokenize_cache.tokenize(ctx, text.substr(0, n_text), system_prompt.empty(), true);
+            } else {
+                task.tokens_route = tokenize(*prompt, system_prompt.empty());
+            }
+            task.has_tokens_route = true;
+        }
+
+        const std::vector<llama_token> & prompt_tokens = task.tokens_route;
+
+        // the tokens of the slots that are released at the next update are final already
+        for (const server_slot & slot : slots) {
+            if (slot.command == SLOT_COMMAND_RELEASE) {
+                prefix_tree.insert(slot.id, slot.cache_tokens);
+            }
+        }
+
+        std::vector<int> ids_slot;
+        const size_t n_cached = prefix_tree.find(prompt_tokens, ids_slot, [&](int id) {
+            return slots[id].available() || slots[id].command == SLOT_COMMAND_RELEASE;
+        });
+        if (n_cached < (size_t) slot_prefix_min) {
+            return nullptr;
+        }
+
+        server_slot * last_used = nullptr;
+        for (const int id : ids_slot) {
+            if (last_used == nullptr || slots[id].available() > last_used->available() ||
+                (slots[id].available() == last_used->available() && slots[id].t_last_used < last_used->t_last_used)) {
+                last_used = &slots[id];
+            }
+        }
+
+        if (last_used->available()) {
+            metrics.n_slot_prefix_routed_total++;
+        }
+
+        LOG_VERBOSE("slot holding the prompt prefix", {
+            {"id_slot",  last_used->id},
+            {"id_task",  task.id},
+            {"n_cached", n_cached},
+        });
+
+        return last_used;
+    }
+
+    // the same schemas tend to be used by many requests, so their conversion is cached
+    std::string schema_to_grammar(const json & schema) {
+        const std::string key = schema.dump();
+
+        auto it = schema_grammars.find(key);
+        if (it == schema_grammars.end()) {
+            if (schema_grammars.size() >= 64) {
+                schema_grammars.clear();
+            }
+            it = schema_grammars.emplace(key, json_schema_to_grammar(schema)).first;
+        }
+
+        return it->second;
+    }
+
+    // parse a "logit_bias" array: [[token or string, bias or false], ...]
+    void parse_logit_bias(const json & logit_bias, std::unordered_map<llama_token, float> & bias) const {
+        const int n_vocab = llama_n_vocab(model);
+        for (const auto & el : logit_bias) {
+            // TODO: we may want to throw errors here, in case "el" is incorrect
+            if (el.is_array() && el.size() == 2) {
+                float value;
+                if (el[1].is_number()) {
+                    value = el[1].get<float>();
+                } else if (el[1].is_boolean() && !el[1].get<bool>()) {
+                    value = -INFINITY;
+                } else {
+                    continue;
+                }
+
+                if (el[0].is_number_integer()) {
+                    llama_token tok = el[0].get<llama_token>();
+                    if (tok >= 0 && tok < n_vocab) {
+                        bias[tok] = value;
+                    }
+                } else if (el[0].is_string()) {
+                    auto toks = llama_tokenize(model, el[0].get<std::string>(), false);
+                    for (auto tok : toks) {
+                        bias[tok] = value;
+                    }
+                }
+            }
+        }
+    }
+
+    // returns the registered set, which stays valid even if another request removes it right away
+    std::shared_ptr<const llama_token_set> token_set_register(const json & data, int & id) {
+        std::unordered_map<llama_token, float> bias;
+
+        const auto & logit_bias = data.find("logit_bias");
+        if (logit_bias != data.end() && logit_bias->is_array()) {
+            parse_logit_bias(*logit_bias, bias);
+        }
+
+        // the tokens of "allowed_tokens" are the only ones that can be sampled, with the bias of "logit_bias" if any
+        const auto & allowed = data.find("allowed_tokens");
+        const bool exclusive = allowed != data.end() && allowed->is_array();
+        if (exclusive) {
+            const int n_vocab = llama_n_vocab(model);
+            for (const auto & el : *allowed) {
+                if (el.is_number_integer()) {
+                    const llama_token tok = el.get<llama_token>();
+                    if (tok >= 0 && tok < n_vocab) {
+                        bias.emplace(tok, 0.0f);
+                    }
+                } else if (el.is_string()) {
+                    for (auto tok : llama_tokenize(model, el.get<std::string>(), false)) {
+                        bias.emplace(tok, 0.0f);
+                    }
+                }
+            }
+        }
+
+        std::shared_ptr<const llama_token_set> set = llama_token_set_init(llama_n_vocab(model), bias, exclusive);
+
+        std::lock_guard<std::mutex> lock(mutex_token_sets);
+
+        while (!token_sets.empty() && token_sets.size() >= token_sets_max) {
+            auto lru = token_sets.begin();
+            for (auto it = token_sets.begin(); it != token_sets.end(); ++it) {
+                if (it->second.n_used < lru->second.n_used) {
+                    lru = it;
+                }
+            }
+
+            LOG_INFO("token set evicted", {
+                {"id",             lru->first},
+                {"token_sets_max", token_sets_max},
+            });
+
+            token_sets.erase(lru);
+            n_token_sets_evicted++;
+        }
+
+        id = id_token_set++;
+        token_sets[id] = { set, n_token_set_uses++ };
+
+        return set;
+    }
+
+    bool token_set_erase(int id) {
+        std::lock_guard<std::mutex> lock(mutex_token_sets);
+        return token_sets.erase(id) > 0;
+    }
+
+    std::shared_ptr<const llama_token_set> token_set_get(int id) {
+        std::lock_guard<std::mutex> lock(mutex_token_sets);
+        const auto it = token_sets.find(id);
+        if (it == token_sets.end()) {
+            return nullptr;
+        }
+        it->second.n_used = n_token_set_uses++;
+        return it->second.set;
+    }
+
     bool launch_slot_with_task(server_slot & slot, const server_task & task) {
         slot_params default_params;
         llama_sampling_params default_sparams;
@@ -852,12 +1388,18 @@ struct server_context {
         slot.sparams.mirostat_tau      = json_value(data, "mirostat_tau",      default_sparams.mirostat_tau);
         slot.sparams.mirostat_eta      = json_value(data, "mirostat_eta",      default_sparams.mirostat_eta);
         slot.sparams.penalize_nl       = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
+        slot.sparams.n_token_healing   = json_value(data, "token_healing",     default_sparams.n_token_healing);
         slot.params.n_keep             = json_value(data, "n_keep",            slot.params.n_keep);
         slot.params.n_discard          = json_value(data, "n_discard",         default_params.n_discard);
         slot.sparams.seed              = json_value(data, "seed",              default_sparams.seed);
         slot.sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
         slot.sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
 
+        if (!server_task_priority_valid(data)) {
+            send_error(task, server_task_priority_error, ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+
         // process "json_schema" and "grammar"
         if (data.contains("json_schema") && !data["json_schema"].is_null() && data.contains("grammar") && !data["grammar"].is_null()) {
             send_error(task, "Either \"json_schema\" or \"grammar\" can be specified, but not both", ERROR_TYPE_INVALID_REQUEST);
@@ -865,7 +1407,7 @@ struct server_context {
         } else if (data.contains("json_schema") && !data.contains("grammar")) {
             try {
                 auto schema                = json_value(data, "json_schema", json::object());
-                slot.sparams.grammar       = json_schema_to_grammar(schema);
+                slot.sparams.grammar       = schema_to_grammar(schema);
             } catch (const std::exception & e) {
                 send_error(task, std::string("\"json_schema\": ") + e.what(), ERROR_TYPE_INVALID_REQUEST);
                 return false;
@@ -874,6 +1416,9 @@ struct server_context {
             slot.sparams.grammar       = json_value(data, "grammar",           default_sparams.grammar);
         }
 
+        // the reported probabilities have to be those of the candidates constrained by the grammar
+        slot.sparams.grammar_lazy = default_sparams.grammar_lazy && slot.sparams.n_probs == 0;
+
         if (slot.params.cache_prompt && slot.ga_n != 1) {
             LOG_WARNING("cache_prompt is not supported with group-attention", {});
             slot.params.cache_prompt = false;
@@ -961,31 +1506,25 @@ struct server_context {
 
             const auto & logit_bias = data.find("logit_bias");
             if (logit_bias != data.end() && logit_bias->is_array()) {
-                const int n_vocab = llama_n_vocab(model);
-                for (const auto & el : *logit_bias) {
-                    // TODO: we may want to throw errors here, in case "el" is incorrect
-                    if (el.is_array() && el.size() == 2) {
-                        float bias;
-                        if (el[1].is_number()) {
-                            bias = el[1].get<float>();
-                        } else if (el[1].is_boolean() && !el[1].get<bool>()) {
-                            bias = -INFINITY;
-                        } else {
-                            continue;
-                        }
+                parse_logit_bias(*logit_bias, slot.sparams.logit_bias);
+            }
+        }
 
-                        if (el[0].is_number_integer()) {
-                            llama_token tok = el[0].get<llama_token>();
-                            if (tok >= 0 && tok < n_vocab) {
-                                slot.sparams.logit_bias[tok] = bias;
-                            }
-                        } else if (el[0].is_string()) {
-                            auto toks = llama_tokenize(model, el[0].get<std::string>(), false);
-                            for (auto tok : toks) {
-                                slot.sparams.logit_bias[tok] = bias;
-                            }
-                        }
+        {
+            slot.params.token_sets.clear();
+            slot.sparams.token_sets.clear();
+
+            const auto & ids = data.find("token_sets");
+            if (ids != data.end() && ids->is_array()) {
+                for (const auto & el : *ids) {
+                    const int id = el.is_number_integer() ? el.get<int>() : -1;
+                    auto set = token_set_get(id);
+                    if (set == nullptr) {
+                        send_error(task, "Unknown token set: " + el.dump(), ERROR_TYPE_INVALID_REQUEST);
+                        return false;
                     }
+                    slot.params.token_sets.push_back(id);
+                    slot.sparams.token_sets.push_back(std::move(set));
                 }
             }
         }
@@ -1001,6 +1540,8 @@ struct server_context {
                     }
                 }
             }
+
+            slot.stop_matcher.build(slot.params.antiprompt);
         }
 
         {
@@ -1041,12 +1582,175 @@ struct server_context {
         return true;
     }
 
+    bool prompt_cache_init(const std::string & path, size_t size_max, size_t n_tokens_min) {
+        // the cells of recurrent models cannot be removed in part, nor saved (see llama_state_seq_get_data) - no cell has
+        // these positions, this removes nothing
+        if (!llama_kv_cache_seq_rm(ctx, -1, INT32_MAX - 1, INT32_MAX)) {
+            LOG_WARNING("the prompt cache is not supported by this model", {});
+            return false;
+        }
+
+        // the files of a model are kept in a directory of their own, named by a hash of what tells the models apart
+        char desc[256];
+        llama_model_desc(model, desc, sizeof(desc));
+
+        char name[32];
+        snprintf(name, sizeof(name), "%016" PRIx64, server_prompt_cache::hash(std::string(desc) + " " + std::to_string(llama_model_n_params(model)) + " " +
+                                                        std::to_string(llama_model_size(model)) + " " + std::to_string(llama_n_vocab(model))));
+
+        if (!prompt_cache.init(path + name + DIRECTORY_SEPARATOR, size_max, n_tokens_min)) {
+            LOG_WARNING("failed to create the prompt cache directory", {{"path", path}});
+            return false;
+        }
+
+        LOG_INFO("prompt cache", {
+            {"path",      prompt_cache.dir},
+            {"n_prompts", prompt_cache.entries.size()},
+            {"size",      prompt_cache.size},
+        });
+
+        return true;
+    }
+
+    // the cells that the slot has computed, of its cached tokens
+    size_t slot_n_kv(const server_slot & slot) const {
+        const int32_t n_kv = llama_kv_cache_seq_pos_max(ctx, slot.id + 1) + 1 - (int32_t) system_tokens.size();
+        return std::min(slot.cache_tokens.size(), (size_t) std::max(0, n_kv));
+    }
+
+    void prompt_cache_save(const server_slot & slot) {
+        const size_t n_kv = slot_n_kv(slot);
+        if (n_kv < prompt_cache.n_tokens_min) {
+            return;
+        }
+
+        std::vector<llama_token> tokens(slot.cache_tokens.begin(), slot.cache_tokens.begin() + n_kv);
+        if (prompt_cache.contains(tokens)) {
+            return;
+        }
+
+        // only the copy of the state is made here, the file is written by the thread of the prompt cache
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot.id + 1));
+        state.resize(llama_state_seq_get_data(ctx, state.data(), slot.id + 1));
+
+        prompt_cache.save(tokens, std::move(state));
+    }
+
+    // when a prompt is loaded into the slot: the cells that the slot drops are saved if there are enough of them, and the
+    // longest prefix of the prompt in the cache is restored if it is longer than the one the slot holds
+    void prompt_cache_update(server_slot & slot) {
+        // the positions of the cells depend on the system prompt
+        if (prompt_cache.dir.empty() || !system_tokens.empty()) {
+            return;
+        }
+
+        if (slot.cache_tokens.size() >= slot.n_past + prompt_cache.n_tokens_min) {
+            prompt_cache_save(slot);
+        }
+
+        server_prompt_cache::entry * e = prompt_cache.find(slot.prompt_tokens);
+        if (e == nullptr || common_part(e->tokens, slot.prompt_tokens) <= (size_t) slot.n_past) {
+            return;
+        }
+
+        // the file may be one that a slot has just dropped
+        prompt_cache.wait(*e);
+
+        const std::string path = prompt_cache.dir + e->name;
+
+        std::vector<llama_token> tokens(e->tokens.size());
+        size_t n_tokens = 0;
+        if (llama_state_seq_load_file(ctx, path.c_str(), slot.id + 1, tokens.data(), tokens.size(), &n_tokens) == 0) {
+            // no room left in the KV cache, or a file that does not fit this context (type of the cache) - it goes
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+            LOG_WARNING("failed to restore prompt from the prompt cache", {{"path", path}});
+            prompt_cache.remove(*e);
+            n_tokens = 0;
+        } else {
+            e->t_last_used = ggml_time_us();
+            prompt_cache.n_restored++;
+            prompt_cache.n_tokens_restored += n_tokens;
+        }
+        tokens.resize(n_tokens);
+
+        slot.cache_tokens = std::move(tokens);
+        slot.n_past       = common_part(slot.cache_tokens, slot.prompt_tokens);
+
+        LOG_VERBOSE("prompt prefix restored from the prompt cache", {
+            {"id_slot",  slot.id},
+            {"id_task",  slot.id_task},
+            {"n_past",   slot.n_past},
+        });
+    }
+
+    // the tokens of the slots are saved when the server stops, to be found after a restart
+    void prompt_cache_save_slots() {
+        if (prompt_cache.dir.empty() || !system_tokens.empty()) {
+            return;
+        }
+
+        for (const server_slot & slot : slots) {
+            prompt_cache_save(slot);
+        }
+    }
+
+    // copies into the sequence of the slot the cells of the longest prefix of its prompt held by another slot, if it is longer
+    // than the prefix the slot holds itself - so that a system prompt or a few-shot block is computed once, not once per slot
+    // the other slot may be busy: only the cells that are already computed are copied
+    void prompt_copy_from_slots(server_slot & slot) {
+        const int32_t n_system = system_tokens.size();
+
+        server_slot * src = nullptr;
+        size_t n_src = slot.n_past;
+
+        for (server_slot & other : slots) {
+            if (&other == &slot || other.cache_tokens.size() <= n_src) {
+                continue;
+            }
+
+            const size_t n = std::min(common_part(other.cache_tokens, slot.prompt_tokens), slot_n_kv(other));
+            if (n > n_src) {
+                src   = &other;
+                n_src = n;
+            }
+        }
+
+        if (src == nullptr) {
+            return;
+        }
+
+        // the cells after the common part are removed first, which is not possible with recurrent models
+        if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, n_system + slot.n_past, -1)) {
+            return;
+        }
+        llama_kv_cache_seq_cp(ctx, src->id + 1, slot.id + 1, n_system + slot.n_past, n_system + n_src);
+
+        LOG_VERBOSE("prompt prefix copied from another slot", {
+            {"id_slot",  slot.id},
+            {"id_task",  slot.id_task},
+            {"id_src",   src->id},
+            {"n_past",   slot.n_past},
+            {"n_copied", n_src - slot.n_past},
+        });
+
+        metrics.n_prompt_tokens_copied_total += n_src - slot.n_past;
+
+        slot.cache_tokens.assign(slot.prompt_tokens.begin(), slot.prompt_tokens.begin() + n_src);
+        slot.n_past = n_src;
+    }
+
     void kv_cache_clear() {
         LOG_VERBOSE("clearing KV cache", {});
 
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        // and what the slots remember of it
+        for (server_slot & slot : slots) {
+            slot.cache_tokens.clear();
+            prefix_tree.remove(slot.id);
+        }
     }
 
     void system_prompt_update() {
@@ -1117,11 +1821,27 @@ struct server_context {
 
     bool process_token(completion_token_output & result, server_slot & slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = llama_token_to_piece(ctx, result.tok, false);
         slot.sampled = result.tok;
 
-        // search stop word and delete it
-        slot.generated_text += token_str;
+        // the piece of the token is written at the end of the generated text directly
+        const size_t n_text_prev = slot.generated_text.size();
+        {
+            slot.generated_text.resize(n_text_prev + 16);
+            int32_t n_piece = llama_token_to_piece(model, result.tok, &slot.generated_text[n_text_prev], 16, false);
+            if (n_piece < 0) {
+                slot.generated_text.resize(n_text_prev - n_piece);
+                n_piece = llama_token_to_piece(model, result.tok, &slot.generated_text[n_text_prev], -n_piece, false);
+            }
+            slot.generated_text.resize(n_text_prev + n_piece);
+        }
+
+        // the regenerated text of the rolled back prompt tokens is already known to the client
+        if (slot.n_healing_skip > 0) {
+            const size_t n_skip = std::min(slot.n_healing_skip, slot.generated_text.size() - n_text_prev);
+            slot.generated_text.erase(n_text_prev, n_skip);
+            slot.n_healing_skip -= n_skip;
+        }
+
         slot.has_next_token = true;
 
         if (slot.ctx_sampling->params.use_penalty_prompt_tokens && result.tok != -1) {
@@ -1129,52 +1849,29 @@ struct server_context {
             slot.ctx_sampling->params.penalty_prompt_tokens.push_back(result.tok);
         }
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = false;
-        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i) {
-            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
-            if ((c & 0xC0) == 0x80) {
-                // continuation byte: 10xxxxxx
-                continue;
-            }
-            if ((c & 0xE0) == 0xC0) {
-                // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
-            } else if ((c & 0xF0) == 0xE0) {
-                // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
-            } else if ((c & 0xF8) == 0xF0) {
-                // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
-            }
-            // else 1-byte character or invalid byte
-            break;
+        // search stop word and delete it
+        const stop_string_matcher::match stop = slot.stop_matcher.feed(slot.generated_text.data() + n_text_prev, slot.generated_text.size() - n_text_prev);
+        if (stop.word >= 0) {
+            slot.stopped_word   = true;
+            slot.stopping_word  = slot.params.antiprompt[stop.word];
+            slot.has_next_token = false;
+            slot.generated_text.resize(stop.begin);
         }
 
+        // check if there is incomplete UTF-8 character at the end
+        const bool incomplete = slot.has_next_token && utf8_incomplete_suffix(slot.generated_text.data(), slot.generated_text.size()) > 0;
+
         if (!incomplete) {
-            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
-
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool is_stop_full = false;
-
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_FULL);
-            if (stop_pos != std::string::npos) {
-                is_stop_full = true;
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            } else {
-                is_stop_full = false;
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_PARTIAL);
+            // the text that may be the beginning of a stop string is held back
+            size_t n_send = slot.generated_text.size();
+            if (slot.has_next_token) {
+                n_send -= slot.stop_matcher.n_partial();
+                n_send -= utf8_incomplete_suffix(slot.generated_text.data(), n_send);
             }
 
-            // check if there is any token to predict
-            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0)) {
-                // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
-                slot.n_sent_text += result.text_to_send.size();
-                // add the token to slot queue and cache
+            if (n_send > slot.n_sent_text) {
+                result.text_to_send.assign(slot.generated_text, slot.n_sent_text, n_send - slot.n_sent_text);
+                slot.n_sent_text = n_send;
             }
 
             slot.add_token_string(result);
@@ -1183,10 +1880,6 @@ struct server_context {
             }
         }
 
-        if (incomplete) {
-            slot.has_next_token = true;
-        }
-
         // check the limits
         if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params)) {
             slot.stopped_limit  = true;
@@ -1278,6 +1971,7 @@ struct server_context {
             {"mirostat_tau",              slot.sparams.mirostat_tau},
             {"mirostat_eta",              slot.sparams.mirostat_eta},
             {"penalize_nl",               slot.sparams.penalize_nl},
+            {"token_healing",             slot.sparams.n_token_healing},
             {"stop",                      slot.params.antiprompt},
             {"n_predict",                 slot.params.n_predict}, // TODO: fix duplicate key n_predict
             {"n_keep",                    slot.params.n_keep},
@@ -1285,6 +1979,7 @@ struct server_context {
             {"ignore_eos",                ignore_eos},
             {"stream",                    slot.params.stream},
             {"logit_bias",                slot.sparams.logit_bias},
+            {"token_sets",                slot.params.token_sets},
             {"n_probs",                   slot.sparams.n_probs},
             {"min_keep",                  slot.sparams.min_keep},
             {"grammar",                   slot.sparams.grammar},
@@ -1447,7 +2142,7 @@ struct server_context {
         queue_results.send(res);
     }
 
-    void request_completion(int id_task, int id_multi, json data, bool infill, bool embedding) {
+    void request_completion(int id_task, int id_multi, json data, bool infill, bool embedding, const std::string & key) {
         server_task task;
         task.id        = id_task;
         task.id_multi  = id_multi;
@@ -1456,6 +2151,10 @@ struct server_context {
         task.infill    = infill;
         task.embedding = embedding;
         task.type      = SERVER_TASK_TYPE_COMPLETION;
+        task.key       = key;
+
+        // an unknown class is reported by launch_slot_with_task
+        server_task_priority_from_string(json_value(task.data, "priority", std::string()), task.priority);
 
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
         // otherwise, it's a single-prompt task, we actually queue it
@@ -1514,16 +2213,21 @@ struct server_context {
             subtask_data["prompt"] = subtask_data["prompt"][i];
 
             // subtasks inherit everything else (infill mode, embedding mode, etc.)
-            request_completion(subtask_ids[i], id_multi, subtask_data, multiprompt_task.infill, multiprompt_task.embedding);
+            request_completion(subtask_ids[i], id_multi, subtask_data, multiprompt_task.infill, multiprompt_task.embedding, multiprompt_task.key);
         }
     }
 
-    void process_single_task(const server_task & task) {
+    void process_single_task(server_task & task) {
         switch (task.type) {
             case SERVER_TASK_TYPE_COMPLETION:
                 {
-                    server_slot * slot = get_slot(json_value(task.data, "id_slot", -1));
+                    const int id_slot = json_value(task.data, "id_slot", -1);
+
+                    server_slot * slot = id_slot == -1 ? get_slot_by_prefix(task) : nullptr;
                     if (slot == nullptr) {
+                        slot = get_slot(id_slot);
+                    }
+                    if (slot == nullptr || !slot->available()) {
                         // if no slot is available, we defer this task for processing later
                         LOG_VERBOSE("no slot is available", {{"id_task", task.id}});
                         queue_tasks.defer(task);
@@ -1545,11 +2249,16 @@ struct server_context {
                     slot->id_multi  = task.id_multi;
                     slot->infill    = task.infill;
                     slot->embedding = task.embedding;
+                    slot->priority  = task.priority;
+                    slot->key       = task.key;
 
                     if (!launch_slot_with_task(*slot, task)) {
                         LOG_ERROR("error while launching slot", task.data);
                         break;
                     }
+
+                    queue_tasks.start_fair_task(task.key);
+                    metrics.on_task_launched(task);
                 } break;
             case SERVER_TASK_TYPE_CANCEL:
                 {
@@ -1609,6 +2318,24 @@ struct server_context {
                         {"slots",              slots_data}
                     });
 
+                    size_t   n_token_sets;
+                    uint64_t n_token_sets_evicted_total;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_token_sets);
+                        n_token_sets               = token_sets.size();
+                        n_token_sets_evicted_total = n_token_sets_evicted;
+                    }
+
+                    uint64_t n_tokenize_cache_hits;
+                    uint64_t n_tokenize_cache_misses;
+                    size_t   n_tokenize_cache_tokens;
+                    {
+                        std::lock_guard<std::mutex> lock(tokenize_cache.mutex);
+                        n_tokenize_cache_hits   = tokenize_cache.n_hits;
+                        n_tokenize_cache_misses = tokenize_cache.n_misses;
+                        n_tokenize_cache_tokens = tokenize_cache.n_tokens;
+                    }
+
                     server_task_result res;
                     res.id       = task.id;
                     res.id_multi = task.id_multi;
@@ -1624,6 +2351,22 @@ struct server_context {
                         { "t_tokens_generation_total",       metrics.t_tokens_generation_total},
                         { "n_tokens_predicted_total",        metrics.n_tokens_predicted_total},
                         { "t_prompt_processing_total",       metrics.t_prompt_processing_total},
+                        { "n_grammar_fast_total",            metrics.n_grammar_fast_total},
+                        { "n_grammar_full_total",            metrics.n_grammar_full_total},
+                        { "n_prompt_tokens_cached_total",    metrics.n_prompt_tokens_cached_total},
+                        { "n_prompt_tokens_copied_total",    metrics.n_prompt_tokens_copied_total},
+                        { "n_prompt_cache_saved_total",      prompt_cache.n_saved},
+                        { "n_prompt_cache_skipped_total",    prompt_cache.n_skipped},
+                        { "n_prompt_cache_restored_total",   prompt_cache.n_restored},
+                        { "n_prompt_cache_tokens_restored_total", prompt_cache.n_tokens_restored},
+                        { "n_prompt_cache_bytes",            prompt_cache.size},
+                        { "queue_wait_seconds",              metrics.queue_wait_data()},
+                        { "n_slot_prefix_routed_total",      metrics.n_slot_prefix_routed_total},
+                        { "n_tokenize_cache_hits",           n_tokenize_cache_hits},
+                        { "n_tokenize_cache_misses",         n_tokenize_cache_misses},
+                        { "n_tokenize_cache_tokens",         n_tokenize_cache_tokens},
+                        { "n_token_sets",                    n_token_sets},
+                        { "n_token_sets_evicted_total",      n_token_sets_evicted_total},
 
                         { "n_prompt_tokens_processed",       metrics.n_prompt_tokens_processed},
                         { "t_prompt_processing",             metrics.t_prompt_processing},
@@ -1699,6 +2442,7 @@ struct server_context {
                         break;
                     }
                     slot->cache_tokens.resize(token_count);
+                    prefix_tree.insert(slot->id, slot->cache_tokens);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -1731,6 +2475,7 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
                     slot->cache_tokens.clear();
+                    prefix_tree.remove(slot->id);
 
                     server_task_result result;
                     result.id = task.id;
@@ -1765,18 +2510,41 @@ struct server_context {
         queue_results.send(result);
     }
 
+    // the slots in the order in which their prompts are given a place in the batch: by priority class, then by the virtual
+    // time of their key (see server_queue::fair_vtime), then by id
+    std::vector<server_slot *> slots_by_priority() {
+        std::vector<std::pair<uint64_t, server_slot *>> order;
+        for (server_slot & slot : slots) {
+            order.emplace_back(queue_tasks.get_fair_vtime(slot.key), &slot);
+        }
+        std::stable_sort(order.begin(), order.end(), [](const std::pair<uint64_t, server_slot *> & a, const std::pair<uint64_t, server_slot *> & b) {
+            return a.second->priority != b.second->priority ? a.second->priority < b.second->priority : a.first < b.first;
+        });
+
+        std::vector<server_slot *> result;
+        for (const auto & el : order) {
+            result.push_back(el.second);
+        }
+        return result;
+    }
+
     void update_slots() {
         if (system_need_update) {
             system_prompt_update();
         }
 
         // release slots
+        bool released = false;
         for (auto & slot : slots) {
             if (slot.command == SLOT_COMMAND_RELEASE) {
+                released = true;
+
                 slot.state       = SLOT_STATE_IDLE;
                 slot.command     = SLOT_COMMAND_NONE;
                 slot.t_last_used = ggml_time_us();
 
+                prefix_tree.insert(slot.id, slot.cache_tokens);
+
                 LOG_INFO("slot released", {
                     {"id_slot",         slot.id},
                     {"id_task",         slot.id_task},
@@ -1791,6 +2559,16 @@ struct server_context {
             }
         }
 
+        if (released) {
+            std::vector<std::string> keys_processing;
+            for (const server_slot & slot : slots) {
+                if (slot.is_processing()) {
+                    keys_processing.push_back(slot.key);
+                }
+            }
+            queue_tasks.forget_idle_keys(keys_processing);
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -1881,6 +2659,8 @@ struct server_context {
 
             slot.n_past += 1;
 
+            queue_tasks.add_fair_tokens(slot.key, 1);
+
             if (slot.params.cache_prompt) {
                 slot.cache_tokens.push_back(slot.sampled);
             }
@@ -1900,9 +2680,14 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // prompts longer than this (in bytes) are tokenized while they are processed
+        const size_t n_prompt_stream_min = 64*1024;
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            for (server_slot * slot_ptr : slots_by_priority()) {
+                server_slot & slot = *slot_ptr;
+
                 // this slot still has a prompt to be processed
                 if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
                     auto & prompt_tokens = slot.prompt_tokens;
@@ -1938,8 +2723,22 @@ struct server_context {
                             prefix_tokens.insert(prefix_tokens.end(),   suffix_tokens.begin(), suffix_tokens.end());
                             prefix_tokens.push_back(llama_token_middle(model));
                             prompt_tokens = prefix_tokens;
+                        } else if (slot.prompt.is_string() && slot.prompt.get_ref<const std::string &>().size() > n_prompt_stream_min &&
+                                   !slot.embedding && slot.ga_n == 1 && slot.sparams.n_token_healing == 0) {
+                            // only the tokens of the first batch are needed now, the rest of the prompt is tokenized while
+                            // the batches are processed - into the same tokens as tokenize() (see llama_tokenizer_stream_feed)
+                            slot.prompt_stream = llama_tokenizer_stream_init(model, system_prompt.empty(), true);
+                            slot.n_prompt_fed  = 0;
+
+                            // with cache_prompt, enough of them to compare with all of the cached tokens
+                            prompt_stream_feed(slot, (slot.params.cache_prompt ? slot.cache_tokens.size() + 1 : 0) + n_batch);
                         } else {
                             prompt_tokens = tokenize(slot.prompt, system_prompt.empty()); // add BOS if there isn't system prompt
+
+                            // the sampling context regenerates the text of the rolled back tokens, see below
+                            if (slot.sparams.n_token_healing > 0) {
+                                slot.healing_prefix = llama_token_healing_rollback(ctx, prompt_tokens, slot.sparams.n_token_healing);
+                            }
                         }
 
                         slot.n_past = 0;
@@ -1980,43 +2779,9 @@ struct server_context {
                                 continue;
                             }
                         } else {
-                            if (slot.params.n_keep < 0) {
-                                slot.params.n_keep = slot.n_prompt_tokens;
-                            }
-                            slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
-
-                            // if input prompt is too big, truncate it (if group attention self-extend is disabled)
-                            if (slot.ga_n == 1 && slot.n_prompt_tokens >= slot.n_ctx) {
-                                const int n_left = slot.n_ctx - slot.params.n_keep;
-
-                                const int n_block_size = n_left / 2;
-                                const int erased_blocks = (slot.n_prompt_tokens - slot.params.n_keep - n_block_size) / n_block_size;
-
-                                std::vector<llama_token> new_tokens(
-                                        prompt_tokens.begin(),
-                                        prompt_tokens.begin() + slot.params.n_keep);
-
-                                new_tokens.insert(
-                                        new_tokens.end(),
-                                        prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size,
-                                        prompt_tokens.end());
-
-                                prompt_tokens = std::move(new_tokens);
-
-                                slot.truncated = true;
-                                slot.n_prompt_tokens = prompt_tokens.size();
-
-                                LOG_VERBOSE("input truncated", {
-                                    {"id_slot",         slot.id},
-                                    {"id_task",         slot.id_task},
-                                    {"n_ctx",           slot.n_ctx},
-                                    {"n_keep",          slot.params.n_keep},
-                                    {"n_left",          n_left},
-                                    {"n_prompt_tokens", slot.n_prompt_tokens},
-                                    {"prompt_tokens",   tokens_to_str(ctx, prompt_tokens.cbegin(), prompt_tokens.cend())},
-                                });
-
-                                GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
+                            // a prompt that is still being tokenized is fit in the context at its end
+                            if (slot.prompt_stream == nullptr) {
+                                fit_prompt_in_context(slot);
                             }
 
                             llama_sampling_reset(slot.ctx_sampling);
@@ -2030,6 +2795,12 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                                // or those of a prompt on disk
+                                prompt_cache_update(slot);
+
+                                // or the cells of another slot that holds more of the prompt
+                                prompt_copy_from_slots(slot);
+
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
                                     llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
@@ -2050,9 +2821,38 @@ struct server_context {
                             }
                         }
 
+                        if (slot.params.cache_prompt) {
+                            metrics.n_prompt_tokens_cached_total += slot.n_past;
+                        }
+
                         slot.n_prompt_tokens_processed = 0;
                     }
 
+                    if (slot.prompt_stream != nullptr) {
+                        const size_t n_text = slot.prompt.get_ref<const std::string &>().size();
+
+                        // extrapolated from the part fed so far
+                        const double n_tokens_est = (double) slot.prompt_tokens.size() * n_text / std::max<size_t>(slot.n_prompt_fed, 1);
+
+                        // the tokens for this batch - or all of them when the prompt could reach the end of the context, to
+                        // truncate it before processing tokens that the truncation drops
+                        size_t n_tokens = slot.n_past + (n_batch - batch.n_tokens);
+                        if (n_tokens >= (size_t) slot.n_ctx || n_tokens_est >= slot.n_ctx) {
+                            n_tokens = SIZE_MAX;
+                        }
+
+                        prompt_stream_feed(slot, n_tokens);
+
+                        if (slot.prompt_stream == nullptr) {
+                            fit_prompt_in_context(slot);
+
+                            // only the first n_keep tokens of a truncated prompt are the same as before
+                            if (slot.truncated) {
+                                slot.n_past = std::min(slot.n_past, slot.params.n_keep);
+                            }
+                        }
+                    }
+
                     if (slot.embedding) {
                         // cannot fit the prompt in the current batch - will try next iter
                         if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
@@ -2083,6 +2883,11 @@ struct server_context {
                     // remove the non-common part from the cache
                     slot.cache_tokens.resize(slot.n_past);
 
+                    if (!slot.healing_prefix.empty()) {
+                        llama_sampling_set_healing_prefix(slot.ctx_sampling, model, slot.healing_prefix);
+                        slot.n_healing_skip = slot.ctx_sampling->healing_prefix.size();
+                    }
+
                     LOG_INFO("kv cache rm [p0, end)", {
                         { "id_slot", slot.id },
                         { "id_task", slot.id_task },
@@ -2095,6 +2900,8 @@ struct server_context {
                     int32_t ga_n = slot.ga_n;
                     int32_t ga_w = slot.ga_w;
 
+                    const int32_t n_batch_tokens = batch.n_tokens;
+
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
                     for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
@@ -2116,6 +2923,8 @@ struct server_context {
                         slot_npast++;
                     }
 
+                    queue_tasks.add_fair_tokens(slot.key, batch.n_tokens - n_batch_tokens);
+
                     LOG_VERBOSE("prompt processing progress", {
                         {"id_slot",  slot.id},
                         {"n_past",   slot.n_past},
@@ -2125,7 +2934,7 @@ struct server_context {
                     });
 
                     // entire prompt has been processed - start decoding new tokens
-                    if (slot.n_past == slot.n_prompt_tokens) {
+                    if (slot.n_past == slot.n_prompt_tokens && slot.prompt_stream == nullptr) {
                         slot.state   = SLOT_STATE_PROCESSING;
                         slot.command = SLOT_COMMAND_NONE;
 
@@ -2237,6 +3046,20 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            // sample all the slots with an output in this batch at once, on the otherwise idle compute threads
+            std::vector<llama_sampling_context *> ctx_samplings;
+            std::vector<int32_t>                  idxs;
+            for (auto & slot : slots) {
+                if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens) || slot.embedding) {
+                    continue;
+                }
+                ctx_samplings.push_back(slot.ctx_sampling);
+                idxs.push_back(slot.i_batch - i);
+            }
+
+            const std::vector<llama_token> ids = llama_sampling_sample_batch(ctx_samplings, ctx, idxs, params.n_threads);
+            size_t i_sampled = 0;
+
             for (auto & slot : slots) {
                 if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2251,7 +3074,7 @@ struct server_context {
                 }
 
                 completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+                const llama_token id = ids[i_sampled++];
 
                 llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
 
@@ -2389,6 +3212,16 @@ static void server_print_usage(const char * argv0, const gpt_params & params, co
     printf("  --slots-endpoint-disable  disables slots monitoring endpoint.\n");
     printf("  --metrics                 enable prometheus compatible metrics endpoint (default: %s).\n", sparams.metrics_endpoint ? "enabled" : "disabled");
     printf("  --slot-save-path PATH     path to save slot kv cache (default: disabled)\n");
+    printf("  --grammar-cache FNAME     file to load compiled grammars from at startup and save them to at shutdown (default: disabled)\n");
+    printf("  --prompt-cache-dir PATH   directory to save the KV cache of the prompts that the slots drop to, and to restore them from\n");
+    printf("                            for later requests with cache_prompt that start with the same tokens (default: disabled)\n");
+    printf("  --prompt-cache-size N     maximum size of the prompt cache directory, in MiB (default: %d)\n", sparams.prompt_cache_size_mb);
+    printf("  --prompt-cache-min N      minimum number of tokens of a prompt to save it to the prompt cache (default: %d)\n", sparams.prompt_cache_min);
+    printf("  --slot-prefix-min N       minimum number of prompt tokens cached by a slot to send a request with cache_prompt to it\n");
+    printf("                            rather than to the least recently used slot, 0 = disabled (default: %d)\n", sparams.slot_prefix_min);
+    printf("  --tokenize-cache N        number of tokens of recent prompt texts kept to skip tokenizing them again, 0 = disabled (default: %d)\n", sparams.tokenize_cache_tokens);
+    printf("  --token-sets-max N        maximum number of token sets registered with /token-sets, the least recently used one is removed\n");
+    printf("                            to register a new one (default: %d)\n", sparams.token_sets_max);
     printf("\n");
     printf("  -n, --n-predict           maximum tokens to predict (default: %d)\n", params.n_predict);
     printf("  --override-kv KEY=TYPE:VALUE\n");
@@ -2809,6 +3642,52 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
             if (!sparams.slot_save_path.empty() && sparams.slot_save_path[sparams.slot_save_path.size() - 1] != DIRECTORY_SEPARATOR) {
                 sparams.slot_save_path += DIRECTORY_SEPARATOR;
             }
+        } else if (arg == "--grammar-cache") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.grammar_cache_path = argv[i];
+        } else if (arg == "--prompt-cache-dir") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.prompt_cache_dir = argv[i];
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!sparams.prompt_cache_dir.empty() && sparams.prompt_cache_dir[sparams.prompt_cache_dir.size() - 1] != DIRECTORY_SEPARATOR) {
+                sparams.prompt_cache_dir += DIRECTORY_SEPARATOR;
+            }
+        } else if (arg == "--prompt-cache-size") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.prompt_cache_size_mb = std::max(0, std::stoi(argv[i]));
+        } else if (arg == "--token-sets-max") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.token_sets_max = std::max(1, std::stoi(argv[i]));
+        } else if (arg == "--prompt-cache-min") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.prompt_cache_min = std::max(1, std::stoi(argv[i]));
+        } else if (arg == "--slot-prefix-min") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.slot_prefix_min = std::max(0, std::stoi(argv[i]));
+        } else if (arg == "--tokenize-cache") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.tokenize_cache_tokens = std::max(0, std::stoi(argv[i]));
         } else if (arg == "--chat-template") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -2873,6 +3752,22 @@ static void log_server_request(const httplib::Request & req, const httplib::Resp
     });
 }
 
+// the key that the tokens of a request are accounted to for fair scheduling: its API key when the server checks them, or
+// else its "user" - which the client chooses freely, so that it tells apart the users of a client that is trusted, and
+// only them
+static std::string request_fair_key(const server_params & sparams, const httplib::Request & req, const json & data) {
+    if (!sparams.api_keys.empty()) {
+        const std::string auth_header = req.get_header_value("Authorization");
+
+        const std::string prefix = "Bearer ";
+        if (auth_header.substr(0, prefix.size()) == prefix) {
+            return "key:" + auth_header.substr(prefix.size());
+        }
+    }
+
+    return "user:" + json_value(data, "user", std::string());
+}
+
 std::function<void(int)> shutdown_handler;
 std::atomic_flag is_terminating = ATOMIC_FLAG_INIT;
 
@@ -3002,17 +3897,30 @@ int main(int argc, char ** argv) {
         log_data["api_key"] = "api_key: " + std::to_string(sparams.api_keys.size()) + " keys loaded";
     }
 
+    ctx_server.tokenize_cache.n_tokens_max = sparams.tokenize_cache_tokens;
+    ctx_server.slot_prefix_min             = sparams.slot_prefix_min;
+    ctx_server.token_sets_max              = sparams.token_sets_max;
+
     // load the model
     if (!ctx_server.load_model(params)) {
         state.store(SERVER_STATE_ERROR);
         return 1;
     } else {
         ctx_server.init();
+        if (!sparams.prompt_cache_dir.empty()) {
+            ctx_server.prompt_cache_init(sparams.prompt_cache_dir, (size_t) sparams.prompt_cache_size_mb*1024*1024, sparams.prompt_cache_min);
+        }
         state.store(SERVER_STATE_READY);
     }
 
     LOG_INFO("model loaded", {});
 
+    if (!sparams.grammar_cache_path.empty() && std::ifstream(sparams.grammar_cache_path).good()) {
+        if (!llama_grammar_cache_load_file(ctx_server.model, sparams.grammar_cache_path.c_str())) {
+            LOG_WARNING("failed to load grammar cache", {{"path", sparams.grammar_cache_path}});
+        }
+    }
+
     const auto model_meta = ctx_server.model_meta();
 
     // if a custom chat template is not supplied, we will use the one that comes with the model (if any)
@@ -3229,6 +4137,54 @@ int main(int argc, char ** argv) {
                     {"name",  "tokens_predicted_seconds_total"},
                     {"help",  "Predict process time"},
                     {"value",  (uint64_t) data["t_tokens_generation_total"] / 1.e3}
+            }, {
+                    {"name",  "grammar_fast_tokens_total"},
+                    {"help",  "Number of grammar-constrained tokens sampled without applying the grammar to the candidates."},
+                    {"value",  (uint64_t) data["n_grammar_fast_total"]}
+            }, {
+                    {"name",  "grammar_resampled_tokens_total"},
+                    {"help",  "Number of grammar-constrained tokens resampled after the grammar rejected the first choice."},
+                    {"value",  (uint64_t) data["n_grammar_full_total"]}
+            }, {
+                    {"name",  "prompt_tokens_cached_total"},
+                    {"help",  "Number of prompt tokens found in the KV cache of the slot, which were not processed again."},
+                    {"value",  (uint64_t) data["n_prompt_tokens_cached_total"]}
+            }, {
+                    {"name",  "prompt_tokens_copied_total"},
+                    {"help",  "Number of cached prompt tokens copied from the KV cache of another slot."},
+                    {"value",  (uint64_t) data["n_prompt_tokens_copied_total"]}
+            }, {
+                    {"name",  "prompt_cache_saved_total"},
+                    {"help",  "Number of prompts saved to the prompt cache directory."},
+                    {"value",  (uint64_t) data["n_prompt_cache_saved_total"]}
+            }, {
+                    {"name",  "prompt_cache_skipped_total"},
+                    {"help",  "Number of prompts not saved to the prompt cache directory because the disk did not keep up."},
+                    {"value",  (uint64_t) data["n_prompt_cache_skipped_total"]}
+            }, {
+                    {"name",  "prompt_cache_restored_total"},
+                    {"help",  "Number of prompts restored from the prompt cache directory."},
+                    {"value",  (uint64_t) data["n_prompt_cache_restored_total"]}
+            }, {
+                    {"name",  "prompt_cache_tokens_restored_total"},
+                    {"help",  "Number of tokens restored from the prompt cache directory."},
+                    {"value",  (uint64_t) data["n_prompt_cache_tokens_restored_total"]}
+            }, {
+                    {"name",  "slot_prefix_routed_total"},
+                    {"help",  "Number of requests sent to the slot that holds the longest prefix of their prompt."},
+                    {"value",  (uint64_t) data["n_slot_prefix_routed_total"]}
+            }, {
+                    {"name",  "tokenize_cache_hits_total"},
+                    {"help",  "Number of prompt texts whose tokens were found in the tokenization cache."},
+                    {"value",  (uint64_t) data["n_tokenize_cache_hits"]}
+            }, {
+                    {"name",  "tokenize_cache_misses_total"},
+                    {"help",  "Number of prompt texts tokenized because they were not in the tokenization cache."},
+                    {"value",  (uint64_t) data["n_tokenize_cache_misses"]}
+            }, {
+                    {"name",  "token_sets_evicted_total"},
+                    {"help",  "Number of token sets removed to make room for new ones."},
+                    {"value",  (uint64_t) data["n_token_sets_evicted_total"]}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3246,6 +4202,18 @@ int main(int argc, char ** argv) {
                     {"name",  "kv_cache_tokens"},
                     {"help",  "KV-cache tokens."},
                     {"value",  (uint64_t) data["kv_cache_tokens_count"]}
+            },{
+                    {"name",  "prompt_cache_bytes"},
+                    {"help",  "Size of the files in the prompt cache directory."},
+                    {"value",  (uint64_t) data["n_prompt_cache_bytes"]}
+            },{
+                    {"name",  "tokenize_cache_tokens"},
+                    {"help",  "Tokens held by the tokenization cache."},
+                    {"value",  (uint64_t) data["n_tokenize_cache_tokens"]}
+            },{
+                    {"name",  "token_sets"},
+                    {"help",  "Number of registered token sets."},
+                    {"value",  (uint64_t) data["n_token_sets"]}
             },{
                     {"name",  "requests_processing"},
                     {"help",  "Number of request processing."},
@@ -3274,6 +4242,23 @@ int main(int argc, char ** argv) {
             }
         }
 
+        {
+            prometheus << "# HELP llamacpp:queue_wait_seconds Time that the completion tasks waited for a slot, by priority class.\n"
+                       << "# TYPE llamacpp:queue_wait_seconds histogram\n";
+
+            for (const auto & el : data["queue_wait_seconds"].items()) {
+                const std::string labels = "priority=\"" + el.key() + "\"";
+                const json & histogram = el.value();
+
+                for (const auto & bucket : histogram["buckets"]) {
+                    prometheus << "llamacpp:queue_wait_seconds_bucket{" << labels << ",le=\"" << (double) bucket[0] << "\"} " << (uint64_t) bucket[1] << "\n";
+                }
+                prometheus << "llamacpp:queue_wait_seconds_bucket{" << labels << ",le=\"+Inf\"} " << (uint64_t) histogram["count"] << "\n"
+                           << "llamacpp:queue_wait_seconds_sum{"    << labels << "} " << (double) histogram["sum"] << "\n"
+                           << "llamacpp:queue_wait_seconds_count{"  << labels << "} " << (uint64_t) histogram["count"] << "\n";
+            }
+        }
+
         const int64_t t_start = data["t_start"];
         res.set_header("Process-Start-Time-Unix", std::to_string(t_start));
 
@@ -3399,15 +4384,20 @@ int main(int argc, char ** argv) {
         res.set_content(data.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_completions = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_completions = [&ctx_server, &sparams, &res_error](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
         json data = json::parse(req.body);
 
+        if (!server_task_priority_valid(data)) {
+            res_error(res, format_error_response(server_task_priority_error, ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
         const int id_task = ctx_server.queue_tasks.get_new_id();
 
         ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, data, false, false);
+        ctx_server.request_completion(id_task, -1, data, false, false, request_fair_key(sparams, req, data));
 
         if (!json_value(data, "stream", false)) {
             server_task_result result = ctx_server.queue_results.recv(id_task);
@@ -3498,10 +4488,15 @@ int main(int argc, char ** argv) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         json data = oaicompat_completion_params_parse(ctx_server.model, json::parse(req.body), sparams.chat_template);
 
+        if (!server_task_priority_valid(data)) {
+            res_error(res, format_error_response(server_task_priority_error, ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
         const int id_task = ctx_server.queue_tasks.get_new_id();
 
         ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, data, false, false);
+        ctx_server.request_completion(id_task, -1, data, false, false, request_fair_key(sparams, req, data));
 
         const auto completion_id = gen_chatcmplid();
         if (!json_value(data, "stream", false)) {
@@ -3566,15 +4561,20 @@ int main(int argc, char ** argv) {
         }
     };
 
-    const auto handle_infill = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_infill = [&ctx_server, &sparams, &res_error](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
         json data = json::parse(req.body);
 
+        if (!server_task_priority_valid(data)) {
+            res_error(res, format_error_response(server_task_priority_error, ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
         const int id_task = ctx_server.queue_tasks.get_new_id();
 
         ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, data, true, false);
+        ctx_server.request_completion(id_task, -1, data, true, false, request_fair_key(sparams, req, data));
 
         if (!json_value(data, "stream", false)) {
             server_task_result result = ctx_server.queue_results.recv(id_task);
@@ -3652,7 +4652,42 @@ int main(int argc, char ** argv) {
         return res.set_content(data.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_embeddings = [&params, &ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_token_sets = [&ctx_server](const httplib::Request & req, httplib::Response & res) {
+        res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+        const json body = json::parse(req.body);
+
+        int id;
+        const auto set = ctx_server.token_set_register(body, id);
+
+        const json data = {
+            { "id",        id },
+            { "n_tokens",  set->tokens.size() },
+            { "exclusive", set->exclusive },
+        };
+        return res.set_content(data.dump(), "application/json; charset=utf-8");
+    };
+
+    const auto handle_token_sets_erase = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+        res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+
+        int id;
+        try {
+            id = std::stoi(req.path_params.at("id"));
+        } catch (const std::exception &) {
+            res_error(res, format_error_response("Invalid token set ID", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        if (!ctx_server.token_set_erase(id)) {
+            res_error(res, format_error_response("Unknown token set ID", ERROR_TYPE_NOT_FOUND));
+            return;
+        }
+
+        const json data = { { "id", id }, { "deleted", true } };
+        res.set_content(data.dump(), "application/json; charset=utf-8");
+    };
+
+    const auto handle_embeddings = [&params, &ctx_server, &sparams, &res_error](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         if (!params.embedding) {
             res.status = 501;
@@ -3676,12 +4711,21 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        if (!server_task_priority_valid(body)) {
+            res_error(res, format_error_response(server_task_priority_error, ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
         // create and queue the task
         json responses;
         {
             const int id_task = ctx_server.queue_tasks.get_new_id();
             ctx_server.queue_results.add_waiting_task_id(id_task);
-            ctx_server.request_completion(id_task, -1, {{"prompt", prompt}}, false, true);
+            json data = {{"prompt", prompt}};
+            if (body.contains("priority")) {
+                data["priority"] = body.at("priority");
+            }
+            ctx_server.request_completion(id_task, -1, data, false, true, request_fair_key(sparams, req, body));
 
             // get the result
             server_task_result result = ctx_server.queue_results.recv(id_task);
@@ -3749,6 +4793,8 @@ int main(int argc, char ** argv) {
     svr->Post("/v1/embeddings",       handle_embeddings);
     svr->Post("/tokenize",            handle_tokenize);
     svr->Post("/detokenize",          handle_detokenize);
+    svr->Post("/token-sets",          handle_token_sets);
+    svr->Delete("/token-sets/:id",    handle_token_sets_erase);
     if (!sparams.slot_save_path.empty()) {
         // only enable slot endpoints if slot_save_path is set
         svr->Post("/slots/:id_slot",  handle_slots_action);
@@ -3813,6 +4859,14 @@ int main(int argc, char ** argv) {
     svr->stop();
     t.join();
 
+    ctx_server.prompt_cache_save_slots();
+
+    if (!sparams.grammar_cache_path.empty()) {
+        if (!llama_grammar_cache_save_file(ctx_server.model, sparams.grammar_cache_path.c_str())) {
+            LOG_WARNING("failed to save grammar cache", {{"path", sparams.grammar_cache_path}});
+        }
+    }
+
     llama_backend_free();
 
     return 0;
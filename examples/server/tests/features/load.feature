@@ -0,0 +1,30 @@
+# run with: ./tests.sh --no-skipped --tags load
+@load
+@slow
+Feature: Load - server CPU time of many concurrent streams
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/split/stories15M-00001-of-00003.gguf from HF repo ggml-org/models
+    And   a model file test-model-00001-of-00003.gguf
+    And   42 as server seed
+    And   128 slots
+    And   8192 KV cache size
+    And   136 HTTP threads
+    And   continuous batching
+    Then  the server is starting
+    Then  the server is healthy
+
+  # Each generated token is sent to the HTTP thread of its stream only, so the CPU time of the server per streamed
+  # token does not grow with the number of concurrent streams.
+  # Reads the CPU time of the server from /proc: Linux only.
+  Scenario Outline: Many concurrent streaming completions
+    Given <n_streams> prompts Once upon a time with seed 42
+    And   <n_predict> max tokens to predict
+    And   the server CPU time is recorded
+    Given concurrent streaming completion requests
+    Then  the server CPU time per streamed token is below <max_cpu_ms> ms
+    Examples:
+      | n_streams | n_predict | max_cpu_ms |
+      | 32        | 32        | 5.0        |
+      | 128       | 32        | 5.0        |
@@ -0,0 +1,40 @@
+@llama.cpp
+@priority
+Feature: Priority classes and fair scheduling of the requests waiting for a slot
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   1024 KV cache size
+    And   1 slots
+    And   8 HTTP threads
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  # The first request holds the only slot while the others are queued. The waiting requests are given the slot by
+  # priority class, then, within a class, the requests of the user that has been served the fewest tokens go first.
+  Scenario: Waiting requests are given the slot by priority class, then by the tokens served to their user
+    Given completion requests sent one after the other:
+      | name | user | priority | n_predict |
+      | busy | A    | low      | 512       |
+      | a1   | A    | low      | 16        |
+      | a2   | A    | normal   | 16        |
+      | b1   | B    | normal   | 16        |
+      | b2   | B    | normal   | 16        |
+      | h1   | C    | high     | 16        |
+    Then  the requests are given the slot in the order busy h1 b1 b2 a2 a1
+    When  prometheus metrics are exposed
+    Then  the queue wait histogram counts 1 high priority requests
+    And   the queue wait histogram counts 3 normal priority requests
+    And   the queue wait histogram counts 2 low priority requests
+
+  Scenario: A request with an unknown priority is rejected before it is queued
+    Given a completion request of priority urgent
+    Then  the server responds with status code 400
+    When  prometheus metrics are exposed
+    Then  the queue wait histogram counts 0 high priority requests
+    And   the queue wait histogram counts 0 normal priority requests
+    And   the queue wait histogram counts 0 low priority requests
@@ -53,6 +53,7 @@ def step_server_config(context, server_fqdn, server_port):
     context.id_slot = None
     context.cache_prompt = None
     context.n_slots = None
+    context.n_threads_http = None
     context.prompt_prefix = None
     context.prompt_suffix = None
     context.server_api_key = None
@@ -124,6 +125,11 @@ def step_n_slots(context, n_slots):
     context.n_slots = n_slots
 
 
+@step('{n_threads_http:d} HTTP threads')
+def step_n_threads_http(context, n_threads_http):
+    context.n_threads_http = n_threads_http
+
+
 @step('{n_predict:d} server max tokens to predict')
 def step_server_n_predict(context, n_predict):
     context.n_server_predict = n_predict
@@ -504,6 +510,94 @@ async def step_concurrent_completion_requests(context):
     )
 
 
+@step('concurrent streaming completion requests')
+@async_run_until_complete()
+async def step_concurrent_streaming_completion_requests(context):
+    await concurrent_requests(
+        context,
+        request_completion_stream,
+        # prompt is inserted automatically
+        context.base_url,
+        debug=context.debug,
+        n_predict=context.n_predict if hasattr(context, 'n_predict') else None,
+    )
+
+
+@step('the server CPU time is recorded')
+def step_server_cpu_time_recorded(context):
+    context.server_cpu_time = server_cpu_time(context)
+
+
+@step('the server CPU time per streamed token is below {max_ms:f} ms')
+@async_run_until_complete
+async def step_server_cpu_time_per_token(context, max_ms):
+    n_completions = await gather_tasks_results(context)
+    assert n_completions > 0
+    n_tokens = 0
+    for i in range(n_completions):
+        n_tokens += context.tasks_result.pop()['timings']['predicted_n']
+    assert n_tokens > 0, "no token predicted"
+    cpu_ms_per_token = (server_cpu_time(context) - context.server_cpu_time) * 1e3 / n_tokens
+    print(f"server CPU time: {cpu_ms_per_token:.3f} ms per streamed token ({n_completions} streams, {n_tokens} tokens)")
+    assert cpu_ms_per_token < max_ms, f"{cpu_ms_per_token:.3f} ms per streamed token, expected below {max_ms} ms"
+
+
+@step('completion requests sent one after the other')
+@async_run_until_complete
+async def step_completion_requests_one_after_the_other(context):
+    async def request(row):
+        async with aiohttp.ClientSession() as session:
+            async with session.post(f'{context.base_url}/completion',
+                                    json={
+                                        "prompt": f"Once upon a time, {row['name']}",
+                                        "n_predict": int(row['n_predict']),
+                                        "ignore_eos": True,
+                                        "user": row['user'],
+                                        "priority": row['priority'],
+                                    },
+                                    timeout=3600) as response:
+                assert response.status == 200
+                await response.json()
+                return row['name'], time.monotonic()
+
+    # with one slot, the requests end in the order in which they are given the slot
+    tasks = []
+    for row in context.table:
+        tasks.append(asyncio.create_task(request(row)))
+        await asyncio.sleep(0.05)
+    results = await asyncio.gather(*tasks)
+    context.completion_order = [name for name, _ in sorted(results, key=lambda result: result[1])]
+
+
+@step('the requests are given the slot in the order {order}')
+def step_requests_order(context, order):
+    assert context.completion_order == order.split(), f"order: {context.completion_order}"
+
+
+@step('a completion request of priority {priority}')
+@async_run_until_complete
+async def step_completion_request_priority(context, priority):
+    async with aiohttp.ClientSession() as session:
+        async with session.post(f'{context.base_url}/completion',
+                                json={
+                                    "prompt": "Once upon a time",
+                                    "n_predict": 1,
+                                    "priority": priority,
+                                }) as response:
+            context.response = response
+
+
+@step('the queue wait histogram counts {n_requests:d} {priority} priority requests')
+def step_queue_wait_histogram(context, n_requests, priority):
+    samples = [sample for sample in context.metrics['llamacpp:queue_wait_seconds'].samples
+               if sample.labels.get('priority') == priority]
+    buckets = [sample.value for sample in samples if sample.name.endswith('_bucket')]
+    counts  = [sample.value for sample in samples if sample.name.endswith('_count')]
+    assert counts == [n_requests], f"priority {priority}: {samples}"
+    # cumulative, up to the +Inf bucket that holds them all
+    assert buckets == sorted(buckets) and buckets[-1] == n_requests, f"priority {priority}: {buckets}"
+
+
 @step('concurrent OAI completions requests')
 @async_run_until_complete
 async def step_oai_chat_completions(context):
@@ -852,6 +946,37 @@ async def request_completion(prompt,
                 return response.status
 
 
+async def request_completion_stream(prompt,
+                                    seed,
+                                    base_url,
+                                    debug=False,
+                                    n_predict=None):
+    if debug:
+        print(f"Sending streaming completion request: {prompt}")
+    async with aiohttp.ClientSession() as session:
+        async with session.post(f'{base_url}/completion',
+                                json={
+                                    "prompt": prompt,
+                                    "n_predict": n_predict if n_predict is not None else -1,
+                                    "seed": seed if seed is not None else 42,
+                                    "stream": True,
+                                },
+                                timeout=3600) as response:
+            assert response.status == 200
+            content = ''
+            result = None
+            async for line_in_bytes in response.content:
+                line = line_in_bytes.decode('utf-8').rstrip()
+                if not line.startswith('data: '):
+                    continue
+                result = json.loads(line[6:])
+                content += result['content']
+            assert result is not None and result['stop'], "the stream did not end with the final result"
+            # the final result holds the timings, and the content of the stream
+            result['content'] = content
+            return result
+
+
 async def oai_chat_completions(user_prompt,
                                seed,
                                system_prompt,
@@ -1092,6 +1217,13 @@ def assert_all_predictions_different(completion_responses):
         assert content_i != content_j, "contents not different"
 
 
+def server_cpu_time(context):
+    # user and system time of the server process, in seconds
+    with open(f'/proc/{context.server_process.pid}/stat', 'r') as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
 async def gather_tasks_results(context):
     n_tasks = len(context.concurrent_tasks)
     if context.debug:
@@ -1246,6 +1378,8 @@ def start_server_background(context):
         server_args.extend(['--ctx-size', context.n_ctx])
     if context.n_slots:
         server_args.extend(['--parallel', context.n_slots])
+    if context.n_threads_http:
+        server_args.extend(['--threads-http', context.n_threads_http])
     if context.n_server_predict:
         server_args.extend(['--n-predict', context.n_server_predict])
     if context.slot_save_path:
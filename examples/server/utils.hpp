@@ -5,7 +5,14 @@
 
 #include "json.hpp"
 
+#include <algorithm>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <sstream>
 #include <random>
@@ -258,25 +265,598 @@ static size_t common_part(const std::vector<llama_token> & a, const std::vector<
     return i;
 }
 
-static bool ends_with(const std::string & str, const std::string & suffix) {
-    return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+// number of bytes at the end of the text that start a UTF-8 character which is not complete yet
+static size_t utf8_incomplete_suffix(const char * text, size_t size) {
+    for (size_t i = 1; i < 5 && i <= size; ++i) {
+        const unsigned char c = text[size - i];
+        if ((c & 0xC0) == 0x80) {
+            // continuation byte: 10xxxxxx
+            continue;
+        }
+        size_t n = 1;
+        if ((c & 0xE0) == 0xC0) {
+            // 2-byte character: 110xxxxx ...
+            n = 2;
+        } else if ((c & 0xF0) == 0xE0) {
+            // 3-byte character: 1110xxxx ...
+            n = 3;
+        } else if ((c & 0xF8) == 0xF0) {
+            // 4-byte character: 11110xxx ...
+            n = 4;
+        }
+        // else 1-byte character or invalid byte
+        return i < n ? i : 0;
+    }
+    return 0;
 }
 
-static size_t find_partial_stop_string(const std::string &stop, const std::string &text) {
-    if (!text.empty() && !stop.empty()) {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--) {
-            if (stop[char_index] == text_last_char) {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial)) {
-                    return text.size() - char_index - 1;
+// finds the stop strings in the generated text as it grows: an Aho-Corasick automaton over the bytes of the strings,
+// fed with the piece of each new token only - the text is never scanned again
+// the depth of the current state is the length of the longest end of the text that a stop string starts with, which is
+// the part of the text that must be held back from the client until the next tokens tell whether the string follows
+struct stop_string_matcher {
+    struct node {
+        std::vector<std::pair<uint8_t, int32_t>> edges; // byte, child
+        int32_t fail   =  0;
+        int32_t depth  =  0;
+        int32_t word   = -1; // the first stop string that ends at this node
+        int32_t output = -1; // the nearest node of the fail chain at which a stop string ends
+    };
+
+    struct match {
+        size_t  begin = std::string::npos; // position in the text fed so far
+        int32_t word  = -1;
+    };
+
+    std::vector<std::string> words;
+    std::vector<node>        nodes;
+
+    int32_t state = 0;
+    size_t  n_fed = 0;
+
+    void build(const std::vector<std::string> & stop_words) {
+        words = stop_words;
+        nodes.assign(1, node());
+        state = 0;
+        n_fed = 0;
+
+        for (size_t w = 0; w < words.size(); ++w) {
+            int32_t cur = 0;
+            for (const char c : words[w]) {
+                int32_t next = child(cur, c);
+                if (next == 0) {
+                    next = nodes.size();
+                    nodes.emplace_back();
+                    nodes[next].depth = nodes[cur].depth + 1;
+                    nodes[cur].edges.emplace_back(c, next);
                 }
+                cur = next;
+            }
+            if (nodes[cur].word < 0) {
+                nodes[cur].word = w;
+            }
+        }
+
+        // fail links in breadth-first order, so that the ones of the shallower nodes are known
+        std::vector<int32_t> queue;
+        for (const auto & edge : nodes[0].edges) {
+            queue.push_back(edge.second);
+        }
+        for (size_t i = 0; i < queue.size(); ++i) {
+            const int32_t cur = queue[i];
+            for (const auto & edge : nodes[cur].edges) {
+                const int32_t next = edge.second;
+                nodes[next].fail   = step(nodes[cur].fail, edge.first);
+                nodes[next].output = nodes[nodes[next].fail].word >= 0 ? nodes[next].fail : nodes[nodes[next].fail].output;
+                queue.push_back(next);
             }
         }
     }
 
-    return std::string::npos;
-}
+    // number of bytes at the end of the text fed so far that may be the beginning of a stop string
+    size_t n_partial() const {
+        return nodes.empty() ? 0 : nodes[state].depth;
+    }
+
+    // feeds the next bytes of the text and returns the stop string that ends in them and starts first
+    // ties go to the string given first, like a search of the strings one after the other
+    match feed(const char * text, size_t size) {
+        match result;
+        if (nodes.size() <= 1) {
+            n_fed += size;
+            return result;
+        }
+
+        for (size_t i = 0; i < size; ++i) {
+            state = step(state, text[i]);
+            n_fed++;
+
+            for (int32_t cur = nodes[state].word >= 0 ? state : nodes[state].output; cur > 0; cur = nodes[cur].output) {
+                const size_t begin = n_fed - nodes[cur].depth;
+                if (begin < result.begin || (begin == result.begin && nodes[cur].word < result.word)) {
+                    result.begin = begin;
+                    result.word  = nodes[cur].word;
+                }
+            }
+        }
+
+        return result;
+    }
+
+private:
+    int32_t child(int32_t cur, uint8_t c) const {
+        for (const auto & edge : nodes[cur].edges) {
+            if (edge.first == c) {
+                return edge.second;
+            }
+        }
+        return 0;
+    }
+
+    int32_t step(int32_t cur, uint8_t c) const {
+        while (true) {
+            const int32_t next = child(cur, c);
+            if (next != 0 || cur == 0) {
+                return next;
+            }
+            cur = nodes[cur].fail;
+        }
+    }
+};
+
+// the tokens cached by the idle slots, as a radix tree: the children of a node start with different tokens, and each node
+// holds the ids of the slots whose tokens go through it - so that the slot holding the longest prefix of a prompt is found
+// without comparing the prompt with the tokens of every slot
+struct server_prefix_tree {
+    struct node {
+        std::vector<llama_token> tokens;   // the tokens from the parent to this node
+        std::vector<int32_t>     children;
+        std::vector<int>         slots;
+        int32_t                  parent = -1;
+    };
+
+    std::vector<node>    nodes = { node() }; // the root, the empty prefix
+    std::vector<int32_t> nodes_free;
+    std::vector<int32_t> slot_leaf;         // the deepest node of each slot, 0 if it has no tokens
+
+    // replaces the tokens of a slot
+    void insert(int id_slot, const std::vector<llama_token> & tokens) {
+        remove(id_slot);
+
+        int32_t cur = 0;
+        size_t  pos = 0;
+        while (pos < tokens.size()) {
+            int32_t next = child(cur, tokens[pos]);
+            if (next < 0) {
+                next = new_node(cur);
+                nodes[next].tokens.assign(tokens.begin() + pos, tokens.end());
+                nodes[cur].children.push_back(next);
+            } else {
+                const size_t n = common(nodes[next].tokens, tokens, pos);
+                if (n < nodes[next].tokens.size()) {
+                    // split the node where the tokens differ
+                    const int32_t mid = new_node(cur);
+                    nodes[mid].tokens.assign(nodes[next].tokens.begin(), nodes[next].tokens.begin() + n);
+                    nodes[mid].children = { next };
+                    nodes[mid].slots    = nodes[next].slots;
+                    nodes[next].tokens.erase(nodes[next].tokens.begin(), nodes[next].tokens.begin() + n);
+                    nodes[next].parent = mid;
+                    std::replace(nodes[cur].children.begin(), nodes[cur].children.end(), next, mid);
+                    next = mid;
+                }
+            }
+            nodes[next].slots.push_back(id_slot);
+            pos += nodes[next].tokens.size();
+            cur = next;
+        }
+
+        if ((size_t) id_slot >= slot_leaf.size()) {
+            slot_leaf.resize(id_slot + 1, 0);
+        }
+        slot_leaf[id_slot] = cur;
+    }
+
+    void remove(int id_slot) {
+        if ((size_t) id_slot >= slot_leaf.size()) {
+            return;
+        }
+
+        int32_t cur = slot_leaf[id_slot];
+        slot_leaf[id_slot] = 0;
+
+        while (cur != 0) {
+            node & nd = nodes[cur];
+            const int32_t parent = nd.parent;
+
+            nd.slots.erase(std::find(nd.slots.begin(), nd.slots.end(), id_slot));
+            if (nd.slots.empty()) {
+                // the slots of the children are slots of the node too, so there are no children left
+                auto & siblings = nodes[parent].children;
+                siblings.erase(std::find(siblings.begin(), siblings.end(), cur));
+                nd = node();
+                nodes_free.push_back(cur);
+            } else if (nd.children.size() == 1 && nodes[nd.children[0]].slots.size() == nd.slots.size()) {
+                // no slot ends in the node and a single one goes on: the split is not needed anymore
+                const int32_t next = nd.children[0];
+                nd.tokens.insert(nd.tokens.end(), nodes[next].tokens.begin(), nodes[next].tokens.end());
+                nd.children = std::move(nodes[next].children);
+                for (const int32_t c : nd.children) {
+                    nodes[c].parent = cur;
+                }
+                std::replace(slot_leaf.begin(), slot_leaf.end(), next, cur);
+                nodes[next] = node();
+                nodes_free.push_back(next);
+            }
+
+            cur = parent;
+        }
+    }
+
+    // the longest prefix of the tokens that is cached by a slot accepted by the filter, and the slots that hold it
+    template <typename F>
+    size_t find(const std::vector<llama_token> & tokens, std::vector<int> & ids_slot, const F & filter) const {
+        size_t n_best = 0;
+        ids_slot.clear();
+
+        int32_t cur = 0;
+        size_t  pos = 0;
+        while (pos < tokens.size()) {
+            const int32_t next = child(cur, tokens[pos]);
+            if (next < 0) {
+                break;
+            }
+
+            const size_t n = common(nodes[next].tokens, tokens, pos);
+
+            std::vector<int> ids;
+            for (const int id : nodes[next].slots) {
+                if (filter(id)) {
+                    ids.push_back(id);
+                }
+            }
+            if (ids.empty()) {
+                break;
+            }
+
+            n_best = pos + n;
+            ids_slot = std::move(ids);
+
+            if (n < nodes[next].tokens.size()) {
+                break;
+            }
+            pos += n;
+            cur = next;
+        }
+
+        return n_best;
+    }
+
+private:
+    int32_t child(int32_t cur, llama_token token) const {
+        for (const int32_t c : nodes[cur].children) {
+            if (nodes[c].tokens[0] == token) {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    static size_t common(const std::vector<llama_token> & a, const std::vector<llama_token> & b, size_t pos) {
+        size_t n = 0;
+        while (n < a.size() && pos + n < b.size() && a[n] == b[pos + n]) {
+            n++;
+        }
+        return n;
+    }
+
+    int32_t new_node(int32_t parent) {
+        int32_t id;
+        if (!nodes_free.empty()) {
+            id = nodes_free.back();
+            nodes_free.pop_back();
+        } else {
+            id = nodes.size();
+            nodes.emplace_back();
+        }
+        nodes[id].parent = parent;
+        return id;
+    }
+};
+
+// the KV cells of the prompts that the slots drop, saved in a directory to be restored by later requests that start with
+// the same tokens - also after a restart, or by another server with the same model
+// each file holds one sequence in the format of llama_state_seq_save_file and is named by the hash of its tokens, the
+// files of the least recently used prompts are removed when the directory holds more than size_max bytes
+// the files are written and removed by a thread of their own, in the order of the calls, so that saving the state of a
+// slot costs the main loop a copy of it and not a write to the disk
+struct server_prompt_cache {
+    struct entry {
+        std::string              name;
+        std::vector<llama_token> tokens;
+        size_t                   size;
+        int64_t                  t_last_used;
+        uint64_t                 n_job; // the job that writes the file, 0 if it was there before
+    };
+
+    std::string dir; // empty: disabled
+
+    size_t size_max     = 0;
+    size_t size         = 0;
+    size_t n_tokens_min = 0;
+
+    // the bytes of the states that are not written yet: a prompt is not saved if there would be more, so that the
+    // memory they take stays bounded when the disk does not keep up
+    size_t size_pending_max = 256u*1024*1024;
+
+    std::vector<entry> entries;
+
+    uint64_t n_saved           = 0;
+    uint64_t n_skipped         = 0;
+    uint64_t n_restored        = 0;
+    uint64_t n_tokens_restored = 0;
+
+    server_prompt_cache() = default;
+    server_prompt_cache(const server_prompt_cache &) = delete;
+    server_prompt_cache & operator=(const server_prompt_cache &) = delete;
+
+    ~server_prompt_cache() {
+        if (worker.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            condition_jobs.notify_one();
+            worker.join(); // the jobs left are done first
+        }
+    }
+
+    // the files that cannot be read are removed, the oldest files when there are too many
+    bool init(const std::string & path, size_t size_max_, size_t n_tokens_min_) {
+        if (!create_directory_with_parents(path)) {
+            return false;
+        }
+
+        dir          = path;
+        size_max     = size_max_;
+        n_tokens_min = n_tokens_min_;
+
+        for (const std::string & file : list_directory_files(dir)) {
+            if (file.size() <= 4 || file.compare(file.size() - 4, 4, ".bin") != 0) {
+                continue;
+            }
+            entry e;
+            e.name        = file;
+            e.t_last_used = 0;
+            e.n_job       = 0;
+            if (!read_tokens(dir + file, e.tokens, e.size)) {
+                LOG_WARNING("removing unreadable file from the prompt cache", {{"path", dir + file}});
+                std::remove((dir + file).c_str());
+                continue;
+            }
+            size += e.size;
+            entries.push_back(std::move(e));
+        }
+
+        worker = std::thread(&server_prompt_cache::loop, this);
+
+        evict();
+
+        return true;
+    }
+
+    // the entry with the longest prefix of the tokens, if it is long enough
+    entry * find(const std::vector<llama_token> & tokens) {
+        entry * best = nullptr;
+        size_t n_best = n_tokens_min > 0 ? n_tokens_min - 1 : 0;
+
+        for (entry & e : entries) {
+            const size_t n = common_part(e.tokens, tokens);
+            if (n > n_best) {
+                best   = &e;
+                n_best = n;
+            }
+        }
+
+        return best;
+    }
+
+    // whether a file holds the tokens already, or tokens that start with them - it counts as a use of the file
+    bool contains(const std::vector<llama_token> & tokens) {
+        for (entry & e : entries) {
+            if (common_part(e.tokens, tokens) == tokens.size()) {
+                e.t_last_used = ggml_time_us();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // the state of the sequence holding the tokens, from llama_state_seq_get_data: the files of their prefixes are not
+    // needed anymore
+    void save(const std::vector<llama_token> & tokens, std::vector<uint8_t> && state) {
+        if (contains(tokens)) {
+            return;
+        }
+
+        job j;
+        j.tokens = tokens;
+        j.state  = std::move(state);
+
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%016" PRIx64 ".bin", hash(tokens));
+        j.path = dir + buf;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (size_pending + j.state.size() > size_pending_max) {
+                n_skipped++;
+                LOG_VERBOSE("prompt not saved, too many states are waiting to be written", {{"size_pending", size_pending}});
+                return;
+            }
+        }
+
+        for (size_t i = entries.size(); i-- > 0;) {
+            if (common_part(entries[i].tokens, tokens) == entries[i].tokens.size()) {
+                remove(entries[i]);
+            }
+        }
+
+        const size_t n_bytes = 3*sizeof(uint32_t) + tokens.size()*sizeof(llama_token) + j.state.size();
+
+        entries.push_back({ buf, tokens, n_bytes, ggml_time_us(), post(std::move(j)) });
+        size += n_bytes;
+        n_saved++;
+
+        evict();
+    }
+
+    // the file of the entry is complete after this
+    void wait(const entry & e) {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition_done.wait(lock, [&]{ return n_jobs_done >= e.n_job; });
+    }
+
+    // the jobs posted so far are done after this
+    void wait_all() {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition_done.wait(lock, [&]{ return n_jobs_done == n_jobs; });
+    }
+
+    // the file of the entry is removed, e.g. when it does not fit the context it is restored into
+    void remove(entry & e) {
+        job j;
+        j.path = dir + e.name;
+        post(std::move(j));
+
+        size -= e.size;
+        entries.erase(entries.begin() + (&e - entries.data()));
+    }
+
+    static uint64_t hash(const void * data, size_t size) {
+        // FNV-1a
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++i) {
+            h ^= ((const uint8_t *) data)[i];
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    static uint64_t hash(const std::string & s) {
+        return hash(s.data(), s.size());
+    }
+
+    static uint64_t hash(const std::vector<llama_token> & tokens) {
+        return hash(tokens.data(), tokens.size()*sizeof(llama_token));
+    }
+
+    // the tokens at the start of a file written by llama_state_seq_save_file
+    static bool read_tokens(const std::string & path, std::vector<llama_token> & tokens, size_t & size) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return false;
+        }
+        size = file.tellg();
+        file.seekg(0);
+
+        uint32_t header[3];
+        if (!file.read((char *) header, sizeof(header)) || header[0] != LLAMA_STATE_SEQ_MAGIC || header[1] != LLAMA_STATE_SEQ_VERSION ||
+            sizeof(header) + header[2]*sizeof(llama_token) > size) {
+            return false;
+        }
+
+        tokens.resize(header[2]);
+        return (bool) file.read((char *) tokens.data(), tokens.size()*sizeof(llama_token));
+    }
+
+private:
+    // a file to write, or to remove if there is no state
+    struct job {
+        std::string              path;
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t>     state;
+    };
+
+    std::deque<job> jobs;
+
+    uint64_t n_jobs       = 0;
+    uint64_t n_jobs_done  = 0;
+    size_t   size_pending = 0;
+    bool     stopping     = false;
+
+    std::mutex              mutex;
+    std::condition_variable condition_jobs;
+    std::condition_variable condition_done;
+    std::thread             worker;
+
+    uint64_t post(job && j) {
+        std::unique_lock<std::mutex> lock(mutex);
+        size_pending += j.state.size();
+        jobs.push_back(std::move(j));
+        condition_jobs.notify_one();
+        return ++n_jobs;
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            condition_jobs.wait(lock, [&]{ return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+
+            job j = std::move(jobs.front());
+            jobs.pop_front();
+
+            lock.unlock();
+            if (j.state.empty()) {
+                std::remove(j.path.c_str());
+            } else if (!write(j)) {
+                LOG_WARNING("failed to save prompt to the prompt cache", {{"path", j.path}});
+            }
+            lock.lock();
+
+            size_pending -= j.state.size();
+            n_jobs_done++;
+            condition_done.notify_all();
+        }
+    }
+
+    // the layout of llama_state_seq_save_file, written under another name first so that no other server reads a file
+    // that is not complete
+    static bool write(const job & j) {
+        const std::string path_tmp = j.path + ".tmp";
+
+        bool ok;
+        {
+            std::ofstream file(path_tmp, std::ios::binary);
+            const uint32_t header[3] = { LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t) j.tokens.size() };
+            file.write((const char *) header, sizeof(header));
+            file.write((const char *) j.tokens.data(), j.tokens.size()*sizeof(llama_token));
+            file.write((const char *) j.state.data(), j.state.size());
+            file.close();
+            ok = (bool) file;
+        }
+
+        if (!ok || std::rename(path_tmp.c_str(), j.path.c_str()) != 0) {
+            std::remove(path_tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void evict() {
+        while (size > size_max && !entries.empty()) {
+            entry * oldest = &entries[0];
+            for (entry & e : entries) {
+                if (e.t_last_used < oldest->t_last_used) {
+                    oldest = &e;
+                }
+            }
+            remove(*oldest);
+        }
+    }
+};
 
 // TODO: reuse llama_detokenize
 template <class Iter>
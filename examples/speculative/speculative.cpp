@@ -173,6 +173,9 @@ int main(int argc, char ** argv) {
     // used to determine end of generation
     bool has_eos = false;
 
+    // the acceptance test compares the probabilities of the candidates, so they have to be constrained by the grammar
+    params.sparams.grammar_lazy = false;
+
     // target model sampling context
     struct llama_sampling_context * ctx_sampling = llama_sampling_init(params.sparams);
 
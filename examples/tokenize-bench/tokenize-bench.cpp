@@ -0,0 +1,164 @@
+#include "common.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// measures the tokenizer throughput of one or more vocabs on the same text
+
+static void print_usage(int, char ** argv) {
+    printf("\nexample usage:\n");
+    printf("\n    %s -f file.txt -r 5 models/ggml-vocab-llama-spm.gguf models/ggml-vocab-llama-bpe.gguf models/ggml-vocab-bert-bge.gguf\n", argv[0]);
+    printf("\n    %s -t 8 models/ggml-vocab-llama-bpe.gguf\n", argv[0]);
+    printf("\n    %s -s -f chat.txt models/ggml-vocab-llama-bpe.gguf\n", argv[0]);
+    printf("\n    %s -l -t 8 -f sentences.txt models/ggml-vocab-bert-bge.gguf\n", argv[0]);
+    printf("\n");
+}
+
+// mixed prose, code, numbers and non-ASCII text, used when no file is given
+static std::string default_text(size_t n_bytes) {
+    static const char * paragraphs[] = {
+        "The quick brown fox jumps over the lazy dog. It's 3:45pm on 2024-05-17, and we've shipped 1,234,567 units so far.\n\n",
+        "int main(int argc, char ** argv) {\n    for (int i = 0; i < argc; ++i) {\n        printf(\"%s\\n\", argv[i]);\n    }\n    return 0;\n}\n",
+        "Retrieval-augmented generation splits long documents into chunks, embeds them, and stores the vectors in an index.\n",
+        "Les élèves ont étudié l'histoire du XIXe siècle. Москва — столица России. 東京は日本の首都です。 🦙🚀\n",
+        "    \t  multiple   spaces\t\tand tabs\r\n   and trailing whitespace   \n",
+    };
+
+    std::string text;
+    for (size_t i = 0; text.size() < n_bytes; ++i) {
+        text += paragraphs[i % (sizeof(paragraphs)/sizeof(paragraphs[0]))];
+    }
+    return text;
+}
+
+int main(int argc, char ** argv) {
+    std::string fname;
+    int n_reps = 3;
+    int n_threads = 1;
+    bool parse_special = false;
+    bool lines         = false;
+    std::vector<std::string> vocabs;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "-f" && i + 1 < argc) {
+            fname = argv[++i];
+        } else if (arg == "-r" && i + 1 < argc) {
+            n_reps = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-t" && i + 1 < argc) {
+            n_threads = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-s") {
+            parse_special = true;
+        } else if (arg == "-l") {
+            lines = true;
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            return 0;
+        } else {
+            vocabs.push_back(arg);
+        }
+    }
+
+    if (vocabs.empty()) {
+        print_usage(argc, argv);
+        return 1;
+    }
+
+    std::string text;
+    if (fname.empty()) {
+        text = default_text(4*1024*1024);
+    } else {
+        std::ifstream file(fname, std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+        std::stringstream ss;
+        ss << file.rdbuf();
+        text = ss.str();
+    }
+
+    // each line as a separate text, all of them tokenized at once
+    std::vector<std::string> texts;
+    if (lines) {
+        std::istringstream ss(text);
+        for (std::string line; std::getline(ss, line); ) {
+            if (!line.empty()) {
+                texts.push_back(line);
+            }
+        }
+    }
+
+    llama_backend_init();
+
+    printf("\n");
+    printf("text: %zu bytes, %d repetitions, %d threads%s", text.size(), n_reps, n_threads, parse_special ? ", parsing special tokens" : "");
+    if (lines) {
+        printf(", %zu lines", texts.size());
+    }
+    printf("\n");
+    printf("\n");
+    printf("| %-40s | %6s | %10s | %10s | %12s |\n", "vocab", "type", "tokens", "MB/s", "tokens/s");
+    printf("|%s|%s|%s|%s|%s|\n", "------------------------------------------", "--------", "------------", "------------", "--------------");
+
+    for (const auto & vocab : vocabs) {
+        llama_model_params mparams = llama_model_default_params();
+        mparams.vocab_only = true;
+
+        llama_model * model = llama_load_model_from_file(vocab.c_str(), mparams);
+        if (model == NULL) {
+            fprintf(stderr, "%s: failed to load vocab '%s'\n", __func__, vocab.c_str());
+            continue;
+        }
+
+        const char * type = "?";
+        switch (llama_vocab_type(model)) {
+            case LLAMA_VOCAB_TYPE_SPM: type = "SPM"; break;
+            case LLAMA_VOCAB_TYPE_BPE: type = "BPE"; break;
+            case LLAMA_VOCAB_TYPE_WPM: type = "WPM"; break;
+            default: break;
+        }
+
+        size_t n_tokens = 0;
+
+        // the fastest repetition, after a warm-up run
+        int64_t t_best_us = -1;
+        for (int rep = 0; rep <= n_reps; ++rep) {
+            const int64_t t_start_us = ggml_time_us();
+            if (lines) {
+                n_tokens = 0;
+                for (const auto & tokens : ::llama_tokenize_batch(model, texts, false, parse_special, n_threads)) {
+                    n_tokens += tokens.size();
+                }
+            } else {
+                n_tokens = ::llama_tokenize(model, text, false, parse_special, n_threads).size();
+            }
+            const int64_t t_us = ggml_time_us() - t_start_us;
+
+            if (rep > 0 && (t_best_us < 0 || t_us < t_best_us)) {
+                t_best_us = t_us;
+            }
+        }
+
+        const double t_s = std::max<int64_t>(t_best_us, 1)/1e6;
+
+        const size_t pos = vocab.find_last_of("/\\");
+        const std::string name = pos == std::string::npos ? vocab : vocab.substr(pos + 1);
+
+        printf("| %-40s | %6s | %10zu | %10.2f | %12.0f |\n", name.c_str(), type, n_tokens, text.size()/t_s/1e6, n_tokens/t_s);
+        fflush(stdout);
+
+        llama_free_model(model);
+    }
+
+    printf("\n");
+
+    llama_backend_free();
+
+    return 0;
+}
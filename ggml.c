@@ -2057,6 +2057,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "ARANGE",
     "TIMESTEP_EMBEDDING",
     "ARGSORT",
+    "TOP_K",
     "LEAKY_RELU",
 
     "FLASH_ATTN",
@@ -2087,7 +2088,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 77, "GGML_OP_COUNT != 77");
+static_assert(GGML_OP_COUNT == 78, "GGML_OP_COUNT != 78");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -2148,6 +2149,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "arange(start, stop, step)",
     "timestep_embedding(timesteps, dim, max_period)",
     "argsort(x)",
+    "top_k(x)",
     "leaky_relu(x)",
 
     "flash_attn(x)",
@@ -2178,7 +2180,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 77, "GGML_OP_COUNT != 77");
+static_assert(GGML_OP_COUNT == 78, "GGML_OP_COUNT != 78");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -6254,6 +6256,25 @@ struct ggml_tensor * ggml_top_k(
     return result;
 }
 
+// ggml_argsort_top_k
+
+struct ggml_tensor * ggml_argsort_top_k(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   k) {
+    GGML_ASSERT(k > 0 && a->ne[0] >= k);
+
+    bool is_node = false;
+
+    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, GGML_TYPE_I32, k, a->ne[1], a->ne[2], a->ne[3]);
+
+    result->op   = GGML_OP_TOP_K;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+
+    return result;
+}
+
 // ggml_flash_attn
 
 struct ggml_tensor * ggml_flash_attn(
@@ -14265,6 +14286,109 @@ static void ggml_compute_forward_argsort(
     }
 }
 
+// ggml_compute_forward_top_k
+
+// min-heap of indices into src_data, ordered so that the root is the worst of the current top k
+// (the smallest value, and for equal values the higher index)
+static inline bool ggml_top_k_worse(const float * src_data, int32_t a, int32_t b) {
+    return src_data[a] < src_data[b] || (src_data[a] == src_data[b] && a > b);
+}
+
+static void ggml_top_k_sift_down(const float * src_data, int32_t * heap, int64_t n, int64_t i) {
+    for (;;) {
+        const int64_t l = 2*i + 1;
+        const int64_t r = l + 1;
+
+        int64_t m = i;
+        if (l < n && ggml_top_k_worse(src_data, heap[l], heap[m])) {
+            m = l;
+        }
+        if (r < n && ggml_top_k_worse(src_data, heap[r], heap[m])) {
+            m = r;
+        }
+        if (m == i) {
+            return;
+        }
+
+        const int32_t tmp = heap[i];
+        heap[i] = heap[m];
+        heap[m] = tmp;
+
+        i = m;
+    }
+}
+
+static void ggml_compute_forward_top_k_f32(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    if (params->type == GGML_TASK_TYPE_INIT || params->type == GGML_TASK_TYPE_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(int32_t));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nr = ggml_nrows(src0);
+    const int64_t k  = ne0;
+
+    for (int64_t i = ith; i < nr; i += nth) {
+        const int64_t i03 = i/(ne01*ne02);
+        const int64_t i02 = (i - i03*ne01*ne02)/ne01;
+        const int64_t i01 = (i - i03*ne01*ne02 - i02*ne01);
+
+        int32_t     * dst_data = (int32_t *)((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3);
+        const float * src_data = (float   *)((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+        // keep the best k elements seen so far in a min-heap: O(ne00 log k) instead of a full sort
+        for (int64_t j = 0; j < k; j++) {
+            dst_data[j] = j;
+        }
+        for (int64_t j = k/2 - 1; j >= 0; j--) {
+            ggml_top_k_sift_down(src_data, dst_data, k, j);
+        }
+        for (int64_t j = k; j < ne00; j++) {
+            if (ggml_top_k_worse(src_data, dst_data[0], j)) {
+                dst_data[0] = j;
+                ggml_top_k_sift_down(src_data, dst_data, k, 0);
+            }
+        }
+
+        // heap sort: moving the worst element to the back leaves the row in descending order
+        for (int64_t n = k - 1; n > 0; n--) {
+            const int32_t tmp = dst_data[0];
+            dst_data[0] = dst_data[n];
+            dst_data[n] = tmp;
+            ggml_top_k_sift_down(src_data, dst_data, n, 0);
+        }
+    }
+}
+
+static void ggml_compute_forward_top_k(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_top_k_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_flash_attn
 
 static void ggml_compute_forward_flash_attn_f32(
@@ -16698,6 +16822,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_argsort(params, tensor);
             } break;
+        case GGML_OP_TOP_K:
+            {
+                ggml_compute_forward_top_k(params, tensor);
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 ggml_compute_forward_leaky_relu(params, tensor);
@@ -17720,6 +17848,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_TOP_K:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -18494,6 +18626,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads, int n_cur_
                 n_tasks = n_threads;
             } break;
         case GGML_OP_ARGSORT:
+        case GGML_OP_TOP_K:
             {
                 n_tasks = n_threads;
             } break;
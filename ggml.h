@@ -472,6 +472,7 @@ extern "C" {
         GGML_OP_ARANGE,
         GGML_OP_TIMESTEP_EMBEDDING,
         GGML_OP_ARGSORT,
+        GGML_OP_TOP_K,
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN,
@@ -1716,6 +1717,13 @@ extern "C" {
             struct ggml_tensor  * a,
             int                   k);
 
+    // indices of the top k elements per row in descending order (ties go to the lower index)
+    // result is I32 [k, ne1, ne2, ne3] - unlike ggml_top_k, the rows are never fully sorted
+    GGML_API struct ggml_tensor * ggml_argsort_top_k(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            int                   k);
+
     GGML_API struct ggml_tensor * ggml_flash_attn(
             struct ggml_context * ctx,
             struct ggml_tensor  * q,
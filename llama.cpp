@@ -60,6 +60,7 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
@@ -72,11 +73,14 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <exception>
 #include <forward_list>
 #include <fstream>
 #include <functional>
 #include <future>
 #include <initializer_list>
+#include <list>
 #include <locale>
 #include <map>
 #include <memory>
@@ -87,9 +91,11 @@
 #include <regex>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -108,6 +114,20 @@
 #define LLAMA_MAX_NODES   8192
 #define LLAMA_MAX_EXPERTS 60
 
+#define LLAMA_SAMPLE_N_BUCKETS            256
+#define LLAMA_SAMPLE_BUCKET_RANGE         32.0f
+#define LLAMA_SAMPLE_MIN_BUCKETED         32768
+#define LLAMA_SAMPLE_TOP_K_PARTIAL_SORT   1024
+
+#define LLAMA_GRAMMAR_MAX_CACHED_MASKS    256
+#define LLAMA_GRAMMAR_MASK_MIN_CANDIDATES 1024
+#define LLAMA_GRAMMAR_MAX_LINEAR_DEDUP    32
+#define LLAMA_GRAMMAR_MAX_STATES          1024
+#define LLAMA_GRAMMAR_MAX_COMPILED        32
+#define LLAMA_GRAMMAR_MAX_STATE_MASK_BYTES (16*1024*1024) // per automaton
+#define LLAMA_GRAMMAR_MAX_REGISTRY_BYTES   (64*1024*1024)
+#define LLAMA_GRAMMAR_MAX_RECENT          32
+
 //
 // logging
 //
@@ -1932,6 +1952,9 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t n_top_k;
+    float    top_k_temp;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
@@ -2106,13 +2129,343 @@ struct llama_control_vector {
     }
 };
 
+// codepoint trie over the decoded token pieces, laid out as flat arrays
+// used by the grammar sampler to match all tokens sharing a prefix against a grammar stack at once
+struct llama_vocab_trie {
+    struct node {
+        uint32_t edge_begin;    // children in edges[edge_begin, edge_end), sorted by code point
+        uint32_t edge_end;
+        uint32_t token_begin;   // tokens whose piece ends at this node, in tokens[token_begin, token_end)
+        uint32_t token_end;
+        uint32_t partial_begin; // tokens whose piece ends at this node with an incomplete UTF-8 sequence
+        uint32_t partial_end;
+    };
+
+    struct edge {
+        uint32_t cpt;
+        uint32_t child;
+    };
+
+    struct partial {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8;
+    };
+
+    std::vector<node>        nodes; // nodes[0] is the root
+    std::vector<edge>        edges;
+    std::vector<llama_token> tokens;
+    std::vector<partial>     partials;
+};
+
+// BPE merges keyed by the token ids of the merged pair, in an open addressing table with linear probing
+struct llama_bpe_merges {
+    struct entry {
+        uint64_t key;  // left id in the high bits, right id in the low bits - empty_key if the entry is free
+        int32_t  rank; // position in the merges list, lower ranks are applied first
+        int32_t  id;   // token of the merged pair
+    };
+
+    static constexpr uint64_t empty_key = UINT64_MAX;
+
+    std::vector<entry> entries; // power of 2 size, at most half full
+    size_t n_merges = 0;
+    int    shift    = 64;
+
+    static uint64_t make_key(int32_t left, int32_t right) {
+        return (uint64_t) (uint32_t) left << 32 | (uint32_t) right;
+    }
+
+    size_t slot(uint64_t key) const {
+        return (key * 0x9E3779B97F4A7C15ull) >> shift; // fibonacci hashing
+    }
+
+    void init(size_t n) {
+        size_t size = 16;
+        shift = 60;
+        while (size < 2*n) {
+            size *= 2;
+            shift--;
+        }
+        entries.assign(size, { empty_key, -1, -1 });
+        n_merges = 0;
+    }
+
+    // the first (lowest rank) occurrence of a pair wins
+    void insert(int32_t left, int32_t right, int32_t rank, int32_t id) {
+        GGML_ASSERT(2*(n_merges + 1) <= entries.size());
+
+        const uint64_t key  = make_key(left, right);
+        const size_t   mask = entries.size() - 1;
+        for (size_t i = slot(key); ; i = (i + 1) & mask) {
+            if (entries[i].key == key) {
+                return;
+            }
+            if (entries[i].key == empty_key) {
+                entries[i] = { key, rank, id };
+                n_merges++;
+                return;
+            }
+        }
+    }
+
+    const entry * find(int32_t left, int32_t right) const {
+        if (entries.empty() || left < 0 || right < 0) {
+            return nullptr;
+        }
+
+        const uint64_t key  = make_key(left, right);
+        const size_t   mask = entries.size() - 1;
+        for (size_t i = slot(key); ; i = (i + 1) & mask) {
+            if (entries[i].key == key) {
+                return &entries[i];
+            }
+            if (entries[i].key == empty_key) {
+                return nullptr;
+            }
+        }
+    }
+};
+
+// the texts of all tokens back to back, each followed by a 0, with an open addressing table from text to token id
+struct llama_token_texts {
+    std::vector<char>     data;
+    std::vector<uint32_t> offsets = { 0 }; // the text of token i is [offsets[i], offsets[i + 1] - 1) in data
+    std::vector<uint64_t> table;           // hash in the high 32 bits, id + 1 in the low ones - 0 if the slot is free
+    int shift = 64;
+
+    // FNV-1a
+    static uint64_t hash(const char * text, size_t size) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++i) {
+            h ^= (uint8_t) text[i];
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    size_t size() const {
+        return offsets.size() - 1;
+    }
+
+    const char * c_str(int32_t id) const {
+        return data.data() + offsets[id];
+    }
+
+    size_t length(int32_t id) const {
+        return offsets[id + 1] - offsets[id] - 1;
+    }
+
+    std::string str(int32_t id) const {
+        return std::string(c_str(id), length(id));
+    }
+
+    void push_back(const std::string & text) {
+        data.insert(data.end(), text.begin(), text.end());
+        data.push_back(0);
+        offsets.push_back(data.size());
+    }
+
+    // returns false if two tokens have the same text
+    bool build_index() {
+        size_t n_slots = 16;
+        shift = 60;
+        while (n_slots < 2*size()) {
+            n_slots *= 2;
+            shift--;
+        }
+        table.assign(n_slots, 0);
+
+        const size_t mask = n_slots - 1;
+        for (int32_t id = 0; id < (int32_t) size(); ++id) {
+            if (find(c_str(id), length(id)) != -1) {
+                return false;
+            }
+            const uint64_t h = hash(c_str(id), length(id));
+            size_t i = slot(h);
+            while (table[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            table[i] = (h & 0xFFFFFFFF00000000ull) | (uint32_t) (id + 1);
+        }
+        return true;
+    }
+
+    size_t slot(uint64_t h) const {
+        return (h * 0x9E3779B97F4A7C15ull) >> shift; // fibonacci hashing
+    }
+
+    // -1 if the text is not a token
+    int32_t find(const char * text, size_t size) const {
+        if (table.empty()) {
+            return -1;
+        }
+
+        const uint64_t h    = hash(text, size);
+        const size_t   mask = table.size() - 1;
+        for (size_t i = slot(h); table[i] != 0; i = (i + 1) & mask) {
+            if ((table[i] >> 32) == (h >> 32)) {
+                const int32_t id = (int32_t) (uint32_t) table[i] - 1;
+                if (length(id) == size && memcmp(c_str(id), text, size) == 0) {
+                    return id;
+                }
+            }
+        }
+        return -1;
+    }
+
+    int32_t find(const std::string & text) const {
+        return find(text.data(), text.size());
+    }
+
+    // like find, but throws if the text is not a token
+    int32_t at(const std::string & text) const {
+        const int32_t id = find(text);
+        if (id == -1) {
+            throw std::out_of_range("token not found: " + text);
+        }
+        return id;
+    }
+};
+
+// Aho-Corasick automaton over token texts, to find all their occurrences in a text in a single pass (special tokens),
+// or the longest one at the start of a text (WordPiece)
+struct llama_token_matcher {
+    struct node {
+        uint32_t edge_begin; // children in edges[edge_begin, edge_end), sorted by byte
+        uint32_t edge_end;
+        uint32_t fail;       // the node of the longest proper suffix of the text of this node that is in the trie
+        int32_t  output;     // the node of the longest suffix that is a whole token text, this one included - -1 if none
+        int32_t  rank;       // index of the token ending at this node in the list it was built from - -1 if none
+        uint32_t depth;      // length of the text of this node
+    };
+
+    struct edge {
+        uint8_t  byte;
+        uint32_t child;
+    };
+
+    std::vector<node> nodes; // nodes[0] is the root
+    std::vector<edge> edges;
+    uint32_t root_next[256] = {}; // children of the root, 0 if none - dense since every mismatch falls back to it
+
+    // texts are ranked by their position, the first of several equal texts wins
+    void build(const std::vector<std::string> & texts) {
+        // a trie with a map per node first
+        std::vector<std::map<uint8_t, uint32_t>> children(1);
+        std::vector<node> tmp(1, { 0, 0, 0, -1, -1, 0 });
+        for (int32_t rank = 0; rank < (int32_t) texts.size(); ++rank) {
+            uint32_t cur = 0;
+            for (const char c : texts[rank]) {
+                auto it = children[cur].find((uint8_t) c);
+                if (it == children[cur].end()) {
+                    it = children[cur].emplace((uint8_t) c, (uint32_t) tmp.size()).first;
+                    tmp.push_back({ 0, 0, 0, -1, -1, tmp[cur].depth + 1 });
+                    children.emplace_back();
+                }
+                cur = it->second;
+            }
+            if (cur != 0 && tmp[cur].rank == -1) {
+                tmp[cur].rank = rank;
+            }
+        }
+
+        nodes = std::move(tmp);
+        edges.clear();
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            nodes[i].edge_begin = edges.size();
+            for (const auto & child : children[i]) {
+                edges.push_back({ child.first, child.second });
+            }
+            nodes[i].edge_end = edges.size();
+        }
+
+        std::fill(std::begin(root_next), std::end(root_next), 0);
+        for (uint32_t e = nodes[0].edge_begin; e < nodes[0].edge_end; ++e) {
+            root_next[edges[e].byte] = edges[e].child;
+        }
+
+        // fail and output links in breadth-first order, so that those of the shorter suffixes are known
+        std::vector<uint32_t> queue = { 0 };
+        for (size_t q = 0; q < queue.size(); ++q) {
+            const uint32_t cur = queue[q];
+            for (uint32_t e = nodes[cur].edge_begin; e < nodes[cur].edge_end; ++e) {
+                const uint32_t child = edges[e].child;
+                nodes[child].fail   = cur == 0 ? 0 : next(nodes[cur].fail, edges[e].byte);
+                nodes[child].output = nodes[child].rank != -1 ? (int32_t) child : nodes[nodes[child].fail].output;
+                queue.push_back(child);
+            }
+        }
+    }
+
+    // the child of a node for a byte, 0 if none
+    uint32_t child(uint32_t state, uint8_t c) const {
+        if (state == 0) {
+            return root_next[c];
+        }
+        const edge * begin = edges.data() + nodes[state].edge_begin;
+        const edge * end   = edges.data() + nodes[state].edge_end;
+        if (end - begin > 8) {
+            begin = std::lower_bound(begin, end, c, [](const edge & e, uint8_t c) { return e.byte < c; });
+            return begin != end && begin->byte == c ? begin->child : 0;
+        }
+        for (const edge * e = begin; e != end && e->byte <= c; ++e) {
+            if (e->byte == c) {
+                return e->child;
+            }
+        }
+        return 0;
+    }
+
+    uint32_t next(uint32_t state, uint8_t c) const {
+        while (state != 0) {
+            const uint32_t next = child(state, c);
+            if (next != 0) {
+                return next;
+            }
+            state = nodes[state].fail;
+        }
+        return root_next[c];
+    }
+
+    // the rank of the longest token text at the start of text[0, size) and its length, -1 if none
+    int32_t longest_prefix(const char * text, size_t size, size_t & length) const {
+        int32_t rank = -1;
+        uint32_t state = 0;
+        for (size_t i = 0; i < size; ++i) {
+            state = child(state, (uint8_t) text[i]);
+            if (state == 0) {
+                break;
+            }
+            if (nodes[state].rank != -1) {
+                rank   = nodes[state].rank;
+                length = i + 1;
+            }
+        }
+        return rank;
+    }
+
+    // calls f(begin, rank) for every occurrence of a token text in text[0, size), in the order they end
+    template <typename F>
+    void search(const char * text, size_t size, F && f) const {
+        if (nodes.size() <= 1) {
+            return;
+        }
+        uint32_t state = 0;
+        for (size_t i = 0; i < size; ++i) {
+            state = next(state, (uint8_t) text[i]);
+            for (int32_t out = nodes[state].output; out != -1; out = nodes[nodes[out].fail].output) {
+                f(i + 1 - nodes[out].depth, nodes[out].rank);
+            }
+        }
+    }
+};
+
 struct llama_vocab {
     using id    = int32_t;
     using token = std::string;
     using ttype = llama_token_type;
 
     struct token_data {
-        token text;
         float score;
         ttype type;
     };
@@ -2120,12 +2473,23 @@ struct llama_vocab {
     enum llama_vocab_type     type     = LLAMA_VOCAB_TYPE_SPM;
     enum llama_vocab_pre_type type_pre = LLAMA_VOCAB_PRE_TYPE_DEFAULT;
 
-    std::unordered_map<token, id> token_to_id;
-    std::vector<token_data>       id_to_token;
+    llama_token_texts       texts;
+    std::vector<token_data> id_to_token;
+
+    // what llama_token_to_piece returns for each token with special = true, back to back - control tokens are empty
+    // with special = false, other pieces are the same (see llama_vocab_build_pieces)
+    std::vector<char>     piece_data;
+    std::vector<uint32_t> piece_offsets;
 
-    std::unordered_map<token, id> special_tokens_cache;
+    // the texts matched by tokenizer_st_partition, longest first so that overlapping special tokens do not depend on
+    // the order they were found in
+    std::vector<std::pair<token, id>> special_tokens_cache;
+    llama_token_matcher               special_tokens_matcher; // over the texts of special_tokens_cache, in that order
 
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    // over the texts of all tokens, ranked by id (WPM only)
+    llama_token_matcher wpm_matcher;
+
+    llama_bpe_merges bpe_merges;
 
     // default LLaMA special tokens
     id special_bos_id  = 1;
@@ -2147,19 +2511,15 @@ struct llama_vocab {
 
     bool add_space_prefix = true;
 
-    int find_bpe_rank(const std::string & token_left, const std::string & token_right) const {
-        GGML_ASSERT(token_left.find(' ') == std::string::npos);
-        GGML_ASSERT(token_left.find('\n') == std::string::npos);
-        GGML_ASSERT(token_right.find(' ') == std::string::npos);
-        GGML_ASSERT(token_right.find('\n') == std::string::npos);
+    // texts can be cut after a newline for parallel tokenization (see tokenizer_split_fragments)
+    bool newline_splits = false;
 
-        auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-        if (it == bpe_ranks.end()) {
-            return -1;
-        }
+    // built on first use by llama_sample_grammar (see llama_vocab_get_trie)
+    mutable std::once_flag   trie_once;
+    mutable llama_vocab_trie trie;
 
-        return it->second;
-    }
+    // hash of the token pieces and EOG tokens, identifies the vocab of compiled grammars (see llama_vocab_fingerprint)
+    uint64_t fingerprint = 0;
 };
 
 struct llama_model {
@@ -2271,14 +2631,14 @@ struct llama_context {
 
     int64_t t_start_us;
     int64_t t_load_us;
-    int64_t t_sample_us = 0;
+    std::atomic<int64_t> t_sample_us {0}; // atomic, as sequences may be sampled in parallel
     int64_t t_p_eval_us = 0;
     int64_t t_eval_us   = 0;
 
     int64_t t_compute_start_us = 0;
     int64_t n_queued_tokens = 0;
 
-    int32_t n_sample = 0; // number of tokens sampled
+    std::atomic<int32_t> n_sample {0}; // number of tokens sampled
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
@@ -2295,6 +2655,11 @@ struct llama_context {
 
     bool logits_all = false;
 
+    // top-k output, replaces the logits when cparams.n_top_k > 0 (2-dimensional arrays: [n_outputs][n_top_k])
+    size_t    top_k_size  = 0; // capacity (of elements) for the top-k ids and probs
+    int32_t * top_k_ids   = nullptr;
+    float   * top_k_probs = nullptr;
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -4210,9 +4575,10 @@ static void llm_load_hparams(
 
 // TODO: This should probably be in llama.h
 static std::vector<llama_vocab::id> llama_tokenize_internal(
-    const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special = false
+    const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special = false, int32_t n_threads = 1
 );
 static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
+static void llama_vocab_build_pieces(llama_vocab & vocab);
 
 static void llm_load_vocab(
         llama_model_loader & ml,
@@ -4223,6 +4589,9 @@ static void llm_load_vocab(
 
     const auto kv = LLM_KV(model.arch);
 
+    // BPE merges as pairs of token pieces, converted to token ids once the tokens are loaded
+    std::vector<std::pair<std::string, std::string>> merges;
+
     // determine vocab type
     {
         std::string tokenizer_model;
@@ -4319,6 +4688,8 @@ static void llm_load_vocab(
 
             const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
 
+            merges.reserve(n_merges);
+
             for (int i = 0; i < n_merges; i++) {
                 const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
                 GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
@@ -4333,7 +4704,7 @@ static void llm_load_vocab(
                     second = word.substr(pos + 1);
                 }
 
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+                merges.emplace_back(std::move(first), std::move(second));
             }
 
             // default special tokens
@@ -4416,14 +4787,45 @@ static void llm_load_vocab(
         std::string word = gguf_get_arr_str(ctx, token_idx, i);
         GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
 
-        vocab.token_to_id[word] = i;
+        vocab.texts.push_back(word);
 
         auto & token_data = vocab.id_to_token[i];
-        token_data.text  = std::move(word);
         token_data.score = scores ? scores[i] : 0.0f;
         token_data.type  = toktypes ? (llama_token_type) toktypes[i] : LLAMA_TOKEN_TYPE_NORMAL;
     }
-    GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
+    GGML_ASSERT(vocab.texts.build_index() && "duplicate token text");
+
+    if (vocab.type == LLAMA_VOCAB_TYPE_WPM) {
+        std::vector<std::string> texts(n_vocab);
+        for (uint32_t i = 0; i < n_vocab; i++) {
+            texts[i] = vocab.texts.str(i);
+        }
+        vocab.wpm_matcher.build(texts);
+    }
+
+    if (vocab.type == LLAMA_VOCAB_TYPE_BPE) {
+        vocab.bpe_merges.init(merges.size());
+
+        // merges of pieces that are not tokens can never apply, since every symbol being merged is a token
+        int n_skipped = 0;
+        for (size_t i = 0; i < merges.size(); i++) {
+            const auto & merge = merges[i];
+
+            const int32_t left   = vocab.texts.find(merge.first);
+            const int32_t right  = vocab.texts.find(merge.second);
+            const int32_t merged = vocab.texts.find(merge.first + merge.second);
+            if (merge.first.empty() || left == -1 || right == -1 || merged == -1) {
+                n_skipped++;
+                continue;
+            }
+
+            vocab.bpe_merges.insert(left, right, i, merged);
+        }
+
+        if (n_skipped > 0) {
+            LLAMA_LOG_WARN("%s: %d BPE merges of pieces that are not in the vocab were skipped\n", __func__, n_skipped);
+        }
+    }
 
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
@@ -4490,18 +4892,12 @@ static void llm_load_vocab(
         // TODO: convert scripts should provide this token through the KV metadata LLAMA_KV_TOKENIZER_EOT_ID
         //       for now, we apply this workaround to find the EOT token based on its text
         if (vocab.special_eot_id == -1) {
-            for (const auto & t : vocab.token_to_id) {
-                if (
-                        // TODO: gemma "<end_of_turn>" is exported as a normal token, so the following check does not work
-                        //       need to fix convert script
-                        //vocab.id_to_token[t.second].type == LLAMA_TOKEN_TYPE_CONTROL &&
-                        (t.first == "<|eot_id|>" ||
-                         t.first == "<|im_end|>" ||
-                         t.first == "<|end|>" ||
-                         t.first == "<end_of_turn>"
-                        )
-                   ) {
-                    vocab.special_eot_id = t.second;
+            // TODO: gemma "<end_of_turn>" is exported as a normal token, so the type of the token cannot be checked
+            //       need to fix convert script
+            for (const std::string text : { "<|eot_id|>", "<|im_end|>", "<|end|>", "<end_of_turn>" }) {
+                const int32_t id = vocab.texts.find(text);
+                if (id != -1) {
+                    vocab.special_eot_id = id;
                     break;
                 }
             }
@@ -4526,9 +4922,8 @@ static void llm_load_vocab(
 
         bool special_tokens_definition_mismatch = false;
 
-        for (const auto & t : vocab.token_to_id) {
-            const auto & token = t.first;
-            const auto & id    = t.second;
+        for (int32_t id = 0; id < (int32_t) vocab.texts.size(); ++id) {
+            const std::string token = vocab.texts.str(id);
 
             // Count all non-normal tokens in the vocab while iterating
             if (vocab.id_to_token[id].type != LLAMA_TOKEN_TYPE_NORMAL) {
@@ -4549,8 +4944,8 @@ static void llm_load_vocab(
                     auto utf = utf8_len(left.at(left.length() - 1));
 
                     if (utf == 1) {
-                        if (vocab.token_to_id.find(left)  != vocab.token_to_id.end() &&
-                            vocab.token_to_id.find(right) != vocab.token_to_id.end() ) {
+                        if (vocab.texts.find(left)  != -1 &&
+                            vocab.texts.find(right) != -1) {
                             is_tokenizable = true;
                             break;
                         }
@@ -4575,7 +4970,7 @@ static void llm_load_vocab(
                     // And skip the ones which are one character
                     if (utf8_str_len > 1) {
                         // At this point what we have left are special tokens only
-                        vocab.special_tokens_cache[token] = id;
+                        vocab.special_tokens_cache.emplace_back(token, id);
 
                         // Count manually found special tokens
                         special_tokens_count_from_verification++;
@@ -4589,6 +4984,20 @@ static void llm_load_vocab(
             }
         }
 
+        std::sort(vocab.special_tokens_cache.begin(), vocab.special_tokens_cache.end(),
+            [](const std::pair<std::string, llama_vocab::id> & a, const std::pair<std::string, llama_vocab::id> & b) {
+                return a.first.size() != b.first.size() ? a.first.size() > b.first.size() : a.second < b.second;
+            });
+
+        {
+            std::vector<std::string> texts;
+            texts.reserve(vocab.special_tokens_cache.size());
+            for (const auto & st : vocab.special_tokens_cache) {
+                texts.push_back(st.first);
+            }
+            vocab.special_tokens_matcher.build(texts);
+        }
+
         if (special_tokens_definition_mismatch || special_tokens_count_from_verification != special_tokens_count_by_type) {
             LLAMA_LOG_WARN("%s: mismatch in special tokens definition ( %u/%zu vs %u/%zu ).\n",
                 __func__,
@@ -4602,6 +5011,67 @@ static void llm_load_vocab(
             );
         }
     }
+
+    // a newline between two printable ASCII characters starts a new word for every pre-tokenizer but MPT's, whose
+    // \s?\p{L}+ glues the newline to the next word - BPE and WPM tokens never cross words, while SPM has no
+    // pre-tokenizer and can only be cut there when no token continues past a newline
+    {
+        switch (vocab.type) {
+            case LLAMA_VOCAB_TYPE_SPM:
+                {
+                    vocab.newline_splits = true;
+                    for (int32_t id = 0; id < (int32_t) vocab.texts.size(); ++id) {
+                        const std::string text = vocab.texts.str(id);
+                        for (size_t pos = text.find('\n'); pos != std::string::npos; pos = text.find('\n', pos + 1)) {
+                            if (pos + 1 < text.size() && text[pos + 1] > ' ' && text[pos + 1] < 0x7F) {
+                                vocab.newline_splits = false;
+                            }
+                        }
+                    }
+                } break;
+            case LLAMA_VOCAB_TYPE_BPE:
+                {
+                    vocab.newline_splits = vocab.type_pre != LLAMA_VOCAB_PRE_TYPE_MPT;
+                } break;
+            case LLAMA_VOCAB_TYPE_WPM:
+                {
+                    vocab.newline_splits = true;
+                } break;
+            default:
+                break;
+        }
+    }
+
+    llama_vocab_build_pieces(vocab);
+}
+
+// FNV-1a over everything that the compiled grammars depend on: the token pieces and which tokens are EOG
+static uint64_t llama_vocab_fingerprint(const llama_model & model) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    auto add = [&hash](const void * data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= ((const uint8_t *) data)[i];
+            hash *= 0x100000001b3ull;
+        }
+    };
+
+    const uint32_t n_vocab = model.vocab.id_to_token.size();
+    add(&n_vocab, sizeof(n_vocab));
+    add(&model.vocab.type, sizeof(model.vocab.type));
+
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        const auto & token_data = model.vocab.id_to_token[id];
+
+        const uint32_t size   = model.vocab.texts.length(id);
+        const uint8_t  is_eog = llama_token_is_eog(&model, id);
+        add(&size, sizeof(size));
+        add(model.vocab.texts.c_str(id), size);
+        add(&token_data.type, sizeof(token_data.type));
+        add(&is_eog, sizeof(is_eog));
+    }
+
+    return hash;
 }
 
 static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
@@ -4615,7 +5085,7 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     LLAMA_LOG_INFO("%s: arch             = %s\n",     __func__, LLM_ARCH_NAMES.at(model.arch));
     LLAMA_LOG_INFO("%s: vocab type       = %s\n",     __func__, llama_model_vocab_type_name(vocab.type));
     LLAMA_LOG_INFO("%s: n_vocab          = %u\n",     __func__, hparams.n_vocab);
-    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_ranks.size());
+    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_merges.n_merges);
     LLAMA_LOG_INFO("%s: n_ctx_train      = %u\n",     __func__, hparams.n_ctx_train);
     LLAMA_LOG_INFO("%s: n_embd           = %u\n",     __func__, hparams.n_embd);
     LLAMA_LOG_INFO("%s: n_head           = %u\n",     __func__, hparams.n_head);
@@ -4668,19 +5138,19 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     LLAMA_LOG_INFO("%s: general.name     = %s\n",    __func__, model.name.c_str());
 
     // special tokens
-    if (vocab.special_bos_id    != -1) { LLAMA_LOG_INFO( "%s: BOS token        = %d '%s'\n", __func__, vocab.special_bos_id,  vocab.id_to_token[vocab.special_bos_id].text.c_str() );  }
-    if (vocab.special_eos_id    != -1) { LLAMA_LOG_INFO( "%s: EOS token        = %d '%s'\n", __func__, vocab.special_eos_id,  vocab.id_to_token[vocab.special_eos_id].text.c_str() );  }
-    if (vocab.special_unk_id    != -1) { LLAMA_LOG_INFO( "%s: UNK token        = %d '%s'\n", __func__, vocab.special_unk_id,  vocab.id_to_token[vocab.special_unk_id].text.c_str() );  }
-    if (vocab.special_sep_id    != -1) { LLAMA_LOG_INFO( "%s: SEP token        = %d '%s'\n", __func__, vocab.special_sep_id,  vocab.id_to_token[vocab.special_sep_id].text.c_str() );  }
-    if (vocab.special_pad_id    != -1) { LLAMA_LOG_INFO( "%s: PAD token        = %d '%s'\n", __func__, vocab.special_pad_id,  vocab.id_to_token[vocab.special_pad_id].text.c_str() );  }
-    if (vocab.special_cls_id    != -1) { LLAMA_LOG_INFO( "%s: CLS token        = %d '%s'\n", __func__, vocab.special_cls_id,  vocab.id_to_token[vocab.special_cls_id].text.c_str() );  }
-    if (vocab.special_mask_id   != -1) { LLAMA_LOG_INFO( "%s: MASK token       = %d '%s'\n", __func__, vocab.special_mask_id, vocab.id_to_token[vocab.special_mask_id].text.c_str() ); }
-
-    if (vocab.linefeed_id       != -1) { LLAMA_LOG_INFO( "%s: LF token         = %d '%s'\n", __func__, vocab.linefeed_id,       vocab.id_to_token[vocab.linefeed_id].text.c_str() );       }
-    if (vocab.special_prefix_id != -1) { LLAMA_LOG_INFO( "%s: PRE token        = %d '%s'\n", __func__, vocab.special_prefix_id, vocab.id_to_token[vocab.special_prefix_id].text.c_str() ); }
-    if (vocab.special_suffix_id != -1) { LLAMA_LOG_INFO( "%s: SUF token        = %d '%s'\n", __func__, vocab.special_suffix_id, vocab.id_to_token[vocab.special_suffix_id].text.c_str() ); }
-    if (vocab.special_middle_id != -1) { LLAMA_LOG_INFO( "%s: MID token        = %d '%s'\n", __func__, vocab.special_middle_id, vocab.id_to_token[vocab.special_middle_id].text.c_str() ); }
-    if (vocab.special_eot_id    != -1) { LLAMA_LOG_INFO( "%s: EOT token        = %d '%s'\n", __func__, vocab.special_eot_id,    vocab.id_to_token[vocab.special_eot_id].text.c_str() );    }
+    if (vocab.special_bos_id    != -1) { LLAMA_LOG_INFO( "%s: BOS token        = %d '%s'\n", __func__, vocab.special_bos_id,  vocab.texts.c_str(vocab.special_bos_id) );  }
+    if (vocab.special_eos_id    != -1) { LLAMA_LOG_INFO( "%s: EOS token        = %d '%s'\n", __func__, vocab.special_eos_id,  vocab.texts.c_str(vocab.special_eos_id) );  }
+    if (vocab.special_unk_id    != -1) { LLAMA_LOG_INFO( "%s: UNK token        = %d '%s'\n", __func__, vocab.special_unk_id,  vocab.texts.c_str(vocab.special_unk_id) );  }
+    if (vocab.special_sep_id    != -1) { LLAMA_LOG_INFO( "%s: SEP token        = %d '%s'\n", __func__, vocab.special_sep_id,  vocab.texts.c_str(vocab.special_sep_id) );  }
+    if (vocab.special_pad_id    != -1) { LLAMA_LOG_INFO( "%s: PAD token        = %d '%s'\n", __func__, vocab.special_pad_id,  vocab.texts.c_str(vocab.special_pad_id) );  }
+    if (vocab.special_cls_id    != -1) { LLAMA_LOG_INFO( "%s: CLS token        = %d '%s'\n", __func__, vocab.special_cls_id,  vocab.texts.c_str(vocab.special_cls_id) );  }
+    if (vocab.special_mask_id   != -1) { LLAMA_LOG_INFO( "%s: MASK token       = %d '%s'\n", __func__, vocab.special_mask_id, vocab.texts.c_str(vocab.special_mask_id) ); }
+
+    if (vocab.linefeed_id       != -1) { LLAMA_LOG_INFO( "%s: LF token         = %d '%s'\n", __func__, vocab.linefeed_id,       vocab.texts.c_str(vocab.linefeed_id) );       }
+    if (vocab.special_prefix_id != -1) { LLAMA_LOG_INFO( "%s: PRE token        = %d '%s'\n", __func__, vocab.special_prefix_id, vocab.texts.c_str(vocab.special_prefix_id) ); }
+    if (vocab.special_suffix_id != -1) { LLAMA_LOG_INFO( "%s: SUF token        = %d '%s'\n", __func__, vocab.special_suffix_id, vocab.texts.c_str(vocab.special_suffix_id) ); }
+    if (vocab.special_middle_id != -1) { LLAMA_LOG_INFO( "%s: MID token        = %d '%s'\n", __func__, vocab.special_middle_id, vocab.texts.c_str(vocab.special_middle_id) ); }
+    if (vocab.special_eot_id    != -1) { LLAMA_LOG_INFO( "%s: EOT token        = %d '%s'\n", __func__, vocab.special_eot_id,    vocab.texts.c_str(vocab.special_eot_id) );    }
 }
 
 // Returns false if cancelled by progress_callback
@@ -6102,6 +6572,8 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
             throw std::runtime_error("error loading model vocabulary: " + std::string(e.what()));
         }
 
+        model.vocab.fingerprint = llama_vocab_fingerprint(model);
+
         llm_load_print_meta(ml, model);
 
         if (model.vocab.type != LLAMA_VOCAB_TYPE_NONE &&
@@ -6774,6 +7246,28 @@ struct llm_build_context {
         }
     }
 
+    // select the top-k tokens of each output on the graph, so that only their ids and probabilities are copied to the host
+    void build_top_k(struct ggml_cgraph * gf) {
+        struct ggml_tensor * logits = gf->nodes[gf->n_nodes - 1];
+        if (!cparams.causal_attn || strcmp(logits->name, "result_output") != 0) {
+            // no logits (e.g. embedding models)
+            return;
+        }
+
+        struct ggml_tensor * ids = ggml_argsort_top_k(ctx0, logits, cparams.n_top_k);
+        cb(ids, "result_top_k_ids", -1);
+        ggml_build_forward_expand(gf, ids);
+
+        struct ggml_tensor * probs = ggml_soft_max_ext(ctx0, logits, nullptr, nullptr, 1.0f/cparams.top_k_temp, 0.0f);
+        cb(probs, "top_k_soft_max", -1);
+
+        // gather the probabilities of the selected ids as rows of a single element
+        probs = ggml_reshape_3d(ctx0, probs, 1, probs->ne[0], probs->ne[1]);
+        probs = ggml_get_rows(ctx0, probs, ids);
+        cb(probs, "result_top_k_probs", -1);
+        ggml_build_forward_expand(gf, probs);
+    }
+
     struct ggml_cgraph * build_k_shift() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, LLAMA_MAX_NODES, false);
 
@@ -10899,6 +11393,10 @@ static struct ggml_cgraph * llama_build_graph(
             GGML_ASSERT(false);
     }
 
+    if (lctx.cparams.n_top_k > 0) {
+        llm.build_top_k(result);
+    }
+
     llm.free();
 
     return result;
@@ -11182,11 +11680,13 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     const auto n_embd  = hparams.n_embd;
 
     // TODO: use a per-batch flag for logits presence instead
-    const bool has_logits = cparams.causal_attn;
+    const bool has_top_k  = cparams.causal_attn && cparams.n_top_k > 0;
+    const bool has_logits = cparams.causal_attn && !has_top_k;
     const bool has_embd   = cparams.embeddings && (hparams.causal_attn || cparams.pooling_type == LLAMA_POOLING_TYPE_NONE);
 
-    const size_t logits_size = has_logits ? n_vocab*n_outputs_max : 0;
-    const size_t embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
+    const size_t logits_size = has_logits ?         n_vocab*n_outputs_max : 0;
+    const size_t embd_size   = has_embd   ?          n_embd*n_outputs_max : 0;
+    const size_t top_k_size  = has_top_k  ? cparams.n_top_k*n_outputs_max : 0;
 
     if (lctx.output_ids.empty()) {
         // init, never resized afterwards
@@ -11194,7 +11694,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     }
 
     const size_t prev_size = lctx.buf_output ? ggml_backend_buffer_get_size(lctx.buf_output) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size) * sizeof(float) + top_k_size * (sizeof(int32_t) + sizeof(float));
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -11208,6 +11708,8 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
             lctx.buf_output = nullptr;
             lctx.logits = nullptr;
             lctx.embd = nullptr;
+            lctx.top_k_ids = nullptr;
+            lctx.top_k_probs = nullptr;
         }
 
         lctx.buf_output = ggml_backend_buft_alloc_buffer(llama_default_buffer_type_cpu(true), new_size);
@@ -11222,9 +11724,13 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     lctx.logits = has_logits ? output_base               : nullptr;
     lctx.embd   = has_embd   ? output_base + logits_size : nullptr;
 
+    lctx.top_k_ids   = has_top_k ? (int32_t *) (output_base + logits_size + embd_size) : nullptr;
+    lctx.top_k_probs = has_top_k ? (float   *) (lctx.top_k_ids + top_k_size)          : nullptr;
+
     lctx.output_size = n_outputs_max;
     lctx.logits_size = logits_size;
     lctx.embd_size   = embd_size;
+    lctx.top_k_size  = top_k_size;
 
     // set all ids as invalid (negative)
     std::fill(lctx.output_ids.begin(), lctx.output_ids.end(), -1);
@@ -11449,6 +11955,26 @@ static int llama_decode_internal(
 
         ggml_cgraph * gf = llama_build_graph(lctx, u_batch, false);
 
+        // the top-k of the logits, if selected on the graph, follows the output
+        struct ggml_tensor * top_k_ids   = nullptr;
+        struct ggml_tensor * top_k_probs = nullptr;
+
+        const int n_nodes = gf->n_nodes;
+        if (strcmp(gf->nodes[n_nodes - 1]->name, "result_top_k_probs") == 0) {
+            top_k_probs = gf->nodes[n_nodes - 1];
+
+            int i_output = n_nodes - 2;
+            for (; i_output >= 0 && strcmp(gf->nodes[i_output]->name, "result_output") != 0; --i_output) {
+                if (strcmp(gf->nodes[i_output]->name, "result_top_k_ids") == 0) {
+                    top_k_ids = gf->nodes[i_output];
+                }
+            }
+            GGML_ASSERT(i_output >= 0 && top_k_ids != nullptr && "missing result_top_k_ids tensor");
+
+            // hide the top-k nodes while looking for the outputs below
+            gf->n_nodes = i_output + 1;
+        }
+
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = gf->nodes[gf->n_nodes - 1];
         struct ggml_tensor * embd = gf->nodes[gf->n_nodes - 2];
@@ -11485,6 +12011,16 @@ static int llama_decode_internal(
             embd = nullptr; // do not extract embeddings when not needed
             GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
         }
+
+        if (top_k_probs) {
+            gf->n_nodes = n_nodes;
+
+            res = nullptr; // only the top-k is extracted
+            if (lctx.n_outputs == 0) {
+                top_k_ids   = nullptr;
+                top_k_probs = nullptr;
+            }
+        }
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
         // for big prompts, if BLAS is enabled, it is better to use only one thread
@@ -11541,6 +12077,22 @@ static int llama_decode_internal(
             }
         }
 
+        // extract the top-k
+        if (top_k_probs) {
+            ggml_backend_t backend_ids   = ggml_backend_sched_get_tensor_backend(lctx.sched, top_k_ids);
+            ggml_backend_t backend_probs = ggml_backend_sched_get_tensor_backend(lctx.sched, top_k_probs);
+            GGML_ASSERT(backend_ids != nullptr && backend_probs != nullptr);
+            GGML_ASSERT(lctx.top_k_ids != nullptr);
+
+            const int64_t n_top_k       = cparams.n_top_k;
+            const int32_t n_outputs_new = lctx.n_outputs;
+
+            GGML_ASSERT( n_outputs_prev + n_outputs_new <= n_outputs);
+            GGML_ASSERT((n_outputs_prev + n_outputs_new)*n_top_k <= (int64_t) lctx.top_k_size);
+            ggml_backend_tensor_get_async(backend_ids,   top_k_ids,   lctx.top_k_ids   + n_outputs_prev*n_top_k, 0, n_outputs_new*n_top_k*sizeof(int32_t));
+            ggml_backend_tensor_get_async(backend_probs, top_k_probs, lctx.top_k_probs + n_outputs_prev*n_top_k, 0, n_outputs_new*n_top_k*sizeof(float));
+        }
+
         // extract embeddings
         if (embd) {
             ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(lctx.sched, embd);
@@ -11952,15 +12504,15 @@ static bool llama_is_user_defined_token(const llama_vocab& vocab, llama_token id
 static uint8_t llama_token_to_byte(const llama_vocab& vocab, llama_token id) {
     GGML_ASSERT(llama_vocab_get_type(vocab) != LLAMA_VOCAB_TYPE_NONE);
     GGML_ASSERT(llama_is_byte_token(vocab, id));
-    const auto& token_data = vocab.id_to_token.at(id);
+    const std::string text = vocab.texts.str(id);
     switch (llama_vocab_get_type(vocab)) {
         case LLAMA_VOCAB_TYPE_SPM: {
-            auto buf = token_data.text.substr(3, 2);
+            auto buf = text.substr(3, 2);
             return strtol(buf.c_str(), NULL, 16);
         }
         case LLAMA_VOCAB_TYPE_BPE: {
             GGML_ASSERT(false);
-            return unicode_utf8_to_byte(token_data.text); // TODO: why is this here after GGML_ASSERT?
+            return unicode_utf8_to_byte(text); // TODO: why is this here after GGML_ASSERT?
         }
         case LLAMA_VOCAB_TYPE_WPM: {
             GGML_ASSERT(false);
@@ -11976,17 +12528,17 @@ static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch) {
     switch (llama_vocab_get_type(vocab)) {
         case LLAMA_VOCAB_TYPE_SPM: {
             const char buf[7] = { '<', '0', 'x', hex[ch >> 4], hex[ch & 15], '>', 0 };
-            auto token = vocab.token_to_id.find(buf);
-            if (token != vocab.token_to_id.end()) {
-                return (*token).second;
+            const int32_t token = vocab.texts.find(buf, 6);
+            if (token != -1) {
+                return token;
             }
             // Try to fall back to just the byte as a string
             const char buf2[2] = { (char)ch, 0 };
-            return vocab.token_to_id.at(buf2);
+            return vocab.texts.at(buf2);
         }
         case LLAMA_VOCAB_TYPE_WPM:
         case LLAMA_VOCAB_TYPE_BPE: {
-            return vocab.token_to_id.at(unicode_byte_to_utf8(ch));
+            return vocab.texts.at(unicode_byte_to_utf8(ch));
         }
         default:
             GGML_ASSERT(false);
@@ -12092,16 +12644,15 @@ struct llm_tokenizer_spm {
 
 private:
     void resegment(llm_symbol & symbol, std::vector<llama_vocab::id> & output) {
-        auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.token_to_id.find(text);
+        const int32_t token = vocab.texts.find(symbol.text, symbol.n);
 
         // Do we need to support is_unused?
-        if (token != vocab.token_to_id.end()) {
-            output.push_back((*token).second);
+        if (token != -1) {
+            output.push_back(token);
             return;
         }
 
-        const auto p = rev_merge.find(text);
+        const auto p = rev_merge.find(std::string(symbol.text, symbol.n));
 
         if (p == rev_merge.end()) {
             // output any symbols that did not form tokens as bytes.
@@ -12122,29 +12673,29 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.token_to_id.find(text);
+        const size_t n = symbols[left].n + symbols[right].n;
+        const int32_t token = vocab.texts.find(symbols[left].text, n);
 
-        if (token == vocab.token_to_id.end()) {
+        if (token == -1) {
             return;
         }
 
-        if (static_cast<size_t>((*token).second) >= vocab.id_to_token.size()) {
+        if (static_cast<size_t>(token) >= vocab.id_to_token.size()) {
             return;
         }
 
-        const auto & tok_data = vocab.id_to_token[(*token).second];
+        const auto & tok_data = vocab.id_to_token[token];
 
         llm_bigram_spm bigram;
         bigram.left  = left;
         bigram.right = right;
         bigram.score = tok_data.score;
-        bigram.size  = text.size();
+        bigram.size  = n;
 
         work_queue.push(bigram);
 
         // Do we need to support is_unused?
-        rev_merge[text] = std::make_pair(left, right);
+        rev_merge[std::string(symbols[left].text, n)] = std::make_pair(left, right);
     }
 
     const llama_vocab & vocab;
@@ -12172,17 +12723,16 @@ struct llm_bigram_bpe {
     using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_vocab::id left_id;  // tokens of the symbols when the bigram was queued - the bigram is outdated if they changed
+    llama_vocab::id right_id;
+    llama_vocab::id id;       // token of the merged pair
     int rank;
-    size_t size;
 };
 
 struct llm_tokenizer_bpe {
     llm_tokenizer_bpe(const llama_vocab & vocab): vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-
         std::vector<std::string> word_collection;
         switch (vocab.type) {
             case LLAMA_VOCAB_TYPE_BPE:
@@ -12256,201 +12806,154 @@ struct llm_tokenizer_bpe {
                 break;
         }
 
-        symbols_final.clear();
-
-        for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+        for (const auto & word : word_collection) {
+            // words repeat a lot in long texts, so their tokens are cached
+            const auto it = cache.find(word);
+            if (it != cache.end()) {
+                output.insert(output.end(), it->second.begin(), it->second.end());
+                continue;
+            }
 
-            int index = 0;
-            size_t offset = 0;
+            const size_t n_output = output.size();
+            tokenize_word(word, output);
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (size_t i = 1; i < symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+            if (word.size() <= max_cached_word_size) {
+                if (cache.size() >= max_cached_words) {
+                    cache.clear();
+                }
+                cache.emplace(word, std::vector<llama_vocab::id>(output.begin() + n_output, output.end()));
             }
+        }
+    }
+
+private:
+    static constexpr size_t max_cached_words     = 16384;
+    static constexpr size_t max_cached_word_size = 64;
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.top();
-                work_queue.pop();
+    void tokenize_word(const std::string & word, std::vector<llama_vocab::id> & output) {
+        work_queue.clear();
+        symbols.clear();
+        symbol_ids.clear();
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        int index = 0;
+        size_t offset = 0;
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+
+            symbol_ids.push_back(vocab.texts.find(sym.text, sym.n));
+        }
+        for (size_t i = 1; i < symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        // build token(s)
+        while (!work_queue.empty()) {
+            std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
+            const auto bigram = work_queue.back();
+            work_queue.pop_back();
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // a symbol changes its token whenever it is merged, so comparing the tokens skips the outdated bigrams
+            if (left_symbol.n == 0 || right_symbol.n == 0 ||
+                symbol_ids[bigram.left] != bigram.left_id || symbol_ids[bigram.right] != bigram.right_id) {
+                continue;
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_ids[bigram.left] = bigram.id;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+            if (symbol_ids[i] >= 0) {
+                output.push_back(symbol_ids[i]);
+                continue;
+            }
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
-                            throw std::runtime_error("ERROR: byte not found in vocab");
-                        }
-                        output.push_back((*token_multibyte).second);
-                    }
-                } else {
-                    output.push_back((*token).second);
+            // a single character that is not in the vocab
+            for (size_t j = 0; j < symbol.n; ++j) {
+                const int32_t token_multibyte = vocab.texts.find(symbol.text + j, 1);
+                if (token_multibyte == -1) {
+                    throw std::runtime_error("ERROR: byte not found in vocab");
                 }
+                output.push_back(token_multibyte);
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
-        int rank_found = -1;
-
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
-
-        if (rank_found < 0) {
+        const auto * merge = vocab.bpe_merges.find(symbol_ids[left], symbol_ids[right]);
+        if (merge == nullptr) {
             return;
         }
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left     = left;
+        bigram.right    = right;
+        bigram.left_id  = symbol_ids[left];
+        bigram.right_id = symbol_ids[right];
+        bigram.id       = merge->id;
+        bigram.rank     = merge->rank;
 
-        work_queue.push(bigram);
+        work_queue.push_back(bigram);
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
     }
 
     const llama_vocab & vocab;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llm_symbol>      symbols;
+    std::vector<llama_vocab::id> symbol_ids; // token of each symbol, -1 for a character that is not in the vocab
 
-    llm_bigram_bpe::queue work_queue;
+    // binary heap of the bigrams that can be merged, ordered like llm_bigram_bpe::queue - a plain vector keeps its
+    // storage from one word to the next
+    llm_bigram_bpe::queue_storage work_queue;
+
+    std::unordered_map<std::string, std::vector<llama_vocab::id>> cache;
 };
 
 struct llm_tokenizer_wpm {
     llm_tokenizer_wpm(const llama_vocab & vocab): vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        auto * token_map = &vocab.token_to_id;
-
-        // normalize and split by whitespace
-        std::vector<std::string> words = preprocess(text);
-
         // bos token prepended already
 
-        // find the longest tokens that form the words
-        for (const std::string &word : words) {
-            // skip empty words
-            if (word.size() == 0) {
-                continue;
-            }
-
-            // prepend phantom space
-            std::string word1 = "\xe2\x96\x81" + word;
-            int n = word1.size();
-
-            // we're at the start of a new word
-            int i = 0;
-            bool match_any = false;
-
-            // move through character position in word
-            while (i < n) {
-                // loop through possible match length
-                bool match = false;
-                for (int j = n; j > i; j--) {
-                    auto it = token_map->find(word1.substr(i, j - i));
-                    if (it != token_map->end()) {
-                        output.push_back(it->second);
-                        match = true;
-                        match_any = true;
-                        i = j;
-                        break;
-                    }
-                }
-
-                // must be an unknown character
-                if (!match) {
-                    i++;
-                }
-            }
-
-            // we didn't find any matches for this word
-            if (!match_any) {
-                output.push_back(vocab.special_unk_id);
-            }
-        }
-    }
-
-    std::vector<std::string> preprocess(const std::string & text) {
-        std::vector<uint32_t> cpts_nfd = unicode_cpts_normalize_nfd(unicode_cpts_from_utf8(text));
+        // normalize and split by whitespace: strip accents, strip control, uniformize whitespace,
+        // to lowercase, pad chinese characters, pad punctuation - each word is tokenized as soon as it ends
+        std::string word = phantom_space;
 
-        // strip accents, strip control, uniformize whitespace,
-        // to lowercase, pad chinese characters, pad punctuation
-        std::string new_str = "";
-        for (uint32_t code : cpts_nfd) {
-            int type = unicode_cpt_type(code);
+        for (uint32_t code : unicode_cpts_normalize_nfd(unicode_cpts_from_utf8(text))) {
+            const int type = unicode_cpt_type(code);
             if (type == CODEPOINT_TYPE_ACCENT_MARK || type == CODEPOINT_TYPE_CONTROL) {
                 continue;
             }
@@ -12458,42 +12961,63 @@ struct llm_tokenizer_wpm {
             if (type == CODEPOINT_TYPE_WHITESPACE) {
                 code = ' ';
             }
-            std::string s = unicode_cpt_to_utf8(code);
             if (type == CODEPOINT_TYPE_PUNCTUATION || is_ascii_punct(code) || is_chinese_char(code)) {
-                new_str += " ";
-                new_str += s;
-                new_str += " ";
+                tokenize_word(word, output);
+                word += unicode_cpt_to_utf8(code);
+                tokenize_word(word, output);
+            } else if (is_ascii_space(code)) {
+                tokenize_word(word, output);
             } else {
-                new_str += s;
+                word += unicode_cpt_to_utf8(code);
             }
         }
+        tokenize_word(word, output);
+    }
+
+    // finds the longest tokens that form a word after the phantom space, and clears the word back to the phantom space
+    void tokenize_word(std::string & word, std::vector<llama_vocab::id> & output) {
+        // skip empty words
+        if (word.size() == phantom_space.size()) {
+            return;
+        }
+
+        const size_t n = word.size();
+
+        // we're at the start of a new word
+        size_t i = 0;
+        bool match_any = false;
 
-        // split by whitespace
-        uint64_t l = 0;
-        uint64_t r = 0;
-        std::vector<std::string> words;
-        while (r < new_str.size()) {
-            // if is whitespace
-            if (isspace(new_str[r], std::locale::classic())) {
-                if (r > l) words.push_back(new_str.substr(l, (r - l)));
-                l = r + 1;
-                r = l;
+        // move through character position in word
+        while (i < n) {
+            size_t length = 0;
+            const int32_t token = vocab.wpm_matcher.longest_prefix(word.data() + i, n - i, length);
+            if (token != -1) {
+                output.push_back(token);
+                match_any = true;
+                i += length;
             } else {
-                r += 1;
+                // must be an unknown character
+                i++;
             }
         }
-        if (r > l) {
-            words.push_back(new_str.substr(l, (r - l)));
+
+        // we didn't find any matches for this word
+        if (!match_any) {
+            output.push_back(vocab.special_unk_id);
         }
-        return words;
+
+        word.resize(phantom_space.size());
     }
 
-    bool is_ascii_punct(uint32_t code) {
-        if (code > 0xFF) {
-            return false;
-        }
-        auto c = char(static_cast<unsigned char>(code));
-        return ispunct(c, std::locale::classic());
+    // the same as std::isspace in the classic locale
+    static bool is_ascii_space(uint32_t code) {
+        return code == ' ' || (code >= '\t' && code <= '\r');
+    }
+
+    // the same as std::ispunct in the classic locale
+    static bool is_ascii_punct(uint32_t code) {
+        return (code >= 0x21 && code <= 0x2F) || (code >= 0x3A && code <= 0x40) ||
+               (code >= 0x5B && code <= 0x60) || (code >= 0x7B && code <= 0x7E);
     }
 
     bool is_chinese_char(uint32_t cpt) {
@@ -12512,6 +13036,8 @@ struct llm_tokenizer_wpm {
         return false;
     }
 
+    const std::string phantom_space = "\xe2\x96\x81";
+
     const llama_vocab & vocab;
 };
 
@@ -12551,123 +13077,141 @@ struct fragment_buffer_variant {
 
 // #define PRETOKENIZERDEBUG
 
+// splits the raw text fragments at the special tokens, trying them in the order of special_tokens_cache and each of them
+// from left to right: all occurrences are found in one pass, then taken in that order unless they overlap one taken before
 static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<fragment_buffer_variant> & buffer) {
-    // for each special token
-    for (const auto & st: vocab.special_tokens_cache) {
-        const auto & special_token = st.first;
-        const auto & special_id    = st.second;
+    struct match {
+        int32_t  rank;
+        uint64_t begin;
+    };
 
-        // for each text fragment
-        std::forward_list<fragment_buffer_variant>::iterator it = buffer.begin();
-        while (it != buffer.end()) {
-            auto & fragment = (*it);
+    std::vector<match> matches;
+    std::vector<char>  taken;
 
-            // if a fragment is text ( not yet processed )
-            if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                auto * raw_text = &(fragment.raw_text);
+    auto before = buffer.before_begin();
+    for (auto it = buffer.begin(); it != buffer.end(); before = it++) {
+        const auto & fragment = (*it);
 
-                auto raw_text_base_offset = fragment.offset;
-                auto raw_text_base_length = fragment.length;
+        if (fragment.type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+            continue;
+        }
 
-                // loop over the text
-                while (true) {
-                    // find the first occurrence of a given special token in this fragment
-                    //  passing offset argument only limit the "search area" but match coordinates
-                    //  are still relative to the source full raw_text
-                    auto match = raw_text->find(special_token, raw_text_base_offset);
+        const std::string & raw_text = fragment.raw_text;
+        const uint64_t      offset   = fragment.offset;
+        const uint64_t      length   = fragment.length;
 
-                    // no occurrences found, stop processing this fragment for a given special token
-                    if (match == std::string::npos) break;
+        matches.clear();
+        vocab.special_tokens_matcher.search(raw_text.data() + offset, length, [&](size_t begin, int32_t rank) {
+            matches.push_back({ rank, offset + begin });
+        });
 
-                    // check if match is within bounds of offset <-> length
-                    if (match + special_token.length() > raw_text_base_offset + raw_text_base_length) break;
+        if (matches.empty()) {
+            continue;
+        }
 
-#ifdef PRETOKENIZERDEBUG
-                    LLAMA_LOG_WARN("FF: (%ld %ld %ld) '%s'\n", raw_text->length(), raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
-#endif
-                    auto source = std::distance(buffer.begin(), it);
+        std::sort(matches.begin(), matches.end(), [](const match & a, const match & b) {
+            return a.rank != b.rank ? a.rank < b.rank : a.begin < b.begin;
+        });
 
-                    // if match is further than base offset
-                    //  then we have some text to the left of it
-                    if (match > raw_text_base_offset) {
-                        // left
-                        const int64_t left_reminder_offset = raw_text_base_offset + 0;
-                        const int64_t left_reminder_length = match - raw_text_base_offset;
-                        buffer.emplace_after(it, (*raw_text), left_reminder_offset, left_reminder_length);
+        // the texts are taken longest first, so a match overlaps one taken before only if its first or last byte does
+        taken.assign(length, 0);
+        size_t n_taken = 0;
+        for (const auto & m : matches) {
+            const size_t size  = vocab.special_tokens_cache[m.rank].first.size();
+            const size_t first = m.begin - offset;
+            if (taken[first] || taken[first + size - 1]) {
+                continue;
+            }
+            std::fill(taken.begin() + first, taken.begin() + first + size, 1);
+            matches[n_taken++] = m;
+        }
+        matches.resize(n_taken);
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("FL: (%ld %ld) '%s'\n", left_reminder_offset, left_reminder_length, raw_text->substr(left_reminder_offset, left_reminder_length).c_str());
-#endif
-                        it++;
-                    }
+        std::sort(matches.begin(), matches.end(), [](const match & a, const match & b) {
+            return a.begin < b.begin;
+        });
 
-                    // special token
-                    buffer.emplace_after(it, special_id);
-                    it++;
+        // replace the fragment with the text between the matches and their tokens
+        auto last = it;
+        uint64_t pos = offset;
+        for (const auto & m : matches) {
+            if (m.begin > pos) {
+                last = buffer.emplace_after(last, raw_text, pos, m.begin - pos);
+            }
+            last = buffer.emplace_after(last, vocab.special_tokens_cache[m.rank].second);
+            pos = m.begin + vocab.special_tokens_cache[m.rank].first.size();
+        }
+        if (pos < offset + length) {
+            last = buffer.emplace_after(last, raw_text, pos, offset + length - pos);
+        }
 
-                    // right
-                    if (match + special_token.length() < raw_text_base_offset + raw_text_base_length) {
-                        const int64_t right_reminder_offset = match + special_token.length();
-                        const int64_t right_reminder_length = raw_text_base_length - ((match - raw_text_base_offset) + special_token.length());
-                        buffer.emplace_after(it, (*raw_text), right_reminder_offset, right_reminder_length);
+        buffer.erase_after(before);
+        it = last;
+    }
+}
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("FR: (%ld %ld) '%s'\n", right_reminder_offset, right_reminder_length, raw_text->substr(right_reminder_offset, right_reminder_length).c_str());
-#endif
+// whether text can be cut at pos, after a newline between two printable ASCII characters, where the tokens of the
+// pieces are the same as those of the whole text (see llama_vocab::newline_splits)
+static bool tokenizer_can_cut(const std::string & text, size_t pos) {
+    auto is_printable = [](char c) {
+        return c > ' ' && c < 0x7F;
+    };
 
-                        it++;
+    return pos >= 2 && pos < text.size() && text[pos - 1] == '\n' && is_printable(text[pos - 2]) && is_printable(text[pos]);
+}
 
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
+// cuts the raw text fragments longer than max_length where tokenizer_can_cut allows it
+static void tokenizer_split_fragments(std::forward_list<fragment_buffer_variant> & buffer, size_t max_length) {
+    GGML_ASSERT(max_length >= 2);
 
-                        // repeat for the right side
-                        raw_text_base_offset = right_reminder_offset;
-                        raw_text_base_length = right_reminder_length;
+    auto prev = buffer.before_begin();
+    for (auto it = buffer.begin(); it != buffer.end(); prev = it++) {
+        const auto & fragment = (*it);
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("RR: (%ld %ld) '%s'\n", raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
-#endif
-                    } else {
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
-                        break;
-                    }
-                }
+        if (fragment.type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT || fragment.length <= max_length) {
+            continue;
+        }
+
+        const std::string & raw_text = fragment.raw_text;
+        const size_t end = fragment.offset + fragment.length;
+
+        size_t start = fragment.offset;
+        auto last = it;
+
+        for (size_t pos = start + max_length; pos < end; ++pos) {
+            if (tokenizer_can_cut(raw_text, pos)) {
+                last  = buffer.emplace_after(last, raw_text, start, pos - start);
+                start = pos;
+                pos   = start + max_length - 1;
             }
-            it++;
         }
-    }
-}
 
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special) {
-    std::vector<llama_vocab::id> output;
-    std::forward_list<fragment_buffer_variant> fragment_buffer;
+        if (start == fragment.offset) {
+            continue;
+        }
 
-    if (!raw_text.empty()) {
-        fragment_buffer.emplace_front(raw_text, 0, raw_text.length());
-        if (parse_special) tokenizer_st_partition(vocab, fragment_buffer);
+        // replace the fragment with its pieces
+        last = buffer.emplace_after(last, raw_text, start, end - start);
+        buffer.erase_after(prev);
+        it = last;
     }
+}
 
+// tokenizes the fragments [i0, i1) of the special token partition, without BOS/EOS - text_start is false when the
+// fragments follow text that was tokenized before (the SPM space prefix only goes at the start of the text)
+static void llama_tokenize_fragments(
+        const llama_vocab & vocab,
+        const std::vector<const fragment_buffer_variant *> & fragments,
+        size_t i0,
+        size_t i1,
+        bool text_start,
+        std::vector<llama_vocab::id> & output) {
     switch (vocab.type) {
         case LLAMA_VOCAB_TYPE_SPM:
             {
-                // OG tokenizer behavior:
-                //
-                // tokenizer.encode('', add_special_tokens=True)  returns [1]
-                // tokenizer.encode('', add_special_tokens=False) returns []
-
-                if (add_special && vocab.special_add_bos != 0) {
-                    GGML_ASSERT(vocab.special_bos_id != -1);
-                    output.push_back(vocab.special_bos_id);
-                }
+                for (size_t i = i0; i < i1; ++i) {
+                    const auto & fragment = *fragments[i];
 
-                for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
                         // without adding this leading whitespace, we do not get the same results as the original tokenizer
 
@@ -12676,7 +13220,7 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
                         //  and passing 'add space prefix' as bool argument
                         //
                         auto raw_text = fragment.raw_text.substr(fragment.offset, fragment.length);
-                        if (&fragment == &fragment_buffer.front()) {
+                        if (i == 0 && text_start) {
                             if (vocab.add_space_prefix) {
                                 raw_text = " " + raw_text; // prefix with space if the first token is not special
                             }
@@ -12692,43 +13236,31 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
                         output.push_back(fragment.token);
                     }
                 }
-
-                if (add_special && vocab.special_add_eos == 1) {
-                    GGML_ASSERT(vocab.special_eos_id != -1);
-                    output.push_back(vocab.special_eos_id);
-                }
             } break;
         case LLAMA_VOCAB_TYPE_BPE:
             {
-                if (add_special && vocab.special_add_bos != 0) {
-                    GGML_ASSERT(vocab.special_bos_id != -1);
-                    output.push_back(vocab.special_bos_id);
-                }
+                llm_tokenizer_bpe tokenizer(vocab);
+
+                for (size_t i = i0; i < i1; ++i) {
+                    const auto & fragment = *fragments[i];
 
-                for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
                         auto raw_text = fragment.raw_text.substr(fragment.offset, fragment.length);
 
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
-                        llm_tokenizer_bpe tokenizer(vocab);
                         tokenizer.tokenize(raw_text, output);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         output.push_back(fragment.token);
                     }
                 }
-
-                GGML_ASSERT(vocab.special_add_eos != 1);
             } break;
         case LLAMA_VOCAB_TYPE_WPM:
             {
-                if (add_special) {
-                    GGML_ASSERT(vocab.special_cls_id != -1);
-                    output.push_back(vocab.special_cls_id);
-                }
+                for (size_t i = i0; i < i1; ++i) {
+                    const auto & fragment = *fragments[i];
 
-                for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
                         auto raw_text = fragment.raw_text.substr(fragment.offset, fragment.length);
 
@@ -12741,7 +13273,62 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
                         output.push_back(fragment.token);
                     }
                 }
+            } break;
+        case LLAMA_VOCAB_TYPE_NONE:
+            GGML_ASSERT(false);
+    }
+}
+
+// the tokens that add_special puts before the text
+static void llama_tokenize_add_bos(const llama_vocab & vocab, bool add_special, std::vector<llama_vocab::id> & output) {
+    switch (vocab.type) {
+        case LLAMA_VOCAB_TYPE_SPM:
+            {
+                // OG tokenizer behavior:
+                //
+                // tokenizer.encode('', add_special_tokens=True)  returns [1]
+                // tokenizer.encode('', add_special_tokens=False) returns []
+
+                if (add_special && vocab.special_add_bos != 0) {
+                    GGML_ASSERT(vocab.special_bos_id != -1);
+                    output.push_back(vocab.special_bos_id);
+                }
+            } break;
+        case LLAMA_VOCAB_TYPE_BPE:
+            {
+                if (add_special && vocab.special_add_bos != 0) {
+                    GGML_ASSERT(vocab.special_bos_id != -1);
+                    output.push_back(vocab.special_bos_id);
+                }
+            } break;
+        case LLAMA_VOCAB_TYPE_WPM:
+            {
+                if (add_special) {
+                    GGML_ASSERT(vocab.special_cls_id != -1);
+                    output.push_back(vocab.special_cls_id);
+                }
+            } break;
+        case LLAMA_VOCAB_TYPE_NONE:
+            GGML_ASSERT(false);
+    }
+}
 
+// the tokens that add_special puts after the text
+static void llama_tokenize_add_eos(const llama_vocab & vocab, bool add_special, std::vector<llama_vocab::id> & output) {
+    switch (vocab.type) {
+        case LLAMA_VOCAB_TYPE_SPM:
+            {
+                if (add_special && vocab.special_add_eos == 1) {
+                    GGML_ASSERT(vocab.special_eos_id != -1);
+                    output.push_back(vocab.special_eos_id);
+                }
+            } break;
+        case LLAMA_VOCAB_TYPE_BPE:
+            {
+                GGML_ASSERT(vocab.special_add_eos != 1);
+            } break;
+        case LLAMA_VOCAB_TYPE_WPM:
+            {
                 if (add_special) {
                     GGML_ASSERT(vocab.special_sep_id != -1);
                     output.push_back(vocab.special_sep_id);
@@ -12750,10 +13337,186 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
         case LLAMA_VOCAB_TYPE_NONE:
             GGML_ASSERT(false);
     }
+}
+
+// calls f(i) for every i in [0, n) on up to n_threads threads, the calling one included - an exception thrown by f is
+// rethrown once all threads are done
+static void llama_tokenize_parallel_for(int32_t n_threads, size_t n, const std::function<void(size_t)> & f) {
+    std::atomic<size_t> next(0);
+
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto compute = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                error = std::current_exception();
+            }
+        }
+    };
+
+    n_threads = std::max<int32_t>(1, std::min<size_t>(n_threads, n));
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int32_t i = 0; i < n_threads - 1; ++i) {
+        workers.emplace_back(compute);
+    }
+    compute();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special, int32_t n_threads) {
+    std::vector<llama_vocab::id> output;
+    std::forward_list<fragment_buffer_variant> fragment_buffer;
+
+    if (!raw_text.empty()) {
+        fragment_buffer.emplace_front(raw_text, 0, raw_text.length());
+        if (parse_special) tokenizer_st_partition(vocab, fragment_buffer);
+    }
+
+    // long texts are cut into pieces of at least min_piece_length bytes, a few per thread, that are tokenized in
+    // parallel - pieces that cannot be cut further are taken as they are
+    const size_t min_piece_length = 64*1024;
+
+    n_threads = std::max<int32_t>(1, std::min<size_t>(n_threads, raw_text.size() / min_piece_length));
+    if (!vocab.newline_splits) {
+        n_threads = 1;
+    }
+
+    const size_t piece_length = std::max(min_piece_length, raw_text.size() / (4*n_threads));
+
+    if (n_threads > 1) {
+        tokenizer_split_fragments(fragment_buffer, piece_length);
+    }
+
+    std::vector<const fragment_buffer_variant *> fragments;
+    for (const auto & fragment : fragment_buffer) {
+        fragments.push_back(&fragment);
+    }
+
+    llama_tokenize_add_bos(vocab, add_special, output);
+
+    if (n_threads == 1) {
+        llama_tokenize_fragments(vocab, fragments, 0, fragments.size(), true, output);
+    } else {
+        // consecutive fragments are grouped into pieces of about piece_length bytes
+        std::vector<size_t> group_begin = { 0 };
+        size_t group_length = 0;
+        for (size_t i = 0; i < fragments.size(); ++i) {
+            if (group_length >= piece_length) {
+                group_begin.push_back(i);
+                group_length = 0;
+            }
+            group_length += fragments[i]->length;
+        }
+        group_begin.push_back(fragments.size());
+
+        const size_t n_groups = group_begin.size() - 1;
+
+        std::vector<std::vector<llama_vocab::id>> group_output(n_groups);
+
+        llama_tokenize_parallel_for(n_threads, n_groups, [&](size_t g) {
+            llama_tokenize_fragments(vocab, fragments, group_begin[g], group_begin[g + 1], true, group_output[g]);
+        });
+
+        size_t n_output = output.size();
+        for (const auto & tokens : group_output) {
+            n_output += tokens.size();
+        }
+        output.reserve(n_output);
+        for (const auto & tokens : group_output) {
+            output.insert(output.end(), tokens.begin(), tokens.end());
+        }
+    }
+
+    llama_tokenize_add_eos(vocab, add_special, output);
 
     return output;
 }
 
+// a text tokenized while it is fed: the part before the last point where tokenizer_can_cut allows a cut is
+// tokenized, the rest is held back until more text arrives or the text ends
+struct llama_tokenizer_stream {
+    llama_tokenizer_stream(const llama_vocab & vocab, bool add_special, bool parse_special)
+        : vocab(vocab), add_special(add_special), parse_special(parse_special) {
+        can_cut = vocab.newline_splits;
+
+        // a special token that continues past a newline could be matched across a cut
+        if (parse_special) {
+            for (const auto & st : vocab.special_tokens_cache) {
+                for (size_t pos = 1; pos < st.first.size(); ++pos) {
+                    if (st.first[pos - 1] == '\n' && st.first[pos] > ' ' && st.first[pos] < 0x7F) {
+                        can_cut = false;
+                    }
+                }
+            }
+        }
+    }
+
+    const llama_vocab & vocab;
+
+    const bool add_special;
+    const bool parse_special;
+
+    bool can_cut;
+
+    bool started  = false; // the tokens at the start of the text were produced
+    bool finished = false;
+
+    std::string text;           // the text after the last cut
+    size_t      n_searched = 0; // the bytes of text that were searched for a cut
+
+    std::vector<llama_vocab::id> tokens; // produced, but not returned yet
+};
+
+// tokenizes the first n bytes of the text of the stream
+static void llama_tokenizer_stream_flush(llama_tokenizer_stream & stream, size_t n) {
+    if (!stream.started) {
+        llama_tokenize_add_bos(stream.vocab, stream.add_special, stream.tokens);
+    }
+
+    if (n > 0) {
+        std::forward_list<fragment_buffer_variant> fragment_buffer;
+        fragment_buffer.emplace_front(stream.text, 0, n);
+        if (stream.parse_special) tokenizer_st_partition(stream.vocab, fragment_buffer);
+
+        std::vector<const fragment_buffer_variant *> fragments;
+        for (const auto & fragment : fragment_buffer) {
+            fragments.push_back(&fragment);
+        }
+
+        llama_tokenize_fragments(stream.vocab, fragments, 0, fragments.size(), !stream.started, stream.tokens);
+
+        stream.text.erase(0, n);
+        stream.n_searched -= std::min(stream.n_searched, n);
+    }
+
+    stream.started = true;
+}
+
+// moves the tokens produced by the stream to the buffer, or returns minus their number if they do not fit
+static int32_t llama_tokenizer_stream_take(llama_tokenizer_stream & stream, llama_token * tokens, int32_t n_tokens_max) {
+    const int32_t n_tokens = stream.tokens.size();
+    if (n_tokens_max < n_tokens) {
+        return -n_tokens;
+    }
+
+    std::copy(stream.tokens.begin(), stream.tokens.end(), tokens);
+    stream.tokens.clear();
+
+    return n_tokens;
+}
+
 //
 // grammar - internal
 //
@@ -12904,17 +13667,54 @@ static bool llama_grammar_match_partial_char(
 }
 
 
+// bookkeeping for llama_grammar_advance_stack
+struct llama_grammar_advance_state {
+    // hashes of the first n_hashed stacks of the output, to find duplicates without scanning it
+    std::unordered_set<size_t> seen;
+    size_t                     n_hashed = 0;
+
+    // stacks currently being expanded, to stop on rules that derive themselves without consuming any
+    // input (e.g. repetitions of nullable rules), which would otherwise recurse forever
+    std::vector<const std::vector<const llama_grammar_element *> *> path;
+};
+
+// appends the stack to new_stacks unless it is already there
+static void llama_grammar_add_stack(
+        const std::vector<const llama_grammar_element *>        & stack,
+        std::vector<std::vector<const llama_grammar_element *>> & new_stacks,
+        llama_grammar_advance_state                             & state) {
+    if (new_stacks.size() < LLAMA_GRAMMAR_MAX_LINEAR_DEDUP) {
+        // a scan is cheaper than hashing for the usual handful of stacks
+        if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
+            new_stacks.emplace_back(stack);
+        }
+        return;
+    }
+
+    for (; state.n_hashed < new_stacks.size(); ++state.n_hashed) {
+        state.seen.insert(llama_grammar_stack_hash()(new_stacks[state.n_hashed]));
+    }
+
+    // only a hash collision needs the scan to tell a duplicate apart
+    if (!state.seen.insert(llama_grammar_stack_hash()(stack)).second &&
+        std::find(new_stacks.begin(), new_stacks.end(), stack) != new_stacks.end()) {
+        return;
+    }
+
+    new_stacks.emplace_back(stack);
+    state.n_hashed = new_stacks.size();
+}
+
 // transforms a grammar pushdown stack into N possible stacks, all ending
 // at a character range (terminal element)
 static void llama_grammar_advance_stack(
         const std::vector<std::vector<llama_grammar_element>>   & rules,
         const std::vector<const llama_grammar_element *>        & stack,
-        std::vector<std::vector<const llama_grammar_element *>> & new_stacks) {
+        std::vector<std::vector<const llama_grammar_element *>> & new_stacks,
+        llama_grammar_advance_state                             & state) {
 
     if (stack.empty()) {
-        if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-            new_stacks.emplace_back(stack);
-        }
+        llama_grammar_add_stack(stack, new_stacks, state);
         return;
     }
 
@@ -12924,7 +13724,14 @@ static void llama_grammar_advance_stack(
         case LLAMA_GRETYPE_RULE_REF: {
             const size_t                  rule_id = static_cast<size_t>(pos->value);
             const llama_grammar_element * subpos  = rules[rule_id].data();
-            do {
+            for (const auto * prev : state.path) {
+                // stacks on the path share their bottom, so compare from the top
+                if (prev->size() == stack.size() && std::equal(stack.rbegin(), stack.rend(), prev->rbegin())) {
+                    return;
+                }
+            }
+            state.path.push_back(&stack);
+            do {
                 // init new stack without the top (pos)
                 std::vector<const llama_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
                 if (!llama_grammar_is_end_of_sequence(pos + 1)) {
@@ -12935,7 +13742,7 @@ static void llama_grammar_advance_stack(
                     // if alternate is nonempty, add to stack
                     new_stack.push_back(subpos);
                 }
-                llama_grammar_advance_stack(rules, new_stack, new_stacks);
+                llama_grammar_advance_stack(rules, new_stack, new_stacks, state);
                 while (!llama_grammar_is_end_of_sequence(subpos)) {
                     // scan to end of alternate def
                     subpos++;
@@ -12947,14 +13754,12 @@ static void llama_grammar_advance_stack(
                     break;
                 }
             } while (true);
+            state.path.pop_back();
             break;
         }
         case LLAMA_GRETYPE_CHAR:
         case LLAMA_GRETYPE_CHAR_NOT:
-            if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-                // only add the stack if it's not a duplicate of one we already have
-                new_stacks.emplace_back(stack);
-            }
+            llama_grammar_add_stack(stack, new_stacks, state);
             break;
         default:
             // end of alternate (LLAMA_GRETYPE_END, LLAMA_GRETYPE_ALT) or middle of char range
@@ -12976,6 +13781,8 @@ void llama_grammar_accept(
 
     new_stacks.clear();
 
+    llama_grammar_advance_state state;
+
     for (const auto & stack : stacks) {
         if (stack.empty()) {
             continue;
@@ -12990,7 +13797,7 @@ void llama_grammar_accept(
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(rules, new_stack, new_stacks);
+            llama_grammar_advance_stack(rules, new_stack, new_stacks, state);
         }
     }
 }
@@ -13045,7 +13852,8 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_
         stack_after.push_back(stack_pos_after);
     }
     std::vector<std::vector<const llama_grammar_element *>> next_stacks;
-    llama_grammar_advance_stack(rules, stack_after, next_stacks);
+    llama_grammar_advance_state state;
+    llama_grammar_advance_stack(rules, stack_after, next_stacks, state);
 
     auto next_rejects = llama_grammar_reject_candidates(rules, next_stacks, next_candidates);
     for (const auto & tok : next_rejects) {
@@ -13073,6 +13881,496 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
     return rejects;
 }
 
+// the tokens in the vocab trie: EOG and control tokens, empty pieces and pieces that are not valid UTF-8 are left out
+// (a piece may still end within a code point)
+static bool llama_vocab_trie_includes(const llama_model & model, llama_token id, const std::string & piece) {
+    if (llama_token_is_eog(&model, id) || llama_is_control_token(model.vocab, id)) {
+        return false;
+    }
+
+    if (piece.empty() || piece[0] == 0) {
+        return false;
+    }
+
+    return decode_utf8(piece, { 0, 0 }).second.n_remain >= 0;
+}
+
+// builds the codepoint trie of all token pieces that the grammar can possibly accept
+// tokens that are EOG, render to an empty piece or contain an invalid UTF-8 sequence are left out
+static void llama_vocab_trie_build(const llama_model & model, llama_vocab_trie & trie) {
+    const int32_t n_vocab = (int32_t) model.vocab.id_to_token.size();
+
+    struct entry {
+        llama_token           id;
+        std::vector<uint32_t> cpts;
+        llama_partial_utf8    partial_utf8;
+    };
+
+    std::vector<entry> entries;
+    entries.reserve(n_vocab);
+
+    std::vector<char> buf(64);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        int32_t n = llama_token_to_piece(&model, id, buf.data(), buf.size(), false);
+        if (n < 0) {
+            buf.resize(-n);
+            n = llama_token_to_piece(&model, id, buf.data(), buf.size(), false);
+        }
+
+        const std::string piece(buf.data(), n);
+        if (!llama_vocab_trie_includes(model, id, piece)) {
+            continue;
+        }
+
+        auto decoded = decode_utf8(piece, { 0, 0 });
+
+        decoded.first.pop_back(); // terminating 0
+        entries.push_back({ id, std::move(decoded.first), decoded.second });
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+        return a.cpts < b.cpts;
+    });
+
+    trie.nodes.clear();
+    trie.edges.clear();
+    trie.tokens.clear();
+    trie.partials.clear();
+
+    // entries in [lo, hi) share their first `depth` code points; since they are sorted, the ones ending
+    // at this node come first and the rest form contiguous groups by their next code point
+    std::function<uint32_t(size_t, size_t, size_t)> build = [&](size_t lo, size_t hi, size_t depth) -> uint32_t {
+        const uint32_t inode = trie.nodes.size();
+        trie.nodes.push_back({});
+
+        llama_vocab_trie::node & node = trie.nodes.back();
+        node.token_begin   = trie.tokens.size();
+        node.partial_begin = trie.partials.size();
+
+        size_t i = lo;
+        for (; i < hi && entries[i].cpts.size() == depth; ++i) {
+            if (entries[i].partial_utf8.n_remain == 0) {
+                trie.tokens.push_back(entries[i].id);
+            } else {
+                trie.partials.push_back({ entries[i].id, entries[i].partial_utf8 });
+            }
+        }
+
+        node.token_end   = trie.tokens.size();
+        node.partial_end = trie.partials.size();
+
+        std::vector<std::pair<size_t, size_t>> groups;
+        while (i < hi) {
+            const uint32_t cpt = entries[i].cpts[depth];
+            size_t j = i + 1;
+            while (j < hi && entries[j].cpts[depth] == cpt) {
+                ++j;
+            }
+            groups.emplace_back(i, j);
+            i = j;
+        }
+
+        const uint32_t edge_begin = trie.edges.size();
+        trie.edges.resize(edge_begin + groups.size());
+        node.edge_begin = edge_begin;
+        node.edge_end   = edge_begin + groups.size();
+
+        // note: `node` is invalidated from here on, as the children are appended to trie.nodes
+        for (size_t k = 0; k < groups.size(); ++k) {
+            const uint32_t cpt   = entries[groups[k].first].cpts[depth];
+            const uint32_t child = build(groups[k].first, groups[k].second, depth + 1);
+            trie.edges[edge_begin + k] = { cpt, child };
+        }
+
+        return inode;
+    };
+
+    build(0, entries.size(), 0);
+}
+
+static const llama_vocab_trie & llama_vocab_get_trie(const llama_model & model) {
+    std::call_once(model.vocab.trie_once, [&model]() {
+        llama_vocab_trie_build(model, model.vocab.trie);
+    });
+    return model.vocab.trie;
+}
+
+// marks in `mask` all tokens below trie node `inode` that the given stack accepts, assuming the code points
+// leading to `inode` have already been consumed; subtrees whose next code point does not match the top of
+// the stack are skipped as a whole
+static void llama_grammar_trie_walk(
+        const llama_vocab_trie                                & trie,
+        const uint32_t                                          inode,
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const std::vector<const llama_grammar_element *>      & stack,
+        std::vector<uint32_t>                                 & mask) {
+    const llama_vocab_trie::node & node = trie.nodes[inode];
+
+    // tokens that end here on a complete code point are accepted, even if the grammar is complete
+    for (uint32_t i = node.token_begin; i < node.token_end; ++i) {
+        const llama_token id = trie.tokens[i];
+        mask[id >> 5] |= 1u << (id & 31);
+    }
+
+    if (stack.empty()) {
+        return;
+    }
+
+    const llama_grammar_element * pos = stack.back();
+
+    for (uint32_t i = node.partial_begin; i < node.partial_end; ++i) {
+        const auto & partial = trie.partials[i];
+        if (llama_grammar_match_partial_char(pos, partial.partial_utf8)) {
+            mask[partial.id >> 5] |= 1u << (partial.id & 31);
+        }
+    }
+
+    const llama_vocab_trie::edge * edges_begin = trie.edges.data() + node.edge_begin;
+    const llama_vocab_trie::edge * edges_end   = trie.edges.data() + node.edge_end;
+
+    std::vector<uint32_t> children;
+    if (pos->type == LLAMA_GRETYPE_CHAR) {
+        // positive char set: look up each range in the sorted children instead of testing all of them
+        const llama_grammar_element * p = pos;
+        do {
+            const uint32_t lo = p->value;
+            const uint32_t hi = p[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ? p[1].value : p->value;
+            p += p[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ? 2 : 1;
+
+            const auto * it = std::lower_bound(edges_begin, edges_end, lo,
+                    [](const llama_vocab_trie::edge & e, uint32_t cpt) { return e.cpt < cpt; });
+            for (; it != edges_end && it->cpt <= hi; ++it) {
+                children.push_back(it->child);
+            }
+        } while (p->type == LLAMA_GRETYPE_CHAR_ALT);
+
+        // ranges may overlap
+        std::sort(children.begin(), children.end());
+        children.erase(std::unique(children.begin(), children.end()), children.end());
+    } else {
+        for (const auto * it = edges_begin; it != edges_end; ++it) {
+            if (llama_grammar_match_char(pos, it->cpt).first) {
+                children.push_back(it->child);
+            }
+        }
+    }
+
+    if (children.empty()) {
+        return;
+    }
+
+    // the stacks after consuming a code point at pos do not depend on the code point itself
+    const llama_grammar_element * pos_after = llama_grammar_match_char(pos, 0).second;
+
+    std::vector<const llama_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+    if (!llama_grammar_is_end_of_sequence(pos_after)) {
+        stack_after.push_back(pos_after);
+    }
+    std::vector<std::vector<const llama_grammar_element *>> next_stacks;
+    llama_grammar_advance_state state;
+    llama_grammar_advance_stack(rules, stack_after, next_stacks, state);
+
+    for (const auto & next_stack : next_stacks) {
+        for (const uint32_t child : children) {
+            llama_grammar_trie_walk(trie, child, rules, next_stack, mask);
+        }
+    }
+}
+
+// hash of a set of grammar stacks, used to look up the states of the automaton
+struct llama_grammar_stacks_hash {
+    size_t operator()(const std::vector<std::vector<const llama_grammar_element *>> & stacks) const {
+        size_t seed = stacks.size();
+        for (const auto & stack : stacks) {
+            seed ^= llama_grammar_stack_hash()(stack) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        }
+        return seed;
+    }
+};
+
+// token-level automaton of a grammar over one vocab, built lazily while grammars with these rules are sampled
+// a state is a set of stacks reached on a code point boundary; it caches the tokens it allows and the states
+// that the tokens accepted from it lead to, so that revisited states need neither the vocab trie walk nor
+// the pushdown interpreter
+// the masks are shared with the samplers that use them outside of the lock, so that they can be evicted meanwhile
+typedef std::shared_ptr<const std::vector<uint32_t>> llama_grammar_mask_ptr;
+
+struct llama_grammar_automaton {
+    struct state {
+        std::vector<std::vector<const llama_grammar_element *>> stacks;
+        llama_grammar_mask_ptr                                  mask; // 1 bit per vocab entry, null until needed or evicted
+        uint64_t                                                t_used; // value of n_used when the mask was last used
+        std::unordered_map<llama_token, uint32_t>               next;
+        std::vector<std::pair<llama_token, bool>>               recent; // verdicts of the last tokens checked without the mask
+    };
+
+    std::deque<state>                         states; // references stay valid as states are added
+    std::unordered_multimap<size_t, uint32_t> ids;    // llama_grammar_stacks_hash of the stacks -> state
+
+    // allowed-token bitmasks of single stacks, combined into the masks of the states
+    std::unordered_map<std::vector<const llama_grammar_element *>, llama_grammar_mask_ptr, llama_grammar_stack_hash> stack_masks;
+
+    size_t   n_state_mask_bytes = 0; // the masks of the least recently used states are evicted above LLAMA_GRAMMAR_MAX_STATE_MASK_BYTES
+    uint64_t n_used             = 0;
+};
+
+struct llama_grammar_compiled {
+    llama_grammar_compiled(std::vector<std::vector<llama_grammar_element>> rules, uint64_t hash)
+        : rules(std::move(rules)), hash(hash) {}
+
+    const std::vector<std::vector<llama_grammar_element>> rules;
+    const uint64_t                                        hash;
+
+    // the masks are looked up and inserted under the lock, but the vocab trie walks that compute them are not, so that
+    // the sequences that share a grammar can be sampled in parallel
+    std::mutex mutex; // guards automata
+
+    std::atomic<size_t> n_mask_bytes{0}; // of all the masks of the automata, for the registry
+
+    // keyed by llama_vocab::fingerprint
+    std::map<uint64_t, llama_grammar_automaton> automata;
+};
+
+// the most recently used compiled grammars are kept alive after their grammars are freed, so that rules that
+// are used for many requests (e.g. the same JSON schema) are compiled once
+struct llama_grammar_registry {
+    std::mutex mutex;
+
+    std::list<std::shared_ptr<llama_grammar_compiled>> entries; // most recently used first
+};
+
+static llama_grammar_registry & llama_grammar_get_registry() {
+    static llama_grammar_registry registry;
+    return registry;
+}
+
+static uint64_t llama_grammar_rules_hash(const std::vector<std::vector<llama_grammar_element>> & rules) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    auto add = [&hash](uint64_t value) {
+        hash ^= value;
+        hash *= 0x100000001b3ull;
+    };
+
+    add(rules.size());
+    for (const auto & rule : rules) {
+        add(rule.size());
+        for (const auto & elem : rule) {
+            add(((uint64_t) elem.type << 32) | elem.value);
+        }
+    }
+
+    return hash;
+}
+
+static bool llama_grammar_rules_equal(
+        const std::vector<std::vector<llama_grammar_element>> & a,
+        const std::vector<std::vector<llama_grammar_element>> & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].size() != b[i].size()) {
+            return false;
+        }
+        for (size_t j = 0; j < a[i].size(); ++j) {
+            if (a[i][j].type != b[i][j].type || a[i][j].value != b[i][j].value) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static std::shared_ptr<llama_grammar_compiled> llama_grammar_get_compiled(std::vector<std::vector<llama_grammar_element>> rules) {
+    const uint64_t hash = llama_grammar_rules_hash(rules);
+
+    auto & registry = llama_grammar_get_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    for (auto it = registry.entries.begin(); it != registry.entries.end(); ++it) {
+        if ((*it)->hash == hash && llama_grammar_rules_equal((*it)->rules, rules)) {
+            registry.entries.splice(registry.entries.begin(), registry.entries, it);
+            return registry.entries.front();
+        }
+    }
+
+    registry.entries.push_front(std::make_shared<llama_grammar_compiled>(std::move(rules), hash));
+    if (registry.entries.size() > LLAMA_GRAMMAR_MAX_COMPILED) {
+        registry.entries.pop_back();
+    }
+
+    return registry.entries.front();
+}
+
+// drops the least recently used compiled grammars while the masks of those in the registry take more than
+// LLAMA_GRAMMAR_MAX_REGISTRY_BYTES - their memory is freed with the last grammar that uses them
+// must not be called with the mutex of a compiled grammar held
+static void llama_grammar_registry_trim() {
+    auto & registry = llama_grammar_get_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    size_t n_bytes = 0;
+    for (const auto & entry : registry.entries) {
+        n_bytes += entry->n_mask_bytes;
+    }
+
+    while (n_bytes > LLAMA_GRAMMAR_MAX_REGISTRY_BYTES && registry.entries.size() > 1) {
+        n_bytes -= registry.entries.back()->n_mask_bytes;
+        registry.entries.pop_back();
+    }
+}
+
+// returns the state of the given stacks, adding it if needed, or -1 if the automaton is full
+static int32_t llama_grammar_automaton_state(
+        llama_grammar_automaton                                       & automaton,
+        const std::vector<std::vector<const llama_grammar_element *>> & stacks) {
+    const size_t hash = llama_grammar_stacks_hash()(stacks);
+
+    const auto range = automaton.ids.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (automaton.states[it->second].stacks == stacks) {
+            return it->second;
+        }
+    }
+
+    if (automaton.states.size() >= LLAMA_GRAMMAR_MAX_STATES) {
+        return -1;
+    }
+
+    const uint32_t id = automaton.states.size();
+    automaton.states.push_back({ stacks, nullptr, 0, {}, {} });
+    automaton.ids.emplace(hash, id);
+
+    return id;
+}
+
+// computes the union of the allowed-token bitmasks of the given stacks
+// the mask of each stack is computed once by walking the vocab trie and cached in the automaton
+// only valid on a code point boundary, i.e. when the grammar is not in the middle of a partial UTF-8 sequence
+// called without the lock of the compiled grammar, which is taken only to look up and insert the masks of the stacks
+static llama_grammar_mask_ptr llama_grammar_get_mask(
+        const llama_model                                             & model,
+        llama_grammar_compiled                                        & compiled,
+        llama_grammar_automaton                                       & automaton,
+        const std::vector<std::vector<const llama_grammar_element *>> & stacks) {
+    const size_t n_words = (model.vocab.id_to_token.size() + 31) / 32;
+
+    std::vector<uint32_t> mask(n_words, 0);
+
+    for (const auto & stack : stacks) {
+        llama_grammar_mask_ptr stack_mask;
+        {
+            std::lock_guard<std::mutex> lock(compiled.mutex);
+            auto it = automaton.stack_masks.find(stack);
+            if (it != automaton.stack_masks.end()) {
+                stack_mask = it->second;
+            }
+        }
+
+        if (!stack_mask) {
+            std::vector<uint32_t> tmp(n_words, 0);
+            llama_grammar_trie_walk(llama_vocab_get_trie(model), 0, compiled.rules, stack, tmp);
+            stack_mask = std::make_shared<const std::vector<uint32_t>>(std::move(tmp));
+
+            std::lock_guard<std::mutex> lock(compiled.mutex);
+            if (automaton.stack_masks.size() >= LLAMA_GRAMMAR_MAX_CACHED_MASKS) {
+                compiled.n_mask_bytes -= automaton.stack_masks.size() * n_words * sizeof(uint32_t);
+                automaton.stack_masks.clear();
+            }
+            if (automaton.stack_masks.emplace(stack, stack_mask).second) {
+                compiled.n_mask_bytes += n_words * sizeof(uint32_t);
+            }
+        }
+
+        const uint32_t * src = stack_mask->data();
+        for (size_t i = 0; i < n_words; ++i) {
+            mask[i] |= src[i];
+        }
+    }
+
+    return std::make_shared<const std::vector<uint32_t>>(std::move(mask));
+}
+
+// stores the mask of a state, evicting the masks of the least recently used states above the byte budget
+// called with the lock of the compiled grammar held
+static void llama_grammar_set_state_mask(
+        llama_grammar_compiled  & compiled,
+        llama_grammar_automaton & automaton,
+        uint32_t                  id,
+        llama_grammar_mask_ptr    mask) {
+    auto & state = automaton.states[id];
+    if (state.mask) {
+        return;
+    }
+
+    const size_t n_bytes = mask->size() * sizeof(uint32_t);
+
+    while (automaton.n_state_mask_bytes + n_bytes > LLAMA_GRAMMAR_MAX_STATE_MASK_BYTES && automaton.n_state_mask_bytes > 0) {
+        llama_grammar_automaton::state * lru = nullptr;
+        for (auto & other : automaton.states) {
+            if (other.mask && (lru == nullptr || other.t_used < lru->t_used)) {
+                lru = &other;
+            }
+        }
+        const size_t n_evicted = lru->mask->size() * sizeof(uint32_t);
+        automaton.n_state_mask_bytes -= n_evicted;
+        compiled.n_mask_bytes        -= n_evicted;
+        lru->mask.reset();
+    }
+
+    state.mask   = std::move(mask);
+    state.t_used = ++automaton.n_used;
+    automaton.n_state_mask_bytes += n_bytes;
+    compiled.n_mask_bytes        += n_bytes;
+}
+
+// the trie walk pays off when most of the vocab is being checked, or when the masks are already cached
+static bool llama_grammar_use_mask(
+        const llama_grammar_automaton                                 & automaton,
+        const std::vector<std::vector<const llama_grammar_element *>> & stacks,
+        size_t                                                          n_candidates) {
+    if (n_candidates >= LLAMA_GRAMMAR_MASK_MIN_CANDIDATES) {
+        return true;
+    }
+
+    for (const auto & stack : stacks) {
+        if (automaton.stack_masks.find(stack) == automaton.stack_masks.end()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// whether the grammar allows a token in a state, as far as the state knows without the mask or the interpreter:
+// 1 = allowed, 0 = rejected, -1 = unknown
+static int llama_grammar_state_allows(const llama_grammar_automaton::state & state, llama_token id) {
+    if (state.next.find(id) != state.next.end()) {
+        // the token has been accepted from this state before
+        return 1;
+    }
+
+    for (const auto & verdict : state.recent) {
+        if (verdict.first == id) {
+            return verdict.second ? 1 : 0;
+        }
+    }
+
+    return -1;
+}
+
+static void llama_grammar_state_remember(llama_grammar_automaton::state & state, llama_token id, bool allowed) {
+    if (llama_grammar_state_allows(state, id) >= 0) {
+        return;
+    }
+
+    if (state.recent.size() >= LLAMA_GRAMMAR_MAX_RECENT) {
+        state.recent.erase(state.recent.begin());
+    }
+    state.recent.emplace_back(id, allowed);
+}
+
 //
 // grammar - external
 //
@@ -13092,16 +14390,20 @@ struct llama_grammar * llama_grammar_init(
         vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
     }
 
+    std::shared_ptr<llama_grammar_compiled> compiled = llama_grammar_get_compiled(std::move(vec_rules));
+    const auto & shared_rules = compiled->rules;
+
     // loop over alternates of start rule to build initial stacks
     std::vector<std::vector<const llama_grammar_element *>> stacks;
-    pos = vec_rules[start_rule_index].data();
+    llama_grammar_advance_state state;
+    pos = shared_rules[start_rule_index].data();
     do {
         std::vector<const llama_grammar_element *> stack;
         if (!llama_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
             stack.push_back(pos);
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
+        llama_grammar_advance_stack(shared_rules, stack, stacks, state);
         while (!llama_grammar_is_end_of_sequence(pos)) {
             // scan to end of alternate def
             pos++;
@@ -13114,7 +14416,7 @@ struct llama_grammar * llama_grammar_init(
         }
     } while (true);
 
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    return new llama_grammar{ compiled, shared_rules, std::move(stacks), {} };
 }
 
 void llama_grammar_free(struct llama_grammar * grammar) {
@@ -13122,22 +14424,221 @@ void llama_grammar_free(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
-
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar->rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar->rules[ir0].size(); ir1++) {
-                    if (grammar->stacks[is][ie] == &grammar->rules[ir0][ir1]) {
-                         result->stacks[is][ie]  =  &result->rules[ir0][ir1];
+    // the rules are shared, so the stacks can be copied as they are
+    return new llama_grammar{ grammar->compiled, grammar->rules, grammar->stacks, grammar->partial_utf8 };
+}
+
+// the cache file stores, for each compiled grammar with an automaton for the vocab, its rules and its states,
+// with the stack elements as (rule index, element offset) pairs
+static bool llama_grammar_cache_save_file_internal(const struct llama_model * model, const char * path) {
+    const uint64_t fingerprint = model->vocab.fingerprint;
+
+    std::vector<std::shared_ptr<llama_grammar_compiled>> entries;
+    {
+        auto & registry = llama_grammar_get_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        entries.assign(registry.entries.begin(), registry.entries.end());
+    }
+
+    llama_file file(path, "wb");
+
+    file.write_u32(LLAMA_GRAMMAR_CACHE_MAGIC);
+    file.write_u32(LLAMA_GRAMMAR_CACHE_VERSION);
+    file.write_raw(&fingerprint, sizeof(fingerprint));
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    std::vector<const llama_grammar_compiled *> compiled;
+    for (const auto & entry : entries) {
+        std::unique_lock<std::mutex> lock(entry->mutex);
+        auto it = entry->automata.find(fingerprint);
+        if (it != entry->automata.end() && !it->second.states.empty()) {
+            locks.push_back(std::move(lock));
+            compiled.push_back(entry.get());
+        }
+    }
+
+    file.write_u32(compiled.size());
+
+    for (const llama_grammar_compiled * entry : compiled) {
+        const auto & rules     = entry->rules;
+        const auto & automaton = entry->automata.at(fingerprint);
+
+        std::unordered_map<const llama_grammar_element *, std::pair<uint32_t, uint32_t>> offsets;
+
+        file.write_u32(rules.size());
+        for (uint32_t ir = 0; ir < rules.size(); ++ir) {
+            file.write_u32(rules[ir].size());
+            for (uint32_t ie = 0; ie < rules[ir].size(); ++ie) {
+                file.write_u32(rules[ir][ie].type);
+                file.write_u32(rules[ir][ie].value);
+                offsets[&rules[ir][ie]] = { ir, ie };
+            }
+        }
+
+        file.write_u32(automaton.states.size());
+        for (const auto & state : automaton.states) {
+            file.write_u32(state.stacks.size());
+            for (const auto & stack : state.stacks) {
+                file.write_u32(stack.size());
+                for (const llama_grammar_element * pos : stack) {
+                    const auto & offset = offsets.at(pos);
+                    file.write_u32(offset.first);
+                    file.write_u32(offset.second);
+                }
+            }
+
+            const size_t n_mask = state.mask ? state.mask->size() : 0;
+            file.write_u32(n_mask);
+            if (n_mask > 0) {
+                file.write_raw(state.mask->data(), n_mask * sizeof(uint32_t));
+            }
+
+            file.write_u32(state.next.size());
+            for (const auto & next : state.next) {
+                file.write_u32(next.first);
+                file.write_u32(next.second);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool llama_grammar_cache_save_file(const struct llama_model * model, const char * path) {
+    try {
+        return llama_grammar_cache_save_file_internal(model, path);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error saving grammar cache file: %s\n", err.what());
+        return false;
+    }
+}
+
+static bool llama_grammar_cache_load_file_internal(const struct llama_model * model, const char * path) {
+    const uint64_t fingerprint = model->vocab.fingerprint;
+    const uint32_t n_vocab     = model->vocab.id_to_token.size();
+    const uint32_t n_words     = (n_vocab + 31) / 32;
+
+    llama_file file(path, "rb");
+
+    {
+        const uint32_t magic   = file.read_u32();
+        const uint32_t version = file.read_u32();
+
+        if (magic != LLAMA_GRAMMAR_CACHE_MAGIC || version != LLAMA_GRAMMAR_CACHE_VERSION) {
+            LLAMA_LOG_ERROR("%s: unknown (magic, version) for grammar cache file: %08x, %08x\n", __func__, magic, version);
+            return false;
+        }
+
+        uint64_t file_fingerprint;
+        file.read_raw(&file_fingerprint, sizeof(file_fingerprint));
+
+        if (file_fingerprint != fingerprint) {
+            LLAMA_LOG_ERROR("%s: grammar cache file was saved for a different vocab\n", __func__);
+            return false;
+        }
+    }
+
+    const uint32_t n_entries = file.read_u32();
+
+    for (uint32_t i = 0; i < n_entries; ++i) {
+        std::vector<std::vector<llama_grammar_element>> rules(file.read_u32());
+        for (auto & rule : rules) {
+            rule.resize(file.read_u32());
+            for (auto & elem : rule) {
+                elem.type  = (llama_gretype) file.read_u32();
+                elem.value = file.read_u32();
+            }
+        }
+
+        for (const auto & rule : rules) {
+            if (rule.empty() || rule.back().type != LLAMA_GRETYPE_END) {
+                throw std::runtime_error("invalid grammar rule");
+            }
+            for (const auto & elem : rule) {
+                if (elem.type > LLAMA_GRETYPE_CHAR_ALT || (elem.type == LLAMA_GRETYPE_RULE_REF && elem.value >= rules.size())) {
+                    throw std::runtime_error("invalid grammar element");
+                }
+            }
+        }
+
+        struct state_offsets {
+            std::vector<std::vector<std::pair<uint32_t, uint32_t>>> stacks;
+            std::vector<uint32_t>                                   mask;
+            std::vector<std::pair<llama_token, uint32_t>>           next;
+        };
+
+        std::vector<state_offsets> states(file.read_u32());
+        if (states.size() > LLAMA_GRAMMAR_MAX_STATES) {
+            throw std::runtime_error("too many grammar states");
+        }
+
+        for (auto & state : states) {
+            state.stacks.resize(file.read_u32());
+            for (auto & stack : state.stacks) {
+                stack.resize(file.read_u32());
+                for (auto & offset : stack) {
+                    offset.first  = file.read_u32();
+                    offset.second = file.read_u32();
+                    if (offset.first >= rules.size() || offset.second >= rules[offset.first].size()) {
+                        throw std::runtime_error("invalid grammar stack");
                     }
                 }
             }
+
+            state.mask.resize(file.read_u32());
+            if (!state.mask.empty() && state.mask.size() != n_words) {
+                throw std::runtime_error("invalid grammar mask");
+            }
+            file.read_raw(state.mask.data(), state.mask.size() * sizeof(uint32_t));
+
+            state.next.resize(file.read_u32());
+            for (auto & next : state.next) {
+                next.first  = file.read_u32();
+                next.second = file.read_u32();
+                if ((uint32_t) next.first >= n_vocab || next.second >= states.size()) {
+                    throw std::runtime_error("invalid grammar transition");
+                }
+            }
+        }
+
+        std::shared_ptr<llama_grammar_compiled> compiled = llama_grammar_get_compiled(std::move(rules));
+
+        std::lock_guard<std::mutex> lock(compiled->mutex);
+        auto & automaton = compiled->automata[fingerprint];
+        if (!automaton.states.empty()) {
+            // already compiled in this process
+            continue;
+        }
+
+        for (auto & state : states) {
+            std::vector<std::vector<const llama_grammar_element *>> stacks(state.stacks.size());
+            for (size_t is = 0; is < stacks.size(); ++is) {
+                for (const auto & offset : state.stacks[is]) {
+                    stacks[is].push_back(&compiled->rules[offset.first][offset.second]);
+                }
+            }
+
+            const uint32_t id = automaton.states.size();
+            automaton.ids.emplace(llama_grammar_stacks_hash()(stacks), id);
+            automaton.states.push_back({ std::move(stacks), nullptr, 0, { state.next.begin(), state.next.end() }, {} });
+            if (!state.mask.empty()) {
+                llama_grammar_set_state_mask(*compiled, automaton, id, std::make_shared<const std::vector<uint32_t>>(std::move(state.mask)));
+            }
         }
     }
 
-    return result;
+    llama_grammar_registry_trim();
+
+    return true;
+}
+
+bool llama_grammar_cache_load_file(const struct llama_model * model, const char * path) {
+    try {
+        return llama_grammar_cache_load_file_internal(model, path);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error loading grammar cache file: %s\n", err.what());
+        return false;
+    }
 }
 
 //
@@ -13180,12 +14681,37 @@ void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * c
     }
 }
 
-void llama_sample_top_k(struct llama_context * ctx, llama_token_data_array * candidates, int32_t k, size_t min_keep) {
-    // TODO: move bucket sort to separate function so that top_p/tail_free/typical/softmax first is equally fast
-    // if (k >= (int32_t)candidates->size) {
-    //     return;
-    // }
+// candidates are bucketed by logit over [max_l - LLAMA_SAMPLE_BUCKET_RANGE, max_l], so that top-p only needs to sort
+// the candidates in the top buckets; lower logits, including -INFINITY, all fall into the first bucket
+static float llama_sample_max_logit(const llama_token_data_array * candidates) {
+    float max_l = -INFINITY;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        max_l = std::max(max_l, candidates->data[i].logit);
+    }
+    return max_l;
+}
+
+static inline int llama_sample_bucket(float logit, float min_l) {
+    constexpr float scale = LLAMA_SAMPLE_N_BUCKETS / LLAMA_SAMPLE_BUCKET_RANGE;
+
+    if (!(logit > min_l)) {
+        return 0;
+    }
+    return std::min(LLAMA_SAMPLE_N_BUCKETS - 1, int((logit - min_l) * scale));
+}
+
+// moves the candidates in buckets >= ib to the front of the array (in no particular order) and returns their number
+static size_t llama_sample_partition_buckets(llama_token_data_array * candidates, float min_l, int ib) {
+    size_t n = 0;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        if (llama_sample_bucket(candidates->data[i].logit, min_l) >= ib) {
+            std::swap(candidates->data[n++], candidates->data[i]);
+        }
+    }
+    return n;
+}
 
+void llama_sample_top_k(struct llama_context * ctx, llama_token_data_array * candidates, int32_t k, size_t min_keep) {
     const int64_t t_start_sample_us = ggml_time_us();
 
     if (k <= 0) {
@@ -13200,57 +14726,13 @@ void llama_sample_top_k(struct llama_context * ctx, llama_token_data_array * can
         auto comp = [](const llama_token_data & a, const llama_token_data & b) {
             return a.logit > b.logit;
         };
-        if (k <= 128) {
+
+        // partial_sort is a single pass for small k, selection wins once the heap of the k best gets large
+        if (k <= LLAMA_SAMPLE_TOP_K_PARTIAL_SORT) {
             std::partial_sort(candidates->data, candidates->data + k, candidates->data + candidates->size, comp);
         } else {
-            constexpr int   nbuckets     = 128;
-            constexpr float bucket_low   = -10.0f;
-            constexpr float bucket_high  =  10.0f;
-            constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
-            constexpr float bucker_inter = -bucket_low * bucket_scale;
-
-            std::vector<int> bucket_idx(candidates->size);
-            std::vector<int> histo(nbuckets, 0);
-
-            for (int i = 0; i < (int)candidates->size; ++i) {
-                const float val = candidates->data[i].logit;
-                int ib = int(bucket_scale * val + bucker_inter); //nbuckets * (val - bucket_low) / (bucket_high - bucket_low);
-                ib = std::max(0, std::min(nbuckets-1, ib));
-                bucket_idx[i] = ib;
-                ++histo[ib];
-            }
-            int nhave = 0;
-            int ib = nbuckets - 1;
-            for ( ; ib >= 0; --ib) {
-                nhave += histo[ib];
-                if (nhave >= k) break;
-            }
-            std::vector<llama_token_data> tmp_tokens(nhave);
-            auto ptr = tmp_tokens.data();
-            std::vector<llama_token_data*> bucket_ptrs;
-            bucket_ptrs.reserve(nbuckets - ib);
-            for (int j = nbuckets - 1; j >= ib; --j) {
-                bucket_ptrs.push_back(ptr);
-                ptr += histo[j];
-            }
-            for (int i = 0; i < (int)candidates->size; ++i) {
-                int j = bucket_idx[i];
-                if (j >= ib) {
-                    *bucket_ptrs[nbuckets-1-j]++ = candidates->data[i];
-                }
-            }
-
-            ptr = tmp_tokens.data();
-            int ndone = 0;
-            for (int j = nbuckets-1; j > ib; --j) {
-                std::sort(ptr, ptr + histo[j], comp);
-                ptr += histo[j];
-                ndone += histo[j];
-            }
-            std::partial_sort(ptr, ptr + k - ndone, ptr + histo[ib], comp);
-
-            std::memcpy(candidates->data, tmp_tokens.data(), k*sizeof(llama_token_data));
-
+            std::nth_element(candidates->data, candidates->data + k - 1, candidates->data + candidates->size, comp);
+            std::sort(candidates->data, candidates->data + k, comp);
         }
         candidates->sorted = true;
     }
@@ -13266,6 +14748,65 @@ void llama_sample_top_p(struct llama_context * ctx, llama_token_data_array * can
         return;
     }
 
+    // on large unsorted arrays, only sort the buckets that hold the top p of the probability mass
+    if (!candidates->sorted && candidates->size >= LLAMA_SAMPLE_MIN_BUCKETED) {
+        const int64_t t_start_sample_us = ggml_time_us();
+
+        const float max_l = llama_sample_max_logit(candidates);
+        const float min_l = max_l - LLAMA_SAMPLE_BUCKET_RANGE;
+
+        double mass [LLAMA_SAMPLE_N_BUCKETS] = { 0 };
+        size_t histo[LLAMA_SAMPLE_N_BUCKETS] = { 0 };
+
+        // accumulated in double, as the nucleus of a large vocab can be made of many small probabilities
+        double cum_sum = 0.0;
+        for (size_t i = 0; i < candidates->size; ++i) {
+            const float e  = expf(candidates->data[i].logit - max_l);
+            const int   ib = llama_sample_bucket(candidates->data[i].logit, min_l);
+            mass[ib]  += e;
+            histo[ib] += 1;
+            cum_sum   += e;
+        }
+
+        int    ib    = LLAMA_SAMPLE_N_BUCKETS - 1;
+        double mhave = mass[ib];
+        size_t nhave = histo[ib];
+        while ((mhave < p * cum_sum || nhave < min_keep) && ib > 0) {
+            --ib;
+            mhave += mass[ib];
+            nhave += histo[ib];
+        }
+
+        const size_t n = llama_sample_partition_buckets(candidates, min_l, ib);
+
+        std::sort(candidates->data, candidates->data + n, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+
+        double cum_p    = 0.0;
+        size_t last_idx = 0;
+        for (size_t i = 0; i < n; ++i) {
+            candidates->data[i].p = expf(candidates->data[i].logit - max_l) / cum_sum;
+            cum_p += candidates->data[i].p;
+
+            if (cum_p >= p && i + 1 >= min_keep) {
+                last_idx = i + 1;
+                break;
+            }
+        }
+
+        if (ctx) {
+            ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        }
+
+        // rounding may leave the selected buckets just short of p, in which case the whole array is sorted below
+        if (last_idx > 0) {
+            candidates->size   = last_idx;
+            candidates->sorted = true;
+            return;
+        }
+    }
+
     llama_sample_softmax(ctx, candidates);
 
     const int64_t t_start_sample_us = ggml_time_us();
@@ -13304,24 +14845,26 @@ void llama_sample_min_p(struct llama_context * ctx, llama_token_data_array * can
 
     // if the candidates aren't sorted, try the unsorted implementation first
     if (!candidates->sorted) {
-        std::vector<llama_token_data> filtered_tokens;
-
         float max_logit = -FLT_MAX;
         for (size_t i = 0; i < candidates->size; ++i) {
             max_logit = std::max(max_logit, candidates->data[i].logit);
         }
         const float min_logit = max_logit + logf(p); // min logit for p_i >= p * p_max
 
+        size_t n_filtered = 0;
         for (size_t i = 0; i < candidates->size; ++i) {
-            if (candidates->data[i].logit >= min_logit) {
-                filtered_tokens.push_back(candidates->data[i]);
-            }
+            n_filtered += candidates->data[i].logit >= min_logit;
         }
 
-        // if we have enough values the operation was a success
-        if (filtered_tokens.size() >= min_keep) {
-            memcpy(candidates->data, filtered_tokens.data(), filtered_tokens.size()*sizeof(llama_token_data));
-            candidates->size = filtered_tokens.size();
+        // if we have enough values the operation was a success, filter in place
+        if (n_filtered >= min_keep) {
+            size_t j = 0;
+            for (size_t i = 0; i < candidates->size; ++i) {
+                if (candidates->data[i].logit >= min_logit) {
+                    candidates->data[j++] = candidates->data[i];
+                }
+            }
+            candidates->size = n_filtered;
             min_p_applied = true;
         }
     }
@@ -13556,6 +15099,18 @@ void llama_sample_temp(struct llama_context * ctx, llama_token_data_array * cand
     }
 }
 
+static inline float llama_sample_penalize(float logit, int count, float penalty_repeat, float penalty_freq, float penalty_present) {
+    // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
+    // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
+    if (logit <= 0) {
+        logit *= penalty_repeat;
+    } else {
+        logit /= penalty_repeat;
+    }
+
+    return logit - (float(count) * penalty_freq + float(count > 0) * penalty_present);
+}
+
 void llama_sample_repetition_penalties(
             struct llama_context * ctx,
           llama_token_data_array * candidates,
@@ -13585,15 +15140,62 @@ void llama_sample_repetition_penalties(
 
         const int count = token_iter->second;
 
-        // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
-        // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (candidates->data[i].logit <= 0) {
-            candidates->data[i].logit *= penalty_repeat;
-        } else {
-            candidates->data[i].logit /= penalty_repeat;
+        candidates->data[i].logit = llama_sample_penalize(candidates->data[i].logit, count, penalty_repeat, penalty_freq, penalty_present);
+    }
+
+    candidates->sorted = false;
+
+    if (ctx) {
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
+
+void llama_sample_repetition_penalties_counts(
+            struct llama_context * ctx,
+          llama_token_data_array * candidates,
+               const llama_token * tokens,
+                   const int32_t * counts,
+                          size_t   n_tokens,
+                           float   penalty_repeat,
+                           float   penalty_freq,
+                           float   penalty_present) {
+    if (n_tokens == 0 || (penalty_repeat == 1.0f && penalty_freq == 0.0f && penalty_present == 0.0f)) {
+        return;
+    }
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    // candidates that have not been filtered or reordered yet are indexed by token id
+    bool indexed = true;
+    for (size_t i = 0; i < n_tokens && indexed; ++i) {
+        indexed = tokens[i] >= 0 && (size_t) tokens[i] < candidates->size && candidates->data[tokens[i]].id == tokens[i];
+    }
+
+    if (indexed) {
+        for (size_t i = 0; i < n_tokens; ++i) {
+            if (counts[i] <= 0) {
+                continue;
+            }
+
+            llama_token_data & cur = candidates->data[tokens[i]];
+            cur.logit = llama_sample_penalize(cur.logit, counts[i], penalty_repeat, penalty_freq, penalty_present);
         }
+    } else {
+        std::unordered_map<llama_token, int> token_count;
+        for (size_t i = 0; i < n_tokens; ++i) {
+            if (counts[i] > 0) {
+                token_count[tokens[i]] += counts[i];
+            }
+        }
+
+        for (size_t i = 0; i < candidates->size; ++i) {
+            const auto token_iter = token_count.find(candidates->data[i].id);
+            if (token_iter == token_count.end()) {
+                continue;
+            }
 
-        candidates->data[i].logit -= float(count) * penalty_freq + float(count > 0) * penalty_present;
+            candidates->data[i].logit = llama_sample_penalize(candidates->data[i].logit, token_iter->second, penalty_repeat, penalty_freq, penalty_present);
+        }
     }
 
     candidates->sorted = false;
@@ -13615,6 +15217,94 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
         }
     }
 
+    // state whose verdicts are remembered for the candidates checked below
+    int32_t id_state_recent = -1;
+
+    if (grammar->partial_utf8.n_remain == 0) {
+        llama_grammar_compiled & compiled = *grammar->compiled;
+
+        llama_grammar_automaton * automaton;
+        int32_t                   id_state;
+        llama_grammar_mask_ptr    mask;
+        bool                      use_mask;
+        {
+            std::lock_guard<std::mutex> lock(compiled.mutex);
+
+            automaton = &compiled.automata[ctx->model.vocab.fingerprint];
+            id_state  = llama_grammar_automaton_state(*automaton, grammar->stacks);
+            if (id_state >= 0) {
+                auto & state = automaton->states[id_state];
+                if (state.mask) {
+                    mask         = state.mask;
+                    state.t_used = ++automaton->n_used;
+                }
+            }
+
+            use_mask = mask || llama_grammar_use_mask(*automaton, grammar->stacks, candidates->size);
+
+            // a few candidates (e.g. a token sampled before applying the grammar) can often be decided by the tokens
+            // that have been checked in this state before
+            if (!use_mask && id_state >= 0 && candidates->size <= LLAMA_GRAMMAR_MAX_RECENT) {
+                const auto & state = automaton->states[id_state];
+
+                bool known = true;
+                for (size_t i = 0; i < candidates->size && known; ++i) {
+                    const llama_token id = candidates->data[i].id;
+                    known = llama_token_is_eog(&ctx->model, id) || llama_grammar_state_allows(state, id) >= 0;
+                }
+
+                if (known) {
+                    for (size_t i = 0; i < candidates->size; ++i) {
+                        const llama_token id = candidates->data[i].id;
+
+                        if (llama_token_is_eog(&ctx->model, id)) {
+                            if (!allow_eog) {
+                                candidates->data[i].logit = -INFINITY;
+                            }
+                        } else if (llama_grammar_state_allows(state, id) == 0) {
+                            candidates->data[i].logit = -INFINITY;
+                        }
+                    }
+
+                    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    return;
+                }
+
+                id_state_recent = id_state;
+            }
+        }
+
+        if (use_mask) {
+            if (!mask) {
+                // the trie walks run without the lock
+                mask = llama_grammar_get_mask(ctx->model, compiled, *automaton, grammar->stacks);
+                if (id_state >= 0) {
+                    {
+                        std::lock_guard<std::mutex> lock(compiled.mutex);
+                        llama_grammar_set_state_mask(compiled, *automaton, id_state, mask);
+                    }
+                    llama_grammar_registry_trim();
+                }
+            }
+
+            const uint32_t * bits = mask->data();
+            for (size_t i = 0; i < candidates->size; ++i) {
+                const llama_token id = candidates->data[i].id;
+
+                if (llama_token_is_eog(&ctx->model, id)) {
+                    if (!allow_eog) {
+                        candidates->data[i].logit = -INFINITY;
+                    }
+                } else if (!(bits[id >> 5] & (1u << (id & 31)))) {
+                    candidates->data[i].logit = -INFINITY;
+                }
+            }
+
+            ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+            return;
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(candidates->size);
     std::vector<llama_grammar_candidate>                              candidates_grammar;
@@ -13641,6 +15331,27 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
         candidates->data[reject.index].logit = -INFINITY;
     }
 
+    if (id_state_recent >= 0) {
+        std::vector<bool> allowed(candidates->size, false);
+        for (const auto & candidate : candidates_grammar) {
+            allowed[candidate.index] = true;
+        }
+        for (const auto & reject : rejects) {
+            allowed[reject.index] = false;
+        }
+
+        llama_grammar_compiled & compiled = *grammar->compiled;
+        std::lock_guard<std::mutex> lock(compiled.mutex);
+
+        auto & state = compiled.automata[ctx->model.vocab.fingerprint].states[id_state_recent];
+        for (size_t i = 0; i < candidates->size; ++i) {
+            const llama_token id = candidates->data[i].id;
+            if (!llama_token_is_eog(&ctx->model, id)) {
+                llama_grammar_state_remember(state, id, allowed[i]);
+            }
+        }
+    }
+
     ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
 }
 
@@ -13826,6 +15537,26 @@ void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar
         GGML_ASSERT(false);
     }
 
+    // on a code point boundary, follow the transition of the automaton if the token was accepted from here before
+    int32_t id_state = -1;
+    if (grammar->partial_utf8.n_remain == 0) {
+        std::lock_guard<std::mutex> lock(grammar->compiled->mutex);
+
+        auto & automaton = grammar->compiled->automata[ctx->model.vocab.fingerprint];
+        id_state = llama_grammar_automaton_state(automaton, grammar->stacks);
+
+        if (id_state >= 0) {
+            const auto & next = automaton.states[id_state].next;
+            const auto it = next.find(token);
+            if (it != next.end()) {
+                grammar->stacks = automaton.states[it->second].stacks;
+
+                ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+                return;
+            }
+        }
+    }
+
     const std::string piece = llama_token_to_piece(ctx, token, false);
 
     // Note terminating 0 in decoded string
@@ -13834,11 +15565,21 @@ void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar
     std::vector<std::vector<const llama_grammar_element *>> tmp_new_stacks;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
         llama_grammar_accept(grammar->rules, grammar->stacks, *it, tmp_new_stacks);
-        grammar->stacks = tmp_new_stacks;
+        grammar->stacks.swap(tmp_new_stacks);
     }
     grammar->partial_utf8 = decoded.second;
     GGML_ASSERT(!grammar->stacks.empty());
 
+    if (id_state >= 0 && grammar->partial_utf8.n_remain == 0) {
+        std::lock_guard<std::mutex> lock(grammar->compiled->mutex);
+
+        auto & automaton = grammar->compiled->automata[ctx->model.vocab.fingerprint];
+        const int32_t id_next = llama_grammar_automaton_state(automaton, grammar->stacks);
+        if (id_next >= 0) {
+            automaton.states[id_state].next[token] = id_next;
+        }
+    }
+
     ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
 }
 
@@ -15246,6 +16987,8 @@ struct llama_context_params llama_context_default_params() {
         /*.flash_attn                  =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
+        /*.n_top_k                     =*/ 0,
+        /*.top_k_temp                  =*/ 1.0f,
     };
 
     return result;
@@ -15408,6 +17151,8 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.n_top_k          = std::min(params.n_top_k, (uint32_t) hparams.n_vocab);
+    cparams.top_k_temp       = params.top_k_temp > 0.0f ? params.top_k_temp : 1.0f;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -15755,6 +17500,10 @@ uint32_t llama_n_seq_max(const struct llama_context * ctx) {
     return ctx->kv_self.size;
 }
 
+uint32_t llama_n_top_k(const struct llama_context * ctx) {
+    return ctx->cparams.n_top_k;
+}
+
 enum llama_vocab_type llama_vocab_type(const struct llama_model * model) {
     return model->vocab.type;
 }
@@ -17253,6 +19002,12 @@ int32_t llama_decode(
 void llama_synchronize(struct llama_context * ctx) {
     ggml_backend_sched_synchronize(ctx->sched);
 
+    // nothing was queued since the last synchronization, leave the context untouched so that
+    // the outputs can be read from several threads at once (see llama_sampling_sample_batch)
+    if (ctx->n_queued_tokens == 0) {
+        return;
+    }
+
     // FIXME: if multiple single tokens are evaluated without a synchronization,
     // the stats will be added to the prompt evaluation stats
     // this should only happen when using batch size 1 to evaluate a batch
@@ -17320,6 +19075,53 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     }
 }
 
+int32_t llama_get_top_k_ith(struct llama_context * ctx, int32_t i, llama_token_data * data) {
+    int32_t j = -1;
+    llama_synchronize(ctx);
+
+    try {
+        if (ctx->top_k_ids == nullptr) {
+            throw std::runtime_error("no top-k");
+        }
+
+        if (i < 0) {
+            j = ctx->n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", ctx->n_outputs));
+            }
+        } else if ((size_t) i >= ctx->output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %lu)", ctx->output_ids.size()));
+        } else {
+            j = ctx->output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= ctx->n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, ctx->n_outputs));
+        }
+
+        const int32_t n_top_k = ctx->cparams.n_top_k;
+
+        const int32_t * ids   = ctx->top_k_ids   + j*n_top_k;
+        const float   * probs = ctx->top_k_probs + j*n_top_k;
+
+        for (int32_t k = 0; k < n_top_k; k++) {
+            data[k] = { ids[k], logf(probs[k]), probs[k] };
+        }
+
+        return n_top_k;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid top-k id %d, reason: %s\n", __func__, i, err.what());
+#ifndef NDEBUG
+        GGML_ASSERT(false);
+#endif
+        return -1;
+    }
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     llama_synchronize(ctx);
 
@@ -17378,7 +19180,7 @@ float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id
 
 const char * llama_token_get_text(const struct llama_model * model, llama_token token) {
     GGML_ASSERT(model->vocab.type != LLAMA_VOCAB_TYPE_NONE);
-    return model->vocab.id_to_token[token].text.c_str();
+    return model->vocab.texts.c_str(token);
 }
 
 float llama_token_get_score(const struct llama_model * model, llama_token token) {
@@ -17450,7 +19252,19 @@ int32_t llama_tokenize(
                      int32_t   n_tokens_max,
                         bool   add_special,
                         bool   parse_special) {
-    auto res = llama_tokenize_internal(model->vocab, std::string(text, text_len), add_special, parse_special);
+    return llama_tokenize_parallel(model, text, text_len, tokens, n_tokens_max, add_special, parse_special, 1);
+}
+
+int32_t llama_tokenize_parallel(
+    const struct llama_model * model,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    auto res = llama_tokenize_internal(model->vocab, std::string(text, text_len), add_special, parse_special, n_threads);
 
     if (n_tokens_max < (int) res.size()) {
         // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
@@ -17464,6 +19278,95 @@ int32_t llama_tokenize(
     return res.size();
 }
 
+int32_t llama_tokenize_batch(
+    const struct llama_model * model,
+          const char * const * texts,
+               const int32_t * text_lens,
+                     int32_t   n_texts,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                     int32_t * offsets,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    std::vector<std::vector<llama_vocab::id>> res(n_texts);
+
+    llama_tokenize_parallel_for(n_threads, n_texts, [&](size_t i) {
+        res[i] = llama_tokenize_internal(model->vocab, std::string(texts[i], text_lens[i]), add_special, parse_special, 1);
+    });
+
+    int64_t n_tokens = 0;
+    offsets[0] = 0;
+    for (int32_t i = 0; i < n_texts; i++) {
+        n_tokens += res[i].size();
+        GGML_ASSERT(n_tokens <= INT32_MAX);
+        offsets[i + 1] = n_tokens;
+    }
+
+    if (n_tokens_max < n_tokens) {
+        return -((int32_t) n_tokens);
+    }
+
+    for (int32_t i = 0; i < n_texts; i++) {
+        std::copy(res[i].begin(), res[i].end(), tokens + offsets[i]);
+    }
+
+    return n_tokens;
+}
+
+struct llama_tokenizer_stream * llama_tokenizer_stream_init(
+        const struct llama_model * model,
+                            bool   add_special,
+                            bool   parse_special) {
+    return new llama_tokenizer_stream(model->vocab, add_special, parse_special);
+}
+
+void llama_tokenizer_stream_free(struct llama_tokenizer_stream * stream) {
+    delete stream;
+}
+
+int32_t llama_tokenizer_stream_feed(
+    struct llama_tokenizer_stream * stream,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max) {
+    GGML_ASSERT(!stream->finished);
+
+    stream->text.append(text, text_len);
+
+    if (stream->can_cut) {
+        // the last cut in the text that was not searched yet - one at the very end needs the next byte, and is found with it
+        size_t cut = 0;
+        for (size_t pos = stream->text.size(); pos-- > std::max<size_t>(stream->n_searched, 2); ) {
+            if (tokenizer_can_cut(stream->text, pos)) {
+                cut = pos;
+                break;
+            }
+        }
+        stream->n_searched = stream->text.size();
+
+        if (cut > 0) {
+            llama_tokenizer_stream_flush(*stream, cut);
+        }
+    }
+
+    return llama_tokenizer_stream_take(*stream, tokens, n_tokens_max);
+}
+
+int32_t llama_tokenizer_stream_finish(
+    struct llama_tokenizer_stream * stream,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max) {
+    if (!stream->finished) {
+        llama_tokenizer_stream_flush(*stream, stream->text.size());
+        llama_tokenize_add_eos(stream->vocab, stream->add_special, stream->tokens);
+        stream->finished = true;
+    }
+
+    return llama_tokenizer_stream_take(*stream, tokens, n_tokens_max);
+}
+
 static std::string llama_decode_text(const std::string & text) {
     std::string decoded_text;
     auto unicode_sequences = unicode_cpts_from_utf8(text);
@@ -17474,74 +19377,173 @@ static std::string llama_decode_text(const std::string & text) {
     return decoded_text;
 }
 
-// does not write null-terminator to buf
-int32_t llama_token_to_piece(const struct llama_model * model, llama_token token, char * buf, int32_t length, bool special) {
-    if (0 <= token && token < llama_n_vocab(model)) {
-        switch (llama_vocab_get_type(model->vocab)) {
+// renders the piece of every token once, so that llama_token_to_piece is a lookup
+static void llama_vocab_build_pieces(llama_vocab & vocab) {
+    const int32_t n_vocab = (int32_t) vocab.id_to_token.size();
+
+    vocab.piece_data.clear();
+    vocab.piece_offsets.assign(1, 0);
+
+    for (llama_token token = 0; token < n_vocab; ++token) {
+        std::string piece;
+
+        switch (llama_vocab_get_type(vocab)) {
         case LLAMA_VOCAB_TYPE_WPM:
         case LLAMA_VOCAB_TYPE_SPM: {
             // NOTE: we accept all unsupported token types,
             // suppressing them like CONTROL tokens.
-            if (llama_is_normal_token(model->vocab, token)) {
-                std::string result = model->vocab.id_to_token[token].text;
-                llama_unescape_whitespace(result);
-                if (length < (int) result.length()) {
-                    return -(int) result.length();
-                }
-                memcpy(buf, result.c_str(), result.length());
-                return result.length();
-            } else if (
-                    (llama_is_user_defined_token(model->vocab, token)) ||
-                    (llama_is_control_token     (model->vocab, token) && special)) {
-                std::string result = model->vocab.id_to_token[token].text;
-                if (length < (int) result.length()) {
-                    return -(int) result.length();
-                }
-                memcpy(buf, result.c_str(), result.length());
-                return result.length();
-            } else if (llama_is_unknown_token(model->vocab, token)) { // NOLINT
-                if (length < 3) {
-                    return -3;
-                }
-                memcpy(buf, "\xe2\x96\x85", 3);
-                return 3;
-            } else if (llama_is_byte_token(model->vocab, token)) {
-                if (length < 1) {
-                    return -1;
-                }
-                buf[0] = llama_token_to_byte(model->vocab, token);
-                return 1;
+            if (llama_is_normal_token(vocab, token)) {
+                piece = vocab.texts.str(token);
+                llama_unescape_whitespace(piece);
+            } else if (llama_is_user_defined_token(vocab, token) || llama_is_control_token(vocab, token)) {
+                piece = vocab.texts.str(token);
+            } else if (llama_is_unknown_token(vocab, token)) { // NOLINT
+                piece = "\xe2\x96\x85";
+            } else if (llama_is_byte_token(vocab, token)) {
+                piece = std::string(1, llama_token_to_byte(vocab, token));
             }
             break;
         }
         case LLAMA_VOCAB_TYPE_BPE: {
             // NOTE: we accept all unsupported token types,
             // suppressing them like CONTROL tokens.
-            if (llama_is_normal_token(model->vocab, token)) {
-                std::string result = model->vocab.id_to_token[token].text;
-                result = llama_decode_text(result);
-                if (length < (int) result.length()) {
-                    return -(int) result.length();
-                }
-                memcpy(buf, result.c_str(), result.length());
-                return result.length();
-            } else if (
-                    (llama_is_user_defined_token(model->vocab, token)) ||
-                    (llama_is_control_token     (model->vocab, token) && special)) {
-                std::string result = model->vocab.id_to_token[token].text;
-                if (length < (int) result.length()) {
-                    return -(int) result.length();
-                }
-                memcpy(buf, result.c_str(), result.length());
-                return result.length();
+            if (llama_is_normal_token(vocab, token)) {
+                piece = llama_decode_text(vocab.texts.str(token));
+            } else if (llama_is_user_defined_token(vocab, token) || llama_is_control_token(vocab, token)) {
+                piece = vocab.texts.str(token);
             }
             break;
         }
         default:
-            GGML_ASSERT(false);
+            break;
         }
+
+        vocab.piece_data.insert(vocab.piece_data.end(), piece.begin(), piece.end());
+        vocab.piece_offsets.push_back(vocab.piece_data.size());
     }
-    return 0;
+}
+
+// does not write null-terminator to buf
+int32_t llama_token_to_piece(const struct llama_model * model, llama_token token, char * buf, int32_t length, bool special) {
+    const llama_vocab & vocab = model->vocab;
+
+    if (token < 0 || token >= (llama_token) vocab.piece_offsets.size() - 1) {
+        return 0;
+    }
+
+    GGML_ASSERT(llama_vocab_get_type(vocab) != LLAMA_VOCAB_TYPE_NONE);
+
+    if (!special && llama_is_control_token(vocab, token)) {
+        return 0;
+    }
+
+    const int32_t size = vocab.piece_offsets[token + 1] - vocab.piece_offsets[token];
+    if (length < size) {
+        return -size;
+    }
+    memcpy(buf, vocab.piece_data.data() + vocab.piece_offsets[token], size);
+    return size;
+}
+
+static void llama_vocab_trie_collect(const llama_vocab_trie & trie, uint32_t inode, std::vector<llama_token> & res) {
+    const llama_vocab_trie::node & node = trie.nodes[inode];
+
+    res.insert(res.end(), trie.tokens.begin() + node.token_begin, trie.tokens.begin() + node.token_end);
+    for (uint32_t i = node.partial_begin; i < node.partial_end; ++i) {
+        res.push_back(trie.partials[i].id);
+    }
+
+    for (uint32_t i = node.edge_begin; i < node.edge_end; ++i) {
+        llama_vocab_trie_collect(trie, trie.edges[i].child, res);
+    }
+}
+
+int32_t llama_token_prefix_candidates(
+    const struct llama_model * model,
+                  const char * prefix,
+                     int32_t   prefix_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max) {
+    const std::string text(prefix, prefix_len);
+
+    std::vector<char> buf(64);
+    auto piece_of = [&](llama_token id) {
+        int32_t n = llama_token_to_piece(model, id, buf.data(), buf.size(), false);
+        if (n < 0) {
+            buf.resize(-n);
+            n = llama_token_to_piece(model, id, buf.data(), buf.size(), false);
+        }
+        return std::string(buf.data(), n);
+    };
+
+    // a piece that is a prefix of the text, or that the text is a prefix of
+    auto consistent = [&](const std::string & piece) {
+        const size_t n = std::min(piece.size(), text.size());
+        return !piece.empty() && piece.compare(0, n, text, 0, n) == 0;
+    };
+
+    // the same tokens as in the trie
+    auto includes = [&](llama_token id, const std::string & piece) {
+        return llama_vocab_trie_includes(*model, id, piece) && consistent(piece);
+    };
+
+    std::vector<llama_token> res;
+
+    auto decoded = decode_utf8(text, { 0, 0 });
+    if (text.empty() || decoded.second.n_remain != 0) {
+        // the text ends within a code point (or is not valid UTF-8), which the trie does not branch on - compare the
+        // pieces instead
+        const int32_t n_vocab = (int32_t) model->vocab.id_to_token.size();
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (includes(id, piece_of(id))) {
+                res.push_back(id);
+            }
+        }
+    } else {
+        const llama_vocab_trie & trie = llama_vocab_get_trie(*model);
+
+        decoded.first.pop_back(); // terminating 0
+
+        uint32_t inode = 0;
+        bool     found = true;
+        for (size_t k = 0; k < decoded.first.size() && found; ++k) {
+            const llama_vocab_trie::node & node = trie.nodes[inode];
+
+            // tokens that end on the way are prefixes of the text, unless they end within the next code point
+            res.insert(res.end(), trie.tokens.begin() + node.token_begin, trie.tokens.begin() + node.token_end);
+            for (uint32_t i = node.partial_begin; i < node.partial_end; ++i) {
+                if (consistent(piece_of(trie.partials[i].id))) {
+                    res.push_back(trie.partials[i].id);
+                }
+            }
+
+            const auto * begin = trie.edges.data() + node.edge_begin;
+            const auto * end   = trie.edges.data() + node.edge_end;
+            const auto * edge  = std::lower_bound(begin, end, decoded.first[k], [](const llama_vocab_trie::edge & e, uint32_t cpt) {
+                return e.cpt < cpt;
+            });
+
+            found = edge != end && edge->cpt == decoded.first[k];
+            if (found) {
+                inode = edge->child;
+            }
+        }
+
+        if (found) {
+            // the pieces of all tokens below the node of the text start with it
+            llama_vocab_trie_collect(trie, inode, res);
+        }
+
+        std::sort(res.begin(), res.end());
+    }
+
+    if ((int32_t) res.size() > n_tokens_max) {
+        return -((int32_t) res.size());
+    }
+
+    std::copy(res.begin(), res.end(), tokens);
+
+    return res.size();
 }
 
 // trim whitespace from the beginning and end of a string
@@ -17831,7 +19833,7 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.t_p_eval_ms =*/ 1e-3 * ctx->t_p_eval_us,
         /*.t_eval_ms   =*/ 1e-3 * ctx->t_eval_us,
 
-        /*.n_sample =*/ std::max(1, ctx->n_sample),
+        /*.n_sample =*/ std::max(1, ctx->n_sample.load()),
         /*.n_p_eval =*/ std::max(1, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
     };
@@ -17905,11 +19907,11 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
             1.0e-3 * ctx->t_sample_us / ctx->n_sample);
     fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", ctx->n_eval);
     fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", ctx->n_p_eval);
-    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample);
+    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample.load());
     fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", ctx->t_eval_us);
     fprintf(stream, "t_load_us: %" PRId64 "  # total microseconds spent loading the model\n", ctx->t_load_us);
     fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", ctx->t_p_eval_us);
-    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us);
+    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us.load());
     fprintf(stream, "ts_eval: %.2f  # tokens / second during generation\n",
             1.0e6 * ctx->n_eval / ctx->t_eval_us);
     fprintf(stream, "ts_p_eval: %.2f  # tokens / second during prompt processing\n",
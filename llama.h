@@ -38,6 +38,7 @@
 #define LLAMA_FILE_MAGIC_GGLA 0x67676c61u // 'ggla'
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
+#define LLAMA_FILE_MAGIC_GGGC 0x67676763u // 'gggc'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION 6
@@ -45,6 +46,9 @@
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
 #define LLAMA_STATE_SEQ_VERSION 1
 
+#define LLAMA_GRAMMAR_CACHE_MAGIC   LLAMA_FILE_MAGIC_GGGC
+#define LLAMA_GRAMMAR_CACHE_VERSION 1
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -57,6 +61,7 @@ extern "C" {
 
     struct llama_model;
     struct llama_context;
+    struct llama_tokenizer_stream;
 
     typedef int32_t llama_pos;
     typedef int32_t llama_token;
@@ -294,6 +299,10 @@ extern "C" {
         // currently works only with CPU execution
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        uint32_t n_top_k;    // if > 0, compute only the top-k token probabilities of each output on the graph
+                             // instead of returning the logits (see llama_get_top_k_ith)
+        float    top_k_temp; // temperature of the n_top_k probabilities, <= 0 = 1.0
     };
 
     // model quantization parameters
@@ -408,6 +417,7 @@ extern "C" {
     LLAMA_API uint32_t llama_n_batch    (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
+    LLAMA_API uint32_t llama_n_top_k    (const struct llama_context * ctx);
 
     LLAMA_API enum llama_pooling_type llama_pooling_type(const struct llama_context * ctx);
 
@@ -759,6 +769,8 @@ extern "C" {
     // Wait until all computations are finished
     // This is automatically done when using one of the functions below to obtain the computation results
     // and is not necessary to call it explicitly in most cases
+    // Once it has returned, the outputs may be read from several threads at once (llama_get_logits_ith etc.) as long as
+    // no llama_decode() is issued on the same context until all of the readers are done
     LLAMA_API void llama_synchronize(struct llama_context * ctx);
 
     // Token logits obtained from the last call to llama_decode()
@@ -774,6 +786,13 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Top-k tokens of the ith output, most likely first, when llama_context_params.n_top_k > 0.
+    // In that case only these are copied from the graph and llama_get_logits returns NULL.
+    // data must hold n_top_k entries. p is the probability over the full vocab at top_k_temp and logit is log(p),
+    // so the array can be passed on to the llama_sample_* functions.
+    // Returns the number of entries written, or -1 for invalid ids.
+    LLAMA_API int32_t llama_get_top_k_ith(struct llama_context * ctx, int32_t i, llama_token_data * data);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -845,6 +864,67 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Same as llama_tokenize, with the text tokenized on n_threads threads when it is long enough. The text
+    ///          is only cut at points where every token of the result stays the same, so the tokens are always
+    ///          identical to those of llama_tokenize.
+    LLAMA_API int32_t llama_tokenize_parallel(
+        const struct llama_model * model,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
+    /// @details Tokenizes n_texts texts on n_threads threads, e.g. the many short inputs of an embedding request. The tokens
+    ///          of texts[i] are identical to those of llama_tokenize, and are written to tokens[offsets[i], offsets[i + 1]).
+    /// @param offsets Array of n_texts + 1 elements, written even if the tokens do not fit
+    /// @return Returns the total number of tokens, no more than n_tokens_max
+    /// @return Returns a negative number if they do not fit - the total number of tokens that would have been written
+    LLAMA_API int32_t llama_tokenize_batch(
+        const struct llama_model * model,
+              const char * const * texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * offsets,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
+    /// @details Incremental tokenization of a text that arrives in chunks, e.g. a long prompt whose first tokens are
+    ///          evaluated while the rest is tokenized. The tokens of the text fed so far are returned as soon as no later
+    ///          text can change them: up to the last point where llama_tokenize_parallel could cut the text. The tail
+    ///          after it is held back until more text is fed or the text ends - texts without such points (or vocabs
+    ///          that cannot be cut at all) are only tokenized at the end. All the tokens returned are identical to
+    ///          those of llama_tokenize of the whole text.
+    LLAMA_API struct llama_tokenizer_stream * llama_tokenizer_stream_init(
+              const struct llama_model * model,
+                                  bool   add_special,
+                                  bool   parse_special);
+
+    LLAMA_API void llama_tokenizer_stream_free(struct llama_tokenizer_stream * stream);
+
+    /// @details Appends text to the stream, and writes the tokens that became final.
+    /// @return Returns the number of tokens written, no more than n_tokens_max
+    /// @return Returns a negative number if they do not fit - the number of tokens that would have been written. None are
+    ///         written, and the next call (which can pass an empty text) returns them.
+    LLAMA_API int32_t llama_tokenizer_stream_feed(
+         struct llama_tokenizer_stream * stream,
+                            const char * text,
+                               int32_t   text_len,
+                           llama_token * tokens,
+                               int32_t   n_tokens_max);
+
+    /// @details Ends the text, and writes the tokens that were held back, followed by EOS if add_special. Returns the
+    ///          same as llama_tokenizer_stream_feed, and can be called again when the tokens did not fit.
+    LLAMA_API int32_t llama_tokenizer_stream_finish(
+         struct llama_tokenizer_stream * stream,
+                           llama_token * tokens,
+                               int32_t   n_tokens_max);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -857,6 +937,19 @@ extern "C" {
                                int32_t   length,
                                   bool   special);
 
+    /// @details Tokens that can start a text beginning with `prefix`: those whose piece starts with the prefix, and those whose
+    /// piece is a non-empty prefix of it (e.g. to regenerate the text of prompt tokens removed for token healing).
+    /// Found through the codepoint trie of the vocab: EOG and control tokens, and tokens whose piece is empty or not valid
+    /// UTF-8 (it may end within a code point) are never returned.
+    /// @return Returns the number of tokens on success, no more than n_tokens_max
+    /// @return Returns a negative number on failure - the number of tokens that would have been returned
+    LLAMA_API int32_t llama_token_prefix_candidates(
+              const struct llama_model * model,
+                            const char * prefix,
+                               int32_t   prefix_len,
+                           llama_token * tokens,
+                               int32_t   n_tokens_max);
+
     /// Apply chat template. Inspired by hf apply_chat_template() on python.
     /// Both "model" and "custom_template" are optional, but at least one is required. "custom_template" has higher precedence than "model"
     /// NOTE: This function does not use a jinja parser. It only support a pre-defined list of template. See more: https://github.com/ggerganov/llama.cpp/wiki/Templates-supported-by-llama_chat_apply_template
@@ -889,6 +982,18 @@ extern "C" {
 
     LLAMA_API struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar);
 
+    /// @details Grammars built from the same rules share a token-level automaton per vocab, which is compiled lazily
+    ///          while they are sampled. Save the automata compiled so far for the vocab of `model` to a file, so that
+    ///          another process can start from them with llama_grammar_cache_load_file.
+    LLAMA_API bool llama_grammar_cache_save_file(
+            const struct llama_model * model,
+                          const char * path);
+
+    /// @details Load automata saved by llama_grammar_cache_save_file. Fails if the file was saved for a different vocab.
+    LLAMA_API bool llama_grammar_cache_load_file(
+            const struct llama_model * model,
+                          const char * path);
+
     //
     // Sampling functions
     //
@@ -907,6 +1012,18 @@ extern "C" {
                            float   penalty_freq,
                            float   penalty_present);
 
+    /// @details Same as llama_sample_repetition_penalties, with the penalized tokens already counted: the distinct tokens[i] occurs counts[i] times
+    /// in the last penalty_last_n tokens. The cost only depends on n_tokens when the candidates are still indexed by token id.
+    LLAMA_API void llama_sample_repetition_penalties_counts(
+            struct llama_context * ctx,
+          llama_token_data_array * candidates,
+               const llama_token * tokens,
+                   const int32_t * counts,
+                          size_t   n_tokens,
+                           float   penalty_repeat,
+                           float   penalty_freq,
+                           float   penalty_present);
+
     /// @details Apply classifier-free guidance to the logits as described in academic paper "Stay on topic with Classifier-Free Guidance" https://arxiv.org/abs/2306.17806
     /// @param logits Logits extracted from the original generation context.
     /// @param logits_guidance Logits extracted from a separate context from the same model. Other than a negative prompt at the beginning, it should have all generated and user input tokens copied from the main context.
@@ -1095,8 +1212,11 @@ extern "C" {
 // Internal API to be implemented by llama.cpp and used by tests/benchmarks only
 #ifdef LLAMA_API_INTERNAL
 
+#include <functional>
+#include <memory>
 #include <random>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct ggml_tensor;
@@ -1106,8 +1226,23 @@ struct llama_partial_utf8 {
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
 };
 
+// hash of a grammar stack, used to deduplicate stacks and to key per-stack caches
+struct llama_grammar_stack_hash {
+    size_t operator()(const std::vector<const llama_grammar_element *> & stack) const {
+        size_t seed = stack.size();
+        for (const llama_grammar_element * pos : stack) {
+            seed ^= std::hash<const llama_grammar_element *>()(pos) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        }
+        return seed;
+    }
+};
+
+// rules and token-level automata shared by all grammars built from the same rules, see llama_grammar_init
+struct llama_grammar_compiled;
+
 struct llama_grammar {
-    const std::vector<std::vector<llama_grammar_element>>   rules;
+    const std::shared_ptr<llama_grammar_compiled>           compiled;
+    const std::vector<std::vector<llama_grammar_element>> & rules; // owned by compiled
     std::vector<std::vector<const llama_grammar_element *>> stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
@@ -7,11 +7,15 @@
 #include "ggml.h"
 #include "llama.h"
 #include "grammar-parser.h"
+#include "json-schema-to-grammar.h"
 #include "unicode.h"
 #include <cassert>
+#include <chrono>
 #include <string>
 #include <vector>
 
+using json = nlohmann::ordered_json;
+
 static llama_grammar* build_grammar(const std::string & grammar_str) {
     auto parsed_grammar = grammar_parser::parse(grammar_str.c_str());
 
@@ -281,6 +285,128 @@ static void test_quantifiers() {
     );
 }
 
+static void test_nullable_repetition() {
+    // repetitions of rules that can match the empty string reach the same stacks along many paths
+    test_grammar(
+        "nullable repetition",
+        // Grammar
+        R"""(
+            root ::= (" "? "a"?)* "b" ws
+            ws ::= ([ \t\n] ws)? ws?
+            )""",
+        // Passing strings
+        {
+            "b",
+            " b",
+            "a b",
+            "  aa  a b",
+            "b \n\t ",
+        },
+        // Failing strings
+        {
+            "",
+            "a",
+            "ba",
+            "a b b",
+        }
+    );
+}
+
+static void benchmark_grammar(const std::string & desc, const std::string & grammar_str, const std::string & input) {
+    auto grammar = build_grammar(grammar_str);
+
+    const auto decoded = decode_utf8(input, {});
+    const auto & code_points = decoded.first;
+
+    size_t n_stacks_max = grammar->stacks.size();
+
+    std::vector<std::vector<const llama_grammar_element *>> new_stacks;
+
+    const auto t_start = std::chrono::high_resolution_clock::now();
+
+    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
+        llama_grammar_accept(grammar->rules, grammar->stacks, *it, new_stacks);
+        grammar->stacks.swap(new_stacks);
+        assert(!grammar->stacks.empty());
+
+        n_stacks_max = std::max(n_stacks_max, grammar->stacks.size());
+    }
+
+    const auto t_end = std::chrono::high_resolution_clock::now();
+
+    bool completed = false;
+    for (const auto & stack : grammar->stacks) {
+        completed = completed || stack.empty();
+    }
+    assert(completed);
+
+    const double t_us = std::chrono::duration<double, std::micro>(t_end - t_start).count();
+
+    fprintf(stderr, "⚫ Benchmark %s: %zu code points, %.2f us per code point, max %zu stacks\n",
+            desc.c_str(), code_points.size() - 1, t_us / (code_points.size() - 1), n_stacks_max);
+
+    llama_grammar_free(grammar);
+}
+
+static void benchmark_worst_case_schemas() {
+    // optional properties with bounded repetitions, which json_schema_to_grammar expands into deeply nested optionals
+    {
+        const json schema = json::parse(R"""({
+            "type": "object",
+            "properties": {
+                "a": {"type": "string", "maxLength": 40},
+                "b": {"type": "number"},
+                "c": {"type": "array", "items": {"type": "integer"}, "maxItems": 20},
+                "d": {"type": "string", "pattern": "^([a-z]+ ?){0,10}$"},
+                "e": {"type": "boolean"},
+                "f": {"type": "array", "items": {"type": "string", "maxLength": 8}, "maxItems": 8}
+            }
+        })""");
+
+        std::string input = R"""({ "a": "the quick brown fox jumps over the dog", "b": -123456789012345.123456789012345e-10, "c": [)""";
+        for (int i = 0; i < 20; i++) {
+            input += (i > 0 ? ", " : "") + std::to_string(100000*i + 7);
+        }
+        input += R"""(], "d": "a bb ccc dddd eeeee ffffff g h i j", "e": false, "f": ["abcdefgh", "", "a b c d ", "x"] })""";
+
+        benchmark_grammar("optional properties", json_schema_to_grammar(schema), input);
+    }
+
+    // a large enum with a shared prefix, which keeps one stack alive per value until the values diverge
+    {
+        json values = json::array();
+        for (int i = 0; i < 2000; i++) {
+            values.push_back("property-name-" + std::to_string(1000000 + 7*i));
+        }
+        const json schema = { {"type", "array"}, {"items", { {"enum", values} }} };
+
+        std::string input = "[";
+        for (int i = 0; i < 20; i++) {
+            input += (i > 0 ? ", \"" : "\"") + values[(i*97) % values.size()].get<std::string>() + "\"";
+        }
+        input += "]";
+
+        benchmark_grammar("large enum", json_schema_to_grammar(schema), input);
+    }
+
+    // ambiguous whitespace between tokens, where every position can be matched by several `ws` rules
+    {
+        const std::string grammar_str = R"""(
+            root  ::= "[" ws ws ( item ws ws ( "," ws ws item ws ws )* )? "]" ws
+            item  ::= [0-9]+ ws ws "x"? ws
+            ws    ::= ([ \t\n] ws)?
+            )""";
+
+        std::string input = "[";
+        for (int i = 0; i < 200; i++) {
+            input += (i > 0 ? " \n ,  " : "  ") + std::to_string(i) + "  x \t ";
+        }
+        input += "]\n";
+
+        benchmark_grammar("ambiguous whitespace", grammar_str, input);
+    }
+}
+
 static void test_failure_missing_root() {
     fprintf(stderr, "⚫ Testing missing root node:\n");
     // Test case for a grammar that is missing a root rule
@@ -325,8 +451,10 @@ int main() {
     test_simple_grammar();
     test_complex_grammar();
     test_quantifiers();
+    test_nullable_repetition();
     test_failure_missing_root();
     test_failure_missing_reference();
+    benchmark_worst_case_schemas();
     fprintf(stdout, "All tests passed.\n");
     return 0;
 }
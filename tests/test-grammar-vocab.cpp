@@ -0,0 +1,292 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#define LLAMA_API_INTERNAL
+
+#include "llama.h"
+#include "grammar-parser.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// checks that the compiled automaton / vocab trie path of llama_sample_grammar agrees with the per-token
+// reference path on a real vocab, while walking the grammar through a pseudo-random token sequence
+
+static const char * grammars[] = {
+    // json
+    R"""(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+object ::= "{" ws ( string ":" ws value ("," ws string ":" ws value)* )? "}" ws
+array  ::= "[" ws ( value ("," ws value)* )? "]" ws
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" (["\\/bfnrt] | "u" [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F]) )* "\"" ws
+number ::= ("-"? ([0-9] | [1-9] [0-9]*)) ("." [0-9]+)? ([eE] [-+]? [0-9]+)? ws
+ws     ::= ([ \t\n] ws)?
+)""",
+    // arithmetic
+    R"""(
+root  ::= (expr "=" ws term "\n")+
+expr  ::= term ([-+*/] term)*
+term  ::= ident | num | "(" ws expr ")" ws
+ident ::= [a-z] [a-z0-9_]* ws
+num   ::= [0-9]+ ws
+ws    ::= [ \t\n]*
+)""",
+    // non-ascii and negated sets
+    R"""(
+root ::= ("héllo" | [一-鿿]+ | [^a-z\n]) [^x]* "x"
+)""",
+};
+
+static std::vector<llama_token> allowed_tokens_mask(llama_context * ctx, const llama_grammar * grammar) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    std::vector<llama_token_data> cur;
+    cur.reserve(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        cur.push_back({ id, 0.0f, 0.0f });
+    }
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+    llama_sample_grammar(ctx, &cur_p, grammar);
+
+    std::vector<llama_token> res;
+    for (const auto & td : cur) {
+        if (td.logit != -INFINITY) {
+            res.push_back(td.id);
+        }
+    }
+    return res;
+}
+
+static std::vector<llama_token> allowed_tokens_ref(llama_context * ctx, const llama_grammar * ref) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    // the reference grammar never computes masks, so small batches of candidates always go through the interpreter
+    const int n_batch = 512;
+
+    std::vector<llama_token> res;
+    std::vector<llama_token_data> cur;
+    for (llama_token id0 = 0; id0 < n_vocab; id0 += n_batch) {
+        cur.clear();
+        for (llama_token id = id0; id < std::min(id0 + n_batch, n_vocab); id++) {
+            cur.push_back({ id, 0.0f, 0.0f });
+        }
+
+        llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+        llama_sample_grammar(ctx, &cur_p, ref);
+
+        for (const auto & td : cur) {
+            if (td.logit != -INFINITY) {
+                res.push_back(td.id);
+            }
+        }
+    }
+
+    return res;
+}
+
+static void test_grammar(llama_context * ctx, const char * grammar_str, int n_steps, int seed = 0) {
+    auto parsed_grammar = grammar_parser::parse(grammar_str);
+    assert(!parsed_grammar.rules.empty());
+
+    std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
+    llama_grammar * grammar = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+
+    // an unused extra rule keeps the reference grammar from sharing the compiled automaton of `grammar`
+    const llama_grammar_element unused[] = { { LLAMA_GRETYPE_CHAR, 'x' }, { LLAMA_GRETYPE_END, 0 } };
+    grammar_rules.push_back(unused);
+    llama_grammar * ref = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+
+    const llama_model * model = llama_get_model(ctx);
+
+    for (int step = 0; step < n_steps; step++) {
+        const auto allowed     = allowed_tokens_mask(ctx, grammar);
+        const auto allowed_ref = allowed_tokens_ref(ctx, ref);
+
+        if (allowed != allowed_ref) {
+            fprintf(stderr, "%s: step %d: mask path allows %zu tokens, reference path allows %zu\n",
+                    __func__, step, allowed.size(), allowed_ref.size());
+            assert(false);
+        }
+
+        // single candidates (e.g. tokens sampled before applying the grammar) are checked without the mask, and
+        // decided by the verdicts remembered for the state on the second pass
+        for (int pass = 0; pass < 2; pass++) {
+            for (llama_token id = step; id < llama_n_vocab(model); id += 4999) {
+                llama_token_data td = { id, 0.0f, 0.0f };
+                llama_token_data_array td_p = { &td, 1, false };
+                llama_sample_grammar(ctx, &td_p, ref);
+
+                const bool is_allowed = td.logit != -INFINITY;
+                assert(is_allowed == std::binary_search(allowed.begin(), allowed.end(), id));
+            }
+        }
+
+        // pick a pseudo-random allowed token, preferring not to end the sequence
+        std::vector<llama_token> next;
+        for (const llama_token id : allowed) {
+            if (!llama_token_is_eog(model, id)) {
+                next.push_back(id);
+            }
+        }
+        if (next.empty()) {
+            break;
+        }
+
+        const llama_token token = next[(step*7919 + 13 + seed*104729) % next.size()];
+        llama_grammar_accept_token(ctx, grammar, token);
+        llama_grammar_accept_token(ctx, ref,     token);
+    }
+
+    llama_grammar_free(grammar);
+    llama_grammar_free(ref);
+}
+
+// no code point starts with a continuation byte - the piece may end within a code point
+static bool utf8_valid_prefix(const std::string & str) {
+    static const int lengths[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    for (size_t i = 0; i < str.size(); ) {
+        const int len = lengths[(uint8_t) str[i] >> 4];
+        if (len == 0) {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+// llama_token_prefix_candidates walks the same trie, or compares the pieces of the whole vocab when the prefix ends
+// within a code point - check both paths against the pieces, with the same tokens left out
+static void test_prefix_candidates(llama_context * ctx, const std::string & prefix) {
+    const llama_model * model = llama_get_model(ctx);
+
+    std::vector<llama_token> expected;
+    for (llama_token id = 0; id < llama_n_vocab(model); id++) {
+        if (llama_token_is_eog(model, id) || llama_token_get_type(model, id) == LLAMA_TOKEN_TYPE_CONTROL) {
+            continue;
+        }
+        const std::string piece = llama_token_to_piece(ctx, id, false);
+        if (piece.empty() || piece[0] == 0 || !utf8_valid_prefix(piece)) {
+            continue;
+        }
+        const size_t n = std::min(piece.size(), prefix.size());
+        if (piece.compare(0, n, prefix, 0, n) == 0) {
+            expected.push_back(id);
+        }
+    }
+
+    std::vector<llama_token> result(1);
+    int32_t n = llama_token_prefix_candidates(model, prefix.data(), prefix.size(), result.data(), result.size());
+    if (n < 0) {
+        result.resize(-n);
+        n = llama_token_prefix_candidates(model, prefix.data(), prefix.size(), result.data(), result.size());
+    }
+    result.resize(n);
+
+    if (result != expected) {
+        fprintf(stderr, "%s: prefix '%s': %zu candidates, expected %zu\n", __func__, prefix.c_str(), result.size(), expected.size());
+        assert(false);
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_model * model;
+    llama_context * ctx;
+
+    llama_backend_init();
+
+    // load the vocab
+    {
+        auto mparams = llama_model_default_params();
+
+        mparams.vocab_only = true;
+
+        model = llama_load_model_from_file(fname.c_str(), mparams);
+
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        auto cparams = llama_context_default_params();
+
+        ctx = llama_new_context_with_model(model, cparams);
+
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            llama_free_model(model);
+            return 1;
+        }
+    }
+
+    // the last ones are not valid UTF-8, the vocab has byte tokens for them
+    for (const char * prefix : { " wor", "Hel", "x", " ", "\n\n", "é", "\xe4\xb8", "一", "\xb8", "a\x80", "\xe4\xb8\x80\x80" }) {
+        test_prefix_candidates(ctx, prefix);
+    }
+
+    // the second pass follows the transitions compiled by the first one
+    for (int pass = 0; pass < 2; pass++) {
+        for (const char * grammar_str : grammars) {
+            test_grammar(ctx, grammar_str, 16);
+        }
+    }
+
+    // grammars with the same rules share the compiled automata, which several threads extend at the same time while
+    // walking different token sequences - each thread with its own context, as the server does with its slots
+    {
+        std::vector<llama_context *> ctxs;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; i++) {
+            ctxs.push_back(llama_new_context_with_model(model, llama_context_default_params()));
+            threads.emplace_back([&ctxs, i]() {
+                for (const char * grammar_str : grammars) {
+                    test_grammar(ctxs[i], grammar_str, 16, 1 + i);
+                }
+            });
+        }
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+            llama_free(ctxs[i]);
+        }
+    }
+
+    // compiled automata round-trip through the cache file
+    {
+        const char * fname_cache = "test-grammar-vocab.cache.tmp";
+
+        assert(llama_grammar_cache_save_file(model, fname_cache));
+        assert(llama_grammar_cache_load_file(model, fname_cache));
+
+        for (const char * grammar_str : grammars) {
+            test_grammar(ctx, grammar_str, 16);
+        }
+
+        std::remove(fname_cache);
+    }
+
+    llama_free_model(model);
+    llama_free(ctx);
+
+    llama_backend_free();
+
+    fprintf(stderr, "%s : tests passed\n", __func__);
+
+    return 0;
+}
@@ -1,5 +1,7 @@
 #include "ggml.h"
 #include "llama.h"
+#include "common.h"
+#include "sampling.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -7,7 +9,10 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <random>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 static void dump(const llama_token_data_array * candidates) {
@@ -230,7 +235,406 @@ static void test_sampler_queue(
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
-int main(void) {
+// large unsorted arrays take the selection / bucketed paths of top-k and top-p, compare them with a full sort
+static void test_large_vocab(const size_t n_vocab, const int top_k, const float top_p) {
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 3.0f);
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+        const float logit = token_id % 7 == 0 ? -INFINITY : dist(rng);
+        candidates.emplace_back(llama_token_data{token_id, logit, 0.0f});
+    }
+
+    std::vector<llama_token_data> expected = candidates;
+    llama_token_data_array expected_p = { expected.data(), expected.size(), false };
+    llama_sample_softmax(nullptr, &expected_p);
+
+    {
+        std::vector<llama_token_data> cur = candidates;
+        llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+        llama_sample_top_k(nullptr, &cur_p, top_k, 1);
+
+        GGML_ASSERT(cur_p.sorted);
+        GGML_ASSERT(cur_p.size == (size_t) top_k);
+        for (size_t i = 0; i < cur_p.size; i++) {
+            GGML_ASSERT(cur_p.data[i].logit == expected[i].logit);
+        }
+    }
+
+    {
+        std::vector<llama_token_data> cur = candidates;
+        llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+        llama_sample_top_p(nullptr, &cur_p, top_p, 1);
+
+        // reference nucleus, accumulated in double
+        double sum = 0.0;
+        for (const auto & td : expected) {
+            sum += exp((double) td.logit - expected[0].logit);
+        }
+
+        size_t expected_size = 0;
+        double cum_sum = 0.0;
+        while (expected_size < expected.size() && cum_sum < top_p) {
+            cum_sum += exp((double) expected[expected_size++].logit - expected[0].logit) / sum;
+        }
+
+        GGML_ASSERT(cur_p.sorted);
+        GGML_ASSERT(cur_p.size + 1 >= expected_size && cur_p.size <= expected_size + 1);
+        for (size_t i = 0; i < cur_p.size; i++) {
+            GGML_ASSERT(cur_p.data[i].logit == expected[i].logit);
+            const double expected_p = exp((double) expected[i].logit - expected[0].logit) / sum;
+            GGML_ASSERT(fabs(cur_p.data[i].p - expected_p) < 1e-4 * expected_p);
+        }
+    }
+
+    printf("Large vocab OK with n_vocab=%zu top_k=%d top_p=%f\n", n_vocab, top_k, top_p);
+}
+
+// the counts kept by llama_sampling_accept must give the same penalties as counting the window of prev
+static void test_penalty_counts(const size_t n_vocab, const int32_t n_prev, const int32_t penalty_last_n) {
+    llama_sampling_params params;
+    params.n_prev          = n_prev;
+    params.penalty_last_n  = penalty_last_n;
+    params.penalty_repeat  = 1.1f;
+    params.penalty_freq    = 0.5f;
+    params.penalty_present = 0.25f;
+
+    llama_sampling_context * ctx_sampling = llama_sampling_init(params);
+    llama_sampling_context * ctx_copy     = llama_sampling_init(params);
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<llama_token> dist_token(0, 15);
+    std::normal_distribution<float> dist_logit(0.0f, 3.0f);
+
+    std::vector<float> logits(n_vocab);
+
+    for (int step = 0; step < 200; step++) {
+        if (step == 100) {
+            llama_sampling_reset(ctx_sampling);
+        }
+        if (step == 150) {
+            llama_sampling_cp(ctx_sampling, ctx_copy);
+            std::swap(ctx_sampling, ctx_copy);
+        }
+
+        llama_sampling_accept(ctx_sampling, nullptr, dist_token(rng), false);
+
+        for (auto & logit : logits) {
+            logit = dist_logit(rng);
+        }
+
+        const int32_t n_last = penalty_last_n < 0 ? n_prev : std::min(n_prev, penalty_last_n);
+        const auto & prev = ctx_sampling->prev;
+
+        std::vector<llama_token_data> expected;
+        std::vector<llama_token_data> indexed;
+        for (llama_token token_id = 0; token_id < (llama_token) n_vocab; token_id++) {
+            expected.push_back({ token_id, logits[token_id], 0.0f });
+            indexed.push_back( { token_id, logits[token_id], 0.0f });
+        }
+        std::vector<llama_token_data> shuffled = indexed;
+        std::shuffle(shuffled.begin(), shuffled.end(), rng);
+
+        llama_token_data_array expected_p = { expected.data(), expected.size(), false };
+        llama_sample_repetition_penalties(nullptr, &expected_p, prev.data() + prev.size() - n_last, n_last,
+                params.penalty_repeat, params.penalty_freq, params.penalty_present);
+
+        for (auto * cur : { &indexed, &shuffled }) {
+            llama_token_data_array cur_p = { cur->data(), cur->size(), false };
+            llama_sample_repetition_penalties_counts(nullptr, &cur_p,
+                    ctx_sampling->penalty_tokens.data(), ctx_sampling->penalty_counts.data(), ctx_sampling->penalty_tokens.size(),
+                    params.penalty_repeat, params.penalty_freq, params.penalty_present);
+
+            for (const auto & td : *cur) {
+                GGML_ASSERT(td.logit == expected[td.id].logit);
+            }
+        }
+    }
+
+    llama_sampling_free(ctx_sampling);
+    llama_sampling_free(ctx_copy);
+
+    printf("Penalty counts OK with n_prev=%d penalty_last_n=%d\n", n_prev, penalty_last_n);
+}
+
+// a precompiled token set must bias the candidates like the equivalent logit_bias map, on both the sparse and the dense path
+static void test_token_set(const size_t n_vocab, const size_t n_bias, const bool exclusive) {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<llama_token> dist_token(0, n_vocab - 1);
+    std::normal_distribution<float> dist_logit(0.0f, 3.0f);
+
+    std::unordered_map<llama_token, float> bias;
+    while (bias.size() < n_bias) {
+        bias[dist_token(rng)] = bias.size() % 7 == 0 ? -INFINITY : dist_logit(rng);
+    }
+    bias[n_vocab] = 1.0f; // out of range, ignored
+
+    const auto set = llama_token_set_init(n_vocab, bias, exclusive);
+    GGML_ASSERT(set->tokens.size() == n_bias);
+    GGML_ASSERT(std::is_sorted(set->tokens.begin(), set->tokens.end()));
+
+    std::vector<llama_token_data> cur;
+    std::vector<llama_token_data> expected;
+    for (llama_token token_id = 0; token_id < (llama_token) n_vocab; token_id++) {
+        const float logit = dist_logit(rng);
+        cur.push_back({ token_id, logit, 0.0f });
+
+        const auto it = bias.find(token_id);
+        GGML_ASSERT(set->contains(token_id) == (it != bias.end()));
+        if (it != bias.end()) {
+            expected.push_back({ token_id, logit + it->second, 0.0f });
+        } else {
+            expected.push_back({ token_id, exclusive ? -INFINITY : logit, 0.0f });
+        }
+    }
+    GGML_ASSERT(!set->contains(-1) && !set->contains(n_vocab));
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+    llama_token_set_apply(*set, &cur_p);
+
+    for (size_t i = 0; i < n_vocab; i++) {
+        GGML_ASSERT(cur[i].id == expected[i].id);
+        GGML_ASSERT(cur[i].logit == expected[i].logit);
+    }
+
+    printf("Token set OK with n_vocab=%zu n_bias=%zu exclusive=%d\n", n_vocab, n_bias, exclusive);
+}
+
+// writes a llama model with one small layer and random weights, taking the hparams and the tokenizer from the vocab file
+static void write_random_model(const char * fname_vocab, const char * fname_out) {
+    const int n_embd = 32;
+    const int n_ff   = 64;
+
+    struct ggml_context * ctx_vocab = nullptr;
+    struct gguf_init_params params_vocab = { /*.no_alloc =*/ true, /*.ctx =*/ &ctx_vocab };
+    struct gguf_context * vocab = gguf_init_from_file(fname_vocab, params_vocab);
+    GGML_ASSERT(vocab != nullptr);
+
+    const int n_vocab = gguf_get_arr_n(vocab, gguf_find_key(vocab, "tokenizer.ggml.tokens"));
+
+    struct gguf_context * out = gguf_init_empty();
+    gguf_set_kv(out, vocab);
+    gguf_set_val_u32(out, "llama.context_length",         256);
+    gguf_set_val_u32(out, "llama.embedding_length",       n_embd);
+    gguf_set_val_u32(out, "llama.feed_forward_length",    n_ff);
+    gguf_set_val_u32(out, "llama.block_count",            1);
+    gguf_set_val_u32(out, "llama.attention.head_count",   4);
+    gguf_set_val_u32(out, "llama.attention.head_count_kv", 4);
+    gguf_set_val_u32(out, "llama.rope.dimension_count",   n_embd/4);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ (size_t) (2*n_vocab*n_embd + 4*n_embd*n_embd + 3*n_embd*n_ff + 3*n_embd)*sizeof(float) + 16*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    auto add = [&](const char * name, int64_t ne0, int64_t ne1, bool ones) {
+        struct ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name);
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ones ? 1.0f : dist(rng);
+        }
+        gguf_add_tensor(out, t);
+    };
+
+    add("token_embd.weight",        n_embd, n_vocab, false);
+    add("output_norm.weight",       n_embd, 0,       true);
+    add("output.weight",            n_embd, n_vocab, false);
+    add("blk.0.attn_norm.weight",   n_embd, 0,       true);
+    add("blk.0.attn_q.weight",      n_embd, n_embd,  false);
+    add("blk.0.attn_k.weight",      n_embd, n_embd,  false);
+    add("blk.0.attn_v.weight",      n_embd, n_embd,  false);
+    add("blk.0.attn_output.weight", n_embd, n_embd,  false);
+    add("blk.0.ffn_norm.weight",    n_embd, 0,       true);
+    add("blk.0.ffn_gate.weight",    n_embd, n_ff,    false);
+    add("blk.0.ffn_down.weight",    n_ff,   n_embd,  false);
+    add("blk.0.ffn_up.weight",      n_embd, n_ff,    false);
+
+    gguf_write_to_file(out, fname_out, false);
+
+    ggml_free(ctx);
+    gguf_free(out);
+    gguf_free(vocab);
+    ggml_free(ctx_vocab);
+}
+
+// llama_sampling_sample_batch must pick the same tokens as sampling the sequences one by one, including when the
+// worker pool is reused across decode steps with a different number of threads
+static void test_sample_batch(llama_model * model) {
+    const int n_seqs  = 5;
+    const int n_steps = 8;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 64;
+    cparams.n_seq_max = n_seqs;
+    cparams.seed      = 1;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    for (int n_threads : {1, 2, 3, 8}) {
+        std::vector<llama_token> tokens[2];
+
+        for (int batched = 0; batched < 2; ++batched) {
+            llama_context * ctx = llama_new_context_with_model(model, cparams);
+            GGML_ASSERT(ctx != nullptr);
+
+            std::vector<llama_sampling_context *> ctx_samplings;
+            for (int s = 0; s < n_seqs; ++s) {
+                llama_sampling_params sparams;
+                sparams.seed = 100 + s;
+                sparams.temp = 1.5f;
+                sparams.top_k = s == 0 ? 1 : 40;
+                ctx_samplings.push_back(llama_sampling_init(sparams));
+            }
+
+            llama_batch batch = llama_batch_init(n_seqs, 0, 1);
+            std::vector<llama_token> last(n_seqs);
+            for (int s = 0; s < n_seqs; ++s) {
+                last[s] = 1 + s;
+            }
+
+            for (int step = 0; step < n_steps; ++step) {
+                batch.n_tokens = 0;
+                std::vector<int32_t> idxs;
+                for (int s = 0; s < n_seqs; ++s) {
+                    const int i = batch.n_tokens++;
+                    batch.token   [i]    = last[s];
+                    batch.pos     [i]    = step;
+                    batch.n_seq_id[i]    = 1;
+                    batch.seq_id  [i][0] = s;
+                    batch.logits  [i]    = true;
+                    idxs.push_back(i);
+                }
+                GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+                std::vector<llama_token> ids;
+                if (batched) {
+                    ids = llama_sampling_sample_batch(ctx_samplings, ctx, idxs, n_threads);
+                } else {
+                    for (int s = 0; s < n_seqs; ++s) {
+                        ids.push_back(llama_sampling_sample(ctx_samplings[s], ctx, nullptr, idxs[s]));
+                    }
+                }
+
+                for (int s = 0; s < n_seqs; ++s) {
+                    llama_sampling_accept(ctx_samplings[s], ctx, ids[s], true);
+                    tokens[batched].push_back(ids[s]);
+                    last[s] = ids[s];
+                }
+            }
+
+            llama_batch_free(batch);
+            for (auto * ctx_sampling : ctx_samplings) {
+                llama_sampling_free(ctx_sampling);
+            }
+            llama_free(ctx);
+        }
+
+        GGML_ASSERT(tokens[0] == tokens[1]);
+
+        printf("Sample batch OK with n_seqs=%d n_threads=%d\n", n_seqs, n_threads);
+    }
+}
+
+// a context created with n_top_k > 0 must return the k largest logits of each output as probabilities over the
+// whole vocab, and greedy sampling from them must pick the same token as from the logits
+static void test_output_top_k(llama_model * model, uint32_t n_top_k, float top_k_temp) {
+    const int n_vocab   = llama_n_vocab(model);
+    const int n_outputs = 3;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 256;
+    cparams.n_batch         = 64;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    llama_context * ctx_logits = llama_new_context_with_model(model, cparams);
+
+    cparams.n_top_k    = n_top_k;
+    cparams.top_k_temp = top_k_temp;
+
+    llama_context * ctx_top_k = llama_new_context_with_model(model, cparams);
+
+    GGML_ASSERT(ctx_logits != nullptr && ctx_top_k != nullptr);
+    GGML_ASSERT(llama_n_top_k(ctx_top_k) == n_top_k);
+
+    llama_batch batch = llama_batch_init(8, 0, 1);
+    for (int i = 0; i < 8; ++i) {
+        llama_batch_add(batch, 100 + 7*i, i, { 0 }, i >= 8 - n_outputs);
+    }
+
+    GGML_ASSERT(llama_decode(ctx_logits, batch) == 0);
+    GGML_ASSERT(llama_decode(ctx_top_k,  batch) == 0);
+
+    GGML_ASSERT(llama_get_logits(ctx_top_k) == nullptr);
+
+    llama_sampling_params sparams;
+    sparams.temp = 0.0f;
+
+    for (int i = 8 - n_outputs; i < 8; ++i) {
+        const float * logits = llama_get_logits_ith(ctx_logits, i);
+
+        std::vector<llama_token_data> expected(n_vocab);
+        float max_logit = -INFINITY;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            expected[id] = { id, logits[id]/top_k_temp, 0.0f };
+            max_logit = std::max(max_logit, expected[id].logit);
+        }
+        double sum = 0.0;
+        for (auto & td : expected) {
+            sum += exp(td.logit - max_logit);
+        }
+        for (auto & td : expected) {
+            td.p = exp(td.logit - max_logit)/sum;
+        }
+        std::stable_sort(expected.begin(), expected.end(), [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+
+        std::vector<llama_token_data> top_k(n_top_k);
+        GGML_ASSERT(llama_get_top_k_ith(ctx_top_k, i, top_k.data()) == (int32_t) n_top_k);
+
+        for (uint32_t k = 0; k < n_top_k; ++k) {
+            GGML_ASSERT(top_k[k].id == expected[k].id);
+            // the soft_max of the graph is computed in lower precision
+            GGML_ASSERT(std::fabs(top_k[k].p - expected[k].p) <= 1e-2f*expected[k].p);
+        }
+
+        // common sampling takes the top-k as candidates
+        llama_sampling_context * ctx_sampling = llama_sampling_init(sparams);
+        GGML_ASSERT(llama_sampling_sample(ctx_sampling, ctx_top_k,  nullptr, i) == expected[0].id);
+        GGML_ASSERT(llama_sampling_sample(ctx_sampling, ctx_logits, nullptr, i) == expected[0].id);
+        llama_sampling_free(ctx_sampling);
+
+        // with penalties and a logit bias the token is still one of the top-k
+        llama_sampling_params sparams_penalties;
+        sparams_penalties.penalty_repeat = 1.5f;
+        sparams_penalties.logit_bias[expected[0].id] = -INFINITY;
+        ctx_sampling = llama_sampling_init(sparams_penalties);
+        llama_sampling_accept(ctx_sampling, ctx_top_k, top_k[n_top_k - 1].id, false);
+        llama_sampling_accept(ctx_sampling, ctx_top_k, llama_token_nl(model), false);
+        const llama_token id = llama_sampling_sample(ctx_sampling, ctx_top_k, nullptr, i);
+        GGML_ASSERT(n_top_k == 1 || id != expected[0].id);
+        GGML_ASSERT(std::find_if(top_k.begin(), top_k.end(), [&](const llama_token_data & td) { return td.id == id; }) != top_k.end());
+        llama_sampling_free(ctx_sampling);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx_top_k);
+    llama_free(ctx_logits);
+
+    printf("Output top-k OK with n_top_k=%u top_k_temp=%.1f\n", n_top_k, top_k_temp);
+}
+
+int main(int argc, char ** argv) {
     ggml_time_init();
 
     test_top_k({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f}, 1);
@@ -267,6 +671,16 @@ int main(void) {
     test_repetition_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2},       {0.499966f, 0.499966f, 0.000023f, 0.000023f, 0.000023f}, 1.0f, 5.0f, 5.0f);
     test_repetition_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2, 0, 0}, {0.499977f, 0.499977f, 0.000023f, 0.000023f, 0.000000f}, 1.0f, 5.0f, 5.0f);
 
+    test_penalty_counts(100, 64,  64);
+    test_penalty_counts(100, 64,  16);
+    test_penalty_counts(100, 32,  -1);
+    test_penalty_counts(100, 16, 256);
+
+    test_token_set(1000,   10, false);
+    test_token_set(1000,  500, false);
+    test_token_set(1000,   10, true);
+    test_token_set(1000, 1000, true);
+
     test_sampler_queue(10000, "k", 10000, 1.0f, 1.0f);
     test_sampler_queue(10000, "k",     1, 1.0f, 1.0f);
     test_sampler_queue(10000, "p", 10000, 1.0f, 1.0f);
@@ -295,6 +709,33 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_large_vocab(150000,   40, 0.95f);
+    test_large_vocab(150000, 5000, 0.50f);
+    test_large_vocab( 10000, 2000, 0.01f);
+
+    if (argc > 1) {
+        const std::string fname_model = "test-sampling-model.gguf.tmp";
+
+        write_random_model(argv[1], fname_model.c_str());
+
+        llama_backend_init();
+
+        llama_model_params mparams = llama_model_default_params();
+        llama_model * model = llama_load_model_from_file(fname_model.c_str(), mparams);
+        GGML_ASSERT(model != nullptr);
+
+        test_sample_batch(model);
+
+        test_output_top_k(model,  1, 1.0f);
+        test_output_top_k(model, 40, 1.0f);
+        test_output_top_k(model, 40, 0.7f);
+
+        llama_free_model(model);
+        llama_backend_free();
+
+        std::remove(fname_model.c_str());
+    }
+
     printf("OK\n");
 
     return 0;
@@ -0,0 +1,418 @@
+// tests of the helpers of the server that do not need a model
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "../examples/server/utils.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+bool server_verbose  = false;
+bool server_log_json = false;
+
+// reference for utf8_incomplete_suffix: decode the code points from the start of the text
+static size_t utf8_incomplete_suffix_ref(const std::string & text) {
+    size_t i = 0;
+    while (i < text.size()) {
+        const unsigned char c = text[i];
+        size_t n = 1;
+        if ((c & 0xE0) == 0xC0) {
+            n = 2;
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 3;
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 4;
+        }
+        size_t k = 1;
+        while (k < n && i + k < text.size() && ((unsigned char) text[i + k] & 0xC0) == 0x80) {
+            k++;
+        }
+        if (k < n && i + k == text.size()) {
+            return k;
+        }
+        i += k;
+    }
+    return 0;
+}
+
+static void test_utf8_incomplete_suffix(std::mt19937 & rng) {
+    // the first bytes of code points of 1 to 4 bytes, continuation bytes and invalid bytes
+    static const unsigned char bytes[] = { 'a', ' ', 0xC3, 0xE4, 0xF0, 0x80, 0xA9, 0xB8, 0xFF };
+
+    assert(utf8_incomplete_suffix("", 0) == 0);
+    assert(utf8_incomplete_suffix("a\xC3", 2) == 1);
+    assert(utf8_incomplete_suffix("a\xC3\xA9", 3) == 0);
+    assert(utf8_incomplete_suffix("\xE4\xB8", 2) == 2);
+    assert(utf8_incomplete_suffix("\xF0\x9F\x98", 3) == 3);
+    assert(utf8_incomplete_suffix("\xF0\x9F\x98\x80", 4) == 0);
+
+    for (int it = 0; it < 100000; ++it) {
+        std::string text;
+        const int n = rng() % 8;
+        for (int i = 0; i < n; ++i) {
+            text += (char) bytes[rng() % sizeof(bytes)];
+        }
+
+        const size_t res = utf8_incomplete_suffix(text.data(), text.size());
+        const size_t ref = utf8_incomplete_suffix_ref(text);
+        if (res != ref) {
+            fprintf(stderr, "%s: text of %zu bytes: got %zu, expected %zu\n", __func__, text.size(), res, ref);
+            assert(false);
+        }
+    }
+
+    printf("%s: OK\n", __func__);
+}
+
+// feeds random pieces to stop_string_matcher and checks each result against searching the whole text for each
+// stop string
+static void test_stop_string_matcher(std::mt19937 & rng) {
+    static const char * word_chars[] = { "a", "b", "c", "\xC3\xA9" };
+    static const char * pieces[]     = { "a", "b", "c", "ab", "ba", "abc", "\xC3", "\xA9", "\xC3\xA9", "x", "\n", " " };
+
+    int n_stopped = 0;
+
+    for (int it = 0; it < 200000; ++it) {
+        std::vector<std::string> words(rng() % 4);
+        for (auto & word : words) {
+            const int n = rng() % 5; // may be empty, which never matches
+            for (int i = 0; i < n; ++i) {
+                word += word_chars[rng() % 4];
+            }
+        }
+
+        stop_string_matcher matcher;
+        matcher.build(words);
+
+        std::string text;
+        const int n_pieces = 1 + rng() % 20;
+        for (int p = 0; p < n_pieces; ++p) {
+            const std::string piece = pieces[rng() % 12];
+            text += piece;
+
+            const stop_string_matcher::match res = matcher.feed(piece.data(), piece.size());
+
+            // the stop string found first in the text, ties go to the string given first
+            stop_string_matcher::match ref;
+            for (size_t w = 0; w < words.size(); ++w) {
+                const size_t pos = words[w].empty() ? std::string::npos : text.find(words[w]);
+                if (pos < ref.begin) {
+                    ref.begin = pos;
+                    ref.word  = (int32_t) w;
+                }
+            }
+
+            assert(res.begin == ref.begin);
+            assert(res.word  == ref.word);
+            if (res.word >= 0) {
+                n_stopped++;
+                break;
+            }
+
+            // the longest end of the text that a stop string starts with
+            size_t n_partial = 0;
+            for (const auto & word : words) {
+                for (size_t n = std::min(word.size(), text.size()); n > n_partial; --n) {
+                    if (text.compare(text.size() - n, n, word, 0, n) == 0) {
+                        n_partial = n;
+                        break;
+                    }
+                }
+            }
+
+            assert(matcher.n_partial() == n_partial);
+        }
+
+        assert(matcher.n_fed == text.size());
+    }
+
+    assert(n_stopped > 0);
+
+    printf("%s: OK, %d of the texts stopped\n", __func__, n_stopped);
+}
+
+static size_t common_prefix(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+static size_t prefix_tree_n_nodes(const server_prefix_tree & tree) {
+    return tree.nodes.size() - tree.nodes_free.size();
+}
+
+static void test_prefix_tree_basic() {
+    server_prefix_tree tree;
+
+    auto all = [](int) { return true; };
+
+    std::vector<int> ids;
+
+    assert(tree.find({ 1, 2, 3 }, ids, all) == 0);
+    assert(ids.empty());
+
+    tree.insert(0, { 1, 2, 3, 4 });
+    tree.insert(1, { 1, 2, 5 });
+    tree.insert(2, { 7 });
+    assert(prefix_tree_n_nodes(tree) == 5); // root, [1 2], [3 4], [5], [7]
+
+    assert(tree.find({ 1, 2, 3, 4, 5 }, ids, all) == 4);
+    assert(ids == std::vector<int>({ 0 }));
+
+    assert(tree.find({ 1, 2, 9 }, ids, all) == 2);
+    std::sort(ids.begin(), ids.end());
+    assert(ids == std::vector<int>({ 0, 1 }));
+
+    assert(tree.find({ 1, 2, 3 }, ids, all) == 3);
+    assert(ids == std::vector<int>({ 0 }));
+
+    // the slots rejected by the filter are skipped, the prefix of another one is found instead
+    assert(tree.find({ 1, 2, 3, 4 }, ids, [](int id) { return id != 0; }) == 2);
+    assert(ids == std::vector<int>({ 1 }));
+    assert(tree.find({ 7, 8 }, ids, [](int id) { return id != 2; }) == 0);
+    assert(ids.empty());
+
+    // replacing the tokens of a slot merges the nodes that were split for it
+    tree.insert(1, { 7, 8 });
+    assert(prefix_tree_n_nodes(tree) == 4); // root, [1 2 3 4], [7], [8]
+    assert(tree.find({ 1, 2, 5 }, ids, all) == 2);
+    assert(ids == std::vector<int>({ 0 }));
+    assert(tree.find({ 7, 8, 9 }, ids, all) == 2);
+    assert(ids == std::vector<int>({ 1 }));
+
+    // a slot without tokens holds no prefix
+    tree.insert(0, {});
+    assert(tree.find({ 1, 2 }, ids, all) == 0);
+
+    tree.remove(1);
+    tree.remove(2);
+    tree.remove(5); // never inserted
+    assert(prefix_tree_n_nodes(tree) == 1);
+
+    printf("%s: OK\n", __func__);
+}
+
+// random inserts, removes and finds, checked against comparing the query with the tokens of each slot
+static void test_prefix_tree_random(std::mt19937 & rng) {
+    size_t n_nodes_max = 0;
+
+    for (int it = 0; it < 2000; ++it) {
+        server_prefix_tree tree;
+
+        const int n_slots = 1 + rng() % 8;
+
+        std::vector<std::vector<llama_token>> slot_tokens(n_slots);
+
+        // a few shared beginnings, so that the prompts have long common prefixes
+        auto gen = [&]() {
+            std::vector<llama_token> tokens;
+            const int base = rng() % 3;
+            const int n    = rng() % 20;
+            for (int i = 0; i < n; i++) {
+                tokens.push_back(i < 5 ? base*10 + i % 2 : (llama_token) (rng() % 3));
+            }
+            return tokens;
+        };
+
+        for (int op = 0; op < 300; ++op) {
+            const int id_slot = rng() % n_slots;
+            const int r = rng() % 10;
+
+            if (r < 5) {
+                slot_tokens[id_slot] = gen();
+                tree.insert(id_slot, slot_tokens[id_slot]);
+            } else if (r < 6) {
+                slot_tokens[id_slot].clear();
+                tree.remove(id_slot);
+            } else {
+                const std::vector<llama_token> query = gen();
+
+                std::vector<bool> available(n_slots);
+                for (int i = 0; i < n_slots; i++) {
+                    available[i] = rng() % 3 != 0;
+                }
+
+                std::vector<int> ids;
+                const size_t n = tree.find(query, ids, [&](int id) { return (bool) available[id]; });
+
+                size_t n_ref = 0;
+                std::vector<int> ids_ref;
+                for (int i = 0; i < n_slots; i++) {
+                    if (!available[i]) {
+                        continue;
+                    }
+                    const size_t n_common = common_prefix(slot_tokens[i], query);
+                    if (n_common > n_ref) {
+                        n_ref = n_common;
+                        ids_ref.clear();
+                    }
+                    if (n_common == n_ref && n_common > 0) {
+                        ids_ref.push_back(i);
+                    }
+                }
+
+                std::sort(ids.begin(), ids.end());
+                assert(n == n_ref);
+                assert(ids == ids_ref);
+            }
+
+            n_nodes_max = std::max(n_nodes_max, prefix_tree_n_nodes(tree));
+        }
+
+        for (int i = 0; i < n_slots; i++) {
+            tree.remove(i);
+        }
+        assert(prefix_tree_n_nodes(tree) == 1);
+    }
+
+    // a node for each slot and one for each split at most, besides the root
+    assert(n_nodes_max <= 1 + 2*8);
+
+    printf("%s: OK, at most %zu nodes\n", __func__, n_nodes_max);
+}
+
+static std::vector<uint8_t> prompt_cache_state(size_t n) {
+    std::vector<uint8_t> state(n);
+    for (size_t i = 0; i < n; i++) {
+        state[i] = (uint8_t) i;
+    }
+    return state;
+}
+
+static bool file_exists(const std::string & path) {
+    return std::ifstream(path).good();
+}
+
+// saves, restores after a restart, eviction and the removal of files that cannot be read, without a model: the states
+// are bytes that the cache writes after the tokens
+static void test_prompt_cache() {
+    const std::string dir = "test-server-utils-prompt-cache" + std::string(1, DIRECTORY_SEPARATOR);
+
+    if (create_directory_with_parents(dir)) {
+        for (const std::string & file : list_directory_files(dir)) {
+            std::remove((dir + file).c_str());
+        }
+    }
+
+    const size_t n_header = 3*sizeof(uint32_t);
+
+    std::string name; // of the file of { 1, 2, 3, 4 }
+
+    {
+        server_prompt_cache cache;
+        assert(cache.init(dir, 1024*1024, 2));
+        assert(cache.entries.empty());
+
+        cache.save({ 1, 2, 3 }, prompt_cache_state(100));
+        cache.save({ 4, 5 },    prompt_cache_state(10));
+        assert(cache.entries.size() == 2);
+        assert(cache.size == 2*n_header + 5*sizeof(llama_token) + 110);
+
+        // the prefix of a saved prompt is found, a prompt that starts with a saved one replaces it
+        assert(cache.contains({ 1, 2 }));
+        assert(!cache.contains({ 1, 2, 3, 4 }));
+        cache.save({ 1, 2, 3, 4 }, prompt_cache_state(200));
+        assert(cache.entries.size() == 2);
+        assert(cache.n_saved == 3);
+
+        server_prompt_cache::entry * e = cache.find({ 1, 2, 3, 9 });
+        assert(e != nullptr && e->tokens == std::vector<llama_token>({ 1, 2, 3, 4 }));
+        assert(cache.find({ 1, 9 }) == nullptr); // shorter than n_tokens_min
+        assert(cache.find({ 6, 7 }) == nullptr);
+
+        cache.wait(*e);
+        std::vector<llama_token> tokens;
+        size_t size = 0;
+        assert(server_prompt_cache::read_tokens(cache.dir + e->name, tokens, size));
+        assert(tokens == e->tokens && size == e->size);
+        name = e->name;
+
+        cache.wait_all();
+        assert(list_directory_files(dir).size() == 2);
+
+        // not saved while too many bytes wait to be written
+        cache.size_pending_max = 0;
+        cache.save({ 7, 8 }, prompt_cache_state(10));
+        assert(cache.entries.size() == 2 && cache.n_skipped == 1);
+    }
+
+    // a file that is cut short, one that is not a state file, and a file of something else
+    {
+        std::ofstream(dir + "0000000000000001.bin") << "not a state";
+        std::ofstream(dir + "notes.txt") << "kept";
+
+        std::ifstream in(dir + name, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::ofstream(dir + "0000000000000002.bin", std::ios::binary) << data.substr(0, n_header + 2*sizeof(llama_token));
+    }
+
+    {
+        server_prompt_cache cache;
+        assert(cache.init(dir, 1024*1024, 2));
+
+        // the prompts saved before the restart
+        assert(cache.entries.size() == 2);
+        server_prompt_cache::entry * e = cache.find({ 1, 2, 3, 4, 5 });
+        assert(e != nullptr && e->tokens.size() == 4);
+        assert(cache.find({ 4, 5 }) != nullptr);
+        assert(cache.size == 2*n_header + 6*sizeof(llama_token) + 210);
+
+        assert(!file_exists(dir + "0000000000000001.bin"));
+        assert(!file_exists(dir + "0000000000000002.bin"));
+        assert( file_exists(dir + "notes.txt"));
+        std::remove((dir + "notes.txt").c_str());
+
+        // the least recently used prompts go when there are too many bytes
+        cache.size_max = cache.size + n_header + 2*sizeof(llama_token) + 100;
+        cache.find({ 4, 5 })->t_last_used = ggml_time_us();
+        cache.save({ 6, 7 }, prompt_cache_state(100));
+        assert(cache.entries.size() == 3);
+        cache.save({ 8, 9 }, prompt_cache_state(100));
+        assert(cache.entries.size() == 3);
+        assert(cache.find({ 1, 2, 3, 4 }) == nullptr);
+        assert(cache.find({ 4, 5 }) != nullptr);
+        assert(cache.find({ 6, 7 }) != nullptr);
+        assert(cache.find({ 8, 9 }) != nullptr);
+        assert(cache.size <= cache.size_max);
+        cache.wait_all();
+        assert(!file_exists(dir + name));
+
+        // a file that cannot be restored is removed
+        cache.remove(*cache.find({ 4, 5 }));
+        cache.wait_all();
+        assert(cache.entries.size() == 2);
+        assert(list_directory_files(dir).size() == 2);
+    }
+
+    for (const std::string & file : list_directory_files(dir)) {
+        std::remove((dir + file).c_str());
+    }
+    std::remove(dir.c_str());
+
+    printf("%s: OK\n", __func__);
+}
+
+int main(void) {
+    std::mt19937 rng(1);
+
+    test_utf8_incomplete_suffix(rng);
+    test_stop_string_matcher(rng);
+
+    test_prefix_tree_basic();
+    test_prefix_tree_random(rng);
+
+    test_prompt_cache();
+
+    printf("tests passed\n");
+
+    return 0;
+}
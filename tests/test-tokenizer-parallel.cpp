@@ -0,0 +1,188 @@
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// checks that llama_tokenize_parallel, and llama_tokenizer_stream fed with chunks of random sizes, return exactly the
+// tokens of llama_tokenize on long random texts, which are built so that the pieces they cut start and end in all kinds
+// of places: words, numbers, whitespace runs, CRLF and blank lines, non-ASCII text and the text of the special tokens
+// of the vocab
+
+static std::vector<llama_token> tokenize(llama_model * model, const std::string & text, bool add_special, bool parse_special, int32_t n_threads) {
+    std::vector<llama_token> result(text.size() + 2);
+    int32_t n = llama_tokenize_parallel(model, text.data(), text.size(), result.data(), result.size(), add_special, parse_special, n_threads);
+    if (n < 0) {
+        result.resize(-n);
+        n = llama_tokenize_parallel(model, text.data(), text.size(), result.data(), result.size(), add_special, parse_special, n_threads);
+    }
+    result.resize(n);
+    return result;
+}
+
+// also returns the number of tokens that the stream returned before the end of the text
+static size_t first_difference(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    size_t pos = 0;
+    while (pos < a.size() && pos < b.size() && a[pos] == b[pos]) {
+        pos++;
+    }
+    return pos;
+}
+
+static std::vector<llama_token> tokenize_stream(llama_model * model, const std::string & text, bool add_special, bool parse_special, std::mt19937 & rng, size_t max_chunk, size_t & n_early) {
+    llama_tokenizer_stream * stream = llama_tokenizer_stream_init(model, add_special, parse_special);
+
+    std::vector<llama_token> result;
+
+    // a small buffer, to also get the tokens that did not fit
+    std::vector<llama_token> buf(16);
+
+    size_t pos = 0;
+    while (pos < text.size()) {
+        const size_t n = std::min<size_t>(text.size() - pos, 1 + rng() % max_chunk);
+        int32_t n_tokens = llama_tokenizer_stream_feed(stream, text.data() + pos, n, buf.data(), buf.size());
+        if (n_tokens < 0) {
+            buf.resize(-n_tokens);
+            n_tokens = llama_tokenizer_stream_feed(stream, "", 0, buf.data(), buf.size());
+        }
+        result.insert(result.end(), buf.begin(), buf.begin() + n_tokens);
+        pos += n;
+    }
+
+    n_early = result.size();
+
+    int32_t n_tokens = llama_tokenizer_stream_finish(stream, buf.data(), buf.size());
+    if (n_tokens < 0) {
+        buf.resize(-n_tokens);
+        n_tokens = llama_tokenizer_stream_finish(stream, buf.data(), buf.size());
+    }
+    result.insert(result.end(), buf.begin(), buf.begin() + n_tokens);
+
+    llama_tokenizer_stream_free(stream);
+
+    return result;
+}
+
+static std::string random_text(std::mt19937 & rng, const std::vector<std::string> & special, size_t n_bytes) {
+    static const char * words[] = {
+        "the", "Quick", "fox", "jumps", "don't", "we'll", "IT'S", "a", "b", "x1", "1", "12", "123", "1234567", "3.14",
+        "é", "naïve", "Москва", "東京", "日本語", "가나다", "🦙", "ﬁ", "µ", "—", "...", "!=", "->", "{", "}", "();", "//",
+        "#include", "\"q\"", "'", "$", "<", ">", "<s", "/s>", "|", "_", "\\", "\xc2\xa0",
+    };
+    static const char * spaces[] = {
+        " ", " ", " ", "  ", "   ", "\t", " \t", "\n", "\n", "\n", "\n\n", "\n\n\n", "\r\n", " \n", "\n ", "\n\t", "\r",
+        "", "",
+    };
+    const size_t n_words  = sizeof(words)/sizeof(words[0]);
+    const size_t n_spaces = sizeof(spaces)/sizeof(spaces[0]);
+
+    std::string text;
+    while (text.size() < n_bytes) {
+        const size_t r = rng() % 100;
+        // special tokens only in the first half, so that the second one is cut as a single fragment
+        if (r < 2 && !special.empty() && text.size() < n_bytes/2) {
+            text += special[rng() % special.size()];
+        } else if (r < 60) {
+            text += words[rng() % n_words];
+        } else {
+            text += spaces[rng() % n_spaces];
+        }
+    }
+    return text;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_load_model_from_file(fname.c_str(), mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+        return 1;
+    }
+
+    // the text of the control tokens, whole and cut in half
+    std::vector<std::string> special;
+    for (llama_token id = 0; id < llama_n_vocab(model); ++id) {
+        if (llama_token_get_type(model, id) != LLAMA_TOKEN_TYPE_CONTROL) {
+            continue;
+        }
+        char buf[256];
+        const int n = llama_token_to_piece(model, id, buf, sizeof(buf), true);
+        if (n > 1) {
+            // cut at a character boundary
+            int half = n/2;
+            while (half > 0 && (buf[half] & 0xC0) == 0x80) {
+                half--;
+            }
+            special.push_back(std::string(buf, n));
+            special.push_back(std::string(buf, half));
+            special.push_back(std::string(buf + half, n - half));
+        }
+    }
+
+    std::mt19937 rng(42);
+
+    int n_failed = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        // short texts are tokenized by a single thread anyway
+        const size_t n_bytes = i == 0 ? 1000 : 600*1024;
+        const std::string text = random_text(rng, special, n_bytes);
+
+        for (const bool add_special : { false, true }) {
+            for (const bool parse_special : { false, true }) {
+                const auto expected = tokenize(model, text, add_special, parse_special, 1);
+
+                for (const int32_t n_threads : { 3, 8 }) {
+                    const auto result = tokenize(model, text, add_special, parse_special, n_threads);
+                    if (result != expected) {
+                        fprintf(stderr, "%s : text %d (%zu bytes), add_special = %d, parse_special = %d, n_threads = %d: "
+                                "%zu tokens instead of %zu, first difference at token %zu\n",
+                                __func__, i, text.size(), add_special, parse_special, n_threads, result.size(), expected.size(),
+                                first_difference(result, expected));
+                        n_failed++;
+                    }
+                }
+
+                size_t n_early = 0;
+                const auto result = tokenize_stream(model, text, add_special, parse_special, rng, i == 0 ? 16 : 4096, n_early);
+                if (result != expected) {
+                    fprintf(stderr, "%s : text %d (%zu bytes), add_special = %d, parse_special = %d, stream: "
+                            "%zu tokens instead of %zu, first difference at token %zu\n",
+                            __func__, i, text.size(), add_special, parse_special, result.size(), expected.size(),
+                            first_difference(result, expected));
+                    n_failed++;
+                }
+                fprintf(stderr, "%s : text %d (%zu bytes), add_special = %d, parse_special = %d: the stream returned %zu of %zu tokens before the end\n",
+                        __func__, i, text.size(), add_special, parse_special, n_early, result.size());
+            }
+        }
+    }
+
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    if (n_failed > 0) {
+        fprintf(stderr, "%s : %d tests failed\n", __func__, n_failed);
+        return 1;
+    }
+
+    fprintf(stderr, "%s : tests passed\n", __func__);
+
+    return 0;
+}
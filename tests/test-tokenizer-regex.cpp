@@ -0,0 +1,137 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "unicode.h"
+
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// checks that the custom implementations of the pre-tokenizer regexes split random texts like std::regex
+
+// the regexes of the pre-tokenizers in llm_tokenizer_bpe
+static const std::vector<std::vector<std::string>> pre_tokenizers = {
+    // llama3
+    {
+        "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    },
+    // deepseek llm
+    {
+        "[\r\n]",
+        "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
+        "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
+        "\\s+$",
+        "[一-龥ࠀ-一가-퟿]+",
+        "\\p{N}+",
+    },
+    // deepseek coder
+    {
+        "[\r\n]",
+        "\\s?\\p{L}+",
+        "\\s?\\p{P}+",
+        "[一-龥ࠀ-一가-퟿]+",
+        "\\p{N}+",
+    },
+    // falcon, default
+    {
+        "[\\p{P}\\$\\+<=>\\^~\\|]+",
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        "\\p{N}+",
+        "[0-9][0-9][0-9]",
+    },
+    // mpt
+    {
+        "\\s?\\p{L}+",
+        "\\s?\\p{P}+",
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+    },
+    // gpt2, starcoder
+    {
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+    },
+};
+
+// code points of every class the regexes tell apart
+static const std::vector<uint32_t> alphabet = {
+    'a', 'b', 's', 't', 'r', 'e', 'v', 'm', 'l', 'd', 'S', 'T', 'R', 'E', 'L', 'D', 'Z',
+    '0', '1', '9',
+    ' ', ' ', ' ', '\t', '\n', '\r', '\v', '\f',
+    '\'', '"', '.', ',', '!', '?', '-', '_', '(', ')', '[', ']', '{', '}', '#', '%', '@', ':', ';', '/', '\\',
+    '$', '+', '<', '=', '>', '^', '~', '|', '`', '&', '*',
+    0x00B5, 0x00E9, 0x00F7, 0x00D7, 0x00A0, 0x00A7, 0x00B2, // µ é ÷ × nbsp § ²
+    0x03A9, 0x0416, 0x05D0, 0x0661, 0x0915, 0x0301,         // Ω Ж א ١ क, combining acute
+    0x2019, 0x201C, 0x2026, 0x2028, 0x2003, 0x20AC,         // ’ “ … line separator, em space, €
+    0x3000, 0x3001, 0x3002, 0x4E00, 0x4E2D, 0x9FA5, 0x9FA6, 0xAC00, 0xD7A3, 0x0800, // ideographic space, 、 。 CJK, hangul
+    0xFF01, 0xFF21, 0xFF41, 0xFF10,                         // fullwidth ！ Ａ ａ ０
+    0x1F600, 0x10400, 0x1D7CE,                              // emoji, deseret letter, math digit
+};
+
+static std::string random_text(std::mt19937 & rng, size_t n) {
+    std::uniform_int_distribution<size_t> dist(0, alphabet.size() - 1);
+
+    std::string text;
+    for (size_t i = 0; i < n; ++i) {
+        text += unicode_cpt_to_utf8(alphabet[dist(rng)]);
+    }
+    return text;
+}
+
+static void check(const std::string & text, const std::vector<std::string> & regex_exprs) {
+    const auto words     = unicode_regex_split(text, regex_exprs, true);
+    const auto words_ref = unicode_regex_split(text, regex_exprs, false);
+
+    if (words != words_ref) {
+        fprintf(stderr, "%s: mismatch for regex '%s' on text:\n", __func__, regex_exprs[0].c_str());
+        for (uint32_t cpt : unicode_cpts_from_utf8(text)) {
+            fprintf(stderr, " %04X", cpt);
+        }
+        fprintf(stderr, "\n%s: %zu words, expected %zu\n", __func__, words.size(), words_ref.size());
+        for (size_t i = 0; i < std::max(words.size(), words_ref.size()); ++i) {
+            fprintf(stderr, "  '%s' | '%s'\n", i < words.size() ? words[i].c_str() : "", i < words_ref.size() ? words_ref[i].c_str() : "");
+        }
+        assert(false);
+    }
+}
+
+int main() {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> dist_len(0, 64);
+
+    size_t n_checks = 0;
+
+    for (const auto & regex_exprs : pre_tokenizers) {
+        // each regex alone, and the whole pre-tokenizer
+        std::vector<std::vector<std::string>> cases;
+        for (const auto & regex_expr : regex_exprs) {
+            cases.push_back({ regex_expr });
+        }
+        cases.push_back(regex_exprs);
+
+        for (const auto & exprs : cases) {
+            for (int i = 0; i < 500; ++i) {
+                check(random_text(rng, dist_len(rng)), exprs);
+                n_checks++;
+            }
+        }
+    }
+
+    // long runs, that make the backtracking of std::regex recurse deeply, are only split by the custom implementations
+    {
+        const std::string text = std::string(100000, ' ') + "x" + std::string(100000, '\n') + std::string(100000, 'a');
+
+        for (const auto & regex_exprs : pre_tokenizers) {
+            size_t n = 0;
+            for (const auto & word : unicode_regex_split(text, regex_exprs)) {
+                n += word.size();
+            }
+            assert(n == unicode_regex_split(text, {}).at(0).size());
+        }
+    }
+
+    fprintf(stderr, "%s: %zu random texts OK\n", __func__, n_checks);
+
+    return 0;
+}
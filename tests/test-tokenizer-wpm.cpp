@@ -0,0 +1,279 @@
+#include "llama.h"
+#include "unicode.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <locale>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// checks the WordPiece tokenizer against the reference below, which looks up every substring of the words in the vocab,
+// on random texts with accents, case mappings, punctuation, CJK, control characters and words that are not in the vocab -
+// and that llama_tokenize_batch returns the tokens of llama_tokenize for each of many short texts
+
+struct wpm_reference {
+    std::unordered_map<std::string, llama_token> token_to_id;
+    llama_token unk_id;
+
+    explicit wpm_reference(const llama_model * model) {
+        for (llama_token id = 0; id < llama_n_vocab(model); ++id) {
+            token_to_id[llama_token_get_text(model, id)] = id;
+        }
+        unk_id = token_to_id.at("[UNK]");
+    }
+
+    std::vector<llama_token> tokenize(const std::string & text) const {
+        std::vector<llama_token> output;
+
+        for (const std::string & word : preprocess(text)) {
+            const std::string word1 = "\xe2\x96\x81" + word;
+            const int n = word1.size();
+
+            // the longest token at each position, skipping bytes that no token starts with
+            int i = 0;
+            bool match_any = false;
+            while (i < n) {
+                bool match = false;
+                for (int j = n; j > i; j--) {
+                    auto it = token_to_id.find(word1.substr(i, j - i));
+                    if (it != token_to_id.end()) {
+                        output.push_back(it->second);
+                        match = true;
+                        match_any = true;
+                        i = j;
+                        break;
+                    }
+                }
+                if (!match) {
+                    i++;
+                }
+            }
+
+            if (!match_any) {
+                output.push_back(unk_id);
+            }
+        }
+
+        return output;
+    }
+
+    static std::vector<std::string> preprocess(const std::string & text) {
+        std::vector<uint32_t> cpts_nfd = unicode_cpts_normalize_nfd(unicode_cpts_from_utf8(text));
+
+        // strip accents, strip control, uniformize whitespace,
+        // to lowercase, pad chinese characters, pad punctuation
+        std::string new_str = "";
+        for (uint32_t code : cpts_nfd) {
+            int type = unicode_cpt_type(code);
+            if (type == CODEPOINT_TYPE_ACCENT_MARK || type == CODEPOINT_TYPE_CONTROL) {
+                continue;
+            }
+            code = unicode_tolower(code);
+            if (type == CODEPOINT_TYPE_WHITESPACE) {
+                code = ' ';
+            }
+            std::string s = unicode_cpt_to_utf8(code);
+            if (type == CODEPOINT_TYPE_PUNCTUATION || is_ascii_punct(code) || is_chinese_char(code)) {
+                new_str += " ";
+                new_str += s;
+                new_str += " ";
+            } else {
+                new_str += s;
+            }
+        }
+
+        // split by whitespace
+        std::vector<std::string> words;
+        size_t l = 0;
+        size_t r = 0;
+        while (r < new_str.size()) {
+            if (std::isspace(new_str[r], std::locale::classic())) {
+                if (r > l) {
+                    words.push_back(new_str.substr(l, r - l));
+                }
+                l = r + 1;
+                r = l;
+            } else {
+                r += 1;
+            }
+        }
+        if (r > l) {
+            words.push_back(new_str.substr(l, r - l));
+        }
+        return words;
+    }
+
+    static bool is_ascii_punct(uint32_t code) {
+        if (code > 0xFF) {
+            return false;
+        }
+        return std::ispunct(char(static_cast<unsigned char>(code)), std::locale::classic());
+    }
+
+    static bool is_chinese_char(uint32_t cpt) {
+        return (cpt >= 0x4E00  && cpt <= 0x9FFF)  ||
+               (cpt >= 0x3400  && cpt <= 0x4DBF)  ||
+               (cpt >= 0x20000 && cpt <= 0x2A6DF) ||
+               (cpt >= 0x2A700 && cpt <= 0x2B73F) ||
+               (cpt >= 0x2B740 && cpt <= 0x2B81F) ||
+               (cpt >= 0x2B920 && cpt <= 0x2CEAF) ||
+               (cpt >= 0xF900  && cpt <= 0xFAFF)  ||
+               (cpt >= 0x2F800 && cpt <= 0x2FA1F) ||
+               (cpt >= 0x3000  && cpt <= 0x303F)  ||
+               (cpt >= 0xFF00  && cpt <= 0xFFEF);
+    }
+};
+
+static std::vector<llama_token> tokenize(llama_model * model, const std::string & text, bool add_special, bool parse_special) {
+    std::vector<llama_token> result(text.size() + 2);
+    int32_t n = llama_tokenize(model, text.data(), text.size(), result.data(), result.size(), add_special, parse_special);
+    if (n < 0) {
+        result.resize(-n);
+        n = llama_tokenize(model, text.data(), text.size(), result.data(), result.size(), add_special, parse_special);
+    }
+    result.resize(n);
+    return result;
+}
+
+static std::string random_text(std::mt19937 & rng, const std::vector<std::string> & vocab_words, size_t n_words) {
+    static const char * words[] = {
+        "the", "Quick", "FOX", "don't", "x1", "123", "3.14", "Café", "naïve", "ÅNGSTRÖM", "\xe2\x84\xaa" /* KELVIN SIGN */,
+        "İstanbul", "Straße", "e\xcc\x81" /* e + COMBINING ACUTE */, "Москва", "東京", "日本語", "가나다", "🦙", "ﬁ", "µ", "—",
+        "...", "!=", "()", "[CLS]", "[SEP]", "[MASK]", "##ing", "▁", "unbelievablyunrecognizablewords",
+        "qzxjvkw", "\x01", "\x7f", "\xc2\x85", "\xe2\x80\x8b", "\xef\xbb\xbf",
+    };
+    static const char * spaces[] = {
+        " ", " ", " ", "  ", "\t", "\n", "\r\n", "\xc2\xa0", "\xe3\x80\x80", "",
+    };
+    const size_t n_fixed  = sizeof(words)/sizeof(words[0]);
+    const size_t n_spaces = sizeof(spaces)/sizeof(spaces[0]);
+
+    std::string text;
+    for (size_t i = 0; i < n_words; ++i) {
+        const size_t r = rng() % 4;
+        if (r == 0) {
+            text += words[rng() % n_fixed];
+        } else {
+            text += vocab_words[rng() % vocab_words.size()];
+        }
+        text += spaces[rng() % n_spaces];
+    }
+    return text;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_load_model_from_file(fname.c_str(), mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+        return 1;
+    }
+
+    if (llama_vocab_type(model) != LLAMA_VOCAB_TYPE_WPM) {
+        fprintf(stderr, "%s : error: not a WPM vocab\n", __func__);
+        llama_free_model(model);
+        return 1;
+    }
+
+    const wpm_reference reference(model);
+
+    // the words of the vocab, without the phantom space of word starts
+    std::vector<std::string> vocab_words;
+    for (llama_token id = 0; id < llama_n_vocab(model); ++id) {
+        std::string text = llama_token_get_text(model, id);
+        if (text.compare(0, 3, "\xe2\x96\x81") == 0) {
+            text = text.substr(3);
+        }
+        if (!text.empty()) {
+            vocab_words.push_back(text);
+        }
+    }
+
+    std::mt19937 rng(42);
+
+    int n_failed = 0;
+
+    for (int i = 0; i < 2000; ++i) {
+        const std::string text = random_text(rng, vocab_words, 1 + rng() % 64);
+
+        const auto expected = reference.tokenize(text);
+        const auto result   = tokenize(model, text, false, false);
+        if (result != expected) {
+            fprintf(stderr, "%s : text %d: %zu tokens instead of %zu: '%s'\n", __func__, i, result.size(), expected.size(), text.c_str());
+            n_failed++;
+        }
+    }
+
+    // many short texts, and an empty one
+    std::vector<std::string> texts;
+    for (int i = 0; i < 500; ++i) {
+        texts.push_back(random_text(rng, vocab_words, rng() % 16));
+    }
+
+    std::vector<const char *> ptrs;
+    std::vector<int32_t>      lens;
+    for (const auto & text : texts) {
+        ptrs.push_back(text.data());
+        lens.push_back(text.size());
+    }
+
+    for (const bool parse_special : { false, true }) {
+        std::vector<std::vector<llama_token>> expected;
+        for (const auto & text : texts) {
+            expected.push_back(tokenize(model, text, true, parse_special));
+        }
+
+        for (const int32_t n_threads : { 1, 3, 8 }) {
+            std::vector<llama_token> tokens(16);
+            std::vector<int32_t>     offsets(texts.size() + 1);
+
+            // too small a buffer first, the offsets are written anyway
+            int32_t n = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), offsets.data(), true, parse_special, n_threads);
+            if (n >= 0 || offsets.back() != -n) {
+                fprintf(stderr, "%s : batch, n_threads = %d: returned %d for a buffer of %zu tokens\n", __func__, n_threads, n, tokens.size());
+                n_failed++;
+                continue;
+            }
+
+            tokens.resize(-n);
+            n = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), offsets.data(), true, parse_special, n_threads);
+
+            for (size_t i = 0; i < texts.size(); ++i) {
+                const std::vector<llama_token> result(tokens.begin() + offsets[i], tokens.begin() + offsets[i + 1]);
+                if (result != expected[i]) {
+                    fprintf(stderr, "%s : batch, n_threads = %d, parse_special = %d: text %zu: %zu tokens instead of %zu\n",
+                            __func__, n_threads, parse_special, i, result.size(), expected[i].size());
+                    n_failed++;
+                }
+            }
+        }
+    }
+
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    if (n_failed > 0) {
+        fprintf(stderr, "%s : %d tests failed\n", __func__, n_failed);
+        return 1;
+    }
+
+    fprintf(stderr, "%s : tests passed\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+// compares ggml_argsort_top_k with the first k indices of each row sorted in descending order on the host
+#include "ggml.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+// rows of a permutation of [0, n) have no ties, so the indices must be the same as the reference
+static void test_top_k(int64_t n, int64_t n_rows, int k, int n_threads, std::mt19937 & rng) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ (size_t) (n*n_rows + k*n_rows)*sizeof(float) + 8*ggml_tensor_overhead() + ggml_graph_overhead() + 1024*1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n, n_rows);
+
+    // the reference: the indices of each row sorted by value, in descending order (ggml_argsort is quadratic on the CPU,
+    // too slow for rows of the size of a vocab)
+    std::vector<std::vector<int32_t>> ref(n_rows, std::vector<int32_t>(n));
+
+    std::vector<float> row(n);
+    for (int64_t r = 0; r < n_rows; r++) {
+        for (int64_t i = 0; i < n; i++) {
+            row[i] = (float) i;
+        }
+        std::shuffle(row.begin(), row.end(), rng);
+        std::copy(row.begin(), row.end(), (float *) ((char *) a->data + r*a->nb[1]));
+
+        std::iota(ref[r].begin(), ref[r].end(), 0);
+        std::stable_sort(ref[r].begin(), ref[r].end(), [&](int32_t i0, int32_t i1) { return row[i0] > row[i1]; });
+    }
+
+    struct ggml_tensor * top_k = ggml_argsort_top_k(ctx, a, k);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, top_k);
+
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    assert(top_k->type == GGML_TYPE_I32);
+    assert(top_k->ne[0] == k && top_k->ne[1] == n_rows);
+
+    for (int64_t r = 0; r < n_rows; r++) {
+        const int32_t * res = (const int32_t *) ((const char *) top_k->data + r*top_k->nb[1]);
+        const int32_t * exp = ref[r].data();
+        for (int i = 0; i < k; i++) {
+            if (res[i] != exp[i]) {
+                fprintf(stderr, "%s: n = %d, n_rows = %d, k = %d: row %d, column %d: got %d, expected %d\n",
+                        __func__, (int) n, (int) n_rows, k, (int) r, i, res[i], exp[i]);
+                abort();
+            }
+        }
+    }
+
+    ggml_free(ctx);
+
+    printf("%s: n = %6d, n_rows = %3d, k = %3d, n_threads = %d: OK\n", __func__, (int) n, (int) n_rows, k, n_threads);
+}
+
+// ties go to the lower index
+static void test_top_k_ties(int64_t n, int k) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ (size_t) (n + k)*sizeof(float) + 8*ggml_tensor_overhead() + ggml_graph_overhead() + 1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * a = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+
+    // a few distinct values, each repeated: the top-k are the indices of the largest value first, in ascending order
+    float * data = (float *) a->data;
+    for (int64_t i = 0; i < n; i++) {
+        data[i] = (float) (i % 3);
+    }
+
+    struct ggml_tensor * top_k = ggml_argsort_top_k(ctx, a, k);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, top_k);
+
+    ggml_graph_compute_with_ctx(ctx, gf, 1);
+
+    std::vector<int32_t> expected;
+    for (int v = 2; v >= 0; v--) {
+        for (int64_t i = v; i < n; i += 3) {
+            expected.push_back((int32_t) i);
+        }
+    }
+
+    const int32_t * res = (const int32_t *) top_k->data;
+    for (int i = 0; i < k; i++) {
+        assert(res[i] == expected[i]);
+    }
+
+    ggml_free(ctx);
+
+    printf("%s: n = %6d, k = %3d: OK\n", __func__, (int) n, k);
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    std::mt19937 rng(1234);
+
+    test_top_k(    8,  1,  8, 1, rng);
+    test_top_k(   16, 10,  4, 1, rng);
+    test_top_k(   16, 10,  1, 4, rng);
+    test_top_k(  100,  7, 33, 3, rng);
+    test_top_k(32000,  4, 40, 1, rng); // output logits
+    test_top_k(32000,  4, 40, 4, rng);
+
+    test_top_k_ties(  10,  7);
+    test_top_k_ties(1000, 50);
+
+    printf("tests passed\n");
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "unicode.h"
+#include "unicode-data.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// checks the lookup tables of unicode.cpp against the data they are built from, and the block-wise UTF-8 decoding
+// against a byte at a time one, on texts that put the non-ASCII and invalid bytes anywhere in and around the blocks
+
+static int cpt_type_ref(uint32_t cpt) {
+    const std::pair<const std::vector<std::pair<uint32_t, uint32_t>> *, int> ranges[] = {
+        { &unicode_ranges_control,     CODEPOINT_TYPE_CONTROL },
+        { &unicode_ranges_symbol,      CODEPOINT_TYPE_SYMBOL },
+        { &unicode_ranges_punctuation, CODEPOINT_TYPE_PUNCTUATION },
+        { &unicode_ranges_accent_mark, CODEPOINT_TYPE_ACCENT_MARK },
+        { &unicode_ranges_whitespace,  CODEPOINT_TYPE_WHITESPACE },
+        { &unicode_ranges_letter,      CODEPOINT_TYPE_LETTER },
+        { &unicode_ranges_digit,       CODEPOINT_TYPE_DIGIT },
+    };
+    // the last matching type in unicode-data.cpp
+    for (const auto & r : ranges) {
+        // the last range starting at or before cpt
+        auto it = std::upper_bound(r.first->begin(), r.first->end(), std::make_pair(cpt, UINT32_MAX));
+        if (it != r.first->begin() && cpt <= (--it)->second) {
+            return r.second;
+        }
+    }
+    return CODEPOINT_TYPE_UNIDENTIFIED;
+}
+
+// the code points of utf8, or false if it is not valid (with the same leniency as unicode_cpts_from_utf8)
+static bool cpts_from_utf8_ref(const std::string & utf8, std::vector<uint32_t> & cpts) {
+    cpts.clear();
+    size_t i = 0;
+    while (i < utf8.size()) {
+        const uint8_t c = utf8[i];
+        const size_t  n = c < 0x80 ? 1 : c < 0xC0 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF8 ? 4 : 0;
+        if (n == 0 || i + n > utf8.size()) {
+            return false;
+        }
+        uint32_t cpt = n == 1 ? c : c & (0x7F >> n);
+        for (size_t k = 1; k < n; ++k) {
+            if ((utf8[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+            cpt = cpt << 6 | (utf8[i + k] & 0x3F);
+        }
+        cpts.push_back(cpt);
+        i += n;
+    }
+    return true;
+}
+
+static void test_tables() {
+    for (uint32_t cpt = 0; cpt < 0x110000; ++cpt) {
+        if (unicode_cpt_type(cpt) != cpt_type_ref(cpt)) {
+            fprintf(stderr, "%s: type of U+%04X: %d instead of %d\n", __func__, cpt, unicode_cpt_type(cpt), cpt_type_ref(cpt));
+            assert(false);
+        }
+
+        const auto it_lower = unicode_map_lowercase.find(cpt);
+        assert(unicode_tolower(cpt) == (it_lower == unicode_map_lowercase.end() ? cpt : it_lower->second));
+
+        const auto it_nfd = unicode_map_nfd.find(cpt);
+        assert(unicode_cpts_normalize_nfd({ cpt })[0] == (it_nfd == unicode_map_nfd.end() ? cpt : it_nfd->second));
+    }
+
+    // the code points past U+10FFFF that UTF-8 can encode
+    for (uint32_t cpt = 0x110000; cpt < 0x200000; cpt += 0x1234) {
+        assert(unicode_cpt_type(cpt) == CODEPOINT_TYPE_UNIDENTIFIED);
+        assert(unicode_tolower(cpt) == cpt);
+    }
+}
+
+static void test_decode(std::mt19937 & rng) {
+    static const char * pieces[] = {
+        "a", "Hello, world! ", "0123456789", "\n", "\t", "\x7f", "é", "naïve", "Москва", "東京", "日本語", "가나다", "🦙",
+    };
+    const size_t n_pieces = sizeof(pieces)/sizeof(pieces[0]);
+
+    for (int i = 0; i < 20000; ++i) {
+        // long ASCII runs with a few other pieces, up to 200 bytes to cross several blocks
+        std::string text;
+        const size_t n = rng() % 200;
+        while (text.size() < n) {
+            const size_t r = rng() % 16;
+            if (r < 10) {
+                text += (char) ('a' + rng() % 26);
+            } else {
+                text += pieces[rng() % n_pieces];
+            }
+        }
+
+        // and sometimes a random byte, often making the text invalid
+        if (i % 4 == 0 && !text.empty()) {
+            text[rng() % text.size()] = (char) (rng() % 256);
+        }
+
+        std::vector<uint32_t> expected;
+        const bool valid = cpts_from_utf8_ref(text, expected);
+
+        try {
+            const auto result = unicode_cpts_from_utf8(text);
+            assert(valid);
+            assert(result == expected);
+        } catch (const std::invalid_argument &) {
+            assert(!valid);
+        }
+    }
+}
+
+int main() {
+    std::mt19937 rng(42);
+
+    test_tables();
+    test_decode(rng);
+
+    fprintf(stderr, "%s : tests passed\n", __func__);
+
+    return 0;
+}
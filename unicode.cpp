@@ -1,10 +1,14 @@
 #include <llama/unicode.h>
 #include <llama/unicode-data.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -14,6 +18,18 @@
 #include <locale>
 #include <codecvt>
 
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UNICODE_USE_SSE2
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define UNICODE_USE_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
 static std::string unicode_cpts_to_utf8(const std::vector<uint32_t> & cps) {
     std::string result;
     for (size_t i = 0; i < cps.size(); ++i) {
@@ -59,6 +75,97 @@ static uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset)
     throw std::invalid_argument("failed to convert utf8 to codepoint");
 }
 
+#if defined(UNICODE_USE_SSE2)
+static inline int unicode_ctz(uint32_t x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long r;
+    _BitScanForward(&r, x);
+    return (int) r;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+#endif
+
+// decode the ASCII bytes from s[i] a block at a time, and return the position of the first byte that was not decoded
+// dst must have room for a whole block: the bytes after the first non-ASCII one can be written there too
+static size_t unicode_cpts_from_ascii(const uint8_t * s, size_t i, size_t n, uint32_t * & dst) {
+#if defined(__AVX2__)
+    while (i + 32 <= n) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        const uint32_t mask = (uint32_t) _mm256_movemask_epi8(v);
+        if (mask & 1) {
+            return i;
+        }
+        for (int k = 0; k < 32; k += 8) {
+            const __m256i w = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (s + i + k)));
+            _mm256_storeu_si256((__m256i *) (dst + k), w);
+        }
+        if (mask != 0) {
+            const int k = unicode_ctz(mask);
+            dst += k;
+            return i + k;
+        }
+        dst += 32;
+        i   += 32;
+    }
+#elif defined(UNICODE_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= n) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        const uint32_t mask = (uint32_t) _mm_movemask_epi8(v);
+        if (mask & 1) {
+            return i;
+        }
+        const __m128i lo = _mm_unpacklo_epi8(v, zero);
+        const __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *) (dst +  0), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *) (dst +  4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *) (dst +  8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *) (dst + 12), _mm_unpackhi_epi16(hi, zero));
+        if (mask != 0) {
+            const int k = unicode_ctz(mask);
+            dst += k;
+            return i + k;
+        }
+        dst += 16;
+        i   += 16;
+    }
+#elif defined(UNICODE_USE_NEON)
+    while (i + 16 <= n) {
+        const uint8x16_t v = vld1q_u8(s + i);
+        if (vmaxvq_u8(v) >= 0x80) {
+            break;
+        }
+        const uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+        const uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+        vst1q_u32(dst +  0, vmovl_u16(vget_low_u16(lo)));
+        vst1q_u32(dst +  4, vmovl_u16(vget_high_u16(lo)));
+        vst1q_u32(dst +  8, vmovl_u16(vget_low_u16(hi)));
+        vst1q_u32(dst + 12, vmovl_u16(vget_high_u16(hi)));
+        dst += 16;
+        i   += 16;
+    }
+#else
+    while (i + 8 <= n) {
+        uint64_t v;
+        memcpy(&v, s + i, sizeof(v));
+        if (v & 0x8080808080808080ull) {
+            break;
+        }
+        for (int k = 0; k < 8; ++k) {
+            dst[k] = s[i + k];
+        }
+        dst += 8;
+        i   += 8;
+    }
+#endif
+    while (i < n && s[i] < 0x80) {
+        *dst++ = s[i++];
+    }
+    return i;
+}
+
 //static std::vector<uint16_t> unicode_cpt_to_utf16(uint32_t cp) {
 //    std::vector<uint16_t> result;
 //    if (/* 0x0000 <= cp && */ cp <= 0xffff) {
@@ -108,48 +215,72 @@ static uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset)
 //    return result;
 //}
 
-static std::unordered_map<uint32_t, int> unicode_cpt_type_map() {
-    std::unordered_map<uint32_t, int> cpt_types;
-    for (auto p : unicode_ranges_digit) {
-        for (auto i = p.first; i <= p.second; ++ i) {
-            cpt_types[i] = CODEPOINT_TYPE_DIGIT;
-        }
-    }
-    for (auto p : unicode_ranges_letter) {
-        for (auto i = p.first; i <= p.second; ++ i) {
-            cpt_types[i] = CODEPOINT_TYPE_LETTER;
-        }
-    }
-    for (auto p : unicode_ranges_whitespace) {
-        for (auto i = p.first; i <= p.second; ++ i) {
-            cpt_types[i] = CODEPOINT_TYPE_WHITESPACE;
-        }
-    }
-    for (auto p : unicode_ranges_accent_mark) {
-        for (auto i = p.first; i <= p.second; ++ i) {
-            cpt_types[i] = CODEPOINT_TYPE_ACCENT_MARK;
+// a value for each code point, in two levels: the index of the block of every 256 code points, and the distinct blocks
+// (most of them are the same, e.g. all letters or all unassigned)
+template <typename T>
+struct unicode_cpt_table {
+    std::vector<uint16_t> index;
+    std::vector<T>        blocks;
+
+    // from the values of the code points 0 to 0x10FFFF
+    explicit unicode_cpt_table(const std::vector<T> & values) {
+        assert(values.size() == 0x110000);
+        std::map<std::vector<T>, uint16_t> ids;
+        for (size_t i = 0; i < values.size(); i += 256) {
+            std::vector<T> block(values.begin() + i, values.begin() + i + 256);
+            auto it = ids.find(block);
+            if (it == ids.end()) {
+                it = ids.emplace(block, (uint16_t) ids.size()).first;
+                blocks.insert(blocks.end(), block.begin(), block.end());
+            }
+            index.push_back(it->second);
         }
     }
-    for (auto p : unicode_ranges_punctuation) {
-        for (auto i = p.first; i <= p.second; ++ i) {
-            cpt_types[i] = CODEPOINT_TYPE_PUNCTUATION;
-        }
+
+    T get(uint32_t cpt) const {
+        return cpt < 0x110000 ? blocks[(size_t) index[cpt >> 8] << 8 | (cpt & 0xff)] : T(0);
     }
-    for  (auto p : unicode_ranges_symbol) {
-        for (auto i = p.first; i <= p.second; ++i) {
-            cpt_types[i] = CODEPOINT_TYPE_SYMBOL;
+};
+
+static unicode_cpt_table<uint8_t> unicode_cpt_type_table() {
+    const std::pair<const std::vector<std::pair<uint32_t, uint32_t>> *, int> ranges[] = {
+        { &unicode_ranges_digit,       CODEPOINT_TYPE_DIGIT },
+        { &unicode_ranges_letter,      CODEPOINT_TYPE_LETTER },
+        { &unicode_ranges_whitespace,  CODEPOINT_TYPE_WHITESPACE },
+        { &unicode_ranges_accent_mark, CODEPOINT_TYPE_ACCENT_MARK },
+        { &unicode_ranges_punctuation, CODEPOINT_TYPE_PUNCTUATION },
+        { &unicode_ranges_symbol,      CODEPOINT_TYPE_SYMBOL },
+        { &unicode_ranges_control,     CODEPOINT_TYPE_CONTROL },
+    };
+
+    // a code point in the ranges of several types gets the last one
+    std::vector<uint8_t> cpt_types(0x110000, CODEPOINT_TYPE_UNIDENTIFIED);
+    for (const auto & r : ranges) {
+        for (const auto & p : *r.first) {
+            for (uint32_t i = p.first; i <= p.second && i < 0x110000; ++i) {
+                cpt_types[i] = r.second;
+            }
         }
     }
-    for (auto p : unicode_ranges_control) {
-        for (auto i = p.first; i <= p.second; ++ i) {
-            cpt_types[i] = CODEPOINT_TYPE_CONTROL;
+    return unicode_cpt_table<uint8_t>(cpt_types);
+}
+
+// the difference between each code point and the first one it maps to, or 0
+template <typename M>
+static unicode_cpt_table<int32_t> unicode_cpt_delta_table(const M & map) {
+    std::vector<int32_t> deltas(0x110000, 0);
+    std::vector<bool>    mapped(0x110000, false);
+    for (const auto & p : map) {
+        if (p.first < 0x110000 && !mapped[p.first]) {
+            deltas[p.first] = (int32_t) p.second - (int32_t) p.first;
+            mapped[p.first] = true;
         }
     }
-    return cpt_types;
+    return unicode_cpt_table<int32_t>(deltas);
 }
 
-static std::unordered_map<uint8_t, std::string> unicode_byte_to_utf8_map() {
-    std::unordered_map<uint8_t, std::string> map;
+static std::vector<std::string> unicode_byte_to_utf8_map() {
+    std::vector<std::string> map(256);
     for (int ch = u'!'; ch <= u'~'; ++ch) {
         assert(0 <= ch && ch < 256);
         map[ch] = unicode_cpt_to_utf8(ch);
@@ -164,7 +295,7 @@ static std::unordered_map<uint8_t, std::string> unicode_byte_to_utf8_map() {
     }
     auto n = 0;
     for (int ch = 0; ch < 256; ++ch) {
-        if (map.find(ch) == map.end()) {
+        if (map[ch].empty()) {
             map[ch] = unicode_cpt_to_utf8(256 + n);
             ++n;
         }
@@ -201,166 +332,6 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
-        }
-
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
-    }
-    return bpe_encoded_words;
-}
-
-// GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
-    std::vector<size_t> bpe_offsets; // store the offset of each word
-    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
-
-    size_t start = 0;
-
-    const auto cpts = unicode_cpts_from_utf8(text);
-
-    for (auto offset : offsets) {
-        std::string token;
-
-        bool collecting_numeric = false;
-        bool collecting_letter = false;
-        bool collecting_special = false;
-        bool collecting_whitespace_lookahead = false;
-        bool collecting = false;
-
-        std::vector<std::string> text_utf;
-        text_utf.reserve(offset);
-
-        for (size_t i = start; i < start + offset; ++i) {
-            text_utf.emplace_back(unicode_cpt_to_utf8(cpts[i]));
-        }
-
-        for (int i = 0; i < (int)text_utf.size(); i++) {
-            const std::string & utf_char = text_utf[i];
-            bool split_condition = false;
-            int bytes_remain = text_utf.size() - i;
-
-            // forward backward lookups
-            const std::string & utf_char_next      = (i + 1 < (int)text_utf.size()) ? text_utf[i + 1] : "";
-            const std::string & utf_char_next_next = (i + 2 < (int)text_utf.size()) ? text_utf[i + 2] : "";
-
-            // handling contractions
-            if (!split_condition && bytes_remain >= 2) {
-                // 's|'t|'m|'d
-                if (utf_char == "\'" && (utf_char_next == "s" || utf_char_next == "t" || utf_char_next == "m" || utf_char_next == "d")) {
-                    split_condition = true;
-                }
-                if (split_condition) {
-                    if (token.size()) {
-                        bpe_offsets.emplace_back(unicode_cpts_from_utf8(token).size());
-                    }
-                    token = utf_char + utf_char_next;
-                    bpe_offsets.emplace_back(unicode_cpts_from_utf8(token).size());
-                    token = "";
-                    i++;
-                    continue;
-                }
-            }
-            if (!split_condition && bytes_remain >= 3) {
-                // 're|'ve|'ll
-                if (utf_char == "\'" && (
-                    (utf_char_next == "r" && utf_char_next_next == "e") ||
-                    (utf_char_next == "v" && utf_char_next_next == "e") ||
-                    (utf_char_next == "l" && utf_char_next_next == "l"))
-                    ) {
-                    split_condition = true;
-                }
-                if (split_condition) {
-                    // current token + next token can be defined
-                    if (token.size()) {
-                        bpe_offsets.emplace_back(unicode_cpts_from_utf8(token).size());
-                    }
-                    token =  utf_char;
-                    token += utf_char_next;
-                    token += utf_char_next_next;
-
-                    bpe_offsets.emplace_back(unicode_cpts_from_utf8(token).size());
-                    token = "";
-                    i += 2;
-                    continue;
-                }
-            }
-
-            if (!split_condition && !collecting) {
-                if (unicode_cpt_type(utf_char) == CODEPOINT_TYPE_LETTER || (token.empty() && utf_char == " " && unicode_cpt_type(utf_char_next) == CODEPOINT_TYPE_LETTER)) {
-                    collecting_letter = true;
-                    collecting = true;
-                }
-                else if (unicode_cpt_type(utf_char) == CODEPOINT_TYPE_DIGIT || (token.empty() && utf_char == " " && unicode_cpt_type(utf_char_next) == CODEPOINT_TYPE_DIGIT)) {
-                    collecting_numeric = true;
-                    collecting = true;
-                }
-                else if (
-                    ((unicode_cpt_type(utf_char) != CODEPOINT_TYPE_LETTER && unicode_cpt_type(utf_char) != CODEPOINT_TYPE_DIGIT) && (unicode_cpt_type(utf_char) != CODEPOINT_TYPE_WHITESPACE)) ||
-                    (token.empty() && utf_char == " " && unicode_cpt_type(utf_char_next) != CODEPOINT_TYPE_LETTER && unicode_cpt_type(utf_char_next) != CODEPOINT_TYPE_DIGIT && unicode_cpt_type(utf_char_next) != CODEPOINT_TYPE_WHITESPACE)
-                    ) {
-                    collecting_special = true;
-                    collecting = true;
-                }
-                else if (unicode_cpt_type(utf_char) == CODEPOINT_TYPE_WHITESPACE && unicode_cpt_type(utf_char_next) == CODEPOINT_TYPE_WHITESPACE) {
-                    collecting_whitespace_lookahead = true;
-                    collecting = true;
-                }
-                else if (unicode_cpt_type(utf_char) == CODEPOINT_TYPE_WHITESPACE) {
-                    split_condition = true;
-                }
-            }
-            else if (!split_condition && collecting) {
-                if (collecting_letter && unicode_cpt_type(utf_char) != CODEPOINT_TYPE_LETTER) {
-                    split_condition = true;
-                }
-                else if (collecting_numeric && unicode_cpt_type(utf_char) != CODEPOINT_TYPE_DIGIT) {
-                    split_condition = true;
-                }
-                else if (collecting_special && (unicode_cpt_type(utf_char) == CODEPOINT_TYPE_LETTER || unicode_cpt_type(utf_char) == CODEPOINT_TYPE_DIGIT || unicode_cpt_type(utf_char) == CODEPOINT_TYPE_WHITESPACE)) {
-                    split_condition = true;
-                }
-                else if (collecting_whitespace_lookahead && (unicode_cpt_type(utf_char_next) == CODEPOINT_TYPE_LETTER || unicode_cpt_type(utf_char_next) == CODEPOINT_TYPE_DIGIT)) {
-                    split_condition = true;
-                }
-            }
-
-            if (utf_char_next == "") {
-                split_condition = true; // final
-                token += utf_char;
-            }
-
-            if (split_condition) {
-                if (token.size()) {
-                    bpe_offsets.emplace_back(unicode_cpts_from_utf8(token).size());
-                }
-                token = utf_char;
-                collecting = false;
-                collecting_letter = false;
-                collecting_numeric = false;
-                collecting_special = false;
-                collecting_whitespace_lookahead = false;
-            }
-            else {
-                token += utf_char;
-            }
-        }
-
-        start += offset;
-    }
-
-    return bpe_offsets;
-}
-
 // use std::wregex to split the text
 static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wstring & regex_expr, const std::vector<size_t> & offsets) {
     std::wregex expr(regex_expr);
@@ -421,21 +392,494 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
-    std::vector<size_t> bpe_offsets;
+//
+// custom pre-tokenizer regexes
+//
+// the patterns of the pre-tokenizers are matched directly on the code points, without std::regex, with the same
+// results as the std::regex fallback below - in particular:
+//  - \s is ASCII whitespace only (like std::regex in the C locale)
+//  - \p{L}, \p{N} and \p{P} are the categories of the collapsed text: fixed sets for ASCII (see k_ucat_map in
+//    unicode_regex_split) and unicode_cpt_type for the other code points
+//
+
+#define UNICODE_REGEX_FLAG_L  0x01 // \p{L}
+#define UNICODE_REGEX_FLAG_N  0x02 // \p{N}
+#define UNICODE_REGEX_FLAG_P  0x04 // \p{P}
+#define UNICODE_REGEX_FLAG_S  0x08 // \s
+#define UNICODE_REGEX_FLAG_RN 0x10 // \r or \n
+
+static uint8_t unicode_regex_flags_ascii(uint32_t cpt) {
+    if (cpt == '\r' || cpt == '\n') {
+        return UNICODE_REGEX_FLAG_S | UNICODE_REGEX_FLAG_RN;
+    }
+    if (cpt == ' ' || (cpt >= '\t' && cpt <= '\r')) {
+        return UNICODE_REGEX_FLAG_S;
+    }
+    if ((cpt >= 'A' && cpt <= 'Z') || (cpt >= 'a' && cpt <= 'z')) {
+        return UNICODE_REGEX_FLAG_L;
+    }
+    if (cpt >= '0' && cpt <= '9') {
+        return UNICODE_REGEX_FLAG_N;
+    }
+    static const std::string punct = "!\"#%&'()*,-./:;?@[\\]_{}";
+    return punct.find((char) cpt) != std::string::npos ? UNICODE_REGEX_FLAG_P : 0;
+}
+
+static uint8_t unicode_regex_flags(uint32_t cpt) {
+    if (cpt < 128) {
+        static const std::vector<uint8_t> ascii = [] {
+            std::vector<uint8_t> res(128);
+            for (uint32_t c = 0; c < 128; ++c) {
+                res[c] = unicode_regex_flags_ascii(c);
+            }
+            return res;
+        }();
+        return ascii[cpt];
+    }
+
+    switch (unicode_cpt_type(cpt)) {
+        case CODEPOINT_TYPE_LETTER:      return UNICODE_REGEX_FLAG_L;
+        case CODEPOINT_TYPE_DIGIT:       return UNICODE_REGEX_FLAG_N;
+        case CODEPOINT_TYPE_PUNCTUATION: return UNICODE_REGEX_FLAG_P;
+        default:                         return 0;
+    }
+}
+
+// the code points of a text and their flags
+struct unicode_regex_text {
+    const std::vector<uint32_t> & cpts;
+    std::vector<uint8_t>          flags;
+
+    unicode_regex_text(const std::vector<uint32_t> & cpts) : cpts(cpts), flags(cpts.size()) {
+        for (size_t i = 0; i < cpts.size(); ++i) {
+            flags[i] = unicode_regex_flags(cpts[i]);
+        }
+    }
+
+    // number of code points from pos that have any of the flags in mask
+    size_t run(size_t pos, size_t end, uint8_t mask) const {
+        size_t i = pos;
+        while (i < end && (flags[i] & mask)) {
+            ++i;
+        }
+        return i - pos;
+    }
+
+    // number of code points from pos that have none of the flags in mask
+    size_t run_not(size_t pos, size_t end, uint8_t mask) const {
+        size_t i = pos;
+        while (i < end && !(flags[i] & mask)) {
+            ++i;
+        }
+        return i - pos;
+    }
+};
+
+// a bracket expression, \s or \p{..}: the code points with any of the flags in mask, or in one of the ranges
+struct unicode_regex_class {
+    uint8_t mask   = 0;
+    bool    negate = false;
+
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // sorted, not overlapping
+
+    bool contains(uint32_t cpt, uint8_t flags) const {
+        bool res = (flags & mask) != 0;
+        if (!res && !ranges.empty()) {
+            // the last range starting at or before cpt
+            auto it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(cpt, UINT32_MAX));
+            res = it != ranges.begin() && cpt <= (--it)->second;
+        }
+        return res != negate;
+    }
+};
+
+// a sequence of classes, each optional ('?'), repeated ('+', '*') or not, optionally followed by '$'
+// the patterns without alternatives or groups compile to this, and are matched with the backtracking of std::regex
+struct unicode_regex_seq {
+    struct atom {
+        unicode_regex_class cls;
+        char quant; // 0, '?', '+' or '*'
+    };
+
+    std::vector<atom> atoms;
+    bool anchor_end = false;
+
+    size_t run(const unicode_regex_text & text, const atom & a, size_t pos, size_t end) const {
+        size_t i = pos;
+        while (i < end && a.cls.contains(text.cpts[i], text.flags[i])) {
+            ++i;
+        }
+        return i - pos;
+    }
+
+    // end of the match of atoms[ia..] at pos, or std::string::npos
+    size_t match(const unicode_regex_text & text, size_t ia, size_t pos, size_t end) const {
+        if (ia == atoms.size()) {
+            return !anchor_end || pos == end ? pos : std::string::npos;
+        }
+
+        const atom & a = atoms[ia];
+
+        const bool repeat = a.quant == '+' || a.quant == '*';
+
+        size_t n_min = a.quant == '?' || a.quant == '*' ? 0 : 1;
+        size_t n_max = repeat ? run(text, a, pos, end) : (pos < end && a.cls.contains(text.cpts[pos], text.flags[pos]));
+        if (n_max < n_min) {
+            return std::string::npos;
+        }
+
+        // nothing after a repetition can match a shorter one: the pattern ends, or must end with the text
+        if (ia + 1 == atoms.size() && repeat) {
+            n_min = n_max;
+        }
+
+        // greedy: the longest repetition first
+        for (size_t n = n_max + 1; n-- > n_min; ) {
+            const size_t res = match(text, ia + 1, pos + n, end);
+            if (res != std::string::npos) {
+                return res;
+            }
+        }
+
+        return std::string::npos;
+    }
+};
+
+// parse a code point, or an escaped character of a bracket expression
+static bool unicode_regex_parse_cpt(const std::vector<uint32_t> & re, size_t & i, uint32_t & cpt) {
+    if (re[i] != '\\') {
+        cpt = re[i++];
+        return true;
+    }
+    if (i + 1 >= re.size()) {
+        return false;
+    }
+    const uint32_t c = re[i + 1];
+    switch (c) {
+        case 'r': cpt = '\r'; break;
+        case 'n': cpt = '\n'; break;
+        case 't': cpt = '\t'; break;
+        default:
+            // escaped punctuation stands for itself
+            if (c >= 128 || (unicode_regex_flags(c) & (UNICODE_REGEX_FLAG_L | UNICODE_REGEX_FLAG_N | UNICODE_REGEX_FLAG_S)) || c < ' ') {
+                return false;
+            }
+            cpt = c;
+    }
+    i += 2;
+    return true;
+}
+
+// parse \s or \p{L}, \p{N}, \p{P} at re[i]
+static bool unicode_regex_parse_category(const std::vector<uint32_t> & re, size_t & i, uint8_t & mask) {
+    if (re[i] != '\\' || i + 1 >= re.size()) {
+        return false;
+    }
+    if (re[i + 1] == 's') {
+        mask |= UNICODE_REGEX_FLAG_S;
+        i += 2;
+        return true;
+    }
+    if (re[i + 1] == 'p' && i + 4 < re.size() && re[i + 2] == '{' && re[i + 4] == '}') {
+        switch (re[i + 3]) {
+            case 'L': mask |= UNICODE_REGEX_FLAG_L; break;
+            case 'N': mask |= UNICODE_REGEX_FLAG_N; break;
+            case 'P': mask |= UNICODE_REGEX_FLAG_P; break;
+            default: return false;
+        }
+        i += 5;
+        return true;
+    }
+    return false;
+}
+
+static bool unicode_regex_parse_seq(const std::string & regex_expr, unicode_regex_seq & seq) {
+    const std::vector<uint32_t> re = unicode_cpts_from_utf8(regex_expr);
+
+    for (size_t i = 0; i < re.size(); ) {
+        if (re[i] == '$' && i + 1 == re.size()) {
+            seq.anchor_end = true;
+            break;
+        }
+
+        unicode_regex_seq::atom a;
+        a.quant = 0;
+
+        if (re[i] == '[') {
+            ++i;
+            if (i < re.size() && re[i] == '^') {
+                a.cls.negate = true;
+                ++i;
+            }
+            while (i < re.size() && re[i] != ']') {
+                if (unicode_regex_parse_category(re, i, a.cls.mask)) {
+                    continue;
+                }
+                if (re[i] == '[') {
+                    return false;
+                }
+                uint32_t first;
+                uint32_t last;
+                if (!unicode_regex_parse_cpt(re, i, first)) {
+                    return false;
+                }
+                last = first;
+                if (i + 1 < re.size() && re[i] == '-' && re[i + 1] != ']') {
+                    ++i;
+                    if (!unicode_regex_parse_cpt(re, i, last) || last < first) {
+                        return false;
+                    }
+                }
+                a.cls.ranges.emplace_back(first, last);
+            }
+            if (i == re.size()) {
+                return false;
+            }
+            ++i;
+        } else if (unicode_regex_parse_category(re, i, a.cls.mask)) {
+            // \s, \p{..}
+        } else if (re[i] == '\\' || std::string("()|.^$*+?{}[]").find((char) re[i]) != std::string::npos) {
+            // other escapes and constructs
+            return false;
+        } else {
+            a.cls.ranges.emplace_back(re[i], re[i]);
+            ++i;
+        }
+
+        if (i < re.size() && (re[i] == '?' || re[i] == '+' || re[i] == '*')) {
+            a.quant = (char) re[i++];
+            if (i < re.size() && (re[i] == '?' || re[i] == '+' || re[i] == '*' || re[i] == '{')) {
+                return false;
+            }
+        } else if (i < re.size() && re[i] == '{') {
+            return false;
+        }
+
+        // sorted, without overlaps, for the binary search of unicode_regex_class::contains
+        auto & ranges = a.cls.ranges;
+        std::sort(ranges.begin(), ranges.end());
+        size_t n = 0;
+        for (size_t j = 0; j < ranges.size(); ++j) {
+            if (n > 0 && ranges[j].first <= ranges[n - 1].second + 1) {
+                ranges[n - 1].second = std::max(ranges[n - 1].second, ranges[j].second);
+            } else {
+                ranges[n++] = ranges[j];
+            }
+        }
+        ranges.resize(n);
+
+        seq.atoms.push_back(std::move(a));
+    }
+
+    // patterns that can match the empty string are left to std::regex
+    for (const auto & a : seq.atoms) {
+        if (a.quant == 0 || a.quant == '+') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// GPT2 system regex: 's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)
+static size_t unicode_regex_match_gpt2(const unicode_regex_text & text, size_t pos, size_t end) {
+    const auto & cpts  = text.cpts;
+    const auto & flags = text.flags;
+
+    const uint32_t c0 = cpts[pos];
+    const uint32_t c1 = pos + 1 < end ? cpts[pos + 1] : 0;
+    const uint32_t c2 = pos + 2 < end ? cpts[pos + 2] : 0;
+
+    // 's|'t|'re|'ve|'m|'ll|'d
+    if (c0 == '\'') {
+        if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+            return 2;
+        }
+        if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+            return 3;
+        }
+    }
+
+    const bool space = c0 == ' ' && pos + 1 < end;
+
+    //  ?\p{L}+ | ?\p{N}+
+    for (const uint8_t mask : { UNICODE_REGEX_FLAG_L, UNICODE_REGEX_FLAG_N }) {
+        if (space && (flags[pos + 1] & mask)) {
+            return 1 + text.run(pos + 1, end, mask);
+        }
+        if (flags[pos] & mask) {
+            return text.run(pos, end, mask);
+        }
+    }
+
+    //  ?[^\s\p{L}\p{N}]+
+    const uint8_t mask_lns = UNICODE_REGEX_FLAG_L | UNICODE_REGEX_FLAG_N | UNICODE_REGEX_FLAG_S;
+    if (space && !(flags[pos + 1] & mask_lns)) {
+        return 1 + text.run_not(pos + 1, end, mask_lns);
+    }
+    if (!(flags[pos] & mask_lns)) {
+        return text.run_not(pos, end, mask_lns);
+    }
+
+    // \s+(?!\S) - all the whitespace but the last one, unless it reaches the end
+    const size_t n = text.run(pos, end, UNICODE_REGEX_FLAG_S);
+    if (n > 0 && pos + n == end) {
+        return n;
+    }
+    return n > 1 ? n - 1 : 0;
+}
+
+// LLAMA3 system regex (adapted to std::regex, see llm_tokenizer_bpe):
+// (?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+
+static size_t unicode_regex_match_llama3(const unicode_regex_text & text, size_t pos, size_t end) {
+    const auto & cpts  = text.cpts;
+    const auto & flags = text.flags;
+
+    const auto lower = [](uint32_t c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; };
+
+    const uint32_t c0 = cpts[pos];
+    const uint32_t c1 = pos + 1 < end ? lower(cpts[pos + 1]) : 0;
+    const uint32_t c2 = pos + 2 < end ? lower(cpts[pos + 2]) : 0;
+
+    // (?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])
+    if (c0 == '\'') {
+        if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+            return 2;
+        }
+        if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+            return 3;
+        }
+    }
+
+    // [^\r\n\p{L}\p{N}]?\p{L}+
+    if (!(flags[pos] & (UNICODE_REGEX_FLAG_RN | UNICODE_REGEX_FLAG_L | UNICODE_REGEX_FLAG_N)) && pos + 1 < end && (flags[pos + 1] & UNICODE_REGEX_FLAG_L)) {
+        return 1 + text.run(pos + 1, end, UNICODE_REGEX_FLAG_L);
+    }
+    if (flags[pos] & UNICODE_REGEX_FLAG_L) {
+        return text.run(pos, end, UNICODE_REGEX_FLAG_L);
+    }
+
+    // \p{N}{1,3}
+    if (flags[pos] & UNICODE_REGEX_FLAG_N) {
+        return std::min<size_t>(3, text.run(pos, end, UNICODE_REGEX_FLAG_N));
+    }
+
+    //  ?[^\s\p{L}\p{N}]+[\r\n]*
+    const uint8_t mask_lns = UNICODE_REGEX_FLAG_L | UNICODE_REGEX_FLAG_N | UNICODE_REGEX_FLAG_S;
+    const size_t start = c0 == ' ' && pos + 1 < end && !(flags[pos + 1] & mask_lns) ? pos + 1 : pos;
+    if (!(flags[start] & mask_lns)) {
+        const size_t i = start + text.run_not(start, end, mask_lns);
+        return i + text.run(i, end, UNICODE_REGEX_FLAG_RN) - pos;
+    }
+
+    const size_t n = text.run(pos, end, UNICODE_REGEX_FLAG_S);
+
+    // \s*[\r\n]+ - up to the last newline of the whitespace
+    for (size_t i = pos + n; i-- > pos; ) {
+        if (flags[i] & UNICODE_REGEX_FLAG_RN) {
+            return i + 1 - pos;
+        }
+    }
+
+    // \s+(?!\S)|\s+
+    if (n > 1 && pos + n < end) {
+        return n - 1;
+    }
+    return n;
+}
+
+typedef size_t (*unicode_regex_matcher)(const unicode_regex_text & text, size_t pos, size_t end);
+
+// split the pieces of offsets at the matches of the pattern, like unicode_regex_split_stl
+template <typename F>
+static std::vector<size_t> unicode_regex_split_matches(const unicode_regex_text & text, const std::vector<size_t> & offsets, F match) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    (void)(text);
-    (void)(regex_expr);
-    (void)(offsets);
-    // TODO: this implementation is actually wrong, uncomment and run:
-    //       make -j && ./bin/test-tokenizer-0 ../models/ggml-vocab-gpt-2.gguf
-    //if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-    //    bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
-    //}
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t prev = start;
+        for (size_t pos = start; pos < end; ) {
+            const size_t n = match(text, pos, end);
+            if (n == 0) {
+                ++pos;
+                continue;
+            }
+            if (pos > prev) {
+                bpe_offsets.emplace_back(pos - prev);
+            }
+            bpe_offsets.emplace_back(n);
+            pos += n;
+            prev = pos;
+        }
+
+        if (prev < end) {
+            bpe_offsets.emplace_back(end - prev);
+        }
+        start = end;
+    }
 
     return bpe_offsets;
 }
 
+// returns false if there is no custom implementation of the regex
+static bool unicode_regex_split_custom(const unicode_regex_text & text, const std::string & regex_expr, std::vector<size_t> & offsets) {
+    static const std::unordered_map<std::string, unicode_regex_matcher> matchers = {
+        { "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)", unicode_regex_match_gpt2 },
+        { "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+", unicode_regex_match_llama3 },
+    };
+
+    const auto it = matchers.find(regex_expr);
+    if (it != matchers.end()) {
+        offsets = unicode_regex_split_matches(text, offsets, it->second);
+        return true;
+    }
+
+    // the other patterns are compiled once - a null entry if the pattern is not a sequence of classes
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::shared_ptr<const unicode_regex_seq>> seqs;
+
+    std::shared_ptr<const unicode_regex_seq> seq;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it_seq = seqs.find(regex_expr);
+        if (it_seq == seqs.end()) {
+            auto parsed = std::make_shared<unicode_regex_seq>();
+            if (!unicode_regex_parse_seq(regex_expr, *parsed)) {
+                parsed.reset();
+            }
+            it_seq = seqs.emplace(regex_expr, std::move(parsed)).first;
+        }
+        seq = it_seq->second;
+    }
+
+    if (!seq) {
+        return false;
+    }
+
+    // when the pattern starts with a repetition and does not match, it does not match in the rest of the repetition
+    // either (e.g. \s+$ in a long run of whitespace), since the same ends of the repetition are tried again
+    size_t fail_end = 0;
+
+    offsets = unicode_regex_split_matches(text, offsets, [&seq, &fail_end](const unicode_regex_text & text, size_t pos, size_t end) -> size_t {
+        if (pos < fail_end) {
+            return 0;
+        }
+        const size_t res = seq->match(text, 0, pos, end);
+        if (res != std::string::npos) {
+            return res - pos;
+        }
+        const auto & a = seq->atoms[0];
+        if (a.quant == '+' || a.quant == '*') {
+            fail_end = pos + seq->run(text, a, pos, end);
+        }
+        return 0;
+    });
+
+    return true;
+}
+
 //
 // interface
 //
@@ -470,32 +914,37 @@ std::string unicode_cpt_to_utf8(uint32_t cp) {
 }
 
 std::vector<uint32_t> unicode_cpts_normalize_nfd(const std::vector<uint32_t> & cpts) {
-    std::vector<uint32_t> result;
-    result.reserve(cpts.size());
+    static const unicode_cpt_table<int32_t> nfd = unicode_cpt_delta_table(unicode_map_nfd);
+    std::vector<uint32_t> result(cpts.size());
     for (size_t i = 0; i < cpts.size(); ++i) {
-        auto it = unicode_map_nfd.find(cpts[i]);
-        if (it == unicode_map_nfd.end()) {
-            result.push_back(cpts[i]);
-        } else {
-            result.push_back(it->second);
-        }
+        result[i] = cpts[i] + nfd.get(cpts[i]);
     }
     return result;
 }
 
 std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
-    std::vector<uint32_t> result;
+    const uint8_t * s = (const uint8_t *) utf8.data();
+    const size_t    n = utf8.size();
+
+    // at most one code point per byte
+    std::vector<uint32_t> result(n);
+    uint32_t * dst = result.data();
+
     size_t offset = 0;
-    while (offset < utf8.size()) {
-        result.push_back(unicode_cpt_from_utf8(utf8, offset));
+    while (offset < n) {
+        if (s[offset] < 0x80) {
+            offset = unicode_cpts_from_ascii(s, offset, n, dst);
+        } else {
+            *dst++ = unicode_cpt_from_utf8(utf8, offset);
+        }
     }
+    result.resize(dst - result.data());
     return result;
 }
 
 int unicode_cpt_type(uint32_t cp) {
-    static std::unordered_map<uint32_t, int> cpt_types = unicode_cpt_type_map();
-    const auto it = cpt_types.find(cp);
-    return it == cpt_types.end() ? CODEPOINT_TYPE_UNIDENTIFIED : it->second;
+    static const unicode_cpt_table<uint8_t> cpt_types = unicode_cpt_type_table();
+    return cpt_types.get(cp);
 }
 
 int unicode_cpt_type(const std::string & utf8) {
@@ -507,7 +956,7 @@ int unicode_cpt_type(const std::string & utf8) {
 }
 
 std::string unicode_byte_to_utf8(uint8_t byte) {
-    static std::unordered_map<uint8_t, std::string> map = unicode_byte_to_utf8_map();
+    static const std::vector<std::string> map = unicode_byte_to_utf8_map();
     return map.at(byte);
 }
 
@@ -517,11 +966,11 @@ uint8_t unicode_utf8_to_byte(const std::string & utf8) {
 }
 
 char32_t unicode_tolower(char32_t cp) {
-    auto it = unicode_map_lowercase.find(cp);
-    return it == unicode_map_lowercase.end() ? cp : it->second;
+    static const unicode_cpt_table<int32_t> lowercase = unicode_cpt_delta_table(unicode_map_lowercase);
+    return cp + lowercase.get(cp);
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", CODEPOINT_TYPE_DIGIT },
@@ -541,53 +990,25 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { CODEPOINT_TYPE_PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
-    // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
-    // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
-    std::string text_collapsed;
-    if (need_collapse) {
-        // collapse all unicode categories
-        text_collapsed.resize(cpts.size());
-
-        for (size_t i = 0; i < cpts.size(); ++i) {
-            // keep single-byte codepoints as is
-            if (cpts[i] < 128) {
-                text_collapsed[i] = cpts[i];
-                continue;
-            }
-
-            const int cpt_type = unicode_cpt_type(cpts[i]);
+    // the code point flags of the custom implementations and the collapsed text of std::regex are computed on first use
+    std::unique_ptr<unicode_regex_text> regex_text;
 
-            if (k_ucat_cpt.find(cpt_type) != k_ucat_cpt.end()) {
-                text_collapsed[i] = k_ucat_cpt.at(cpt_type);
-            } else {
-                text_collapsed[i] = (char) 0xD0; // fallback
-            }
-        }
-    }
+    bool        collapsed = false;
+    std::string text_collapsed;
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
     for (auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
-
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
-            continue;
+        if (use_custom) {
+            if (!regex_text) {
+                regex_text.reset(new unicode_regex_text(cpts));
+            }
+            if (unicode_regex_split_custom(*regex_text, regex_expr, bpe_offsets)) {
+                continue;
+            }
         }
 
         // fallback to general-purpose std::regex / std::wregex
@@ -611,6 +1032,29 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                     }
                 }
 
+                // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
+                // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
+                if (!collapsed) {
+                    text_collapsed.resize(cpts.size());
+
+                    for (size_t i = 0; i < cpts.size(); ++i) {
+                        // keep single-byte codepoints as is
+                        if (cpts[i] < 128) {
+                            text_collapsed[i] = cpts[i];
+                            continue;
+                        }
+
+                        const int cpt_type = unicode_cpt_type(cpts[i]);
+
+                        if (k_ucat_cpt.find(cpt_type) != k_ucat_cpt.end()) {
+                            text_collapsed[i] = k_ucat_cpt.at(cpt_type);
+                        } else {
+                            text_collapsed[i] = (char) 0xD0; // fallback
+                        }
+                    }
+                    collapsed = true;
+                }
+
                 // generate a collapsed representation of the regex
                 std::string regex_expr_collapsed;
 
@@ -670,6 +1114,9 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
+    static const std::vector<std::string> byte_to_utf8 = unicode_byte_to_utf8_map();
+
+    // the words, with their bytes mapped to printable code points for the BPE vocab
     std::vector<std::string> bpe_words;
     bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
 
@@ -677,10 +1124,16 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
     for (size_t & offset : bpe_offsets) {
         bpe_words.emplace_back();
         for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
+            if (cpts[i] < 128) {
+                bpe_words.back() += byte_to_utf8[cpts[i]];
+                continue;
+            }
+            for (const char c : unicode_cpt_to_utf8(cpts[i])) {
+                bpe_words.back() += byte_to_utf8[(uint8_t) c];
+            }
         }
         start += offset;
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_words;
 }
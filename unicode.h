@@ -26,4 +26,6 @@ uint8_t unicode_utf8_to_byte(const std::string & utf8);
 
 char32_t unicode_tolower(char32_t cp);
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs);
+// split the text at the matches of each regex in turn, and map the bytes of the words to the code points of the BPE vocab
+// the pre-tokenizer regexes have custom implementations - use_custom = false forces std::regex (e.g. to compare them)
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom = true);